@@ -1,5 +1,5 @@
 SACKHASH_SRC_LIB := sackhash.c
-SACKHASH_SRC := $(SACKHASH_SRC_LIB) sackhashtest.c sackhashtest2.c sackhashtest3.c sackhashtest4.c
+SACKHASH_SRC := $(SACKHASH_SRC_LIB) sackhashtest.c sackhashtest2.c sackhashtest3.c sackhashtest4.c sackhashtest5.c
 
 SACKHASH_SRC_LIB := $(patsubst %,$(DIRSACKHASH)/%,$(SACKHASH_SRC_LIB))
 SACKHASH_SRC := $(patsubst %,$(DIRSACKHASH)/%,$(SACKHASH_SRC))
@@ -22,10 +22,10 @@ clean_$(LCSACKHASH): clean_SACKHASH
 distclean_$(LCSACKHASH): distclean_SACKHASH
 unit_$(LCSACKHASH): unit_SACKHASH
 
-SACKHASH: $(DIRSACKHASH)/libsackhash.a $(DIRSACKHASH)/sackhashtest $(DIRSACKHASH)/sackhashtest2 $(DIRSACKHASH)/sackhashtest3 $(DIRSACKHASH)/sackhashtest4
+SACKHASH: $(DIRSACKHASH)/libsackhash.a $(DIRSACKHASH)/sackhashtest $(DIRSACKHASH)/sackhashtest2 $(DIRSACKHASH)/sackhashtest3 $(DIRSACKHASH)/sackhashtest4 $(DIRSACKHASH)/sackhashtest5
 
-unit_SACKHASH:
-	@true
+unit_SACKHASH: $(DIRSACKHASH)/sackhashtest5
+	$(DIRSACKHASH)/sackhashtest5
 
 $(DIRSACKHASH)/libsackhash.a: $(SACKHASH_OBJ_LIB) $(MAKEFILES_COMMON) $(MAKEFILES_SACKHASH)
 	rm -f $@
@@ -43,6 +43,9 @@ $(DIRSACKHASH)/sackhashtest3: $(DIRSACKHASH)/sackhashtest3.o $(DIRSACKHASH)/libs
 $(DIRSACKHASH)/sackhashtest4: $(DIRSACKHASH)/sackhashtest4.o $(DIRSACKHASH)/libsackhash.a $(LIBS_SACKHASH) $(MAKEFILES_COMMON) $(MAKEFILES_SACKHASH)
 	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SACKHASH)
 
+$(DIRSACKHASH)/sackhashtest5: $(DIRSACKHASH)/sackhashtest5.o $(DIRSACKHASH)/libsackhash.a $(LIBS_SACKHASH) $(MAKEFILES_COMMON) $(MAKEFILES_SACKHASH)
+	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SACKHASH) -lpthread
+
 $(SACKHASH_OBJ): %.o: %.c %.d $(MAKEFILES_COMMON) $(MAKEFILES_SACKHASH)
 	$(CC) $(CFLAGS) -c -o $*.o $*.c $(CFLAGS_SACKHASH)
 	$(CC) $(CFLAGS) -c -S -o $*.s $*.c $(CFLAGS_SACKHASH)
@@ -54,6 +57,6 @@ clean_SACKHASH:
 	rm -f $(SACKHASH_OBJ) $(SACKHASH_DEP)
 
 distclean_SACKHASH: clean_SACKHASH
-	rm -f $(DIRSACKHASH)/libsackhash.a $(DIRSACKHASH)/sackhashtest $(DIRSACKHASH)/sackhashtest2 $(DIRSACKHASH)/sackhashtest3 $(DIRSACKHASH)/sackhashtest4
+	rm -f $(DIRSACKHASH)/libsackhash.a $(DIRSACKHASH)/sackhashtest $(DIRSACKHASH)/sackhashtest2 $(DIRSACKHASH)/sackhashtest3 $(DIRSACKHASH)/sackhashtest4 $(DIRSACKHASH)/sackhashtest5
 
 -include $(DIRSACKHASH)/*.d
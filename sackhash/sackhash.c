@@ -1,8 +1,12 @@
-#include "hashtable.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "siphash.h"
-#include "linkedlist.h"
-#include "containerof.h"
-#include <pthread.h>
 #include "sackhash.h"
 #include "hashseed.h"
 
@@ -26,22 +30,28 @@ ipport_form6(struct ipport *ipport, const void *ip, uint16_t port)
   ipport->ipport3 = ((uint64_t)port)<<32;
 }
 
+#define SACK_HASH_VALID (1ULL<<24)
+
+static inline uint64_t sack_hash_data_pack(const struct sack_hash_data *data)
+{
+  return SACK_HASH_VALID | (((uint64_t)data->sack_supported) << 16) | data->mss;
+}
+
+static inline void sack_hash_data_unpack(
+  uint64_t packed, struct sack_hash_data *data)
+{
+  data->mss = packed & 0xFFFF;
+  data->sack_supported = (packed >> 16) & 0xFF;
+}
+
 static inline int
-ipport_equals(const struct ipport *ipport1, const struct ipport *ipport2)
+ipport_equals_slot(
+  const struct ipport *ipport, const struct sack_ip_port_hash_slot *slot)
 {
-  if (ipport2->ipport1 != ipport2->ipport1)
-  {
-    return 0;
-  }
-  if (ipport2->ipport2 != ipport2->ipport2)
-  {
-    return 0;
-  }
-  if (ipport2->ipport3 != ipport2->ipport3)
-  {
-    return 0;
-  }
-  return 1;
+  return
+    atomic_load_explicit(&slot->key[0], memory_order_relaxed) == ipport->ipport1 &&
+    atomic_load_explicit(&slot->key[1], memory_order_relaxed) == ipport->ipport2 &&
+    atomic_load_explicit(&slot->key[2], memory_order_relaxed) == ipport->ipport3;
 }
 
 static inline uint32_t
@@ -55,170 +65,150 @@ ipport_hash(const struct ipport *ipport)
   return siphash_get(&ctx);
 }
 
-static inline uint64_t ip_port(uint32_t ip, uint16_t port)
-{
-  return ip | (((uint64_t)port)<<32);
-}
-
-static inline uint32_t sack_ipport_hash_value(uint64_t ipport)
-{
-  return siphash64(hash_seed_get(), ipport);
-}
-
-static inline uint32_t sack_ip_port_hash_value(uint32_t ip, uint16_t port)
-{
-  return sack_ipport_hash_value(ip_port(ip, port));
-}
-
-static inline uint32_t sack_ip_port_hash_fn(
-  struct hash_list_node *node, void *ud)
+static inline struct sack_ip_port_hash_bucket *sack_ip_port_hash_bucket(
+  struct sack_ip_port_hash *hash, const struct ipport *ipport)
 {
-  struct sack_ip_port_hash_entry *e;
-  e = CONTAINER_OF(node, struct sack_ip_port_hash_entry, node);
-  return ipport_hash(&e->ipport);
+  return &hash->buckets[ipport_hash(ipport) & hash->bucket_mask];
 }
 
 int sack_ip_port_hash_init(
   struct sack_ip_port_hash *hash, size_t capacity)
 {
-  int i;
-  if (capacity < SACK_HASH_READ_MTX_CNT)
+  size_t i, j, bucketcnt;
+  if (capacity < 128)
   {
-    capacity = SACK_HASH_READ_MTX_CNT;
+    capacity = 128;
   }
   if (capacity == 0 || (capacity & (capacity-1)) != 0)
   {
     abort();
   }
-  if (pthread_mutex_init(&hash->mtx, NULL) != 0)
+  bucketcnt = capacity / SACK_HASH_WAYS;
+  hash->buckets = malloc(bucketcnt*sizeof(*hash->buckets));
+  if (hash->buckets == NULL)
   {
     return -ENOMEM;
   }
-  for (i = 0; i < SACK_HASH_READ_MTX_CNT; i++)
-  {
-    if (pthread_mutex_init(&hash->read_mtx[i], NULL) != 0)
-    {
-      while (i >= 0)
-      {
-        pthread_mutex_destroy(&hash->read_mtx[i]);
-        i--;
-      }
-      pthread_mutex_destroy(&hash->mtx);
-      return -ENOMEM;
-    }
-  }
-  if (hash_table_init(&hash->hash, capacity, sack_ip_port_hash_fn, NULL))
+  hash->bucket_mask = bucketcnt - 1;
+  for (i = 0; i < bucketcnt; i++)
   {
-    for (i = 0; i < SACK_HASH_READ_MTX_CNT; i++)
+    struct sack_ip_port_hash_bucket *b = &hash->buckets[i];
+    atomic_init(&b->seq, 0);
+    b->hand = 0;
+    for (j = 0; j < SACK_HASH_WAYS; j++)
     {
-      pthread_mutex_destroy(&hash->read_mtx[i]);
+      atomic_init(&b->slots[j].key[0], 0);
+      atomic_init(&b->slots[j].key[1], 0);
+      atomic_init(&b->slots[j].key[2], 0);
+      atomic_init(&b->slots[j].data, 0);
     }
-    pthread_mutex_destroy(&hash->mtx);
-    return -ENOMEM;
   }
-  linked_list_head_init(&hash->list);
   return 0;
 }
 
 void sack_ip_port_hash_free(struct sack_ip_port_hash *hash)
 {
-  int i;
-  while (!linked_list_is_empty(&hash->list))
-  {
-    struct linked_list_node *llnode = hash->list.node.next;
-    struct sack_ip_port_hash_entry *old;
-    uint32_t hashval2;
-    old = CONTAINER_OF(llnode, struct sack_ip_port_hash_entry, llnode);
-    hashval2 = ipport_hash(&old->ipport);
-    linked_list_delete(llnode);
-    hash_table_delete(&hash->hash, &old->node, hashval2);
-    free(old);
-  }
-  for (i = 0; i < SACK_HASH_READ_MTX_CNT; i++)
+  free(hash->buckets);
+  hash->buckets = NULL;
+}
+
+static inline void sack_bucket_write_lock(struct sack_ip_port_hash_bucket *b)
+{
+  unsigned seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+  for (;;)
   {
-    pthread_mutex_destroy(&hash->read_mtx[i]);
+    if ((seq & 1) == 0 &&
+        atomic_compare_exchange_weak_explicit(
+          &b->seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+    {
+      break;
+    }
+    seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
   }
-  pthread_mutex_destroy(&hash->mtx);
-  hash_table_free(&hash->hash);
+  // Slot stores must not become visible before the odd sequence number
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void sack_bucket_write_unlock(struct sack_ip_port_hash_bucket *b)
+{
+  atomic_fetch_add_explicit(&b->seq, 1, memory_order_release);
 }
 
 static inline int sack_ip_port_hash_add_common(
   struct sack_ip_port_hash *hash, struct ipport *ipport,
   const struct sack_hash_data *data)
 {
-  int result = 0, status = 0;
-  uint32_t hashval;
-  struct hash_list_node *node;
-  struct sack_ip_port_hash_entry *e;
-  hashval = ipport_hash(ipport);
-  if (pthread_mutex_lock(&hash->mtx) != 0)
+  struct sack_ip_port_hash_bucket *b = sack_ip_port_hash_bucket(hash, ipport);
+  struct sack_ip_port_hash_slot *slot = NULL;
+  uint64_t packed = sack_hash_data_pack(data);
+  unsigned i;
+  sack_bucket_write_lock(b);
+  for (i = 0; i < SACK_HASH_WAYS; i++)
   {
-    abort();
-  }
-  HASH_TABLE_FOR_EACH_POSSIBLE(&hash->hash, node, hashval)
-  {
-    e = CONTAINER_OF(node, struct sack_ip_port_hash_entry, node);
-    if (ipport_equals(&e->ipport, ipport))
+    if (atomic_load_explicit(&b->slots[i].data, memory_order_relaxed) != 0 &&
+        ipport_equals_slot(ipport, &b->slots[i]))
     {
-      if (pthread_mutex_lock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
-      {
-        abort();
-      }
-      e->data = *data; // struct assignment
-      if (pthread_mutex_unlock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
-      {
-        abort();
-      }
-      result = 1;
-      break;
+      atomic_store_explicit(&b->slots[i].data, packed, memory_order_relaxed);
+      sack_bucket_write_unlock(b);
+      return 0;
     }
+    if (slot == NULL &&
+        atomic_load_explicit(&b->slots[i].data, memory_order_relaxed) == 0)
+    {
+      slot = &b->slots[i];
+    }
+  }
+  if (slot == NULL)
+  {
+    slot = &b->slots[b->hand];
+    b->hand = (b->hand + 1) % SACK_HASH_WAYS;
   }
-  if (!result)
+  atomic_store_explicit(&slot->key[0], ipport->ipport1, memory_order_relaxed);
+  atomic_store_explicit(&slot->key[1], ipport->ipport2, memory_order_relaxed);
+  atomic_store_explicit(&slot->key[2], ipport->ipport3, memory_order_relaxed);
+  atomic_store_explicit(&slot->data, packed, memory_order_relaxed);
+  sack_bucket_write_unlock(b);
+  return 0;
+}
+
+static inline int sack_ip_port_hash_get_common(
+  struct sack_ip_port_hash *hash, const struct ipport *ipport,
+  struct sack_hash_data *data)
+{
+  struct sack_ip_port_hash_bucket *b = sack_ip_port_hash_bucket(hash, ipport);
+  unsigned seq, i;
+  uint64_t packed;
+  for (;;)
   {
-    e = malloc(sizeof(*e));
-    if (e == NULL)
+    seq = atomic_load_explicit(&b->seq, memory_order_acquire);
+    if (seq & 1)
     {
-      status = -ENOMEM;
-      goto out;
+      continue;
     }
-    e->ipport = *ipport;
-    e->data = *data; // struct assignment
-    if (hash->hash.itemcnt >= hash->hash.bucketcnt)
+    packed = 0;
+    for (i = 0; i < SACK_HASH_WAYS; i++)
     {
-      struct linked_list_node *llnode = hash->list.node.next;
-      struct sack_ip_port_hash_entry *old;
-      uint32_t hashval2;
-      old = CONTAINER_OF(llnode, struct sack_ip_port_hash_entry, llnode);
-      hashval2 = ipport_hash(&old->ipport);
-      linked_list_delete(llnode);
-      if (pthread_mutex_lock(&hash->read_mtx[hashval2%SACK_HASH_READ_MTX_CNT]) != 0)
-      {
-        abort();
-      }
-      hash_table_delete(&hash->hash, &old->node, hashval2);
-      if (pthread_mutex_unlock(&hash->read_mtx[hashval2%SACK_HASH_READ_MTX_CNT]) != 0)
+      if (ipport_equals_slot(ipport, &b->slots[i]))
       {
-        abort();
+        packed = atomic_load_explicit(&b->slots[i].data, memory_order_relaxed);
+        if (packed != 0)
+        {
+          break;
+        }
       }
-      free(old);
-    }
-    linked_list_add_tail(&e->llnode, &hash->list);
-    if (pthread_mutex_lock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
-    {
-      abort();
     }
-    hash_table_add_nogrow(&hash->hash, &e->node, hashval);
-    if (pthread_mutex_unlock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&b->seq, memory_order_relaxed) == seq)
     {
-      abort();
+      break;
     }
   }
-out:
-  if (pthread_mutex_unlock(&hash->mtx) != 0)
+  if (packed == 0)
   {
-    abort();
+    return 0;
   }
-  return status;
+  sack_hash_data_unpack(packed, data);
+  return 1;
 }
 
 int sack_ip_port_hash_add4(
@@ -243,62 +233,199 @@ int sack_ip_port_hash_get4(
   struct sack_ip_port_hash *hash, uint32_t ip, uint16_t port,
   struct sack_hash_data *data)
 {
-  int result = 0;
   struct ipport ipport;
-  uint32_t hashval;
-  struct hash_list_node *node;
-  struct sack_ip_port_hash_entry *e;
   ipport_form4(&ipport, ip, port);
-  hashval = ipport_hash(&ipport);
-  if (pthread_mutex_lock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
+  return sack_ip_port_hash_get_common(hash, &ipport, data);
+}
+
+int sack_ip_port_hash_get6(
+  struct sack_ip_port_hash *hash, const void *ip, uint16_t port,
+  struct sack_hash_data *data)
+{
+  struct ipport ipport;
+  ipport_form6(&ipport, ip, port);
+  return sack_ip_port_hash_get_common(hash, &ipport, data);
+}
+
+/*
+ * Copies the valid slots of a bucket as seen at one point of time. Returns
+ * the number of slots copied.
+ */
+static int sack_bucket_snapshot(
+  struct sack_ip_port_hash_bucket *b, struct sack_hash_file_entry *out)
+{
+  unsigned seq, i;
+  int cnt;
+  for (;;)
   {
-    abort();
+    seq = atomic_load_explicit(&b->seq, memory_order_acquire);
+    if (seq & 1)
+    {
+      continue;
+    }
+    cnt = 0;
+    for (i = 0; i < SACK_HASH_WAYS; i++)
+    {
+      uint64_t packed;
+      packed = atomic_load_explicit(&b->slots[i].data, memory_order_relaxed);
+      if (packed == 0)
+      {
+        continue;
+      }
+      memset(&out[cnt], 0, sizeof(out[cnt]));
+      out[cnt].key[0] =
+        atomic_load_explicit(&b->slots[i].key[0], memory_order_relaxed);
+      out[cnt].key[1] =
+        atomic_load_explicit(&b->slots[i].key[1], memory_order_relaxed);
+      out[cnt].key[2] =
+        atomic_load_explicit(&b->slots[i].key[2], memory_order_relaxed);
+      out[cnt].mss = packed & 0xFFFF;
+      out[cnt].sack_supported = (packed >> 16) & 0xFF;
+      cnt++;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&b->seq, memory_order_relaxed) == seq)
+    {
+      return cnt;
+    }
+  }
+}
+
+static const char sack_hash_file_key[16] = "sackhashsnapshot";
+
+static uint32_t sack_hash_file_checksum(
+  const struct sack_hash_file_entry *entries, uint64_t count)
+{
+  return siphash_buf(sack_hash_file_key, entries, count*sizeof(*entries));
+}
+
+int sack_ip_port_hash_save(struct sack_ip_port_hash *hash, const char *path)
+{
+  struct sack_hash_file_hdr *hdr;
+  struct sack_hash_file_entry *entries;
+  size_t i, len, bucketcnt = hash->bucket_mask + 1;
+  uint64_t count = 0;
+  char tmppath[4096];
+  const char *p;
+  int fd;
+  if ((size_t)snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= sizeof(tmppath))
+  {
+    return -ENAMETOOLONG;
+  }
+  hdr = malloc(sizeof(*hdr) + bucketcnt*SACK_HASH_WAYS*sizeof(*entries));
+  if (hdr == NULL)
+  {
+    return -ENOMEM;
+  }
+  entries = (struct sack_hash_file_entry*)(hdr + 1);
+  for (i = 0; i < bucketcnt; i++)
+  {
+    count += sack_bucket_snapshot(&hash->buckets[i], &entries[count]);
+  }
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, SACK_HASH_FILE_MAGIC, sizeof(hdr->magic));
+  hdr->version = SACK_HASH_FILE_VERSION;
+  hdr->entry_size = sizeof(*entries);
+  hdr->count = count;
+  hdr->checksum = sack_hash_file_checksum(entries, count);
+  len = sizeof(*hdr) + count*sizeof(*entries);
+
+  // Written to a new file and renamed, so a crash leaves the old snapshot
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+  {
+    free(hdr);
+    return -errno;
   }
-  HASH_TABLE_FOR_EACH_POSSIBLE(&hash->hash, node, hashval)
+  p = (const char*)hdr;
+  while (len > 0)
   {
-    e = CONTAINER_OF(node, struct sack_ip_port_hash_entry, node);
-    if (ipport_equals(&e->ipport, &ipport))
+    ssize_t ret = write(fd, p, len);
+    if (ret < 0 && errno == EINTR)
     {
-      *data = e->data; // struct assignment
-      result = 1;
-      break;
+      continue;
+    }
+    if (ret <= 0)
+    {
+      int err = ret < 0 ? errno : EIO;
+      close(fd);
+      unlink(tmppath);
+      free(hdr);
+      return -err;
     }
+    p += ret;
+    len -= ret;
   }
-  if (pthread_mutex_unlock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
+  free(hdr);
+  if (fsync(fd) != 0 || close(fd) != 0)
   {
-    abort();
+    int err = errno;
+    unlink(tmppath);
+    return -err;
+  }
+  if (rename(tmppath, path) != 0)
+  {
+    int err = errno;
+    unlink(tmppath);
+    return -err;
   }
-  return result;
+  return count;
 }
 
-int sack_ip_port_hash_get6(
-  struct sack_ip_port_hash *hash, const void *ip, uint16_t port,
-  struct sack_hash_data *data)
+int sack_ip_port_hash_load(struct sack_ip_port_hash *hash, const char *path)
 {
-  int result = 0;
-  struct ipport ipport;
-  uint32_t hashval;
-  struct hash_list_node *node;
-  struct sack_ip_port_hash_entry *e;
-  ipport_form6(&ipport, ip, port);
-  hashval = ipport_hash(&ipport);
-  if (pthread_mutex_lock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
+  const struct sack_hash_file_hdr *hdr;
+  const struct sack_hash_file_entry *entries;
+  struct stat st;
+  void *map;
+  uint64_t i;
+  int fd, ret;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
   {
-    abort();
+    return -errno;
   }
-  HASH_TABLE_FOR_EACH_POSSIBLE(&hash->hash, node, hashval)
+  if (fstat(fd, &st) != 0)
   {
-    e = CONTAINER_OF(node, struct sack_ip_port_hash_entry, node);
-    if (ipport_equals(&e->ipport, &ipport))
-    {
-      *data = e->data; // struct assignment
-      result = 1;
-      break;
-    }
+    ret = -errno;
+    close(fd);
+    return ret;
   }
-  if (pthread_mutex_unlock(&hash->read_mtx[hashval%SACK_HASH_READ_MTX_CNT]) != 0)
+  if ((size_t)st.st_size < sizeof(*hdr))
   {
-    abort();
+    close(fd);
+    return -EINVAL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -errno;
+  }
+  hdr = map;
+  entries = (const struct sack_hash_file_entry*)(hdr + 1);
+  if (memcmp(hdr->magic, SACK_HASH_FILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != SACK_HASH_FILE_VERSION ||
+      hdr->entry_size != sizeof(*entries) ||
+      hdr->count > ((size_t)st.st_size - sizeof(*hdr))/sizeof(*entries) ||
+      sizeof(*hdr) + hdr->count*sizeof(*entries) != (size_t)st.st_size ||
+      sack_hash_file_checksum(entries, hdr->count) != hdr->checksum)
+  {
+    munmap(map, st.st_size);
+    return -EINVAL;
+  }
+  for (i = 0; i < hdr->count; i++)
+  {
+    struct ipport ipport;
+    struct sack_hash_data data;
+    ipport.ipport1 = entries[i].key[0];
+    ipport.ipport2 = entries[i].key[1];
+    ipport.ipport3 = entries[i].key[2];
+    data.mss = entries[i].mss;
+    data.sack_supported = entries[i].sack_supported;
+    sack_ip_port_hash_add_common(hash, &ipport, &data);
   }
-  return result;
+  ret = hdr->count;
+  munmap(map, st.st_size);
+  return ret;
 }
@@ -1,11 +1,9 @@
 #ifndef _SACKHASH_H_
 #define _SACKHASH_H_
 
-#include "hashtable.h"
-#include "siphash.h"
-#include "linkedlist.h"
-#include "containerof.h"
-#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 struct sack_hash_data {
   uint16_t mss;
@@ -19,21 +17,33 @@ struct ipport {
   uint64_t ipport3;
 };
 
-struct sack_ip_port_hash_entry {
-  struct hash_list_node node;
-  struct linked_list_node llnode;
-  struct ipport ipport;
-  struct sack_hash_data data;
+/*
+ * The table is set associative: an address and port can be stored only in the
+ * SACK_HASH_WAYS slots of its bucket, and when they are all in use the oldest
+ * insertion of that bucket is replaced. All slots are allocated up front.
+ *
+ * Every bucket has a sequence number that is odd while a writer changes the
+ * bucket. Writers make it odd with compare-and-swap, so writers of different
+ * buckets never wait for each other. Readers take no lock: they retry if the
+ * sequence number was odd or changed while they read the bucket.
+ */
+
+#define SACK_HASH_WAYS 4
+
+struct sack_ip_port_hash_slot {
+  atomic_uint_least64_t key[3];
+  atomic_uint_least64_t data; // 0: empty, else valid flag, SACK and MSS
 };
 
-#define SACK_HASH_READ_MTX_CNT 128
+struct sack_ip_port_hash_bucket {
+  atomic_uint seq;
+  unsigned hand; // next slot to replace, changed only by the writer
+  struct sack_ip_port_hash_slot slots[SACK_HASH_WAYS];
+};
 
 struct sack_ip_port_hash {
-  // Lock order, mtx first, then read_mtx.
-  pthread_mutex_t read_mtx[SACK_HASH_READ_MTX_CNT];
-  pthread_mutex_t mtx;
-  struct hash_table hash;
-  struct linked_list_head list;
+  size_t bucket_mask;
+  struct sack_ip_port_hash_bucket *buckets;
 };
 
 int sack_ip_port_hash_init(
@@ -57,4 +67,41 @@ int sack_ip_port_hash_get6(
 
 void sack_ip_port_hash_free(struct sack_ip_port_hash *hash);
 
+/*
+ * Snapshot file: a header followed by count entries, in host byte order so
+ * that the file can be used through mmap(). The checksum covers the entries.
+ */
+
+#define SACK_HASH_FILE_MAGIC "SACKHASH"
+#define SACK_HASH_FILE_VERSION 1
+
+struct sack_hash_file_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t count;
+  uint32_t checksum;
+  uint32_t reserved;
+};
+
+struct sack_hash_file_entry {
+  uint64_t key[3];
+  uint16_t mss;
+  uint8_t sack_supported;
+  uint8_t reserved[5];
+};
+
+/*
+ * Writes the table to the file atomically. Returns the number of entries
+ * written or a negative errno.
+ */
+int sack_ip_port_hash_save(struct sack_ip_port_hash *hash, const char *path);
+
+/*
+ * Adds the entries of a snapshot file to the table. Returns the number of
+ * entries, -EINVAL if the file isn't a valid snapshot or another negative
+ * errno if it can't be read.
+ */
+int sack_ip_port_hash_load(struct sack_ip_port_hash *hash, const char *path);
+
 #endif
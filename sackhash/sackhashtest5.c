@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "sackhash.h"
+#include "hashseed.h"
+
+/*
+ * Writers keep adding more keys than the table holds, so buckets are evicted
+ * all the time, while readers check that every entry they find has the data
+ * of its own key. A torn read would give the data of another key.
+ */
+
+#define WRITERS 2
+#define READERS 2
+#define WRITES (2*1000*1000)
+#define KEYS 4096
+
+static atomic_int writers_done;
+
+static void key_ip6(uint32_t n, char *ip)
+{
+  memset(&ip[0], n & 0xFF, 8);
+  memset(&ip[8], (n >> 8) & 0xFF, 8);
+}
+
+static void key_data(uint32_t n, struct sack_hash_data *data)
+{
+  data->mss = 536 + (n * 31) % 1000;
+  data->sack_supported = (n >> 3) & 1;
+}
+
+static void key_add(struct sack_ip_port_hash *hash, uint32_t n)
+{
+  struct sack_hash_data data;
+  char ip6[16];
+  key_data(n, &data);
+  if (n & 1)
+  {
+    key_ip6(n, ip6);
+    if (sack_ip_port_hash_add6(hash, ip6, 1 + (n & 0xF), &data) != 0)
+    {
+      abort();
+    }
+  }
+  else if (sack_ip_port_hash_add4(hash, n, 1 + (n & 0xF), &data) != 0)
+  {
+    abort();
+  }
+}
+
+static int key_get(
+  struct sack_ip_port_hash *hash, uint32_t n, struct sack_hash_data *data)
+{
+  char ip6[16];
+  if (n & 1)
+  {
+    key_ip6(n, ip6);
+    return sack_ip_port_hash_get6(hash, ip6, 1 + (n & 0xF), data);
+  }
+  return sack_ip_port_hash_get4(hash, n, 1 + (n & 0xF), data);
+}
+
+static void *writer_thr(void *userdata)
+{
+  struct sack_ip_port_hash *hash = userdata;
+  unsigned seed = (unsigned)(uintptr_t)&seed;
+  int i;
+  for (i = 0; i < WRITES; i++)
+  {
+    key_add(hash, rand_r(&seed) % KEYS);
+  }
+  return NULL;
+}
+
+static void *reader_thr(void *userdata)
+{
+  struct sack_ip_port_hash *hash = userdata;
+  unsigned seed = (unsigned)(uintptr_t)&seed;
+  uint64_t hits = 0;
+  while (!atomic_load(&writers_done))
+  {
+    struct sack_hash_data data, expected;
+    uint32_t n = rand_r(&seed) % KEYS;
+    if (key_get(hash, n, &data))
+    {
+      key_data(n, &expected);
+      if (data.mss != expected.mss ||
+          data.sack_supported != expected.sack_supported)
+      {
+        abort();
+      }
+      hits++;
+    }
+  }
+  if (hits == 0)
+  {
+    abort();
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  struct sack_ip_port_hash hash;
+  pthread_t writers[WRITERS], readers[READERS];
+  int i;
+  hash_seed_init();
+  if (sack_ip_port_hash_init(&hash, 128) != 0)
+  {
+    abort();
+  }
+  atomic_init(&writers_done, 0);
+  for (i = 0; i < READERS; i++)
+  {
+    pthread_create(&readers[i], NULL, reader_thr, &hash);
+  }
+  for (i = 0; i < WRITERS; i++)
+  {
+    pthread_create(&writers[i], NULL, writer_thr, &hash);
+  }
+  for (i = 0; i < WRITERS; i++)
+  {
+    pthread_join(writers[i], NULL);
+  }
+  atomic_store(&writers_done, 1);
+  for (i = 0; i < READERS; i++)
+  {
+    pthread_join(readers[i], NULL);
+  }
+  sack_ip_port_hash_free(&hash);
+  return 0;
+}
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <poll.h>
+#include "capture.h"
+#include "synproxy.h"
+#include "dispatch.h"
+#include "iphdr.h"
+#include "time64.h"
+#include "log.h"
+
+void capture_filter_init(struct capture_filter *f)
+{
+  memset(f, 0, sizeof(*f));
+}
+
+static int capture_filter_is_all(const struct capture_filter *f)
+{
+  return !f->off && f->version == 0 && f->port == 0 &&
+         f->tcp_flags_mask == 0 && !f->synproxied_only && f->sample <= 1 &&
+         f->snaplen == 0;
+}
+
+static int capture_prefix_match(
+  const unsigned char *addr, const unsigned char *net, int prefix)
+{
+  int bytes = prefix / 8;
+  int bits = prefix % 8;
+  unsigned char mask;
+  if (memcmp(addr, net, bytes) != 0)
+  {
+    return 0;
+  }
+  if (bits == 0)
+  {
+    return 1;
+  }
+  mask = (unsigned char)(0xFF << (8 - bits));
+  return (addr[bytes] & mask) == (net[bytes] & mask);
+}
+
+int capture_filter_match(
+  const struct capture_filter *f, struct worker_local *local,
+  const void *data, size_t sz)
+{
+  const void *ip;
+  const unsigned char *src = NULL;
+  const unsigned char *dst = NULL;
+  const unsigned char *tcp = NULL;
+  size_t ip_len;
+  int version = 0;
+
+  if (f->off)
+  {
+    return 0;
+  }
+  if (sz >= ETHER_HDR_LEN)
+  {
+    ip = ether_const_payload(data);
+    ip_len = sz - ETHER_HDR_LEN;
+    if (ether_type(data) == ETHER_TYPE_IP &&
+        ip_len >= IP_HDR_MINLEN && ip_version(ip) == 4)
+    {
+      version = 4;
+      src = ip_src_ptr(ip);
+      dst = ip_dst_ptr(ip);
+      if (ip_proto(ip) == 6 && ip_frag_off(ip) == 0 &&
+          ip_len >= (size_t)ip_hdr_len(ip) + 20)
+      {
+        tcp = ip_const_payload(ip);
+      }
+    }
+    else if (ether_type(data) == ETHER_TYPE_IPV6 &&
+             ip_len >= 40 && ip_version(ip) == 6)
+    {
+      version = 6;
+      src = ipv6_const_src(ip);
+      dst = ipv6_const_dst(ip);
+      if (ip_len >= (size_t)(ipv6_payload_len(ip) + 40))
+      {
+        int is_frag = 0;
+        uint16_t proto_off_from_frag = 0;
+        uint8_t protocol = 0;
+        const unsigned char *ippay = ipv6_proto_hdr_2(
+          (void*)ip, &protocol, &is_frag, NULL, &proto_off_from_frag);
+        if (ippay != NULL && protocol == 6 && !is_frag &&
+            ip_len >= (size_t)(ippay - (const unsigned char*)ip) + 20)
+        {
+          tcp = ippay;
+        }
+      }
+    }
+  }
+  if (f->version)
+  {
+    if (version != f->version)
+    {
+      return 0;
+    }
+    if (!capture_prefix_match(src, f->addr, f->prefix) &&
+        !capture_prefix_match(dst, f->addr, f->prefix))
+    {
+      return 0;
+    }
+  }
+  if (f->port || f->tcp_flags_mask || f->synproxied_only)
+  {
+    if (tcp == NULL)
+    {
+      return 0;
+    }
+    if (f->port && tcp_src_port(tcp) != f->port && tcp_dst_port(tcp) != f->port)
+    {
+      return 0;
+    }
+    if ((tcp[13] & f->tcp_flags_mask) != f->tcp_flags)
+    {
+      return 0;
+    }
+    if (f->synproxied_only &&
+        (local == NULL || !synproxy_is_synproxied(local, (void*)data, sz)))
+    {
+      return 0;
+    }
+  }
+  if (f->sample > 1 && dispatch_hash((void*)data, sz) % f->sample != 0)
+  {
+    return 0;
+  }
+  return 1;
+}
+
+static int capture_has_files(struct capture *c)
+{
+  int i;
+  for (i = 0; i < CAPTURE_FILE_COUNT; i++)
+  {
+    if (c->ctx[i] != NULL)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int capture_set_filter(struct capture *c, const struct capture_filter *f)
+{
+  pthread_mutex_lock(&c->filter_lock);
+  c->filter = *f;
+  if (c->filter.snaplen > sizeof(((struct capture_rec*)NULL)->data))
+  {
+    c->filter.snaplen = sizeof(((struct capture_rec*)NULL)->data);
+  }
+  atomic_fetch_add_explicit(&c->filter_gen, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&c->filter_lock);
+  return capture_has_files(c) ? 0 : -ENOENT;
+}
+
+void capture_ring_load_filter(struct capture_ring *ring)
+{
+  struct capture *c = ring->capture;
+  pthread_mutex_lock(&c->filter_lock);
+  ring->filter = c->filter;
+  ring->filter_gen = atomic_load_explicit(&c->filter_gen, memory_order_relaxed);
+  pthread_mutex_unlock(&c->filter_lock);
+  ring->filter_all = capture_filter_is_all(&ring->filter);
+}
+
+int capture_init(struct capture *c, int num_rings)
+{
+  int i;
+  memset(c->ctx, 0, sizeof(c->ctx));
+  memset(c->failed, 0, sizeof(c->failed));
+  c->rings = calloc(num_rings, sizeof(*c->rings));
+  if (c->rings == NULL)
+  {
+    return -ENOMEM;
+  }
+  c->num_rings = num_rings;
+  c->written = 0;
+  atomic_init(&c->stop, 0);
+  pthread_mutex_init(&c->filter_lock, NULL);
+  capture_filter_init(&c->filter);
+  atomic_init(&c->filter_gen, 0);
+  for (i = 0; i < num_rings; i++)
+  {
+    struct capture_ring *ring = &c->rings[i];
+    ring->recs = malloc(CAPTURE_RING_SIZE*sizeof(*ring->recs));
+    if (ring->recs == NULL)
+    {
+      capture_free(c);
+      return -ENOMEM;
+    }
+    ring->mask = CAPTURE_RING_SIZE - 1;
+    atomic_init(&ring->prod, 0);
+    atomic_init(&ring->cons, 0);
+    atomic_init(&ring->published_drops, 0);
+    ring->prod_priv = 0;
+    ring->cached_cons = 0;
+    ring->cons_priv = 0;
+    ring->cached_prod = 0;
+    ring->drops = 0;
+    ring->capture = c;
+    ring->local = NULL;
+    ring->filter_gen = 0;
+    ring->filter_all = 1;
+    capture_filter_init(&ring->filter);
+  }
+  return 0;
+}
+
+void capture_free(struct capture *c)
+{
+  int i;
+  for (i = 0; i < c->num_rings; i++)
+  {
+    free(c->rings[i].recs);
+  }
+  free(c->rings);
+  c->rings = NULL;
+  c->num_rings = 0;
+  pthread_mutex_destroy(&c->filter_lock);
+}
+
+static uint64_t capture_drops(struct capture *c)
+{
+  uint64_t drops = 0;
+  int i;
+  for (i = 0; i < c->num_rings; i++)
+  {
+    drops += atomic_load_explicit(&c->rings[i].published_drops,
+                                  memory_order_relaxed);
+  }
+  return drops;
+}
+
+/*
+ * Writes the records available in the ring. Returns the number of records.
+ */
+static int capture_drain(struct capture *c, struct capture_ring *ring)
+{
+  int cnt = 0;
+  ring->cached_prod = atomic_load_explicit(&ring->prod, memory_order_acquire);
+  while (ring->cons_priv != ring->cached_prod)
+  {
+    struct capture_rec *rec = &ring->recs[ring->cons_priv & ring->mask];
+    if (!c->failed[rec->file] &&
+        pcapng_out_ctx_write(c->ctx[rec->file], rec->data, rec->sz,
+                             rec->time64, rec->out ? "out" : "in") != 0)
+    {
+      // Capture is best effort, so stop writing the file instead of exiting
+      log_log(LOG_LEVEL_ERR, "CAPTURE", "can't record packet, file %d closed",
+              (int)rec->file);
+      c->failed[rec->file] = 1;
+    }
+    ring->cons_priv++;
+    cnt++;
+  }
+  atomic_store_explicit(&ring->cons, ring->cons_priv, memory_order_release);
+  return cnt;
+}
+
+static void *capture_func(void *userdata)
+{
+  struct capture *c = userdata;
+  uint64_t next_time64 = gettime64() + 2*1000*1000;
+  uint64_t last_drops = 0;
+  for (;;)
+  {
+    int stop = atomic_load(&c->stop);
+    int cnt = 0;
+    int i;
+    uint64_t time64;
+    for (i = 0; i < c->num_rings; i++)
+    {
+      cnt += capture_drain(c, &c->rings[i]);
+    }
+    c->written += cnt;
+    if (stop && cnt == 0)
+    {
+      break;
+    }
+    time64 = gettime64();
+    if (time64 >= next_time64)
+    {
+      uint64_t drops = capture_drops(c);
+      if (drops != last_drops)
+      {
+        log_log(LOG_LEVEL_WARNING, "CAPTURE", "dropped %llu packets",
+                (unsigned long long)(drops - last_drops));
+        last_drops = drops;
+      }
+      next_time64 += 2*1000*1000;
+    }
+    if (cnt == 0)
+    {
+      poll(NULL, 0, 1);
+    }
+  }
+  return NULL;
+}
+
+int capture_start(struct capture *c)
+{
+  if (!capture_has_files(c))
+  {
+    return 0;
+  }
+  if (pthread_create(&c->thr, NULL, capture_func, c) != 0)
+  {
+    return -ENOMEM;
+  }
+  return 1;
+}
+
+void capture_stop(struct capture *c)
+{
+  if (!capture_has_files(c))
+  {
+    return;
+  }
+  atomic_store(&c->stop, 1);
+  pthread_join(c->thr, NULL);
+  log_log(LOG_LEVEL_NOTICE, "CAPTURE", "wrote %llu packets, dropped %llu",
+          (unsigned long long)c->written,
+          (unsigned long long)capture_drops(c));
+}
+
+void captureportfunc(struct packet *pkt, void *userdata)
+{
+  struct captureport_userdata *ud = userdata;
+  uint64_t time64 = gettime64();
+  capture_packet(ud->capture, ud->ring, CAPTURE_FILE_OUT, 1,
+                 pkt->data, pkt->sz, time64);
+  capture_packet(ud->capture, ud->ring,
+                 pkt->direction == PACKET_DIRECTION_UPLINK ?
+                   CAPTURE_FILE_WAN : CAPTURE_FILE_LAN,
+                 1, pkt->data, pkt->sz, time64);
+  ud->next->portfunc(pkt, ud->next->userdata);
+}
@@ -0,0 +1,206 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "mypcapng.h"
+#include "ports.h"
+
+/*
+ * Asynchronous packet capture. Every packet processing thread copies the
+ * packets to capture to its own single-producer single-consumer ring, and one
+ * writer thread drains the rings to the pcapng files. A full ring or a packet
+ * too large for a record drops the packet from the capture and counts it, so
+ * a slow disk never stalls packet processing.
+ *
+ * Records of different threads may be written out of time order.
+ *
+ * A filter set at runtime limits what is captured. Every ring keeps its own
+ * copy of the filter and picks up changes in capture_flush(), so matching
+ * takes no locks. Packets longer than snaplen are truncated, which also lets
+ * packets too large for a record be captured.
+ */
+
+#define CAPTURE_RING_SIZE 4096
+#define CAPTURE_REC_SIZE 2048
+
+enum capture_file {
+  CAPTURE_FILE_IN,
+  CAPTURE_FILE_OUT,
+  CAPTURE_FILE_LAN,
+  CAPTURE_FILE_WAN,
+  CAPTURE_FILE_COUNT,
+};
+
+struct capture_rec {
+  uint64_t time64;
+  uint16_t sz;
+  uint8_t file;
+  uint8_t out; // interface name "out" instead of "in"
+  char data[CAPTURE_REC_SIZE - 12];
+};
+
+struct worker_local;
+
+/*
+ * Every condition must match. Addresses and ports match either the source or
+ * the destination. Flows are sampled by a symmetric hash, so both directions
+ * of a sampled flow are captured.
+ */
+struct capture_filter {
+  int off; // capture nothing
+  int version; // 0: any address
+  int prefix;
+  unsigned char addr[16];
+  uint16_t port; // 0: any
+  uint8_t tcp_flags_mask;
+  uint8_t tcp_flags;
+  int synproxied_only;
+  uint32_t sample; // 1 in sample flows, 0 or 1: every flow
+  uint32_t snaplen; // 0: whole packet
+};
+
+struct capture;
+
+struct capture_ring {
+  atomic_uint prod __attribute__((aligned(64)));
+  unsigned prod_priv;
+  unsigned cached_cons;
+  uint64_t drops;
+  atomic_uint cons __attribute__((aligned(64)));
+  unsigned cons_priv;
+  unsigned cached_prod;
+  _Atomic uint64_t published_drops __attribute__((aligned(64)));
+  unsigned mask;
+  struct capture_rec *recs;
+  struct capture *capture;
+  struct worker_local *local; // conn table for synproxied_only, may be NULL
+  unsigned filter_gen;
+  int filter_all;
+  struct capture_filter filter;
+};
+
+struct capture {
+  struct pcapng_out_ctx *ctx[CAPTURE_FILE_COUNT]; // NULL: not captured
+  int failed[CAPTURE_FILE_COUNT];
+  int num_rings;
+  struct capture_ring *rings;
+  pthread_t thr;
+  atomic_int stop;
+  uint64_t written;
+  pthread_mutex_t filter_lock;
+  struct capture_filter filter;
+  atomic_uint filter_gen;
+};
+
+int capture_init(struct capture *c, int num_rings);
+
+void capture_free(struct capture *c);
+
+/*
+ * Starts the writer thread if any file is set.
+ */
+int capture_start(struct capture *c);
+
+/*
+ * Writes everything still in the rings and stops the writer thread. Call
+ * after the producer threads have exited.
+ */
+void capture_stop(struct capture *c);
+
+/*
+ * Initializes a filter that captures everything.
+ */
+void capture_filter_init(struct capture_filter *f);
+
+int capture_filter_match(
+  const struct capture_filter *f, struct worker_local *local,
+  const void *data, size_t sz);
+
+/*
+ * Replaces the filter of all rings. Safe to call from any thread. Returns
+ * -ENOENT if no file is captured.
+ */
+int capture_set_filter(struct capture *c, const struct capture_filter *f);
+
+void capture_ring_load_filter(struct capture_ring *ring);
+
+static inline void capture_set_file(
+  struct capture *c, enum capture_file file, struct pcapng_out_ctx *ctx)
+{
+  c->ctx[file] = ctx;
+}
+
+static inline int capture_enabled(struct capture *c, enum capture_file file)
+{
+  return c->ctx[file] != NULL;
+}
+
+static inline void capture_packet(
+  struct capture *c, struct capture_ring *ring, enum capture_file file,
+  int out, const void *data, size_t sz, uint64_t time64)
+{
+  struct capture_rec *rec;
+  if (c->ctx[file] == NULL)
+  {
+    return;
+  }
+  if (!ring->filter_all &&
+      !capture_filter_match(&ring->filter, ring->local, data, sz))
+  {
+    return;
+  }
+  if (ring->filter.snaplen && sz > ring->filter.snaplen)
+  {
+    sz = ring->filter.snaplen;
+  }
+  if (ring->prod_priv - ring->cached_cons > ring->mask)
+  {
+    ring->cached_cons = atomic_load_explicit(&ring->cons, memory_order_acquire);
+  }
+  if (ring->prod_priv - ring->cached_cons > ring->mask ||
+      sz > sizeof(rec->data))
+  {
+    ring->drops++;
+    return;
+  }
+  rec = &ring->recs[ring->prod_priv & ring->mask];
+  rec->time64 = time64;
+  rec->sz = sz;
+  rec->file = file;
+  rec->out = !!out;
+  memcpy(rec->data, data, sz);
+  ring->prod_priv++;
+}
+
+/*
+ * Publishes the captured packets to the writer thread. Call once per batch.
+ */
+static inline void capture_flush(struct capture_ring *ring)
+{
+  atomic_store_explicit(&ring->prod, ring->prod_priv, memory_order_release);
+  atomic_store_explicit(&ring->published_drops, ring->drops,
+                        memory_order_relaxed);
+  if (atomic_load_explicit(&ring->capture->filter_gen, memory_order_relaxed) !=
+      ring->filter_gen)
+  {
+    capture_ring_load_filter(ring);
+  }
+}
+
+/*
+ * Port that records every packet to the out file and to the wan or lan file
+ * by its direction, then passes it to the next port.
+ */
+struct captureport_userdata {
+  struct capture *capture;
+  struct capture_ring *ring;
+  struct port *next;
+};
+
+void captureportfunc(struct packet *pkt, void *userdata);
+
+#endif
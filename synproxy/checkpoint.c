@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "synproxy.h"
+#include "time64.h"
+#include "log.h"
+
+static const char checkpoint_file_key[16] = "synproxyckptfile";
+
+static uint32_t checkpoint_checksum(
+  const struct checkpoint_file_entry *entries, uint64_t count)
+{
+  return siphash_buf(checkpoint_file_key, entries, count*sizeof(*entries));
+}
+
+static uint64_t checkpoint_wallclock_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000ULL*1000ULL + ts.tv_nsec/1000;
+}
+
+void checkpoint_init(
+  struct checkpoint *c, const char *path, struct worker_local *locals,
+  int num_locals, int num_threads)
+{
+  c->path = path;
+  c->locals = locals;
+  c->num_locals = num_locals;
+  pthread_mutex_init(&c->mtx, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  atomic_init(&c->req, 0);
+  c->running = num_threads;
+  c->parked = 0;
+  c->closed = 0;
+}
+
+int checkpoint_entry_saved(
+  struct synproxy_hash_entry *e, uint64_t time64)
+{
+  return e->cold == NULL && timer_wheel_time(&e->timer) > time64;
+}
+
+void checkpoint_entry_out(
+  struct checkpoint_file_entry *out, struct synproxy_hash_entry *e,
+  uint64_t time64)
+{
+  memset(out, 0, sizeof(*out));
+  memcpy(out->local_ip, &e->local_ip, sizeof(out->local_ip));
+  memcpy(out->remote_ip, &e->remote_ip, sizeof(out->remote_ip));
+  out->local_port = e->local_port;
+  out->remote_port = e->remote_port;
+  out->flag_state = e->flag_state;
+  out->version = e->version;
+  out->wscalediff = e->wscalediff;
+  out->seqoffset = e->seqoffset;
+  out->tsoffset = e->tsoffset;
+  out->lan_sent = e->lan_sent;
+  out->wan_sent = e->wan_sent;
+  out->lan_acked = e->lan_acked;
+  out->wan_acked = e->wan_acked;
+  out->lan_max = e->lan_max;
+  out->wan_max = e->wan_max;
+  out->lan_max_window_unscaled = e->lan_max_window_unscaled;
+  out->wan_max_window_unscaled = e->wan_max_window_unscaled;
+  out->lan_wscale = e->lan_wscale;
+  out->wan_wscale = e->wan_wscale;
+  out->was_synproxied = e->was_synproxied;
+  out->lan_sack_was_supported = e->lan_sack_was_supported;
+  out->ulflowlabel = e->ulflowlabel;
+  out->dlflowlabel = e->dlflowlabel;
+  out->upfin = e->established.upfin;
+  out->downfin = e->established.downfin;
+  if (timer_wheel_time(&e->timer) > time64)
+  {
+    out->timeout_usec = timer_wheel_time(&e->timer) - time64;
+  }
+}
+
+void checkpoint_entry_in(
+  struct synproxy_hash_entry *e, const struct checkpoint_file_entry *in,
+  uint64_t deadline64)
+{
+  memset(e, 0, sizeof(*e));
+  memcpy(&e->local_ip, in->local_ip, sizeof(in->local_ip));
+  memcpy(&e->remote_ip, in->remote_ip, sizeof(in->remote_ip));
+  e->local_port = in->local_port;
+  e->remote_port = in->remote_port;
+  e->flag_state = in->flag_state;
+  e->version = in->version;
+  e->wscalediff = in->wscalediff;
+  e->seqoffset = in->seqoffset;
+  e->tsoffset = in->tsoffset;
+  e->lan_sent = in->lan_sent;
+  e->wan_sent = in->wan_sent;
+  e->lan_acked = in->lan_acked;
+  e->wan_acked = in->wan_acked;
+  e->lan_max = in->lan_max;
+  e->wan_max = in->wan_max;
+  e->lan_max_window_unscaled = in->lan_max_window_unscaled;
+  e->wan_max_window_unscaled = in->wan_max_window_unscaled;
+  e->lan_wscale = in->lan_wscale;
+  e->wan_wscale = in->wan_wscale;
+  e->was_synproxied = in->was_synproxied;
+  e->lan_sack_was_supported = in->lan_sack_was_supported;
+  e->ulflowlabel = in->ulflowlabel;
+  e->dlflowlabel = in->dlflowlabel;
+  e->established.upfin = in->upfin;
+  e->established.downfin = in->downfin;
+  e->timer.time64 = deadline64;
+}
+
+uint64_t checkpoint_walk(
+  struct worker_local *local, struct checkpoint_file_entry *out,
+  uint64_t max, uint64_t time64)
+{
+  uint64_t cnt = 0;
+  size_t bucket;
+  if (local->tagged)
+  {
+    void *entry;
+    int slot;
+    FLOWTABLE_FOR_EACH(&local->flowtable, bucket, slot, entry)
+    {
+      struct synproxy_hash_entry *e = entry;
+      if (!checkpoint_entry_saved(e, time64))
+      {
+        continue;
+      }
+      if (out != NULL && cnt < max)
+      {
+        checkpoint_entry_out(&out[cnt], e, time64);
+      }
+      cnt++;
+    }
+  }
+  else
+  {
+    struct hash_list_node *x, *n;
+    HASH_TABLE_FOR_EACH_SAFE(&local->hash, bucket, n, x)
+    {
+      struct synproxy_hash_entry *e;
+      e = CONTAINER_OF(n, struct synproxy_hash_entry, node);
+      if (!checkpoint_entry_saved(e, time64))
+      {
+        continue;
+      }
+      if (out != NULL && cnt < max)
+      {
+        checkpoint_entry_out(&out[cnt], e, time64);
+      }
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+static int checkpoint_fill(
+  struct checkpoint *c, int fd, const uint64_t *counts, uint64_t total,
+  uint64_t time64)
+{
+  struct checkpoint_file_hdr *hdr;
+  struct checkpoint_file_section *sections;
+  struct checkpoint_file_entry *entries;
+  size_t len = sizeof(*hdr) + c->num_locals*sizeof(*sections) +
+               total*sizeof(*entries);
+  void *map;
+  int i;
+  if (ftruncate(fd, len) != 0)
+  {
+    return -errno;
+  }
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    return -errno;
+  }
+  hdr = map;
+  sections = (struct checkpoint_file_section*)(hdr + 1);
+  entries = (struct checkpoint_file_entry*)(sections + c->num_locals);
+  memcpy(hdr->magic, CHECKPOINT_FILE_MAGIC, sizeof(hdr->magic));
+  hdr->version = CHECKPOINT_FILE_VERSION;
+  hdr->entry_size = sizeof(*entries);
+  hdr->num_sections = c->num_locals;
+  hdr->saved_usec = checkpoint_wallclock_usec();
+  for (i = 0; i < c->num_locals; i++)
+  {
+    checkpoint_walk(&c->locals[i], entries, counts[i], time64);
+    sections[i].count = counts[i];
+    sections[i].checksum = checkpoint_checksum(entries, counts[i]);
+    entries += counts[i];
+  }
+  if (munmap(map, len) != 0)
+  {
+    return -errno;
+  }
+  return 0;
+}
+
+int checkpoint_save(struct checkpoint *c)
+{
+  uint64_t counts[c->num_locals];
+  uint64_t total = 0;
+  uint64_t time64 = gettime64();
+  char tmppath[4096];
+  int fd, i, ret;
+  if ((size_t)snprintf(tmppath, sizeof(tmppath), "%s.tmp", c->path) >= sizeof(tmppath))
+  {
+    return -ENAMETOOLONG;
+  }
+  for (i = 0; i < c->num_locals; i++)
+  {
+    counts[i] = checkpoint_walk(&c->locals[i], NULL, 0, time64);
+    total += counts[i];
+  }
+
+  // Written to a new file and renamed, so a crash leaves the old checkpoint
+  fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+  {
+    return -errno;
+  }
+  ret = checkpoint_fill(c, fd, counts, total, time64);
+  if (ret == 0 && fsync(fd) != 0)
+  {
+    ret = -errno;
+  }
+  if (close(fd) != 0 && ret == 0)
+  {
+    ret = -errno;
+  }
+  if (ret == 0 && rename(tmppath, c->path) != 0)
+  {
+    ret = -errno;
+  }
+  if (ret != 0)
+  {
+    unlink(tmppath);
+    return ret;
+  }
+  return total;
+}
+
+struct checkpoint_restore_args {
+  struct worker_local *local;
+  const struct checkpoint_file_entry *entries;
+  uint64_t count;
+  uint64_t downtime_usec;
+  pthread_t thr;
+  int started;
+  uint64_t restored;
+  uint64_t expired;
+  uint64_t failed;
+};
+
+static void *checkpoint_restore_func(void *userdata)
+{
+  struct checkpoint_restore_args *args = userdata;
+  uint64_t time64 = gettime64();
+  uint64_t i;
+  int ret;
+  for (i = 0; i < args->count; i++)
+  {
+    const struct checkpoint_file_entry *in = &args->entries[i];
+    struct synproxy_hash_entry e;
+    if ((in->version != 4 && in->version != 6) ||
+        in->timeout_usec <= args->downtime_usec)
+    {
+      args->expired++;
+      continue;
+    }
+    checkpoint_entry_in(&e, in, time64 + in->timeout_usec - args->downtime_usec);
+    ret = synproxy_hash_put_restored(args->local, &e, time64);
+    if (ret == -EEXIST)
+    {
+      continue;
+    }
+    if (ret != 0)
+    {
+      args->failed++;
+      continue;
+    }
+    args->restored++;
+  }
+  return NULL;
+}
+
+int checkpoint_restore(struct checkpoint *c, int num_threads)
+{
+  const struct checkpoint_file_hdr *hdr;
+  const struct checkpoint_file_section *sections;
+  const struct checkpoint_file_entry *entries;
+  struct checkpoint_restore_args *args;
+  struct stat st;
+  uint64_t now_usec, downtime_usec = 0;
+  uint64_t total = 0, restored = 0, expired = 0, failed = 0;
+  size_t avail;
+  void *map;
+  int fd, ret, i, j, parts, num_args = 0;
+  if (c->path == NULL)
+  {
+    return 0;
+  }
+  fd = open(c->path, O_RDONLY);
+  if (fd < 0)
+  {
+    return -errno;
+  }
+  if (fstat(fd, &st) != 0)
+  {
+    ret = -errno;
+    close(fd);
+    return ret;
+  }
+  if ((size_t)st.st_size < sizeof(*hdr))
+  {
+    close(fd);
+    return -EINVAL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -errno;
+  }
+  hdr = map;
+  sections = (const struct checkpoint_file_section*)(hdr + 1);
+  avail = st.st_size - sizeof(*hdr);
+  if (memcmp(hdr->magic, CHECKPOINT_FILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != CHECKPOINT_FILE_VERSION ||
+      hdr->entry_size != sizeof(*entries) ||
+      hdr->num_sections == 0 ||
+      hdr->num_sections > avail/sizeof(*sections))
+  {
+    munmap(map, st.st_size);
+    return -EINVAL;
+  }
+  // Sharded tables can be merged into one table but not split
+  if (c->num_locals != 1 && hdr->num_sections != (uint32_t)c->num_locals)
+  {
+    log_log(LOG_LEVEL_WARNING, "CHECKPOINT",
+            "checkpoint has %u conn tables, %d now",
+            hdr->num_sections, c->num_locals);
+    munmap(map, st.st_size);
+    return -EINVAL;
+  }
+  avail -= hdr->num_sections*sizeof(*sections);
+  entries = (const struct checkpoint_file_entry*)(sections + hdr->num_sections);
+  for (i = 0; i < (int)hdr->num_sections; i++)
+  {
+    if (sections[i].count > avail/sizeof(*entries) - total)
+    {
+      munmap(map, st.st_size);
+      return -EINVAL;
+    }
+    if (checkpoint_checksum(entries + total, sections[i].count) !=
+        sections[i].checksum)
+    {
+      munmap(map, st.st_size);
+      return -EINVAL;
+    }
+    total += sections[i].count;
+  }
+  if (total*sizeof(*entries) != avail)
+  {
+    munmap(map, st.st_size);
+    return -EINVAL;
+  }
+  now_usec = checkpoint_wallclock_usec();
+  if (now_usec > hdr->saved_usec)
+  {
+    downtime_usec = now_usec - hdr->saved_usec;
+  }
+
+  /*
+   * An unlocked table is restored by one thread. A locked table is shared by
+   * all RX threads, so every thread restores a part of every section.
+   */
+  parts = c->locals[0].locked ? num_threads : 1;
+  if (parts < 1)
+  {
+    parts = 1;
+  }
+  args = calloc(hdr->num_sections*parts, sizeof(*args));
+  if (args == NULL)
+  {
+    munmap(map, st.st_size);
+    return -ENOMEM;
+  }
+  for (i = 0; i < (int)hdr->num_sections; i++)
+  {
+    for (j = 0; j < parts; j++)
+    {
+      struct checkpoint_restore_args *a = &args[num_args];
+      uint64_t begin = sections[i].count*j/parts;
+      uint64_t end = sections[i].count*(j+1)/parts;
+      a->local = &c->locals[c->num_locals == 1 ? 0 : i];
+      a->entries = entries + begin;
+      a->count = end - begin;
+      a->downtime_usec = downtime_usec;
+      num_args++;
+    }
+    entries += sections[i].count;
+  }
+  // Sections of one unlocked table can't be restored in parallel
+  if (c->num_locals == 1 && !c->locals[0].locked)
+  {
+    for (i = 0; i < num_args; i++)
+    {
+      checkpoint_restore_func(&args[i]);
+    }
+  }
+  else
+  {
+    for (i = 0; i < num_args; i++)
+    {
+      args[i].started = (pthread_create(&args[i].thr, NULL,
+                                        checkpoint_restore_func,
+                                        &args[i]) == 0);
+      if (!args[i].started)
+      {
+        // Done in this thread instead
+        checkpoint_restore_func(&args[i]);
+      }
+    }
+    for (i = 0; i < num_args; i++)
+    {
+      if (args[i].started)
+      {
+        pthread_join(args[i].thr, NULL);
+      }
+    }
+  }
+  for (i = 0; i < num_args; i++)
+  {
+    restored += args[i].restored;
+    expired += args[i].expired;
+    failed += args[i].failed;
+  }
+  free(args);
+  munmap(map, st.st_size);
+  if (failed > 0)
+  {
+    log_log(LOG_LEVEL_WARNING, "CHECKPOINT",
+            "%llu connections didn't fit in the conn table",
+            (unsigned long long)failed);
+  }
+  log_log(LOG_LEVEL_NOTICE, "CHECKPOINT",
+          "restored %llu connections from %s, %llu expired during %llu ms",
+          (unsigned long long)restored, c->path, (unsigned long long)expired,
+          (unsigned long long)(downtime_usec/1000));
+  return restored;
+}
+
+void checkpoint_start(
+  struct checkpoint *c, const char *path, struct worker_local *locals,
+  int num_locals, int num_threads)
+{
+  int ret;
+  checkpoint_init(c, path, locals, num_locals, num_threads);
+  if (path == NULL)
+  {
+    return;
+  }
+  ret = checkpoint_restore(c, num_threads);
+  if (ret == -ENOENT)
+  {
+    log_log(LOG_LEVEL_NOTICE, "CHECKPOINT", "no %s, starting empty", path);
+  }
+  else if (ret < 0)
+  {
+    log_log(LOG_LEVEL_WARNING, "CHECKPOINT", "ignoring %s: %s", path,
+            ret == -EINVAL ? "invalid checkpoint" : strerror(-ret));
+  }
+}
+
+static void checkpoint_save_log(struct checkpoint *c)
+{
+  uint64_t begin = gettime64();
+  int ret = checkpoint_save(c);
+  if (ret < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "CHECKPOINT", "can't save %s: %s",
+            c->path, strerror(-ret));
+    return;
+  }
+  log_log(LOG_LEVEL_NOTICE, "CHECKPOINT", "saved %d connections in %llu ms",
+          ret, (unsigned long long)((gettime64() - begin)/1000));
+}
+
+int checkpoint_run(struct checkpoint *c, void (*fn)(void *ud), void *ud)
+{
+  pthread_mutex_lock(&c->mtx);
+  if (c->closed)
+  {
+    pthread_mutex_unlock(&c->mtx);
+    return -ESHUTDOWN;
+  }
+  atomic_store_explicit(&c->req, 1, memory_order_relaxed);
+  while (c->parked < c->running)
+  {
+    pthread_cond_wait(&c->cond, &c->mtx);
+  }
+  fn(ud);
+  atomic_store_explicit(&c->req, 0, memory_order_relaxed);
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->mtx);
+  return 0;
+}
+
+static void checkpoint_request_fn(void *ud)
+{
+  checkpoint_save_log(ud);
+}
+
+void checkpoint_request(struct checkpoint *c)
+{
+  if (c->path == NULL)
+  {
+    return;
+  }
+  checkpoint_run(c, checkpoint_request_fn, c);
+}
+
+void checkpoint_park(struct checkpoint *c)
+{
+  pthread_mutex_lock(&c->mtx);
+  c->parked++;
+  pthread_cond_broadcast(&c->cond);
+  while (atomic_load_explicit(&c->req, memory_order_relaxed))
+  {
+    pthread_cond_wait(&c->cond, &c->mtx);
+  }
+  c->parked--;
+  pthread_mutex_unlock(&c->mtx);
+}
+
+void checkpoint_thread_exit(struct checkpoint *c)
+{
+  pthread_mutex_lock(&c->mtx);
+  c->running--;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->mtx);
+}
+
+void checkpoint_stop(struct checkpoint *c)
+{
+  pthread_mutex_lock(&c->mtx);
+  if (c->path != NULL && !c->closed)
+  {
+    checkpoint_save_log(c);
+  }
+  c->closed = 1;
+  pthread_mutex_unlock(&c->mtx);
+}
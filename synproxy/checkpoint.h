@@ -0,0 +1,182 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Keeps established connections over restarts. The connection tables are
+ * written to a file on SIGUSR1 and at exit, and read back at start, so the
+ * sequence number and timestamp translation of synproxied connections goes
+ * on after the restart.
+ *
+ * A checkpoint at runtime stops the world: every RX thread parks at the top
+ * of its loop, the tables are written while no thread changes them, then the
+ * threads go on. Restore runs before the RX threads, in parallel.
+ *
+ * Connections still in handshake aren't saved. Their peers retransmit, and
+ * the retransmission is handled as a new connection.
+ */
+
+#define CHECKPOINT_FILE_MAGIC "SYNPCKPT"
+#define CHECKPOINT_FILE_VERSION 1
+
+/*
+ * The file is a header, a section per connection table and then the entries
+ * of every section in order, in host byte order so that it can be used
+ * through mmap(). Every section has a checksum of its entries.
+ */
+
+struct checkpoint_file_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t num_sections;
+  uint32_t reserved;
+  uint64_t saved_usec; // wall clock, to subtract the downtime from timeouts
+};
+
+struct checkpoint_file_section {
+  uint64_t count;
+  uint32_t checksum;
+  uint32_t reserved;
+};
+
+struct checkpoint_file_entry {
+  char local_ip[16];
+  char remote_ip[16];
+  uint16_t local_port;
+  uint16_t remote_port;
+  uint16_t flag_state;
+  uint8_t version;
+  int8_t wscalediff;
+  uint32_t seqoffset;
+  uint32_t tsoffset;
+  uint32_t lan_sent;
+  uint32_t wan_sent;
+  uint32_t lan_acked;
+  uint32_t wan_acked;
+  uint32_t lan_max;
+  uint32_t wan_max;
+  uint16_t lan_max_window_unscaled;
+  uint16_t wan_max_window_unscaled;
+  uint8_t lan_wscale;
+  uint8_t wan_wscale;
+  uint8_t was_synproxied;
+  uint8_t lan_sack_was_supported;
+  uint32_t ulflowlabel;
+  uint32_t dlflowlabel;
+  uint32_t upfin;
+  uint32_t downfin;
+  uint64_t timeout_usec; // time left until expiry
+};
+
+struct worker_local;
+struct synproxy_hash_entry;
+
+/*
+ * Converts between table entries and records. The timeout of a record is
+ * relative to time64, and the timer of a converted entry expires at
+ * deadline64.
+ */
+void checkpoint_entry_out(
+  struct checkpoint_file_entry *out, struct synproxy_hash_entry *e,
+  uint64_t time64);
+
+void checkpoint_entry_in(
+  struct synproxy_hash_entry *e, const struct checkpoint_file_entry *in,
+  uint64_t deadline64);
+
+/*
+ * Returns 1 if a checkpoint saves the entry: it isn't in handshake and hasn't
+ * expired by time64.
+ */
+int checkpoint_entry_saved(
+  struct synproxy_hash_entry *e, uint64_t time64);
+
+/*
+ * Returns the number of entries of the table that a checkpoint saves, and
+ * copies up to max of them to out. Entries in handshake are skipped.
+ */
+uint64_t checkpoint_walk(
+  struct worker_local *local, struct checkpoint_file_entry *out,
+  uint64_t max, uint64_t time64);
+
+struct checkpoint {
+  const char *path; // NULL: disabled
+  struct worker_local *locals;
+  int num_locals;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  atomic_int req;
+  int running; // RX threads that haven't exited
+  int parked;
+  int closed;
+};
+
+void checkpoint_init(
+  struct checkpoint *c, const char *path, struct worker_local *locals,
+  int num_locals, int num_threads);
+
+/*
+ * Initializes and restores the tables from the file, with as many threads as
+ * there are RX threads. A missing or invalid file only means starting with
+ * empty tables.
+ */
+void checkpoint_start(
+  struct checkpoint *c, const char *path, struct worker_local *locals,
+  int num_locals, int num_threads);
+
+/*
+ * Writes the tables to the file atomically. No thread may change the tables
+ * meanwhile. Returns the number of entries written or a negative errno.
+ */
+int checkpoint_save(struct checkpoint *c);
+
+/*
+ * Adds the entries of the file to the tables with num_threads threads. Call
+ * before the RX threads. Sharded tables are restored only if their number
+ * hasn't changed, as the queue of a flow depends on it. Returns the number of
+ * entries added, -EINVAL if the file isn't a valid checkpoint or doesn't fit
+ * the tables, or another negative errno if it can't be read.
+ */
+int checkpoint_restore(struct checkpoint *c, int num_threads);
+
+/*
+ * Parks the RX threads, calls fn and lets the threads go on. Returns
+ * -ESHUTDOWN after checkpoint_stop().
+ */
+int checkpoint_run(struct checkpoint *c, void (*fn)(void *ud), void *ud);
+
+/*
+ * Saves with the RX threads parked. Called from the signal thread.
+ */
+void checkpoint_request(struct checkpoint *c);
+
+void checkpoint_park(struct checkpoint *c);
+
+/*
+ * Called by an RX thread when it exits, so that checkpoints no longer wait
+ * for it.
+ */
+void checkpoint_thread_exit(struct checkpoint *c);
+
+/*
+ * Saves once more and disables further checkpoints. Call after the RX
+ * threads have exited.
+ */
+void checkpoint_stop(struct checkpoint *c);
+
+/*
+ * Called by every RX thread at the top of its loop, without any locks.
+ */
+static inline void checkpoint_poll(struct checkpoint *c)
+{
+  if (atomic_load_explicit(&c->req, memory_order_relaxed))
+  {
+    checkpoint_park(c);
+  }
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <errno.h>
 #include "dynarr.h"
 #include "log.h"
@@ -23,6 +24,10 @@ enum sackconflict {
   SACKCONFLICT_REMOVE,
   SACKCONFLICT_RETAIN,
 };
+enum conntabletype {
+  CONNTABLETYPE_CHAINED,
+  CONNTABLETYPE_TAGGED,
+};
 
 struct ratehashconf {
   size_t size;
@@ -33,20 +38,40 @@ struct ratehashconf {
   uint8_t network_prefix6;
 };
 
+struct hittersconf {
+  size_t size;
+  uint32_t timer_period_usec;
+  uint32_t threshold;
+  uint32_t topk;
+};
+
 struct conf {
   enum learnmode sackmode;
   enum sackconflict sackconflict;
   enum learnmode mssmode;
   enum learnmode wscalemode;
   size_t learnhashsize;
+  size_t commandedhashsize;
+  char *learnhashfile; // NULL: not saved
+  uint32_t learnhashsave_interval;
+  char *checkpointfile; // NULL: no checkpoints
+  char *replicate_peer; // NULL: not sent
+  char *replicate_listen; // NULL: not received
   size_t conntablesize;
+  enum conntabletype conntabletype;
+  int hugepages;
   unsigned threadcount;
+  unsigned queuecount;
+  uint32_t busypoll;
+  uint32_t txsync_threshold;
   struct ratehashconf ratehash;
+  struct hittersconf hitters;
   DYNARR(uint16_t) msslist;
   DYNARR(uint8_t) wscalelist;
   DYNARR(uint16_t) tsmsslist;
   DYNARR(uint8_t) tswscalelist;
   uint32_t halfopen_cache_max;
+  int halfopen_cache_adaptive;
   int msslist_present;
   int wscalelist_present;
   int tsmsslist_present;
@@ -64,6 +89,8 @@ struct conf {
   uid_t uid;
   gid_t gid;
   int test_connections;
+  int sharding;
+  int dispatch;
   uint16_t port;
 };
 
@@ -72,7 +99,15 @@ struct conf {
   .sackconflict = SACKCONFLICT_RETAIN, \
   .mssmode = HASHMODE_HASHIP, \
   .learnhashsize = 131072, \
+  .commandedhashsize = 65536, \
+  .learnhashfile = NULL, \
+  .learnhashsave_interval = 60, \
+  .checkpointfile = NULL, \
+  .replicate_peer = NULL, \
+  .replicate_listen = NULL, \
   .conntablesize = 131072, \
+  .conntabletype = CONNTABLETYPE_CHAINED, \
+  .hugepages = 0, \
   .ratehash = { \
     .size = 131072, \
     .timer_period_usec = (1000*1000), \
@@ -81,6 +116,12 @@ struct conf {
     .network_prefix = 24, \
     .network_prefix6 = 64, \
   }, \
+  .hitters = { \
+    .size = 4096, \
+    .timer_period_usec = (1000*1000), \
+    .threshold = 0, \
+    .topk = 16, \
+  }, \
   .msslist = DYNARR_INITER, \
   .wscalelist = DYNARR_INITER, \
   .tsmsslist = DYNARR_INITER, \
@@ -93,10 +134,16 @@ struct conf {
   .mss_clamp = 1460, \
   .ts_bits = 5, \
   .halfopen_cache_max = 0, \
+  .halfopen_cache_adaptive = 0, \
   .threadcount = 1, \
+  .queuecount = 0, \
+  .busypoll = 0, \
+  .txsync_threshold = 0, \
   .uid = 0, \
   .gid = 0, \
   .test_connections = 0, \
+  .sharding = 0, \
+  .dispatch = 0, \
   .port = 12345, \
 }
 
@@ -106,6 +153,14 @@ static inline void conf_free(struct conf *conf)
   DYNARR_FREE(&conf->wscalelist);
   DYNARR_FREE(&conf->tsmsslist);
   DYNARR_FREE(&conf->tswscalelist);
+  free(conf->learnhashfile);
+  conf->learnhashfile = NULL;
+  free(conf->checkpointfile);
+  conf->checkpointfile = NULL;
+  free(conf->replicate_peer);
+  conf->replicate_peer = NULL;
+  free(conf->replicate_listen);
+  conf->replicate_listen = NULL;
 }
 
 static inline int conf_postprocess(struct conf *conf)
@@ -49,13 +49,15 @@ int confyywrap(yyscan_t scanner)
 %destructor { free ($$); } STRING_LITERAL
 
 %token ENABLE DISABLE HASHIP HASHIPPORT COMMANDED SACKHASHMODE EQUALS SEMICOLON OPENBRACE CLOSEBRACE SYNPROXYCONF ERROR_TOK INT_LITERAL
-%token LEARNHASHSIZE RATEHASH SIZE TIMER_PERIOD_USEC TIMER_ADD INITIAL_TOKENS
-%token CONNTABLESIZE THREADCOUNT
+%token LEARNHASHSIZE COMMANDEDHASHSIZE LEARNHASHFILE LEARNHASHSAVE_INTERVAL CHECKPOINTFILE REPLICATE_PEER REPLICATE_LISTEN RATEHASH SIZE TIMER_PERIOD_USEC TIMER_ADD INITIAL_TOKENS
+%token HITTERS THRESHOLD TOPK
+%token CONNTABLESIZE CONNTABLETYPE CHAINED TAGGED HUGEPAGES THREADCOUNT SHARDING DISPATCH QUEUECOUNT
+%token BUSYPOLL TXSYNC_THRESHOLD
 %token COMMA MSS WSCALE TSMSS TSWSCALE TS_BITS OWN_MSS OWN_WSCALE OWN_SACK
 %token STRING_LITERAL
 %token SACKCONFLICT REMOVE RETAIN
 %token MSS_CLAMP
-%token NETWORK_PREFIX NETWORK_PREFIX6 MSSMODE WSCALEMODE DEFAULT HALFOPEN_CACHE_MAX
+%token NETWORK_PREFIX NETWORK_PREFIX6 MSSMODE WSCALEMODE DEFAULT HALFOPEN_CACHE_MAX HALFOPEN_CACHE_ADAPTIVE
 %token USER GROUP
 %token TEST_CONNECTIONS
 %token PORT
@@ -65,7 +67,8 @@ int confyywrap(yyscan_t scanner)
 %type<i> msshashval
 %type<i> wscaleval
 %type<i> sackconflictval
-%type<i> own_sack
+%type<i> conntabletypeval
+%type<i> enabledisable
 %type<i> INT_LITERAL
 %type<s> STRING_LITERAL
 %type<both> intorstring
@@ -122,7 +125,18 @@ sackhashval:
 }
 ;
 
-own_sack:
+conntabletypeval:
+  CHAINED
+{
+  $$ = CONNTABLETYPE_CHAINED;
+}
+| TAGGED
+{
+  $$ = CONNTABLETYPE_TAGGED;
+}
+;
+
+enabledisable:
   ENABLE
 {
   $$ = 1;
@@ -166,6 +180,10 @@ ratehashlist:
 | ratehashlist ratehash_entry
 ;
 
+hitterslist:
+| hitterslist hitters_entry
+;
+
 conflist:
 | conflist conflist_entry
 ;
@@ -502,7 +520,7 @@ TEST_CONNECTIONS SEMICOLON
   }
   conf->tswscalelist_present = 1;
 }
-| OWN_SACK EQUALS own_sack SEMICOLON
+| OWN_SACK EQUALS enabledisable SEMICOLON
 {
   conf->own_sack = $3;
 }
@@ -562,6 +580,87 @@ TEST_CONNECTIONS SEMICOLON
   }
   conf->learnhashsize = $3;
 }
+| COMMANDEDHASHSIZE EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 <= 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid commandedhash size: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  if (($3 & ($3-1)) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "commandedhash size not power of 2: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->commandedhashsize = $3;
+}
+| LEARNHASHFILE EQUALS STRING_LITERAL SEMICOLON
+{
+  free(conf->learnhashfile);
+  conf->learnhashfile = NULL;
+  if ($3[0] != '\0')
+  {
+    conf->learnhashfile = $3;
+  }
+  else
+  {
+    free($3);
+  }
+}
+| LEARNHASHSAVE_INTERVAL EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid learnhashsave_interval: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->learnhashsave_interval = $3;
+}
+| CHECKPOINTFILE EQUALS STRING_LITERAL SEMICOLON
+{
+  free(conf->checkpointfile);
+  conf->checkpointfile = NULL;
+  if ($3[0] != '\0')
+  {
+    conf->checkpointfile = $3;
+  }
+  else
+  {
+    free($3);
+  }
+}
+| REPLICATE_PEER EQUALS STRING_LITERAL SEMICOLON
+{
+  free(conf->replicate_peer);
+  conf->replicate_peer = NULL;
+  if ($3[0] != '\0')
+  {
+    conf->replicate_peer = $3;
+  }
+  else
+  {
+    free($3);
+  }
+}
+| REPLICATE_LISTEN EQUALS STRING_LITERAL SEMICOLON
+{
+  free(conf->replicate_listen);
+  conf->replicate_listen = NULL;
+  if ($3[0] != '\0')
+  {
+    conf->replicate_listen = $3;
+  }
+  else
+  {
+    free($3);
+  }
+}
 | CONNTABLESIZE EQUALS INT_LITERAL SEMICOLON
 {
   if ($3 <= 0)
@@ -580,6 +679,14 @@ TEST_CONNECTIONS SEMICOLON
   }
   conf->conntablesize = $3;
 }
+| CONNTABLETYPE EQUALS conntabletypeval SEMICOLON
+{
+  conf->conntabletype = $3;
+}
+| HUGEPAGES EQUALS enabledisable SEMICOLON
+{
+  conf->hugepages = $3;
+}
 | THREADCOUNT EQUALS INT_LITERAL SEMICOLON
 {
   if ($3 <= 0)
@@ -591,6 +698,47 @@ TEST_CONNECTIONS SEMICOLON
   }
   conf->threadcount = $3;
 }
+| SHARDING EQUALS enabledisable SEMICOLON
+{
+  conf->sharding = $3;
+}
+| DISPATCH EQUALS enabledisable SEMICOLON
+{
+  conf->dispatch = $3;
+}
+| QUEUECOUNT EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 <= 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid queue count: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->queuecount = $3;
+}
+| BUSYPOLL EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid busypoll: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->busypoll = $3;
+}
+| TXSYNC_THRESHOLD EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid txsync_threshold: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->txsync_threshold = $3;
+}
 | TS_BITS EQUALS INT_LITERAL SEMICOLON
 {
   if ($3 < 0)
@@ -620,7 +768,12 @@ TEST_CONNECTIONS SEMICOLON
   }
   conf->halfopen_cache_max = $3;
 }
+| HALFOPEN_CACHE_ADAPTIVE EQUALS enabledisable SEMICOLON
+{
+  conf->halfopen_cache_adaptive = $3;
+}
 | RATEHASH EQUALS OPENBRACE ratehashlist CLOSEBRACE SEMICOLON
+| HITTERS EQUALS OPENBRACE hitterslist CLOSEBRACE SEMICOLON
 ;
 
 ratehash_entry:
@@ -698,3 +851,57 @@ SIZE EQUALS INT_LITERAL SEMICOLON
   conf->ratehash.network_prefix6 = $3;
 }
 ;
+
+hitters_entry:
+SIZE EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 <= 0 || $3 > 65536)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid hitters size: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  if (($3 & ($3-1)) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "hitters size not power of 2: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->hitters.size = $3;
+}
+| TIMER_PERIOD_USEC EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 <= 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid hitters timer period: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->hitters.timer_period_usec = $3;
+}
+| THRESHOLD EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid hitters threshold: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->hitters.threshold = $3;
+}
+| TOPK EQUALS INT_LITERAL SEMICOLON
+{
+  if ($3 <= 0 || $3 > 1024)
+  {
+    log_log(LOG_LEVEL_CRIT, "CONFPARSER",
+            "invalid hitters topk: %d at line %d col %d",
+            $3, @3.first_line, @3.first_column);
+    YYABORT;
+  }
+  conf->hitters.topk = $3;
+}
+;
@@ -2,8 +2,45 @@
 #include "databuf.h"
 #include "read.h"
 #include <fcntl.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 
+// Stop reading a client that doesn't read its replies
+#define CTRL_OUT_HIGH (1024*1024)
+
+enum ctrl_kind {
+  CTRL_KIND_LISTEN,
+  CTRL_KIND_PIPE,
+  CTRL_KIND_CLIENT,
+};
+
+struct ctrl_client {
+  enum ctrl_kind kind;
+  int fd;
+  int idx; // in clients
+  uint32_t events;
+  int v2;
+  char *in;
+  size_t inoff;
+  size_t inlen;
+  size_t insize;
+  char *out;
+  size_t outoff;
+  size_t outlen;
+  size_t outsize;
+  int dumping;
+  uint32_t dump_seq;
+  unsigned dump_bucket;
+  uint32_t dump_count;
+};
+
+struct ctrl {
+  struct ctrl_args *args;
+  int epfd;
+  struct ctrl_client *clients[CTRL_MAX_CLIENTS];
+  int num_clients;
+};
+
 static void set_nonblock(int fd)
 {
   int opt;
@@ -19,15 +56,953 @@ static void set_nonblock(int fd)
   }
 }
 
+static void ctrl_reserve(char **buf, size_t *size, size_t needed)
+{
+  size_t newsize = *size ? *size : 4096;
+  char *newbuf;
+  if (needed <= *size)
+  {
+    return;
+  }
+  while (newsize < needed)
+  {
+    newsize *= 2;
+  }
+  newbuf = realloc(*buf, newsize);
+  if (newbuf == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "CTRL", "can't allocate buffer");
+    abort();
+  }
+  *buf = newbuf;
+  *size = newsize;
+}
+
+/*
+ * Returns space for len bytes at the end of the output. The pointer is valid
+ * until the next call.
+ */
+static char *ctrl_append(struct ctrl_client *c, size_t len)
+{
+  char *p;
+  ctrl_reserve(&c->out, &c->outsize, c->outlen + len);
+  p = &c->out[c->outlen];
+  c->outlen += len;
+  return p;
+}
+
+static void ctrl_append_str(struct ctrl_client *c, const char *str)
+{
+  size_t len = strlen(str);
+  memcpy(ctrl_append(c, len), str, len);
+}
+
+static size_t ctrl_client_pending(struct ctrl_client *c)
+{
+  return c->outlen - c->outoff;
+}
+
+/*
+ * Writes the heavy hitters of the last period: the count of entries on the
+ * first line, then "network/prefix port count" per line, largest first.
+ */
+static void ctrl_append_hitters(struct ctrl_client *c, struct synproxy *synproxy)
+{
+  struct hitters *h = &synproxy->hitters;
+  struct hitter *top;
+  char line[INET6_ADDRSTRLEN + 32];
+  size_t n, i;
+  top = malloc(h->topk*sizeof(*top));
+  if (top == NULL)
+  {
+    ctrl_append_str(c, "0\n");
+    return;
+  }
+  n = hitters_get_top(h, top, h->topk);
+  snprintf(line, sizeof(line), "%zu\n", n);
+  ctrl_append_str(c, line);
+  for (i = 0; i < n; i++)
+  {
+    char str[INET6_ADDRSTRLEN] = {0};
+    if (top[i].version == 4)
+    {
+      struct in_addr in;
+      in.s_addr = htonl(top[i].addr.ip);
+      inet_ntop(AF_INET, &in, str, sizeof(str));
+    }
+    else
+    {
+      inet_ntop(AF_INET6, top[i].addr.ip6, str, sizeof(str));
+    }
+    snprintf(line, sizeof(line), "%s/%d %d %u\n",
+             str,
+             top[i].version == 4 ? h->network_prefix : h->network_prefix6,
+             top[i].port, top[i].count);
+    ctrl_append_str(c, line);
+  }
+  free(top);
+}
+
+static int ctrl_v2_apply_one(
+  struct threetuplectx *ctx, uint8_t operation, const char *entry)
+{
+  uint8_t version = entry[0];
+  uint8_t proto = entry[1];
+  uint16_t port = hdr_get16n(&entry[2]);
+  uint32_t ip = hdr_get32n(&entry[8]);
+  const char *ip6 = &entry[8];
+  struct threetuplepayload payload;
+  payload.mss = hdr_get16n(&entry[4]);
+  payload.sack_supported = entry[6];
+  payload.wscaleshift = entry[7];
+  if (operation == (1<<0) && version == 0)
+  {
+    threetuplectx_flush(ctx);
+    return 0;
+  }
+  if (version != 4 && version != 6)
+  {
+    return -EINVAL;
+  }
+  switch (operation)
+  {
+    case (1<<0):
+      if (version == 4)
+      {
+        threetuplectx_flush_ip(ctx, ip);
+      }
+      else
+      {
+        threetuplectx_flush_ip6(ctx, ip6);
+      }
+      return 0;
+    case (1<<1):
+      if (version == 4)
+      {
+        return threetuplectx_add(ctx, ip, port, proto, (port != 0),
+                                 (proto != 0), &payload);
+      }
+      return threetuplectx_add6(ctx, ip6, port, proto, (port != 0),
+                                (proto != 0), &payload);
+    case (1<<2):
+      if (version == 4)
+      {
+        return threetuplectx_modify(ctx, ip, port, proto, (port != 0),
+                                    (proto != 0), &payload);
+      }
+      return threetuplectx_modify6(ctx, ip6, port, proto, (port != 0),
+                                   (proto != 0), &payload);
+    case (1<<3):
+      if (version == 4)
+      {
+        return threetuplectx_delete(ctx, ip, port, proto, (port != 0),
+                                    (proto != 0));
+      }
+      return threetuplectx_delete6(ctx, ip6, port, proto, (port != 0),
+                                   (proto != 0));
+    default:
+      return -EINVAL;
+  }
+}
+
+uint32_t ctrl_v2_apply(
+  struct threetuplectx *ctx, uint8_t operation, const char *entries,
+  uint32_t count, uint32_t *first_failed)
+{
+  uint32_t i;
+  uint32_t failed = 0;
+  *first_failed = CTRL_V2_NONE_FAILED;
+  for (i = 0; i < count; i++)
+  {
+    if (ctrl_v2_apply_one(ctx, operation, &entries[i*CTRL_V2_ENTRY_SIZE]) != 0)
+    {
+      if (failed++ == 0)
+      {
+        *first_failed = i;
+      }
+    }
+  }
+  return failed;
+}
+
+static void ctrl_v2_reply_fill(
+  char *reply, uint32_t seq, uint32_t count, uint32_t failed,
+  uint32_t first_failed)
+{
+  hdr_set32n(&reply[0], seq);
+  hdr_set32n(&reply[4], count);
+  hdr_set32n(&reply[8], failed);
+  hdr_set32n(&reply[12], first_failed);
+}
+
+static int ctrl_v2_lookup_one(
+  struct ctrl_args *args, struct ctrl_client *c, const char *flow,
+  uint64_t time64)
+{
+  struct synproxy_hash_entry e;
+  char *result = ctrl_append(c, CTRL_V2_RESULT_SIZE);
+  uint8_t version = flow[0];
+  uint16_t local_port = hdr_get16n(&flow[2]);
+  uint16_t remote_port = hdr_get16n(&flow[4]);
+  uint64_t timeout = 0;
+  int i;
+  memset(result, 0, CTRL_V2_RESULT_SIZE);
+  if (version != 4 && version != 6)
+  {
+    return -EINVAL;
+  }
+  for (i = 0; i < args->num_locals; i++)
+  {
+    if (synproxy_hash_peek(&args->locals[i], version, &flow[8], local_port,
+                           &flow[24], remote_port, &e) == 0)
+    {
+      break;
+    }
+  }
+  if (i == args->num_locals)
+  {
+    return -ENOENT;
+  }
+  if (timer_wheel_time(&e.timer) > time64)
+  {
+    timeout = timer_wheel_time(&e.timer) - time64;
+  }
+  result[0] = 1;
+  result[1] = e.was_synproxied;
+  hdr_set16n(&result[2], e.flag_state);
+  hdr_set32n(&result[4], i);
+  hdr_set32n(&result[8], e.seqoffset);
+  hdr_set32n(&result[12], e.tsoffset);
+  hdr_set32n(&result[16], e.lan_sent);
+  hdr_set32n(&result[20], e.wan_sent);
+  hdr_set32n(&result[24], timeout >> 32);
+  hdr_set32n(&result[28], (uint32_t)timeout);
+  return 0;
+}
+
+static void ctrl_v2_stats(
+  struct ctrl_args *args, struct ctrl_client *c, uint32_t seq)
+{
+  int i;
+  ctrl_v2_reply_fill(ctrl_append(c, CTRL_V2_REPLY_SIZE),
+                     seq, args->num_locals, 0, CTRL_V2_NONE_FAILED);
+  for (i = 0; i < args->num_locals; i++)
+  {
+    struct worker_local *local = &args->locals[i];
+    uint64_t failures = worker_local_alloc_failures(local);
+    char *rec = ctrl_append(c, CTRL_V2_STATS_SIZE);
+    hdr_set32n(&rec[0], i);
+    hdr_set32n(&rec[4], local->synproxied_connections);
+    hdr_set32n(&rec[8], local->direct_connections);
+    hdr_set32n(&rec[12], local->half_open_connections);
+    hdr_set32n(&rec[16], failures >> 32);
+    hdr_set32n(&rec[20], (uint32_t)failures);
+  }
+}
+
+static void ctrl_v2_workers(
+  struct ctrl_args *args, struct ctrl_client *c, uint32_t seq)
+{
+  int i;
+  ctrl_v2_reply_fill(ctrl_append(c, CTRL_V2_REPLY_SIZE),
+                     seq, args->num_workers, 0, CTRL_V2_NONE_FAILED);
+  for (i = 0; i < args->num_workers; i++)
+  {
+    struct ctrl_worker_stats *stats = &args->workers[i];
+    uint64_t rxpkts =
+      atomic_load_explicit(&stats->rxpkts, memory_order_relaxed);
+    uint64_t rxbytes =
+      atomic_load_explicit(&stats->rxbytes, memory_order_relaxed);
+    uint64_t txpkts =
+      atomic_load_explicit(&stats->txpkts, memory_order_relaxed);
+    char *rec = ctrl_append(c, CTRL_V2_WORKER_SIZE);
+    hdr_set32n(&rec[0], i);
+    hdr_set32n(&rec[4], 0);
+    hdr_set32n(&rec[8], rxpkts >> 32);
+    hdr_set32n(&rec[12], (uint32_t)rxpkts);
+    hdr_set32n(&rec[16], rxbytes >> 32);
+    hdr_set32n(&rec[20], (uint32_t)rxbytes);
+    hdr_set32n(&rec[24], txpkts >> 32);
+    hdr_set32n(&rec[28], (uint32_t)txpkts);
+  }
+}
+
+static void ctrl_v2_dump_fn(const struct threetupleentry *e, void *ud)
+{
+  struct ctrl_client *c = ud;
+  char *entry = ctrl_append(c, CTRL_V2_ENTRY_SIZE);
+  memset(entry, 0, CTRL_V2_ENTRY_SIZE);
+  entry[0] = e->version;
+  entry[1] = e->proto;
+  hdr_set16n(&entry[2], e->port);
+  hdr_set16n(&entry[4], e->payload.mss);
+  entry[6] = e->payload.sack_supported;
+  entry[7] = e->payload.wscaleshift;
+  if (e->version == 4)
+  {
+    hdr_set32n(&entry[8], e->ip.ipv4);
+  }
+  else
+  {
+    memcpy(&entry[8], e->ip.ipv6, 16);
+  }
+  c->dump_count++;
+}
+
+/*
+ * Sends the next reply of a dump, taking one bucket lock at a time.
+ */
+static void ctrl_v2_dump_chunk(struct ctrl_args *args, struct ctrl_client *c)
+{
+  struct threetuplectx *ctx = &args->synproxy->threetuplectx;
+  size_t hdroff = c->outlen;
+  ctrl_append(c, CTRL_V2_REPLY_SIZE);
+  c->dump_count = 0;
+  while (c->dump_bucket < ctx->tbl.bucketcnt &&
+         c->dump_count < CTRL_V2_DUMP_CHUNK)
+  {
+    threetuplectx_for_each_bucket(ctx, c->dump_bucket++, ctrl_v2_dump_fn, c);
+  }
+  ctrl_v2_reply_fill(&c->out[hdroff], c->dump_seq, c->dump_count, 0,
+                     CTRL_V2_NONE_FAILED);
+  if (c->dump_count == 0)
+  {
+    c->dumping = 0;
+  }
+}
+
+static size_t ctrl_v2_entry_size(uint8_t operation)
+{
+  return operation == CTRL_V2_LOOKUP ? CTRL_V2_FLOW_SIZE : CTRL_V2_ENTRY_SIZE;
+}
+
+static void ctrl_v2_frame(
+  struct ctrl_args *args, struct ctrl_client *c, const char *frame)
+{
+  uint32_t seq = hdr_get32n(&frame[0]);
+  uint32_t count = hdr_get32n(&frame[4]);
+  uint8_t operation = frame[8];
+  const char *entries = &frame[CTRL_V2_HDR_SIZE];
+  uint32_t failed = 0;
+  uint32_t first_failed = CTRL_V2_NONE_FAILED;
+  uint32_t i;
+  if (operation == CTRL_V2_DUMP)
+  {
+    log_log(LOG_LEVEL_DEBUG, "CTRL", "batch %u dump", seq);
+    c->dumping = 1;
+    c->dump_seq = seq;
+    c->dump_bucket = 0;
+  }
+  else if (operation == CTRL_V2_STATS)
+  {
+    log_log(LOG_LEVEL_DEBUG, "CTRL", "batch %u stats", seq);
+    ctrl_v2_stats(args, c, seq);
+  }
+  else if (operation == CTRL_V2_WORKERS)
+  {
+    log_log(LOG_LEVEL_DEBUG, "CTRL", "batch %u workers", seq);
+    ctrl_v2_workers(args, c, seq);
+  }
+  else if (operation == CTRL_V2_LOOKUP)
+  {
+    size_t hdroff = c->outlen;
+    uint64_t time64 = gettime64();
+    ctrl_append(c, CTRL_V2_REPLY_SIZE);
+    for (i = 0; i < count; i++)
+    {
+      if (ctrl_v2_lookup_one(args, c, &entries[i*CTRL_V2_FLOW_SIZE],
+                             time64) != 0)
+      {
+        if (failed++ == 0)
+        {
+          first_failed = i;
+        }
+      }
+    }
+    log_log(LOG_LEVEL_DEBUG, "CTRL", "batch %u lookup %u not found %u",
+            seq, count, failed);
+    ctrl_v2_reply_fill(&c->out[hdroff], seq, count, failed, first_failed);
+  }
+  else
+  {
+    failed = ctrl_v2_apply(&args->synproxy->threetuplectx, operation,
+                           entries, count, &first_failed);
+    log_log(LOG_LEVEL_NOTICE, "CTRL",
+            "batch %u operation %d entries %u failed %u",
+            seq, operation, count, failed);
+    ctrl_v2_reply_fill(ctrl_append(c, CTRL_V2_REPLY_SIZE),
+                       seq, count, failed, first_failed);
+  }
+}
+
+static void ctrl_legacy(
+  struct ctrl_args *args, struct ctrl_client *c, const char *buf)
+{
+  const char *ip6 = &buf[12];
+  char str6[INET6_ADDRSTRLEN] = {0};
+  struct in6_addr in6;
+  uint32_t ip;
+  uint16_t port;
+  uint8_t proto;
+  uint8_t operation;
+  struct threetuplepayload payload;
+  struct datainbuf inbuf;
+  int ok;
+  datainbuf_init(&inbuf, buf, 12);
+  if (datainbuf_get_u32(&inbuf, &ip) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u16(&inbuf, &port) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u8(&inbuf, &proto) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u8(&inbuf, &operation) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u16(&inbuf, &payload.mss) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u8(&inbuf, &payload.sack_supported) != 0)
+  {
+    abort();
+  }
+  if (datainbuf_get_u8(&inbuf, &payload.wscaleshift) != 0)
+  {
+    abort();
+  }
+  if (operation & (1<<7))
+  {
+    memcpy(in6.s6_addr, ip6, 16);
+    if (inet_ntop(AF_INET6, &in6, str6, sizeof(str6)) == NULL)
+    {
+      strncpy(str6, "UNKNOWN", sizeof(str6));
+    }
+  }
+  if (operation == ((1<<7)|(1<<3)))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "rm [%s]:%d proto %d port_valid %d proto_valid %d",
+           str6,
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0);
+    ok = threetuplectx_delete6(&args->synproxy->threetuplectx, ip6,
+                               port, proto, (port != 0), (proto != 0)) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == (1<<3))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "rm %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d",
+           (uint8_t)(ip>>24),
+           (uint8_t)(ip>>16),
+           (uint8_t)(ip>>8),
+           (uint8_t)(ip>>0),
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0);
+    ok = threetuplectx_delete(&args->synproxy->threetuplectx, ip, port, proto,
+                              (port != 0), (proto != 0)) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == ((1<<7)|(1<<2)))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "mod [%s]:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           str6,
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ok = threetuplectx_modify6(&args->synproxy->threetuplectx, ip6,
+                               port, proto, (port != 0), (proto != 0),
+                               &payload) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == (1<<2))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "mod %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           (uint8_t)(ip>>24),
+           (uint8_t)(ip>>16),
+           (uint8_t)(ip>>8),
+           (uint8_t)(ip>>0),
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ok = threetuplectx_modify(&args->synproxy->threetuplectx, ip, port, proto,
+                              (port != 0), (proto != 0),
+                              &payload) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == ((1<<7)|(1<<0)))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "flush [%s]", str6);
+    threetuplectx_flush_ip6(&args->synproxy->threetuplectx, ip6);
+    ctrl_append_str(c, "1\n");
+  }
+  else if (operation == (1<<0))
+  {
+    if (ip == 0)
+    {
+      log_log(
+             LOG_LEVEL_NOTICE, "CTRL",
+             "flush all");
+      threetuplectx_flush(&args->synproxy->threetuplectx);
+    }
+    else
+    {
+      log_log(
+             LOG_LEVEL_NOTICE, "CTRL",
+             "flush %d.%d.%d.%d",
+             (uint8_t)(ip>>24),
+             (uint8_t)(ip>>16),
+             (uint8_t)(ip>>8),
+             (uint8_t)(ip>>0));
+      threetuplectx_flush_ip(&args->synproxy->threetuplectx, ip);
+    }
+    ctrl_append_str(c, "1\n");
+  }
+  else if (operation == ((1<<7)|(1<<1)))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "add [%s]:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           str6,
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ok = threetuplectx_add6(&args->synproxy->threetuplectx, ip6,
+                            port, proto, (port != 0), (proto != 0),
+                            &payload) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == (1<<1))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "add %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           (uint8_t)(ip>>24),
+           (uint8_t)(ip>>16),
+           (uint8_t)(ip>>8),
+           (uint8_t)(ip>>0),
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ok = threetuplectx_add(&args->synproxy->threetuplectx, ip, port, proto,
+                           (port != 0), (proto != 0),
+                           &payload) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == (1<<4))
+  {
+    log_log(LOG_LEVEL_NOTICE, "CTRL", "hitters");
+    ctrl_append_hitters(c, args->synproxy);
+  }
+  else if ((operation & ~(1<<7)) == (1<<5))
+  {
+    const char *ext = &buf[(operation & (1<<7)) ? 28 : 12];
+    char str[INET6_ADDRSTRLEN] = "any";
+    struct capture_filter filter;
+    uint32_t sample;
+    uint8_t flags;
+    datainbuf_init(&inbuf, ext, 8);
+    if (datainbuf_get_u32(&inbuf, &sample) != 0)
+    {
+      abort();
+    }
+    if (datainbuf_get_u8(&inbuf, &flags) != 0)
+    {
+      abort();
+    }
+    capture_filter_init(&filter);
+    filter.synproxied_only = !!(flags & (1<<0));
+    filter.off = !!(flags & (1<<1));
+    if (flags & (1<<2))
+    {
+      if (operation & (1<<7))
+      {
+        filter.version = 6;
+        filter.prefix = proto > 128 ? 128 : proto;
+        memcpy(filter.addr, ip6, 16);
+        inet_ntop(AF_INET6, filter.addr, str, sizeof(str));
+      }
+      else
+      {
+        filter.version = 4;
+        filter.prefix = proto > 32 ? 32 : proto;
+        filter.addr[0] = ip>>24;
+        filter.addr[1] = ip>>16;
+        filter.addr[2] = ip>>8;
+        filter.addr[3] = ip>>0;
+        inet_ntop(AF_INET, filter.addr, str, sizeof(str));
+      }
+    }
+    filter.port = port;
+    filter.tcp_flags_mask = payload.sack_supported;
+    filter.tcp_flags = payload.wscaleshift & payload.sack_supported;
+    filter.snaplen = payload.mss;
+    filter.sample = sample;
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "capture %s/%d port %d flags 0x%02x/0x%02x sample %u snaplen %u"
+           " synproxied_only %d off %d",
+           str,
+           filter.prefix,
+           (uint16_t)port,
+           filter.tcp_flags,
+           filter.tcp_flags_mask,
+           filter.sample,
+           filter.snaplen,
+           filter.synproxied_only,
+           filter.off);
+    ok = args->capture != NULL &&
+         capture_set_filter(args->capture, &filter) == 0;
+    ctrl_append_str(c, ok ? "1\n" : "0\n");
+  }
+  else if (operation == CTRL_V2_OP && ip == CTRL_V2_MAGIC)
+  {
+    log_log(LOG_LEVEL_NOTICE, "CTRL", "v2");
+    c->v2 = 1;
+    ctrl_append_str(c, "1\n");
+  }
+  else if (operation & (1<<7))
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "invalid [%s]:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           str6,
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ctrl_append_str(c, "0\n");
+  }
+  else
+  {
+    log_log(
+           LOG_LEVEL_NOTICE, "CTRL",
+           "invalid %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
+           " mss %d sack %d wscaleshift %d",
+           (uint8_t)(ip>>24),
+           (uint8_t)(ip>>16),
+           (uint8_t)(ip>>8),
+           (uint8_t)(ip>>0),
+           (uint16_t)port,
+           (uint8_t)proto,
+           port != 0,
+           proto != 0,
+           payload.mss,
+           payload.sack_supported,
+           payload.wscaleshift);
+    ctrl_append_str(c, "0\n");
+  }
+}
+
+/*
+ * Handles the next message of a client if it has been read whole. Returns 1
+ * if a message was handled, 0 if more input is needed, or a negative errno
+ * if the connection should be closed.
+ */
+static int ctrl_client_message(struct ctrl_args *args, struct ctrl_client *c)
+{
+  const char *msg = &c->in[c->inoff];
+  size_t avail = c->inlen - c->inoff;
+  size_t len;
+  // Legacy messages and frame headers are 12 bytes
+  if (avail < 12)
+  {
+    return 0;
+  }
+  if (c->v2)
+  {
+    uint32_t count = hdr_get32n(&msg[4]);
+    if (count > CTRL_V2_MAX_ENTRIES)
+    {
+      log_log(LOG_LEVEL_ERR, "CTRL", "batch %u too large: %u entries",
+              hdr_get32n(&msg[0]), count);
+      return -EINVAL;
+    }
+    len = CTRL_V2_HDR_SIZE + (size_t)count*ctrl_v2_entry_size(msg[8]);
+  }
+  else
+  {
+    uint8_t operation = msg[7];
+    len = 12;
+    if (operation & (1<<7))
+    {
+      len += 16;
+    }
+    if ((operation & ~(1<<7)) == (1<<5))
+    {
+      len += 8;
+    }
+  }
+  if (avail < len)
+  {
+    ctrl_reserve(&c->in, &c->insize, c->inoff + len);
+    return 0;
+  }
+  if (c->v2)
+  {
+    ctrl_v2_frame(args, c, msg);
+  }
+  else
+  {
+    ctrl_legacy(args, c, msg);
+  }
+  c->inoff += len;
+  return 1;
+}
+
+/*
+ * Returns 1 at end of file, else 0 or a negative errno.
+ */
+static int ctrl_client_read(struct ctrl_client *c)
+{
+  ssize_t ret;
+  if (c->inoff > 0)
+  {
+    memmove(c->in, &c->in[c->inoff], c->inlen - c->inoff);
+    c->inlen -= c->inoff;
+    c->inoff = 0;
+  }
+  if (c->inlen == c->insize)
+  {
+    // Full of messages waiting for their replies to be sent
+    return 0;
+  }
+  ret = read(c->fd, &c->in[c->inlen], c->insize - c->inlen);
+  if (ret == 0)
+  {
+    return 1;
+  }
+  if (ret < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    {
+      return 0;
+    }
+    return -errno;
+  }
+  c->inlen += ret;
+  return 0;
+}
+
+static int ctrl_client_flush(struct ctrl_client *c)
+{
+  while (c->outoff < c->outlen)
+  {
+    ssize_t ret = send(c->fd, &c->out[c->outoff], c->outlen - c->outoff,
+                       MSG_NOSIGNAL);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      break;
+    }
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ret <= 0)
+    {
+      return -EIO;
+    }
+    c->outoff += ret;
+  }
+  memmove(c->out, &c->out[c->outoff], c->outlen - c->outoff);
+  c->outlen -= c->outoff;
+  c->outoff = 0;
+  return 0;
+}
+
+/*
+ * Handles messages and sends replies until the client has to be waited for.
+ */
+static int ctrl_client_work(struct ctrl_args *args, struct ctrl_client *c)
+{
+  int ret = 1;
+  for (;;)
+  {
+    while (ctrl_client_pending(c) < CTRL_OUT_HIGH)
+    {
+      if (c->dumping)
+      {
+        ctrl_v2_dump_chunk(args, c);
+        continue;
+      }
+      ret = ctrl_client_message(args, c);
+      if (ret <= 0)
+      {
+        break;
+      }
+    }
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ctrl_client_flush(c) != 0)
+    {
+      return -EIO;
+    }
+    if (ctrl_client_pending(c) > 0 || (!c->dumping && ret == 0))
+    {
+      return 0;
+    }
+  }
+}
+
+static void ctrl_client_close(struct ctrl *ctrl, struct ctrl_client *c)
+{
+  ctrl->clients[c->idx] = ctrl->clients[--ctrl->num_clients];
+  ctrl->clients[c->idx]->idx = c->idx;
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+static void ctrl_client_event(
+  struct ctrl *ctrl, struct ctrl_client *c, uint32_t events)
+{
+  struct epoll_event ev;
+  int ret = 0;
+  if (events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+  {
+    ret = ctrl_client_read(c);
+  }
+  if (ret >= 0 && ctrl_client_work(ctrl->args, c) < 0)
+  {
+    ret = -EIO;
+  }
+  if (ret != 0)
+  {
+    if (ret < 0)
+    {
+      log_log(LOG_LEVEL_ERR, "CTRL", "connection failed, closing");
+    }
+    else
+    {
+      log_log(LOG_LEVEL_NOTICE, "CTRL", "closed");
+    }
+    ctrl_client_close(ctrl, c);
+    return;
+  }
+  ev.events = 0;
+  if (!c->dumping && ctrl_client_pending(c) < CTRL_OUT_HIGH)
+  {
+    ev.events |= EPOLLIN;
+  }
+  if (ctrl_client_pending(c) > 0)
+  {
+    ev.events |= EPOLLOUT;
+  }
+  if (ev.events != c->events)
+  {
+    ev.data.ptr = c;
+    if (epoll_ctl(ctrl->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "CTRL", "can't modify epoll");
+      abort();
+    }
+    c->events = ev.events;
+  }
+}
+
+static void ctrl_watch(struct ctrl *ctrl, struct ctrl_client *c)
+{
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  c->events = EPOLLIN;
+  if (epoll_ctl(ctrl->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "CTRL", "can't add to epoll");
+    abort();
+  }
+}
+
+static void ctrl_accept(struct ctrl *ctrl, int fd)
+{
+  struct ctrl_client *c;
+  int fd2 = accept(fd, NULL, NULL);
+  if (fd2 < 0)
+  {
+    return;
+  }
+  if (ctrl->num_clients >= CTRL_MAX_CLIENTS)
+  {
+    log_log(LOG_LEVEL_ERR, "CTRL", "too many clients, closing");
+    close(fd2);
+    return;
+  }
+  set_nonblock(fd2);
+  c = calloc(1, sizeof(*c));
+  if (c == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "CTRL", "can't allocate client");
+    close(fd2);
+    return;
+  }
+  c->kind = CTRL_KIND_CLIENT;
+  c->fd = fd2;
+  c->idx = ctrl->num_clients;
+  ctrl_reserve(&c->in, &c->insize, 4096);
+  ctrl_watch(ctrl, c);
+  ctrl->clients[ctrl->num_clients++] = c;
+  log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
+}
+
 void *ctrl_func(void *userdata)
 {
   struct ctrl_args *args = userdata;
+  struct ctrl ctrl = {.args = args};
+  struct ctrl_client listen4 = {.kind = CTRL_KIND_LISTEN};
+  struct ctrl_client listen6 = {.kind = CTRL_KIND_LISTEN};
+  struct ctrl_client piperd = {.kind = CTRL_KIND_PIPE};
   int fd;
   int fd6;
-  int fd2;
   struct sockaddr_in sin;
   struct sockaddr_in6 sin6;
   int enable;
+  int exiting = 0;
   set_nonblock(args->piperd);
   fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (fd < 0)
@@ -87,532 +1062,58 @@ void *ctrl_func(void *userdata)
     log_log(LOG_LEVEL_ERR, "CTRL", "can't listen IPv6");
     abort();
   }
-  fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-  if (fd2 < 0 && errno == EINTR)
+  set_nonblock(fd);
+  set_nonblock(fd6);
+  ctrl.epfd = epoll_create1(0);
+  if (ctrl.epfd < 0)
   {
-    log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-    return NULL;
+    log_log(LOG_LEVEL_ERR, "CTRL", "can't create epoll");
+    abort();
   }
-  set_nonblock(fd2);
-  log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-  for (;;)
+  listen4.fd = fd;
+  listen6.fd = fd6;
+  piperd.fd = args->piperd;
+  ctrl_watch(&ctrl, &listen4);
+  ctrl_watch(&ctrl, &listen6);
+  ctrl_watch(&ctrl, &piperd);
+  while (!exiting)
   {
-    char buf[12];
-    char ip6[16];
-    char str6[INET6_ADDRSTRLEN] = {0};
-    struct in6_addr in6;
-    uint32_t ip;
-    uint16_t port;
-    uint8_t proto;
-    uint8_t operation;
-    struct threetuplepayload payload;
-    struct datainbuf inbuf;
-    errno = 0;
-    if (readall_interrupt(fd2, buf, sizeof(buf), args->piperd) != sizeof(buf))
+    struct epoll_event evs[16];
+    int i, n;
+    n = epoll_wait(ctrl.epfd, evs, 16, -1);
+    if (n < 0 && errno == EINTR)
     {
-      if (errno == EINTR)
-      {
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-        close(fd2);
-        close(fd);
-        close(fd6);
-        return NULL;
-      }
-      close(fd2);
-      log_log(LOG_LEVEL_ERR, "CTRL", "can't read, reopening connection");
-      fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-      if (fd2 < 0 && errno == EINTR)
-      {
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-        return NULL;
-      }
-      set_nonblock(fd2);
-      log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
       continue;
     }
-    datainbuf_init(&inbuf, buf, sizeof(buf));
-    if (datainbuf_get_u32(&inbuf, &ip) != 0)
-    {
-      abort();
-    }
-    if (datainbuf_get_u16(&inbuf, &port) != 0)
-    {
-      abort();
-    }
-    if (datainbuf_get_u8(&inbuf, &proto) != 0)
-    {
-      abort();
-    }
-    if (datainbuf_get_u8(&inbuf, &operation) != 0)
-    {
-      abort();
-    }
-    if (datainbuf_get_u16(&inbuf, &payload.mss) != 0)
+    if (n < 0)
     {
+      log_log(LOG_LEVEL_ERR, "CTRL", "can't wait for epoll");
       abort();
     }
-    if (datainbuf_get_u8(&inbuf, &payload.sack_supported) != 0)
-    {
-      abort();
-    }
-    if (datainbuf_get_u8(&inbuf, &payload.wscaleshift) != 0)
-    {
-      abort();
-    }
-    if (operation & (1<<7))
-    {
-      if (readall_interrupt(fd2, ip6, sizeof(ip6), args->piperd) != sizeof(ip6))
-      {
-        if (errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          close(fd2);
-          close(fd);
-          close(fd6);
-          return NULL;
-        }
-        close(fd2);
-        log_log(LOG_LEVEL_ERR, "CTRL", "can't read, reopening connection");
-        fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-        if (fd2 < 0 && errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          return NULL;
-        }
-        set_nonblock(fd2);
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-        continue;
-      }
-      memcpy(in6.s6_addr, ip6, 16);
-      if (inet_ntop(AF_INET6, &in6, str6, sizeof(str6)) == NULL)
-      {
-        strncpy(str6, "UNKNOWN", sizeof(str6));
-      }
-    }
-    if (operation == ((1<<7)|(1<<3)))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "rm [%s]:%d proto %d port_valid %d proto_valid %d",
-             str6,
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0);
-      if (threetuplectx_delete6(&args->synproxy->threetuplectx, ip6,
-                                port, proto, (port != 0), (proto != 0))
-          == 0)
-      {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-      else
-      {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation == (1<<3))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "rm %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d",
-             (uint8_t)(ip>>24),
-             (uint8_t)(ip>>16),
-             (uint8_t)(ip>>8),
-             (uint8_t)(ip>>0),
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0);
-      if (threetuplectx_delete(&args->synproxy->threetuplectx, ip, port, proto,
-                               (port != 0), (proto != 0))
-          == 0)
-      {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-      else
-      {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation == ((1<<7)|(1<<2)))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "mod [%s]:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             str6,
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (threetuplectx_modify6(&args->synproxy->threetuplectx, ip6,
-                                port, proto, (port != 0), (proto != 0),
-                                &payload) == 0)
-      {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-      else
-      {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation == (1<<2))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "mod %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             (uint8_t)(ip>>24),
-             (uint8_t)(ip>>16),
-             (uint8_t)(ip>>8),
-             (uint8_t)(ip>>0),
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (threetuplectx_modify(&args->synproxy->threetuplectx, ip, port, proto,
-                               (port != 0), (proto != 0),
-                               &payload) == 0)
-      {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-      else
-      {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation == ((1<<7)|(1<<0)))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "flush [%s]", str6);
-      threetuplectx_flush_ip6(&args->synproxy->threetuplectx, ip6);
-      if (write(fd2, "1\n", 2) != 2)
-      {
-        close(fd2);
-        log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-        fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-        if (fd2 < 0 && errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          return NULL;
-        }
-        set_nonblock(fd2);
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-        continue;
-      }
-    }
-    else if (operation == (1<<0))
-    {
-      if (ip == 0)
-      {
-        log_log(
-               LOG_LEVEL_NOTICE, "CTRL",
-               "flush all");
-        threetuplectx_flush(&args->synproxy->threetuplectx);
-      }
-      else
-      {
-        log_log(
-               LOG_LEVEL_NOTICE, "CTRL",
-               "flush %d.%d.%d.%d",
-               (uint8_t)(ip>>24),
-               (uint8_t)(ip>>16),
-               (uint8_t)(ip>>8),
-               (uint8_t)(ip>>0));
-        threetuplectx_flush_ip(&args->synproxy->threetuplectx, ip);
-      }
-      if (write(fd2, "1\n", 2) != 2)
-      {
-        close(fd2);
-        log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-        fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-        if (fd2 < 0 && errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          return NULL;
-        }
-        set_nonblock(fd2);
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-        continue;
-      }
-    }
-    else if (operation == ((1<<7)|(1<<1)))
+    for (i = 0; i < n; i++)
     {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "add [%s]:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             str6,
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (threetuplectx_add6(&args->synproxy->threetuplectx, ip6,
-                             port, proto, (port != 0), (proto != 0),
-                             &payload) == 0)
+      struct ctrl_client *c = evs[i].data.ptr;
+      if (c->kind == CTRL_KIND_PIPE)
       {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
+        exiting = 1;
       }
-      else
-      {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation == (1<<1))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "add %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             (uint8_t)(ip>>24),
-             (uint8_t)(ip>>16),
-             (uint8_t)(ip>>8),
-             (uint8_t)(ip>>0),
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (threetuplectx_add(&args->synproxy->threetuplectx, ip, port, proto,
-                            (port != 0), (proto != 0),
-                            &payload) == 0)
+      else if (c->kind == CTRL_KIND_LISTEN)
       {
-        if (write(fd2, "1\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
+        ctrl_accept(&ctrl, c->fd);
       }
       else
       {
-        if (write(fd2, "0\n", 2) != 2)
-        {
-          close(fd2);
-          log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-          fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-          if (fd2 < 0 && errno == EINTR)
-          {
-            log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-            return NULL;
-          }
-          set_nonblock(fd2);
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-          continue;
-        }
-      }
-    }
-    else if (operation & (1<<7))
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "invalid [%s]:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             str6,
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (write(fd2, "0\n", 2) != 2)
-      {
-        close(fd2);
-        log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-        fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-        if (fd2 < 0 && errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          return NULL;
-        }
-        set_nonblock(fd2);
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-        continue;
-      }
-    }
-    else
-    {
-      log_log(
-             LOG_LEVEL_NOTICE, "CTRL",
-             "invalid %d.%d.%d.%d:%d proto %d port_valid %d proto_valid %d"
-             " mss %d sack %d wscaleshift %d",
-             (uint8_t)(ip>>24),
-             (uint8_t)(ip>>16),
-             (uint8_t)(ip>>8),
-             (uint8_t)(ip>>0),
-             (uint16_t)port,
-             (uint8_t)proto,
-             port != 0,
-             proto != 0,
-             payload.mss,
-             payload.sack_supported,
-             payload.wscaleshift);
-      if (write(fd2, "0\n", 2) != 2)
-      {
-        close(fd2);
-        log_log(LOG_LEVEL_ERR, "CTRL", "can't write, reopening connection");
-        fd2 = accept_interrupt_dual(fd, fd6, NULL, NULL, args->piperd, NULL);
-        if (fd2 < 0 && errno == EINTR)
-        {
-          log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
-          return NULL;
-        }
-        set_nonblock(fd2);
-        log_log(LOG_LEVEL_NOTICE, "CTRL", "accepted");
-        continue;
+        ctrl_client_event(&ctrl, c, evs[i].events);
       }
     }
   }
-  return 0;
+  log_log(LOG_LEVEL_NOTICE, "CTRL", "exiting");
+  while (ctrl.num_clients > 0)
+  {
+    ctrl_client_close(&ctrl, ctrl.clients[0]);
+  }
+  close(ctrl.epfd);
+  close(fd);
+  close(fd6);
+  return NULL;
 }
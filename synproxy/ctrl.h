@@ -1,13 +1,132 @@
 #ifndef _CTRL_H_
 #define _CTRL_H_
 
+#include <stdatomic.h>
 #include "synproxy.h"
+#include "capture.h"
+
+/*
+ * Bulk protocol. A legacy message with operation CTRL_V2_OP and address
+ * CTRL_V2_MAGIC, answered by "1\n", switches the connection to frames. Older
+ * versions answer "0\n".
+ *
+ * A frame is a header and count entries, in network byte order:
+ *   - 32 bits: sequence number, echoed in the reply
+ *   - 32 bits: entry count, at most CTRL_V2_MAX_ENTRIES
+ *   - 8 bits: operation, the same bits as in legacy messages: flush, add,
+ *     mod or del
+ *   - 24 bits: reserved
+ * Every entry is:
+ *   - 8 bits: IP version, 4 or 6, or 0 to flush everything
+ *   - 8 bits: protocol
+ *   - 16 bits: port
+ *   - 16 bits: TCP MSS
+ *   - 8 bits: TCP SACK
+ *   - 8 bits: TCP window scaling shift
+ *   - 128 bits: IPv6 address, or IPv4 address in the first 32 bits
+ * Every frame is answered in order, so frames can be pipelined:
+ *   - 32 bits: sequence number
+ *   - 32 bits: entry count
+ *   - 32 bits: count of failed entries
+ *   - 32 bits: index of the first failed entry, CTRL_V2_NONE_FAILED if none
+ *
+ * Read-only operations, answered from snapshots without stopping packet
+ * processing:
+ *   - CTRL_V2_DUMP: the commanded entries, as entries in the format above.
+ *     They come in replies of any count, the last one having count 0.
+ *   - CTRL_V2_LOOKUP: the frame has flows instead of entries, and the reply
+ *     a result per flow; failed counts flows not found. A flow is:
+ *       - 8 bits: IP version, 4 or 6
+ *       - 8 bits: reserved
+ *       - 16 bits: local port
+ *       - 16 bits: remote port
+ *       - 16 bits: reserved
+ *       - 128 bits: local IP address, IPv4 in the first 32 bits
+ *       - 128 bits: remote IP address, IPv4 in the first 32 bits
+ *     A result is:
+ *       - 8 bits: 1 if found, else 0 and the rest zero
+ *       - 8 bits: 1 if SYN proxied
+ *       - 16 bits: state flags
+ *       - 32 bits: connection table
+ *       - 32 bits: sequence number offset
+ *       - 32 bits: timestamp offset
+ *       - 32 bits: last sequence number sent by the LAN side
+ *       - 32 bits: last sequence number sent by the WAN side
+ *       - 64 bits: microseconds until the entry expires
+ *   - CTRL_V2_STATS: a record per connection table, approximate as they're
+ *     read while the tables change:
+ *       - 32 bits: connection table
+ *       - 32 bits: SYN proxied connections
+ *       - 32 bits: directly opened connections
+ *       - 32 bits: half-open connections
+ *       - 64 bits: failed allocations
+ *   - CTRL_V2_WORKERS: a record per worker thread, counted since start and
+ *     published by the worker after every poll:
+ *       - 32 bits: worker
+ *       - 32 bits: reserved
+ *       - 64 bits: received packets
+ *       - 64 bits: received bytes
+ *       - 64 bits: packets queued for transmission
+ * The entries of DUMP, STATS and WORKERS frames are ignored.
+ */
+
+#define CTRL_V2_OP (1<<6)
+#define CTRL_V2_MAGIC 0x53505632 // "SPV2"
+#define CTRL_V2_HDR_SIZE 12
+#define CTRL_V2_ENTRY_SIZE 24
+#define CTRL_V2_REPLY_SIZE 16
+#define CTRL_V2_MAX_ENTRIES 65536
+#define CTRL_V2_NONE_FAILED 0xFFFFFFFFU
+#define CTRL_V2_DUMP 0x11
+#define CTRL_V2_LOOKUP 0x12
+#define CTRL_V2_STATS 0x13
+#define CTRL_V2_WORKERS 0x14
+#define CTRL_V2_FLOW_SIZE 40
+#define CTRL_V2_RESULT_SIZE 32
+#define CTRL_V2_STATS_SIZE 24
+#define CTRL_V2_WORKER_SIZE 32
+#define CTRL_V2_DUMP_CHUNK 4096
+
+#define CTRL_MAX_CLIENTS 64
+
+/*
+ * Packet counters of a worker thread. Only the worker writes them.
+ */
+struct ctrl_worker_stats {
+  _Atomic uint64_t rxpkts;
+  _Atomic uint64_t rxbytes;
+  _Atomic uint64_t txpkts;
+} __attribute__((aligned(64)));
+
+static inline void ctrl_worker_stats_publish(
+  struct ctrl_worker_stats *stats, uint64_t rxpkts, uint64_t rxbytes,
+  uint64_t txpkts)
+{
+  atomic_store_explicit(&stats->rxpkts, rxpkts, memory_order_relaxed);
+  atomic_store_explicit(&stats->rxbytes, rxbytes, memory_order_relaxed);
+  atomic_store_explicit(&stats->txpkts, txpkts, memory_order_relaxed);
+}
 
 struct ctrl_args {
   struct synproxy *synproxy;
+  struct capture *capture; // NULL: no capture filter operation
+  struct worker_local *locals; // for lookups and stats
+  int num_locals;
+  struct ctrl_worker_stats *workers;
+  int num_workers;
   int piperd;
 };
 
+/*
+ * Applies the entries of a frame. Returns the count of failed entries.
+ */
+uint32_t ctrl_v2_apply(
+  struct threetuplectx *ctx, uint8_t operation, const char *entries,
+  uint32_t count, uint32_t *first_failed);
+
+/*
+ * Serves up to CTRL_MAX_CLIENTS clients at once until piperd is readable.
+ */
 void *ctrl_func(void *userdata);
 
 #endif
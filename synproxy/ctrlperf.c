@@ -5,13 +5,14 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include "read.h"
+#include "ctrl.h"
 
 #define MSGS 16384
+#define V2_BATCH 4096
+#define V2_WINDOW 64
 
-int main(int argc, char **argv)
+static void legacy(int sock)
 {
-  int sock;
-  struct sockaddr_in sin;
   uint32_t u32;
   uint16_t u16;
   uint8_t u8;
@@ -19,19 +20,6 @@ int main(int argc, char **argv)
   char msg[12] = {0};
   char msgs[12*MSGS];
   char resp[2*MSGS];
-  sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0)
-  {
-    abort();
-  }
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  sin.sin_port = htons(12345);
-  if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0)
-  {
-    perror("connect failed");
-    abort();
-  }
   u32 = htonl(0);
   memcpy(&msg[0], &u32, 4);
   u16 = htons(0);
@@ -61,6 +49,112 @@ int main(int argc, char **argv)
       abort();
     }
   }
+}
+
+static void read_reply(int sock, uint32_t *failed)
+{
+  char reply[CTRL_V2_REPLY_SIZE];
+  if (readall(sock, reply, sizeof(reply)) != sizeof(reply))
+  {
+    abort();
+  }
+  *failed += hdr_get32n(&reply[8]);
+}
+
+/*
+ * Adds count distinct IPv4 entries in pipelined batches.
+ */
+static void v2(int sock, uint32_t count)
+{
+  char hello[12] = {0};
+  char resp[2];
+  static char frame[CTRL_V2_HDR_SIZE + V2_BATCH*CTRL_V2_ENTRY_SIZE];
+  uint32_t seq = 0;
+  uint32_t done = 0;
+  uint32_t failed = 0;
+  unsigned outstanding = 0;
+  uint32_t i;
+  hdr_set32n(&hello[0], CTRL_V2_MAGIC);
+  hello[7] = CTRL_V2_OP;
+  if (write(sock, hello, sizeof(hello)) != sizeof(hello) ||
+      readall(sock, resp, sizeof(resp)) != sizeof(resp))
+  {
+    abort();
+  }
+  if (resp[0] != '1')
+  {
+    fprintf(stderr, "v2 not supported\n");
+    exit(1);
+  }
+  while (done < count)
+  {
+    uint32_t n = count - done;
+    char *entry;
+    if (n > V2_BATCH)
+    {
+      n = V2_BATCH;
+    }
+    memset(frame, 0, CTRL_V2_HDR_SIZE + n*CTRL_V2_ENTRY_SIZE);
+    hdr_set32n(&frame[0], seq++);
+    hdr_set32n(&frame[4], n);
+    frame[8] = 1<<1;
+    for (i = 0; i < n; i++)
+    {
+      entry = &frame[CTRL_V2_HDR_SIZE + i*CTRL_V2_ENTRY_SIZE];
+      entry[0] = 4;
+      entry[1] = 6;
+      hdr_set16n(&entry[2], 80);
+      hdr_set16n(&entry[4], 1460);
+      entry[6] = 1;
+      entry[7] = 7;
+      hdr_set32n(&entry[8], (10U<<24) + done + i);
+    }
+    if (outstanding == V2_WINDOW)
+    {
+      read_reply(sock, &failed);
+      outstanding--;
+    }
+    if (write(sock, frame, CTRL_V2_HDR_SIZE + n*CTRL_V2_ENTRY_SIZE) !=
+        (ssize_t)(CTRL_V2_HDR_SIZE + n*CTRL_V2_ENTRY_SIZE))
+    {
+      abort();
+    }
+    outstanding++;
+    done += n;
+  }
+  while (outstanding > 0)
+  {
+    read_reply(sock, &failed);
+    outstanding--;
+  }
+  printf("%u entries, %u failed\n", count, failed);
+}
+
+int main(int argc, char **argv)
+{
+  int sock;
+  struct sockaddr_in sin;
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0)
+  {
+    abort();
+  }
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(12345);
+  if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+  {
+    perror("connect failed");
+    abort();
+  }
+  if (argc >= 2 && strcmp(argv[1], "v2") == 0)
+  {
+    v2(sock, argc >= 3 ? strtoul(argv[2], NULL, 10) : 10*1000*1000);
+  }
+  else
+  {
+    legacy(sock);
+  }
   close(sock);
   return 0;
 }
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "dispatch.h"
+#include "iphdr.h"
+#include "siphash.h"
+#include "hashseed.h"
+
+int dispatch_ring_init(struct dispatch_ring *ring, size_t size)
+{
+  if (size == 0 || (size & (size-1)) != 0)
+  {
+    return -EINVAL;
+  }
+  ring->pkts = malloc(size*sizeof(*ring->pkts));
+  if (ring->pkts == NULL)
+  {
+    return -ENOMEM;
+  }
+  ring->mask = size - 1;
+  atomic_store(&ring->prod, 0);
+  atomic_store(&ring->cons, 0);
+  ring->prod_priv = 0;
+  ring->cached_cons = 0;
+  ring->cons_priv = 0;
+  ring->cached_prod = 0;
+  return 0;
+}
+
+void dispatch_ring_free(struct dispatch_ring *ring)
+{
+  free(ring->pkts);
+  ring->pkts = NULL;
+}
+
+static void feed_ordered(
+  struct siphash_ctx *ctx, const void *ip1, uint16_t port1,
+  const void *ip2, uint16_t port2, size_t iplen)
+{
+  int cmp = memcmp(ip1, ip2, iplen);
+  if (cmp > 0 || (cmp == 0 && port1 > port2))
+  {
+    const void *tmpip = ip1;
+    uint16_t tmpport = port1;
+    ip1 = ip2;
+    port1 = port2;
+    ip2 = tmpip;
+    port2 = tmpport;
+  }
+  siphash_feed_buf(ctx, ip1, iplen);
+  siphash_feed_buf(ctx, ip2, iplen);
+  siphash_feed_u64(ctx, (((uint64_t)port1) << 16) | port2);
+}
+
+uint32_t dispatch_hash_flow(
+  int version, const void *ip1, uint16_t port1,
+  const void *ip2, uint16_t port2)
+{
+  struct siphash_ctx ctx;
+  siphash_init(&ctx, hash_seed_get());
+  feed_ordered(&ctx, ip1, port1, ip2, port2, (version == 4) ? 4 : 16);
+  return siphash_get(&ctx);
+}
+
+uint32_t dispatch_hash(void *ether, size_t ether_len)
+{
+  void *ip;
+  void *ippay;
+  size_t ip_len;
+  uint16_t ihl;
+  uint8_t protocol;
+  uint16_t port1 = 0, port2 = 0;
+
+  if (ether_len < ETHER_HDR_LEN)
+  {
+    return 0;
+  }
+  ip = ether_payload(ether);
+  ip_len = ether_len - ETHER_HDR_LEN;
+  if (ether_type(ether) == ETHER_TYPE_IP)
+  {
+    if (ip_len < IP_HDR_MINLEN || ip_version(ip) != 4)
+    {
+      return 0;
+    }
+    ihl = ip_hdr_len(ip);
+    protocol = ip_proto(ip);
+    // Fragments and non-TCP packets are forwarded statelessly by any worker
+    if (protocol == 6 && ip_frag_off(ip) == 0 && ip_len >= (size_t)ihl + 4)
+    {
+      ippay = ip_payload(ip);
+      port1 = tcp_src_port(ippay);
+      port2 = tcp_dst_port(ippay);
+    }
+    return dispatch_hash_flow(4, ip_src_ptr(ip), port1, ip_dst_ptr(ip), port2);
+  }
+  else if (ether_type(ether) == ETHER_TYPE_IPV6)
+  {
+    int is_frag = 0;
+    uint16_t proto_off_from_frag = 0;
+    if (ip_len < 40 || ip_version(ip) != 6)
+    {
+      return 0;
+    }
+    if (ip_len >= (size_t)(ipv6_payload_len(ip) + 40))
+    {
+      protocol = 0;
+      ippay = ipv6_proto_hdr_2(ip, &protocol, &is_frag, NULL, &proto_off_from_frag);
+      if (ippay != NULL && protocol == 6 && !is_frag &&
+          ip_len >= (size_t)(((char*)ippay) - ((char*)ip)) + 4)
+      {
+        port1 = tcp_src_port(ippay);
+        port2 = tcp_dst_port(ippay);
+      }
+    }
+    return dispatch_hash_flow(6, ipv6_src(ip), port1, ipv6_dst(ip), port2);
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "packet.h"
+
+#define DISPATCH_PKT_SIZE 2048
+
+struct dispatch_pkt {
+  enum packet_direction direction;
+  uint32_t sz;
+  char data[DISPATCH_PKT_SIZE];
+};
+
+/*
+ * Single-producer single-consumer ring. Both sides work on private indices
+ * and publish them with dispatch_ring_prod_flush() / dispatch_ring_cons_flush()
+ * so that the shared cache lines are touched once per batch.
+ */
+struct dispatch_ring {
+  atomic_uint prod __attribute__((aligned(64)));
+  unsigned prod_priv;
+  unsigned cached_cons;
+  atomic_uint cons __attribute__((aligned(64)));
+  unsigned cons_priv;
+  unsigned cached_prod;
+  unsigned mask __attribute__((aligned(64)));
+  struct dispatch_pkt *pkts;
+};
+
+int dispatch_ring_init(struct dispatch_ring *ring, size_t size);
+
+void dispatch_ring_free(struct dispatch_ring *ring);
+
+static inline struct dispatch_pkt *dispatch_ring_prod_get(
+  struct dispatch_ring *ring)
+{
+  if (ring->prod_priv - ring->cached_cons > ring->mask)
+  {
+    ring->cached_cons = atomic_load_explicit(&ring->cons, memory_order_acquire);
+    if (ring->prod_priv - ring->cached_cons > ring->mask)
+    {
+      return NULL;
+    }
+  }
+  return &ring->pkts[ring->prod_priv & ring->mask];
+}
+
+static inline void dispatch_ring_prod_commit(struct dispatch_ring *ring)
+{
+  ring->prod_priv++;
+}
+
+static inline void dispatch_ring_prod_flush(struct dispatch_ring *ring)
+{
+  atomic_store_explicit(&ring->prod, ring->prod_priv, memory_order_release);
+}
+
+static inline struct dispatch_pkt *dispatch_ring_cons_get(
+  struct dispatch_ring *ring)
+{
+  if (ring->cons_priv == ring->cached_prod)
+  {
+    ring->cached_prod = atomic_load_explicit(&ring->prod, memory_order_acquire);
+    if (ring->cons_priv == ring->cached_prod)
+    {
+      return NULL;
+    }
+  }
+  return &ring->pkts[ring->cons_priv & ring->mask];
+}
+
+static inline void dispatch_ring_cons_release(struct dispatch_ring *ring)
+{
+  ring->cons_priv++;
+}
+
+static inline void dispatch_ring_cons_flush(struct dispatch_ring *ring)
+{
+  atomic_store_explicit(&ring->cons, ring->cons_priv, memory_order_release);
+}
+
+/*
+ * Symmetric flow hash: both directions of a TCP connection get the same
+ * value, so they are dispatched to the same worker.
+ */
+uint32_t dispatch_hash(void *ether, size_t ether_len);
+
+/*
+ * The same hash from the addresses and ports, in either order.
+ */
+uint32_t dispatch_hash_flow(
+  int version, const void *ip1, uint16_t port1,
+  const void *ip2, uint16_t port2);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "dispatch.h"
+#include "iphdr.h"
+#include "hashseed.h"
+#include "log.h"
+
+static void build_pkt(
+  char *pkt, size_t sz, int version,
+  const void *src, const void *dst, uint16_t sport, uint16_t dport)
+{
+  void *ether = pkt;
+  void *ip, *tcp;
+  memset(pkt, 0, sz);
+  ether_set_type(ether, version == 4 ? ETHER_TYPE_IP : ETHER_TYPE_IPV6);
+  ip = ether_payload(ether);
+  ip_set_version(ip, version);
+  ip46_set_min_hdr_len(ip);
+  ip46_set_total_len(ip, sz - 14);
+  ip46_set_dont_frag(ip, 1);
+  ip46_set_ttl(ip, 64);
+  ip46_set_proto(ip, 6);
+  ip46_set_src(ip, src);
+  ip46_set_dst(ip, dst);
+  ip46_set_hdr_cksum_calc(ip);
+  tcp = ip46_payload(ip);
+  tcp_set_src_port(tcp, sport);
+  tcp_set_dst_port(tcp, dport);
+  tcp_set_syn_on(tcp);
+  tcp_set_data_offset(tcp, 20);
+  tcp46_set_cksum_calc(ip);
+}
+
+static void hash_test(int version)
+{
+  char pkt1[14+40+20];
+  char pkt2[14+40+20];
+  size_t sz = 14 + (version == 4 ? 20 : 40) + 20;
+  char ip1[16] = {10,0,0,1, 0,0,0,0, 0,0,0,0, 0,0,0,1};
+  char ip2[16] = {11,0,0,2, 0,0,0,0, 0,0,0,0, 0,0,0,2};
+
+  build_pkt(pkt1, sz, version, ip1, ip2, 12345, 80);
+  build_pkt(pkt2, sz, version, ip2, ip1, 80, 12345);
+  if (dispatch_hash(pkt1, sz) != dispatch_hash(pkt2, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "DISPATCHTEST", "hash not symmetric");
+    abort();
+  }
+  if (dispatch_hash_flow(version, ip2, 80, ip1, 12345) !=
+      dispatch_hash(pkt1, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "DISPATCHTEST", "flow hash differs from packet's");
+    abort();
+  }
+  build_pkt(pkt2, sz, version, ip1, ip2, 12346, 80);
+  if (dispatch_hash(pkt1, sz) == dispatch_hash(pkt2, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "DISPATCHTEST", "hash ignores ports");
+    abort();
+  }
+  build_pkt(pkt2, sz, version, ip1, ip2, 80, 12345);
+  if (dispatch_hash(pkt1, sz) == dispatch_hash(pkt2, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "DISPATCHTEST", "hash ignores port order");
+    abort();
+  }
+}
+
+#define RING_TEST_COUNT (1000*1000)
+
+static void *producer_thr(void *userdata)
+{
+  struct dispatch_ring *ring = userdata;
+  uint32_t i = 0;
+  while (i < RING_TEST_COUNT)
+  {
+    struct dispatch_pkt *dp = dispatch_ring_prod_get(ring);
+    if (dp == NULL)
+    {
+      dispatch_ring_prod_flush(ring);
+      continue;
+    }
+    dp->sz = sizeof(i);
+    memcpy(dp->data, &i, sizeof(i));
+    dispatch_ring_prod_commit(ring);
+    i++;
+    if ((i % 32) == 0)
+    {
+      dispatch_ring_prod_flush(ring);
+    }
+  }
+  dispatch_ring_prod_flush(ring);
+  return NULL;
+}
+
+static void ring_test(void)
+{
+  struct dispatch_ring ring;
+  pthread_t thr;
+  uint32_t i = 0;
+  if (dispatch_ring_init(&ring, 256) != 0)
+  {
+    abort();
+  }
+  pthread_create(&thr, NULL, producer_thr, &ring);
+  while (i < RING_TEST_COUNT)
+  {
+    uint32_t val;
+    struct dispatch_pkt *dp = dispatch_ring_cons_get(&ring);
+    if (dp == NULL)
+    {
+      dispatch_ring_cons_flush(&ring);
+      continue;
+    }
+    memcpy(&val, dp->data, sizeof(val));
+    if (dp->sz != sizeof(val) || val != i)
+    {
+      log_log(LOG_LEVEL_ERR, "DISPATCHTEST", "ring out of order");
+      abort();
+    }
+    dispatch_ring_cons_release(&ring);
+    i++;
+  }
+  dispatch_ring_cons_flush(&ring);
+  pthread_join(thr, NULL);
+  dispatch_ring_free(&ring);
+}
+
+int main(int argc, char **argv)
+{
+  hash_seed_init();
+  hash_test(4);
+  hash_test(6);
+  ring_test();
+  return 0;
+}
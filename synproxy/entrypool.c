@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include "entrypool.h"
+#include "log.h"
+
+#define ENTRYPOOL_HUGEPAGE_SIZE (2*1024*1024)
+
+int entrypool_init(
+  struct entrypool *pool, size_t objsize, size_t objcnt, int hugepages,
+  int locked)
+{
+  void *mem = MAP_FAILED;
+  if (objsize < sizeof(struct entrypool_obj) || objcnt == 0)
+  {
+    return -EINVAL;
+  }
+  objsize = (objsize + 63) & ~(size_t)63;
+  pool->objsize = objsize;
+  pool->objcnt = objcnt;
+  pool->memsize = objsize*objcnt;
+  pool->hugepages = 0;
+#ifdef MAP_HUGETLB
+  if (hugepages)
+  {
+    size_t hugesize = pool->memsize + ENTRYPOOL_HUGEPAGE_SIZE - 1;
+    hugesize &= ~(size_t)(ENTRYPOOL_HUGEPAGE_SIZE - 1);
+    mem = mmap(NULL, hugesize, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+      pool->memsize = hugesize;
+      pool->hugepages = 1;
+    }
+    else
+    {
+      log_log(LOG_LEVEL_WARNING, "ENTRYPOOL",
+              "can't map %zu bytes of hugepages, using normal pages",
+              hugesize);
+    }
+  }
+#endif
+  if (mem == MAP_FAILED)
+  {
+    mem = mmap(NULL, pool->memsize, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+      return -ENOMEM;
+    }
+  }
+  pool->mem = mem;
+  pool->used = 0;
+  pool->freelist = NULL;
+  pool->exhausted = 0;
+  pool->locked = locked;
+  if (locked && pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE) != 0)
+  {
+    munmap(pool->mem, pool->memsize);
+    return -ENOMEM;
+  }
+  atomic_store(&pool->returned, NULL);
+  return 0;
+}
+
+void entrypool_free(struct entrypool *pool)
+{
+  if (pool->locked)
+  {
+    pthread_spin_destroy(&pool->lock);
+  }
+  munmap(pool->mem, pool->memsize);
+  pool->mem = NULL;
+  pool->freelist = NULL;
+  atomic_store(&pool->returned, NULL);
+}
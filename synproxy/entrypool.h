@@ -0,0 +1,116 @@
+#ifndef _ENTRYPOOL_H_
+#define _ENTRYPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Preallocated pool of fixed-size 64-byte aligned objects.
+ *
+ * An unlocked pool is owned by one thread that allocates and frees with plain
+ * list operations. Other threads give objects back with entrypool_put_remote()
+ * which pushes them to a lock-free return stack, taken over by the owner when
+ * its own free list runs out. A locked pool can be used by any thread:
+ * allocation takes a spinlock and all frees go to the return stack.
+ *
+ * Memory is reserved at init time but touched only when objects are first
+ * handed out.
+ */
+
+struct entrypool_obj {
+  struct entrypool_obj *next;
+};
+
+struct entrypool {
+  char *mem;
+  size_t memsize;
+  size_t objsize;
+  size_t objcnt;
+  size_t used; // objects ever handed out from mem
+  struct entrypool_obj *freelist;
+  uint64_t exhausted;
+  int locked;
+  int hugepages;
+  pthread_spinlock_t lock;
+  _Atomic(struct entrypool_obj *) returned __attribute__((aligned(64)));
+};
+
+int entrypool_init(
+  struct entrypool *pool, size_t objsize, size_t objcnt, int hugepages,
+  int locked);
+
+void entrypool_free(struct entrypool *pool);
+
+static inline void entrypool_put_remote(struct entrypool *pool, void *ptr)
+{
+  struct entrypool_obj *obj = ptr;
+  struct entrypool_obj *head;
+  head = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+  do {
+    obj->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+             &pool->returned, &head, obj,
+             memory_order_release, memory_order_relaxed));
+}
+
+static inline void *entrypool_get_unlocked(struct entrypool *pool)
+{
+  struct entrypool_obj *obj = pool->freelist;
+  if (obj != NULL)
+  {
+    pool->freelist = obj->next;
+    return obj;
+  }
+  if (atomic_load_explicit(&pool->returned, memory_order_relaxed) != NULL)
+  {
+    obj = atomic_exchange_explicit(
+      &pool->returned, NULL, memory_order_acquire);
+    pool->freelist = obj->next;
+    return obj;
+  }
+  if (pool->used < pool->objcnt)
+  {
+    return pool->mem + (pool->used++)*pool->objsize;
+  }
+  pool->exhausted++;
+  return NULL;
+}
+
+/*
+ * Returns NULL and increments the exhausted counter if all objects are in use.
+ */
+static inline void *entrypool_get(struct entrypool *pool)
+{
+  void *ptr;
+  if (!pool->locked)
+  {
+    return entrypool_get_unlocked(pool);
+  }
+  pthread_spin_lock(&pool->lock);
+  ptr = entrypool_get_unlocked(pool);
+  pthread_spin_unlock(&pool->lock);
+  return ptr;
+}
+
+/*
+ * For the owner thread. ptr may be NULL.
+ */
+static inline void entrypool_put(struct entrypool *pool, void *ptr)
+{
+  struct entrypool_obj *obj = ptr;
+  if (obj == NULL)
+  {
+    return;
+  }
+  if (pool->locked)
+  {
+    entrypool_put_remote(pool, obj);
+    return;
+  }
+  obj->next = pool->freelist;
+  pool->freelist = obj;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flowtable.h"
+
+int flowtable_init(struct flowtable *t, size_t bucketcnt)
+{
+  void *mem;
+  if (bucketcnt == 0 || (bucketcnt & (bucketcnt-1)) != 0)
+  {
+    return -EINVAL;
+  }
+  if (posix_memalign(&mem, 64, bucketcnt*sizeof(*t->buckets)) != 0)
+  {
+    return -ENOMEM;
+  }
+  memset(mem, 0, bucketcnt*sizeof(*t->buckets));
+  t->buckets = mem;
+  t->bucketmask = bucketcnt - 1;
+  t->itemcnt = 0;
+  return 0;
+}
+
+void flowtable_free(struct flowtable *t)
+{
+  free(t->buckets);
+  t->buckets = NULL;
+  t->bucketmask = 0;
+  t->itemcnt = 0;
+}
+
+static inline uint8_t tag_at(const struct flowtable_bucket *b, int slot)
+{
+  return b->tags >> (8*slot);
+}
+
+static inline void set_tag_at(struct flowtable_bucket *b, int slot, uint8_t tag)
+{
+  b->tags &= ~(0xFFULL << (8*slot));
+  b->tags |= ((uint64_t)tag) << (8*slot);
+}
+
+static inline void set_overflow(struct flowtable_bucket *b, uint8_t overflow)
+{
+  set_tag_at(b, FLOWTABLE_SLOTS, overflow);
+}
+
+int flowtable_add(struct flowtable *t, uint32_t hashval, void *entry)
+{
+  size_t idx = hashval & t->bucketmask;
+  int slot;
+  if (t->itemcnt >= (t->bucketmask + 1) * FLOWTABLE_SLOTS)
+  {
+    return -ENOSPC;
+  }
+  for (;;)
+  {
+    struct flowtable_bucket *b = &t->buckets[idx];
+    for (slot = 0; slot < FLOWTABLE_SLOTS; slot++)
+    {
+      if (tag_at(b, slot) == 0)
+      {
+        set_tag_at(b, slot, flowtable_tag(hashval));
+        b->entries[slot] = entry;
+        t->itemcnt++;
+        return 0;
+      }
+    }
+    // Saturated counters are never decremented, lookups always probe past
+    if (flowtable_overflow(b) != 255)
+    {
+      set_overflow(b, flowtable_overflow(b) + 1);
+    }
+    idx = (idx + 1) & t->bucketmask;
+  }
+}
+
+int flowtable_delete(struct flowtable *t, uint32_t hashval, void *entry)
+{
+  size_t home = hashval & t->bucketmask;
+  size_t idx = home;
+  size_t probes;
+  int slot;
+  for (probes = 0; probes <= t->bucketmask; probes++)
+  {
+    struct flowtable_bucket *b = &t->buckets[idx];
+    for (slot = 0; slot < FLOWTABLE_SLOTS; slot++)
+    {
+      if (b->entries[slot] == entry && tag_at(b, slot) != 0)
+      {
+        set_tag_at(b, slot, 0);
+        b->entries[slot] = NULL;
+        t->itemcnt--;
+        while (home != idx)
+        {
+          struct flowtable_bucket *b2 = &t->buckets[home];
+          if (flowtable_overflow(b2) != 255)
+          {
+            set_overflow(b2, flowtable_overflow(b2) - 1);
+          }
+          home = (home + 1) & t->bucketmask;
+        }
+        return 0;
+      }
+    }
+    if (flowtable_overflow(b) == 0)
+    {
+      break;
+    }
+    idx = (idx + 1) & t->bucketmask;
+  }
+  return -ENOENT;
+}
@@ -0,0 +1,119 @@
+#ifndef _FLOWTABLE_H_
+#define _FLOWTABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Open addressing table of entry pointers with 64-byte buckets. Every bucket
+ * has 7 slots, each with an 8-bit tag taken from the hash value, so that a
+ * lookup compares the tags of the whole bucket at once and usually touches
+ * only one bucket and the matching entry. The last tag byte counts entries
+ * that overflowed past this bucket; a lookup can stop at a bucket where it is
+ * zero.
+ *
+ * Not thread safe: meant for worker_local instances with locked = 0.
+ */
+
+#define FLOWTABLE_SLOTS 7
+
+struct flowtable_bucket {
+  uint64_t tags;
+  void *entries[FLOWTABLE_SLOTS];
+} __attribute__((aligned(64)));
+
+struct flowtable {
+  struct flowtable_bucket *buckets;
+  size_t bucketmask;
+  size_t itemcnt;
+};
+
+#define FLOWTABLE_ONES 0x0101010101010101ULL
+#define FLOWTABLE_LOWS 0x7F7F7F7F7F7F7F7FULL
+#define FLOWTABLE_SLOTMASK 0x0080808080808080ULL
+
+static inline uint8_t flowtable_tag(uint32_t hashval)
+{
+  uint8_t tag = hashval >> 24;
+  return tag ? tag : 1;
+}
+
+static inline uint8_t flowtable_overflow(const struct flowtable_bucket *b)
+{
+  return b->tags >> 56;
+}
+
+/*
+ * Returns a mask having the highest bit set in every slot byte equal to tag.
+ * Exact, no false positives from borrows.
+ */
+static inline uint64_t flowtable_match(uint64_t tags, uint8_t tag)
+{
+  uint64_t x = tags ^ (FLOWTABLE_ONES * tag);
+  uint64_t y = (x & FLOWTABLE_LOWS) + FLOWTABLE_LOWS;
+  return ~(y | x | FLOWTABLE_LOWS) & FLOWTABLE_SLOTMASK;
+}
+
+static inline struct flowtable_bucket *flowtable_home(
+  struct flowtable *t, uint32_t hashval)
+{
+  return &t->buckets[hashval & t->bucketmask];
+}
+
+static inline void flowtable_prefetch(struct flowtable *t, uint32_t hashval)
+{
+  __builtin_prefetch(flowtable_home(t, hashval));
+}
+
+/*
+ * Look up an entry. The eq function is inlined into the caller.
+ */
+static inline void *flowtable_get(
+  struct flowtable *t, uint32_t hashval,
+  int (*eq)(const void *entry, const void *key), const void *key)
+{
+  uint8_t tag = flowtable_tag(hashval);
+  size_t idx = hashval & t->bucketmask;
+  size_t probes;
+  for (probes = 0; probes <= t->bucketmask; probes++)
+  {
+    struct flowtable_bucket *b = &t->buckets[idx];
+    uint64_t match = flowtable_match(b->tags, tag);
+    while (match)
+    {
+      int slot = __builtin_ctzll(match) / 8;
+      if (eq(b->entries[slot], key))
+      {
+        return b->entries[slot];
+      }
+      match &= match - 1;
+    }
+    if (flowtable_overflow(b) == 0)
+    {
+      return NULL;
+    }
+    idx = (idx + 1) & t->bucketmask;
+  }
+  return NULL;
+}
+
+int flowtable_init(struct flowtable *t, size_t bucketcnt);
+
+void flowtable_free(struct flowtable *t);
+
+/*
+ * Returns -ENOSPC if the table is full.
+ */
+int flowtable_add(struct flowtable *t, uint32_t hashval, void *entry);
+
+/*
+ * Returns -ENOENT if the entry isn't in the table.
+ */
+int flowtable_delete(struct flowtable *t, uint32_t hashval, void *entry);
+
+#define FLOWTABLE_FOR_EACH(t, bucket, slot, entry) \
+  for ((bucket) = 0; (bucket) <= (t)->bucketmask; (bucket)++) \
+    for ((slot) = 0; (slot) < FLOWTABLE_SLOTS; (slot)++) \
+      if (((entry) = (t)->buckets[(bucket)].entries[(slot)]) != NULL)
+
+#endif
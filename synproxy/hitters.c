@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <stdlib.h>
+#include "hitters.h"
+#include "hashseed.h"
+
+int hitters_init(
+  struct hitters *h, const struct hittersconf *conf,
+  const struct ratehashconf *ratehash)
+{
+  size_t i;
+  if (conf->size == 0 || (conf->size & (conf->size - 1)) != 0 ||
+      conf->size > HITTERS_MAX_SIZE || conf->timer_period_usec == 0 ||
+      conf->topk == 0)
+  {
+    return -EINVAL;
+  }
+  h->counters = malloc(HITTERS_DEPTH*conf->size*sizeof(*h->counters));
+  h->top = malloc(conf->topk*sizeof(*h->top));
+  h->last = malloc(conf->topk*sizeof(*h->last));
+  if (h->counters == NULL || h->top == NULL || h->last == NULL)
+  {
+    free(h->counters);
+    free(h->top);
+    free(h->last);
+    return -ENOMEM;
+  }
+  for (i = 0; i < HITTERS_DEPTH*conf->size; i++)
+  {
+    atomic_init(&h->counters[i], 0);
+  }
+  h->size = conf->size;
+  h->threshold = conf->threshold;
+  h->timer_period_usec = conf->timer_period_usec;
+  h->network_prefix = ratehash->network_prefix;
+  h->network_prefix6 = ratehash->network_prefix6;
+  sipbatch_key_init(&h->key, hash_seed_get());
+  atomic_init(&h->period, 0);
+  pthread_mutex_init(&h->mtx, NULL);
+  h->topk = conf->topk;
+  h->top_count = 0;
+  h->last_count = 0;
+  return 0;
+}
+
+void hitters_free(struct hitters *h)
+{
+  pthread_mutex_destroy(&h->mtx);
+  free(h->counters);
+  free(h->top);
+  free(h->last);
+  h->counters = NULL;
+  h->top = NULL;
+  h->last = NULL;
+}
+
+/*
+ * Rows already counting a newer period are skipped. Returns 0 if all are.
+ */
+static uint32_t hitters_estimate(
+  struct hitters *h, uint64_t hashval, uint32_t period)
+{
+  uint32_t min = UINT32_MAX;
+  int row;
+  for (row = 0; row < HITTERS_DEPTH; row++)
+  {
+    uint64_t counter = atomic_load_explicit(
+      &h->counters[hitters_idx(h, hashval, row)], memory_order_relaxed);
+    if ((uint32_t)(counter >> 32) == period && (uint32_t)counter < min)
+    {
+      min = (uint32_t)counter;
+    }
+  }
+  return min == UINT32_MAX ? 0 : min;
+}
+
+static int hitter_cmp(const void *va, const void *vb)
+{
+  const struct hitter *a = va;
+  const struct hitter *b = vb;
+  if (a->count != b->count)
+  {
+    return (a->count > b->count) ? -1 : 1;
+  }
+  return 0;
+}
+
+uint32_t hitters_rotate(struct hitters *h, uint32_t cur, uint32_t period)
+{
+  size_t i;
+  while (!atomic_compare_exchange_strong_explicit(
+           &h->period, &cur, period,
+           memory_order_relaxed, memory_order_relaxed))
+  {
+    if (cur != 0 && (int32_t)(period - cur) <= 0)
+    {
+      return cur;
+    }
+  }
+  pthread_mutex_lock(&h->mtx);
+  // The counts in the list are powers of two, get the final counts
+  for (i = 0; i < h->top_count; i++)
+  {
+    uint32_t count = hitters_estimate(h, h->top[i].hashval, cur);
+    if (count > h->top[i].count)
+    {
+      h->top[i].count = count;
+    }
+  }
+  qsort(h->top, h->top_count, sizeof(*h->top), hitter_cmp);
+  memcpy(h->last, h->top, h->top_count*sizeof(*h->top));
+  h->last_count = h->top_count;
+  h->top_count = 0;
+  pthread_mutex_unlock(&h->mtx);
+  return period;
+}
+
+void hitters_record(struct hitters *h, const struct hitter *hitter)
+{
+  size_t i, min = 0;
+  pthread_mutex_lock(&h->mtx);
+  for (i = 0; i < h->top_count; i++)
+  {
+    if (h->top[i].hashval == hitter->hashval)
+    {
+      if (hitter->count > h->top[i].count)
+      {
+        h->top[i].count = hitter->count;
+      }
+      pthread_mutex_unlock(&h->mtx);
+      return;
+    }
+    if (h->top[i].count < h->top[min].count)
+    {
+      min = i;
+    }
+  }
+  if (h->top_count < h->topk)
+  {
+    h->top[h->top_count++] = *hitter;
+  }
+  else if (hitter->count > h->top[min].count)
+  {
+    h->top[min] = *hitter;
+  }
+  pthread_mutex_unlock(&h->mtx);
+}
+
+size_t hitters_get_top(struct hitters *h, struct hitter *out, size_t n)
+{
+  pthread_mutex_lock(&h->mtx);
+  if (n > h->last_count)
+  {
+    n = h->last_count;
+  }
+  memcpy(out, h->last, n*sizeof(*out));
+  pthread_mutex_unlock(&h->mtx);
+  return n;
+}
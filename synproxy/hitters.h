@@ -0,0 +1,205 @@
+#ifndef _HITTERS_H_
+#define _HITTERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "sipbatch.h"
+#include "conf.h"
+
+/*
+ * Heavy hitter tracker for SYNs, keyed by source network and destination
+ * port. A count-min sketch of HITTERS_DEPTH rows counts the SYNs of the
+ * current period, shared by all worker threads. A key whose count exceeds the
+ * threshold is dropped before it can take tokens from the rate limiter, so a
+ * flood doesn't empty the buckets of the networks it collides with. The
+ * counters of such a key are only read from then on, so that a flood doesn't
+ * keep every thread writing the same cache lines.
+ *
+ * Every counter has the period it counts in its upper 32 bits, and a counter
+ * of an older period counts from zero. A new period thus needs no clearing:
+ * the thread that sees it first only moves the period forward.
+ *
+ * The largest keys of the period are kept in a small list that is updated
+ * only when a count reaches a power of two. The list of the last complete
+ * period can be read with hitters_get_top().
+ */
+
+#define HITTERS_DEPTH 4
+#define HITTERS_MAX_SIZE 65536
+#define HITTERS_MIN_REPORT 16
+
+struct hitter {
+  uint64_t hashval;
+  uint32_t count;
+  uint16_t port;
+  uint8_t version;
+  union {
+    uint32_t ip; // host byte order
+    unsigned char ip6[16];
+  } addr;
+};
+
+struct hitters {
+  _Atomic uint64_t *counters; // HITTERS_DEPTH rows of size counters
+  size_t size;
+  uint32_t threshold; // 0: only track
+  uint32_t timer_period_usec;
+  uint8_t network_prefix;
+  uint8_t network_prefix6;
+  struct sipbatch_key key;
+  _Atomic uint32_t period; // 0: no sample yet
+  pthread_mutex_t mtx; // protects the lists below
+  size_t topk;
+  size_t top_count;
+  struct hitter *top;
+  size_t last_count;
+  struct hitter *last;
+};
+
+int hitters_init(
+  struct hitters *h, const struct hittersconf *conf,
+  const struct ratehashconf *ratehash);
+
+void hitters_free(struct hitters *h);
+
+/*
+ * Moves the period from cur forward to period, unless another thread has
+ * moved it already. Returns the period now current.
+ */
+uint32_t hitters_rotate(struct hitters *h, uint32_t cur, uint32_t period);
+
+void hitters_record(struct hitters *h, const struct hitter *hitter);
+
+/*
+ * Copies at most n entries of the last complete period, largest first.
+ * Returns the number of entries copied.
+ */
+size_t hitters_get_top(struct hitters *h, struct hitter *out, size_t n);
+
+static inline size_t hitters_idx(
+  struct hitters *h, uint64_t hashval, int row)
+{
+  return row*h->size + ((hashval >> (16*row)) & (h->size - 1));
+}
+
+static inline uint32_t hitters_count(uint64_t counter, uint32_t period)
+{
+  return (uint32_t)(counter >> 32) == period ? (uint32_t)counter : 0;
+}
+
+/*
+ * Returns the count of the key in this period, including this sample if it
+ * was counted.
+ */
+static inline uint32_t hitters_add(
+  struct hitters *h, uint64_t hashval, uint64_t time64)
+{
+  uint32_t period = time64 / h->timer_period_usec;
+  uint32_t cur = atomic_load_explicit(&h->period, memory_order_relaxed);
+  uint64_t counters[HITTERS_DEPTH];
+  uint32_t min = UINT32_MAX;
+  int row;
+  // A sample from a thread late by a period is counted in the current one
+  if (cur == 0 || (int32_t)(period - cur) > 0)
+  {
+    cur = hitters_rotate(h, cur, period);
+  }
+  for (row = 0; row < HITTERS_DEPTH; row++)
+  {
+    uint32_t count;
+    counters[row] = atomic_load_explicit(
+      &h->counters[hitters_idx(h, hashval, row)], memory_order_relaxed);
+    count = hitters_count(counters[row], cur);
+    if (count < min)
+    {
+      min = count;
+    }
+  }
+  if (h->threshold != 0 && min > h->threshold)
+  {
+    return min;
+  }
+  min = UINT32_MAX;
+  for (row = 0; row < HITTERS_DEPTH; row++)
+  {
+    _Atomic uint64_t *counter = &h->counters[hitters_idx(h, hashval, row)];
+    uint64_t old = counters[row];
+    uint32_t count;
+    // A counter of an older period is started over, others are added to
+    for (;;)
+    {
+      if ((int32_t)((uint32_t)(old >> 32) - cur) >= 0)
+      {
+        count = (uint32_t)atomic_fetch_add_explicit(counter, 1,
+                                                    memory_order_relaxed) + 1;
+        break;
+      }
+      if (atomic_compare_exchange_weak_explicit(
+            counter, &old, (((uint64_t)cur) << 32) | 1,
+            memory_order_relaxed, memory_order_relaxed))
+      {
+        count = 1;
+        break;
+      }
+    }
+    if (count < min)
+    {
+      min = count;
+    }
+  }
+  return min;
+}
+
+static inline int hitters_check(
+  struct hitters *h, struct hitter *hitter, uint64_t time64)
+{
+  uint32_t count = hitters_add(h, hitter->hashval, time64);
+  if (count >= HITTERS_MIN_REPORT && (count & (count - 1)) == 0)
+  {
+    hitter->count = count;
+    hitters_record(h, hitter);
+  }
+  return h->threshold == 0 || count <= h->threshold;
+}
+
+/*
+ * Counts a SYN from the IP to the port. Returns 0 if the network has sent
+ * too many SYNs to the port in this period.
+ */
+static inline int hitters_ip_permitted(
+  struct hitters *h, uint32_t ip, uint16_t port, uint64_t time64)
+{
+  struct hitter hitter = {.port = port, .version = 4};
+  uint64_t words[2];
+  uint32_t mask =
+    h->network_prefix ? (~(uint32_t)0) << (32 - h->network_prefix) : 0;
+  hitter.addr.ip = ip & mask;
+  words[0] = hitter.addr.ip;
+  words[1] = (4ULL << 16) | port;
+  hitter.hashval = sipbatch_hash1(&h->key, words, 2);
+  return hitters_check(h, &hitter, time64);
+}
+
+static inline int hitters_ipv6_permitted(
+  struct hitters *h, const void *ip, uint16_t port, uint64_t time64)
+{
+  struct hitter hitter = {.port = port, .version = 6};
+  uint64_t words[3];
+  int bytes = h->network_prefix6 / 8;
+  int bits = h->network_prefix6 % 8;
+  memcpy(hitter.addr.ip6, ip, bytes);
+  if (bits)
+  {
+    hitter.addr.ip6[bytes] =
+      ((const unsigned char*)ip)[bytes] & (0xFF << (8 - bits));
+  }
+  memcpy(words, hitter.addr.ip6, 16);
+  words[2] = (6ULL << 16) | port;
+  hitter.hashval = sipbatch_hash1(&h->key, words, 3);
+  return hitters_check(h, &hitter, time64);
+}
+
+#endif
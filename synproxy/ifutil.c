@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include "ifutil.h"
+
+static int ifutil_get_flags(const char *name, short *flags)
+{
+  struct ifreq ifr;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+  {
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0)
+  {
+    close(sock);
+    return -1;
+  }
+  *flags = ifr.ifr_flags;
+  close(sock);
+  return 0;
+}
+
+int ifutil_link_wait(const char *name)
+{
+  int i;
+  for (i = 0; i < 100; i++)
+  {
+    short flags;
+    if (ifutil_get_flags(name, &flags) != 0)
+    {
+      return -1;
+    }
+    if ((flags & IFF_UP) && (flags & IFF_RUNNING))
+    {
+      return 0;
+    }
+    usleep(100*1000);
+  }
+  return -1;
+}
+
+int ifutil_set_promisc_mode(const char *name, int on)
+{
+  struct ifreq ifr;
+  int ret;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+  {
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0)
+  {
+    close(sock);
+    return -1;
+  }
+  if (on)
+  {
+    ifr.ifr_flags |= IFF_PROMISC;
+  }
+  else
+  {
+    ifr.ifr_flags &= ~IFF_PROMISC;
+  }
+  ret = ioctl(sock, SIOCSIFFLAGS, &ifr);
+  close(sock);
+  return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef _IFUTIL_H_
+#define _IFUTIL_H_
+
+/*
+ * Interface flag helpers for the socket based backends.
+ */
+
+/*
+ * Waits up to 10 seconds for the interface to be up and running.
+ */
+int ifutil_link_wait(const char *name);
+
+int ifutil_set_promisc_mode(const char *name, int on);
+
+#endif
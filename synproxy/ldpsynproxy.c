@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <pthread.h>
+#include <inttypes.h>
 #include <signal.h>
 #include "llalloc.h"
 #include "synproxy.h"
@@ -19,8 +20,17 @@
 #include "ctrl.h"
 #include "ldp.h"
 #include "linkcommon.h"
+#include "dispatch.h"
+#include "xdp.h"
+#include "tpacket.h"
+#include "rxsched.h"
+#include "capture.h"
+#include "learnsave.h"
+#include "checkpoint.h"
+#include "replicate.h"
 
 atomic_int exit_threads = 0;
+struct checkpoint checkpoint; // SIGUSR1 saves the conn tables
 int numpkts = 0;
 
 static void *signal_handler_thr(void *arg)
@@ -35,7 +45,15 @@ static void *signal_handler_thr(void *arg)
   sigaddset(&set, SIGUSR1);
   sigaddset(&set, SIGUSR2);
   sigaddset(&set, SIGALRM);
-  sigwait(&set, &sig);
+  for (;;)
+  {
+    sigwait(&set, &sig);
+    if (sig != SIGUSR1 || checkpoint.path == NULL)
+    {
+      break;
+    }
+    checkpoint_request(&checkpoint);
+  }
   atomic_store(&exit_threads, 1);
   return NULL;
 }
@@ -49,6 +67,7 @@ struct rx_args {
 
 struct periodic_userdata {
   struct rx_args *args;
+  struct rxsched *sched;
   uint64_t dlbytes, ulbytes;
   uint64_t dlpkts, ulpkts;
   uint64_t last_dlbytes, last_ulbytes;
@@ -66,6 +85,8 @@ static void periodic_fn(
   uint64_t dlbdiff = ud->dlbytes - ud->last_dlbytes;
   uint64_t ulpdiff = ud->ulpkts - ud->last_ulpkts;
   uint64_t dlpdiff = ud->dlpkts - ud->last_dlpkts;
+  double processpct, pollpct, sleeppct;
+  rxsched_usage(ud->sched, &processpct, &pollpct, &sleeppct);
   ud->last_ulbytes = ud->ulbytes;
   ud->last_dlbytes = ud->dlbytes;
   ud->last_ulpkts = ud->ulpkts;
@@ -73,12 +94,21 @@ static void periodic_fn(
   worker_local_rdlock(ud->args->local);
   log_log(LOG_LEVEL_INFO, "LDPPROXY",
          "worker/%d %g MPPS %g Gbps ul %g MPPS %g Gbps dl"
-         " %u conns synproxied %u conns not",
+         " %u conns synproxied %u conns not %" PRIu64 " allocs failed"
+         " %u/%u half-open %u/%u SYNs completed%s"
+         " %.0f%% processing %.0f%% polling %.0f%% sleeping",
          ud->args->idx,
          ulpdiff/diff/1e6, 8*ulbdiff/diff/1e9,
          dlpdiff/diff/1e6, 8*dlbdiff/diff/1e9,
          ud->args->local->synproxied_connections,
-         ud->args->local->direct_connections);
+         ud->args->local->direct_connections,
+         worker_local_alloc_failures(ud->args->local),
+         ud->args->local->half_open_connections,
+         ud->args->local->halfopen.limit,
+         ud->args->local->halfopen.last_completions,
+         ud->args->local->halfopen.last_syns,
+         ud->args->local->halfopen.flood ? " (SYN flood)" : "",
+         processpct, pollpct, sleeppct);
   worker_local_rdunlock(ud->args->local);
   ud->last_time64 = time64;
   ud->next_time64 += 2*1000*1000;
@@ -89,11 +119,200 @@ static void periodic_fn(
 #define MAX_TX 64
 #define MAX_RX 64
 
-struct ldp_interface *dlintf, *ulintf;
-struct ldp_in_queue *dlinq[MAX_RX_TX];
-struct ldp_in_queue *ulinq[MAX_RX_TX];
-struct ldp_out_queue *dloutq[MAX_RX_TX];
-struct ldp_out_queue *uloutq[MAX_RX_TX];
+/*
+ * Interfaces named xdp:ifname use the AF_XDP backend, tpacket:ifname the
+ * PACKET_MMAP backend, everything else LDP.
+ */
+struct intf {
+  struct ldp_interface *ldp;
+  struct xdp_interface *xdp;
+  struct tpacket_interface *tpacket;
+};
+
+struct intf_in_queue {
+  struct ldp_in_queue *ldp;
+  struct xdp_queue *xdp;
+  struct tpacket_queue *tpacket;
+};
+
+struct intf_out_queue {
+  struct ldp_out_queue *ldp;
+  struct xdp_queue *xdp;
+  struct tpacket_queue *tpacket;
+};
+
+struct intf dlintf, ulintf;
+struct intf_in_queue dlinq[MAX_RX_TX];
+struct intf_in_queue ulinq[MAX_RX_TX];
+struct intf_out_queue dloutq[MAX_RX_TX];
+struct intf_out_queue uloutq[MAX_RX_TX];
+
+static int intf_open(
+  struct intf *intf, const char *name, int num_queues,
+  struct intf_in_queue *inq, struct intf_out_queue *outq)
+{
+  int i;
+  memset(intf, 0, sizeof(*intf));
+  memset(inq, 0, num_queues*sizeof(*inq));
+  memset(outq, 0, num_queues*sizeof(*outq));
+  if (strncmp(name, "xdp:", 4) == 0)
+  {
+    intf->xdp = xdp_interface_open(name + 4, num_queues);
+    if (intf->xdp == NULL)
+    {
+      return -1;
+    }
+    for (i = 0; i < num_queues; i++)
+    {
+      inq[i].xdp = &intf->xdp->queues[i];
+      outq[i].xdp = &intf->xdp->queues[i];
+    }
+    return 0;
+  }
+  if (strncmp(name, "tpacket:", 8) == 0)
+  {
+    intf->tpacket = tpacket_interface_open(name + 8, num_queues);
+    if (intf->tpacket == NULL)
+    {
+      return -1;
+    }
+    for (i = 0; i < num_queues; i++)
+    {
+      inq[i].tpacket = &intf->tpacket->queues[i];
+      outq[i].tpacket = &intf->tpacket->queues[i];
+    }
+    return 0;
+  }
+  intf->ldp = ldp_interface_open(name, num_queues, num_queues);
+  if (intf->ldp == NULL)
+  {
+    return -1;
+  }
+  for (i = 0; i < num_queues; i++)
+  {
+    inq[i].ldp = intf->ldp->inq[i];
+    outq[i].ldp = intf->ldp->outq[i];
+  }
+  return 0;
+}
+
+static void intf_close(struct intf *intf)
+{
+  if (intf->xdp)
+  {
+    xdp_interface_close(intf->xdp);
+  }
+  else if (intf->tpacket)
+  {
+    tpacket_interface_close(intf->tpacket);
+  }
+  else
+  {
+    ldp_interface_close(intf->ldp);
+  }
+}
+
+static int intf_link_wait(struct intf *intf)
+{
+  if (intf->xdp)
+  {
+    return xdp_interface_link_wait(intf->xdp);
+  }
+  if (intf->tpacket)
+  {
+    return tpacket_interface_link_wait(intf->tpacket);
+  }
+  return ldp_interface_link_wait(intf->ldp);
+}
+
+static int intf_set_promisc_mode(struct intf *intf, int on)
+{
+  if (intf->xdp)
+  {
+    return xdp_interface_set_promisc_mode(intf->xdp, on);
+  }
+  if (intf->tpacket)
+  {
+    return tpacket_interface_set_promisc_mode(intf->tpacket, on);
+  }
+  return ldp_interface_set_promisc_mode(intf->ldp, on);
+}
+
+static inline int intf_in_nextpkts(
+  struct intf_in_queue *q, struct ldp_packet *pkts, int num)
+{
+  if (q->xdp)
+  {
+    return xdp_in_nextpkts(q->xdp, pkts, num);
+  }
+  if (q->tpacket)
+  {
+    return tpacket_in_nextpkts(q->tpacket, pkts, num);
+  }
+  return ldp_in_nextpkts(q->ldp, pkts, num);
+}
+
+static inline void intf_in_deallocate_some(
+  struct intf_in_queue *q, struct ldp_packet *pkts, int num)
+{
+  if (q->xdp)
+  {
+    xdp_in_deallocate_some(q->xdp, pkts, num);
+  }
+  else if (q->tpacket)
+  {
+    tpacket_in_deallocate_some(q->tpacket, pkts, num);
+  }
+  else
+  {
+    ldp_in_deallocate_some(q->ldp, pkts, num);
+  }
+}
+
+static inline int intf_in_eof(struct intf_in_queue *q)
+{
+  return q->ldp ? ldp_in_eof(q->ldp) : 0;
+}
+
+static inline int intf_in_fd(struct intf_in_queue *q)
+{
+  if (q->xdp)
+  {
+    return q->xdp->fd;
+  }
+  if (q->tpacket)
+  {
+    return q->tpacket->fd;
+  }
+  return q->ldp->fd;
+}
+
+static inline int intf_out_inject(
+  struct intf_out_queue *q, struct ldp_packet *pkts, int num)
+{
+  if (q->xdp)
+  {
+    return xdp_out_inject(q->xdp, pkts, num);
+  }
+  if (q->tpacket)
+  {
+    return tpacket_out_inject(q->tpacket, pkts, num);
+  }
+  return ldp_out_inject(q->ldp, pkts, num);
+}
+
+static inline int intf_out_txsync(struct intf_out_queue *q)
+{
+  if (q->xdp)
+  {
+    return xdp_out_txsync(q->xdp);
+  }
+  if (q->tpacket)
+  {
+    return tpacket_out_txsync(q->tpacket);
+  }
+  return ldp_out_txsync(q->ldp);
+}
 
 
 int in = 0;
@@ -104,6 +323,8 @@ int lan = 0;
 struct pcapng_out_ctx lanctx;
 int wan = 0;
 struct pcapng_out_ctx wanctx;
+struct capture capture; // rings: RX or worker threads, then dispatchers
+struct ctrl_worker_stats worker_stats[MAX_RX]; // RX or worker threads
 
 #define POOL_SIZE 48
 #define CACHE_SIZE 100
@@ -115,30 +336,67 @@ struct tx_args {
   int idx;
 };
 
+struct intffunc_userdata {
+  struct ll_alloc_st *st;
+  struct intf_out_queue *dloutq;
+  struct intf_out_queue *uloutq;
+  uint32_t dlunsynced; // injected since the last TX sync
+  uint32_t ulunsynced;
+  uint64_t txpkts; // queued since start
+  struct capture_ring *capring;
+};
+
+static void intffunc(struct packet *pkt, void *userdata)
+{
+  struct intffunc_userdata *ud = userdata;
+  struct ldp_packet ldppkt = { .data = pkt->data, .sz = pkt->sz };
+  uint64_t time64 = gettime64();
+  int queued;
+
+  capture_packet(&capture, ud->capring, CAPTURE_FILE_OUT, 1,
+                 pkt->data, pkt->sz, time64);
+  if (pkt->direction == PACKET_DIRECTION_UPLINK)
+  {
+    capture_packet(&capture, ud->capring, CAPTURE_FILE_WAN, 1,
+                   pkt->data, pkt->sz, time64);
+    queued = intf_out_inject(ud->uloutq, &ldppkt, 1);
+    ud->ulunsynced += queued;
+  }
+  else
+  {
+    capture_packet(&capture, ud->capring, CAPTURE_FILE_LAN, 1,
+                   pkt->data, pkt->sz, time64);
+    queued = intf_out_inject(ud->dloutq, &ldppkt, 1);
+    ud->dlunsynced += queued;
+  }
+  ud->txpkts += queued;
+  ll_free_st(ud->st, pkt);
+}
+
 static void *rx_func(void *userdata)
 {
   struct rx_args *args = userdata;
   struct ll_alloc_st st;
-  int i, j;
+  int i, j, queued;
   uint64_t pktnum = 1;
   struct port outport;
-  struct ldpfunc2_userdata ud;
+  struct intffunc_userdata ud;
   struct timeval tv1;
   struct periodic_userdata periodic = {};
-  struct allocif intf = {.ops = &ll_allocif_ops_st, .userdata = &st};
+  struct rxsched sched;
 
   gettimeofday(&tv1, NULL);
+  rxsched_init(&sched, args->synproxy->conf->busypoll,
+               args->synproxy->conf->txsync_threshold);
 
-  ud.intf = &intf;
-  ud.dloutq = dloutq[args->idx];
-  ud.uloutq = uloutq[args->idx];
-  ud.lan = lan;
-  ud.wan = wan;
-  ud.out = out;
-  ud.lanctx = &lanctx;
-  ud.wanctx = &wanctx;
-  ud.outctx = &outctx;
-  outport.portfunc = ldpfunc2;
+  ud.st = &st;
+  ud.dloutq = &dloutq[args->idx];
+  ud.uloutq = &uloutq[args->idx];
+  ud.dlunsynced = 0;
+  ud.ulunsynced = 0;
+  ud.txpkts = 0;
+  ud.capring = &capture.rings[args->idx];
+  outport.portfunc = intffunc;
   outport.userdata = &ud;
 
   if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
@@ -149,6 +407,7 @@ static void *rx_func(void *userdata)
   periodic.last_time64 = gettime64();
   periodic.next_time64 = periodic.last_time64 + 2*1000*1000;
   periodic.args = args;
+  periodic.sched = &sched;
 
   while (!atomic_load(&exit_threads))
   {
@@ -157,37 +416,47 @@ static void *rx_func(void *userdata)
     int try;
     uint32_t timeout;
     struct pollfd pfds[2];
+    int cnt = 0;
+    uint32_t maxsleep;
+
+    checkpoint_poll(&checkpoint);
+    maxsleep = replicate_poll(args->local->repl, args->local->replin);
 
-    if (ldp_in_eof(dlinq[args->idx]) && ldp_in_eof(ulinq[args->idx]))
+    if (intf_in_eof(&dlinq[args->idx]) && intf_in_eof(&ulinq[args->idx]))
     {
       break;
     }
 
-    pfds[0].fd = dlinq[args->idx]->fd;
+    pfds[0].fd = intf_in_fd(&dlinq[args->idx]);
     pfds[0].events = POLLIN;
-    pfds[1].fd = ulinq[args->idx]->fd;
+    pfds[1].fd = intf_in_fd(&ulinq[args->idx]);
     pfds[1].events = POLLIN;
 
     worker_local_rdlock(args->local);
     expiry = timer_linkheap_next_expiry_time(&args->local->timers);
     time64 = gettime64();
-    if (expiry > time64 + 1000*1000)
+    if (expiry > periodic.next_time64)
     {
-      expiry = time64 + 1000*1000;
+      expiry = periodic.next_time64;
     }
     worker_local_rdunlock(args->local);
 
-    //ldp_in_deallocate_all(dlinq[args->idx]);
-    //ldp_in_deallocate_all(ulinq[args->idx]);
     timeout = (expiry > time64 ? (999 + expiry - time64)/1000 : 0);
-    if (timeout > 0)
+    if (timeout > maxsleep)
+    {
+      timeout = maxsleep;
+    }
+    if (timeout > 0 && rxsched_should_sleep(&sched))
     {
-      ldp_out_txsync(dloutq[args->idx]);
-      ldp_out_txsync(uloutq[args->idx]);
+      intf_out_txsync(&dloutq[args->idx]);
+      intf_out_txsync(&uloutq[args->idx]);
+      ud.dlunsynced = 0;
+      ud.ulunsynced = 0;
       if (pfds[0].fd >= 0 && pfds[1].fd >= 0)
       {
         poll(pfds, 2, timeout);
       }
+      rxsched_slept(&sched, gettime64());
     }
 
     time64 = gettime64();
@@ -216,114 +485,506 @@ static void *rx_func(void *userdata)
 
     struct ldp_packet pkts[1000];
     struct ldp_packet pkts2[1000];
+    struct packet pktstructs[1000];
+    int rets[1000];
     int num;
 
-    num = ldp_in_nextpkts(dlinq[args->idx], pkts, sizeof(pkts)/sizeof(*pkts));
+    num = intf_in_nextpkts(&dlinq[args->idx], pkts, sizeof(pkts)/sizeof(*pkts));
     
-    j = 0;
     for (i = 0; i < num; i++)
     {
-      struct packet pktstruct;
-      //pktstruct = ll_alloc_st(&st, packet_size(0));
-      pktstruct.data = pkts[i].data;
-      pktstruct.direction = PACKET_DIRECTION_UPLINK;
-      pktstruct.sz = pkts[i].sz;
-      if (numpkts)
+      pktstructs[i].data = pkts[i].data;
+      pktstructs[i].direction = PACKET_DIRECTION_UPLINK;
+      pktstructs[i].sz = pkts[i].sz;
+    }
+    if (numpkts)
+    {
+      for (i = 0; i < num; i++)
       {
         printf("pkt %llu\n", (unsigned long long)(pktnum++));
+        uplink_burst(args->synproxy, args->local, &pktstructs[i], &rets[i], 1, &outport, time64, &st);
       }
+    }
+    else
+    {
+      uplink_burst(args->synproxy, args->local, pktstructs, rets, num, &outport, time64, &st);
+    }
 
-      if (uplink(args->synproxy, args->local, &pktstruct, &outport, time64, &st))
-      {
-        //ll_free_st(&st, pktstruct);
-      }
-      else
+    j = 0;
+    for (i = 0; i < num; i++)
+    {
+      if (rets[i] == 0)
       {
-        pkts2[j].data = pktstruct.data;
-        pkts2[j].sz = pktstruct.sz;
+        pkts2[j].data = pktstructs[i].data;
+        pkts2[j].sz = pktstructs[i].sz;
         j++;
       }
       periodic.ulpkts++;
       periodic.ulbytes += pkts[i].sz;
-      if (in)
-      {
-        if (pcapng_out_ctx_write(&inctx, pkts[i].data, pkts[i].sz, gettime64(), "out"))
-        {
-          log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't record packet");
-          exit(1);
-        }
-      }
-      if (lan)
-      {
-        if (pcapng_out_ctx_write(&lanctx, pkts[i].data, pkts[i].sz, gettime64(), "in"))
-        {
-          log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't record packet");
-          exit(1);
-        }
-      }
+      capture_packet(&capture, ud.capring, CAPTURE_FILE_IN, 1,
+                     pkts[i].data, pkts[i].sz, time64);
+      capture_packet(&capture, ud.capring, CAPTURE_FILE_LAN, 0,
+                     pkts[i].data, pkts[i].sz, time64);
     }
-    ldp_out_inject(uloutq[args->idx], pkts2, j);
-    ldp_in_deallocate_some(dlinq[args->idx], pkts, num);
+    queued = intf_out_inject(&uloutq[args->idx], pkts2, j);
+    ud.ulunsynced += queued;
+    ud.txpkts += queued;
+    intf_in_deallocate_some(&dlinq[args->idx], pkts, num);
+    cnt += num;
 
-    num = ldp_in_nextpkts(ulinq[args->idx], pkts, sizeof(pkts)/sizeof(*pkts));
+    num = intf_in_nextpkts(&ulinq[args->idx], pkts, sizeof(pkts)/sizeof(*pkts));
     
-    j = 0;
     for (i = 0; i < num; i++)
     {
-      struct packet pktstruct;
-      //pktstruct = ll_alloc_st(&st, packet_size(0));
-      pktstruct.data = pkts[i].data;
-      pktstruct.direction = PACKET_DIRECTION_DOWNLINK;
-      pktstruct.sz = pkts[i].sz;
-      if (numpkts)
+      pktstructs[i].data = pkts[i].data;
+      pktstructs[i].direction = PACKET_DIRECTION_DOWNLINK;
+      pktstructs[i].sz = pkts[i].sz;
+    }
+    if (numpkts)
+    {
+      for (i = 0; i < num; i++)
       {
         printf("pkt %llu\n", (unsigned long long)(pktnum++));
+        downlink_burst(args->synproxy, args->local, &pktstructs[i], &rets[i], 1, &outport, time64, &st);
       }
+    }
+    else
+    {
+      downlink_burst(args->synproxy, args->local, pktstructs, rets, num, &outport, time64, &st);
+    }
 
-      if (downlink(args->synproxy, args->local, &pktstruct, &outport, time64, &st))
-      {
-        //ll_free_st(&st, pktstruct);
-      }
-      else
+    j = 0;
+    for (i = 0; i < num; i++)
+    {
+      if (rets[i] == 0)
       {
-        pkts2[j].data = pktstruct.data;
-        pkts2[j].sz = pktstruct.sz;
+        pkts2[j].data = pktstructs[i].data;
+        pkts2[j].sz = pktstructs[i].sz;
         j++;
       }
       periodic.dlpkts++;
       periodic.dlbytes += pkts[i].sz;
-      if (in)
+      capture_packet(&capture, ud.capring, CAPTURE_FILE_IN, 0,
+                     pkts[i].data, pkts[i].sz, time64);
+      capture_packet(&capture, ud.capring, CAPTURE_FILE_WAN, 0,
+                     pkts[i].data, pkts[i].sz, time64);
+    }
+    queued = intf_out_inject(&dloutq[args->idx], pkts2, j);
+    ud.dlunsynced += queued;
+    ud.txpkts += queued;
+    intf_in_deallocate_some(&ulinq[args->idx], pkts, num);
+    cnt += num;
+
+    if (rxsched_should_txsync(&sched, ud.dlunsynced))
+    {
+      intf_out_txsync(&dloutq[args->idx]);
+      ud.dlunsynced = 0;
+    }
+    if (rxsched_should_txsync(&sched, ud.ulunsynced))
+    {
+      intf_out_txsync(&uloutq[args->idx]);
+      ud.ulunsynced = 0;
+    }
+    capture_flush(ud.capring);
+    rxsched_done(&sched, cnt);
+    ctrl_worker_stats_publish(&worker_stats[args->idx],
+                              periodic.ulpkts + periodic.dlpkts,
+                              periodic.ulbytes + periodic.dlbytes,
+                              ud.txpkts);
+  }
+  capture_flush(ud.capring);
+  ll_alloc_st_free(&st);
+  checkpoint_thread_exit(&checkpoint);
+  log_log(LOG_LEVEL_NOTICE, "RX", "exiting RX thread");
+  return NULL;
+}
+
+/*
+ * Software RSS: dispatcher threads read the NIC queues and hand each packet
+ * over to the worker owning its flow, workers hand output packets back to
+ * the dispatcher that transmits them. Every ring has exactly one producer and
+ * one consumer thread.
+ */
+#define DISPATCH_RING_SIZE 1024
+
+/*
+ * Threads in dispatch mode can't block on the rings between them, so they
+ * spin this many empty iterations before sleeping for a millisecond, unless
+ * busypoll is configured.
+ */
+#define DISPATCH_BUSYPOLL 1000
+
+int num_disp = 0;
+int num_work = 0;
+struct dispatch_ring *torings; // [num_disp][num_work]
+struct dispatch_ring *fromrings; // [num_work][num_disp]
+
+static inline struct dispatch_ring *toring(int disp, int work)
+{
+  return &torings[disp*num_work + work];
+}
+
+static inline struct dispatch_ring *fromring(int work, int disp)
+{
+  return &fromrings[work*num_disp + disp];
+}
+
+struct dispatchfunc_userdata {
+  struct ll_alloc_st *st;
+  struct dispatch_ring *ring;
+  uint64_t drops;
+  uint64_t txpkts; // queued since start
+  struct capture_ring *capring;
+};
+
+static void dispatchfunc(struct packet *pkt, void *userdata)
+{
+  struct dispatchfunc_userdata *ud = userdata;
+  struct dispatch_pkt *dp;
+  uint64_t time64 = gettime64();
+
+  capture_packet(&capture, ud->capring, CAPTURE_FILE_OUT, 1,
+                 pkt->data, pkt->sz, time64);
+  capture_packet(&capture, ud->capring,
+                 pkt->direction == PACKET_DIRECTION_UPLINK ?
+                   CAPTURE_FILE_WAN : CAPTURE_FILE_LAN,
+                 1, pkt->data, pkt->sz, time64);
+  dp = dispatch_ring_prod_get(ud->ring);
+  if (dp == NULL || pkt->sz > DISPATCH_PKT_SIZE)
+  {
+    ud->drops++;
+  }
+  else
+  {
+    dp->direction = pkt->direction;
+    dp->sz = pkt->sz;
+    memcpy(dp->data, pkt->data, pkt->sz);
+    dispatch_ring_prod_commit(ud->ring);
+    ud->txpkts++;
+  }
+  ll_free_st(ud->st, pkt);
+}
+
+static void *work_func(void *userdata)
+{
+  struct rx_args *args = userdata;
+  struct ll_alloc_st st;
+  int d, i;
+  struct port outport;
+  struct dispatchfunc_userdata ud;
+  struct periodic_userdata periodic = {};
+  struct rxsched sched;
+  const struct conf *conf = args->synproxy->conf;
+
+  ud.st = &st;
+  ud.ring = fromring(args->idx, args->idx % num_disp);
+  ud.drops = 0;
+  ud.txpkts = 0;
+  ud.capring = &capture.rings[args->idx];
+  outport.portfunc = dispatchfunc;
+  outport.userdata = &ud;
+  rxsched_init(&sched, conf->busypoll ? conf->busypoll : DISPATCH_BUSYPOLL,
+               conf->txsync_threshold);
+
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+
+  periodic.last_time64 = gettime64();
+  periodic.next_time64 = periodic.last_time64 + 2*1000*1000;
+  periodic.args = args;
+  periodic.sched = &sched;
+
+  while (!atomic_load(&exit_threads))
+  {
+    uint64_t time64;
+    int cnt = 0;
+
+    checkpoint_poll(&checkpoint);
+    replicate_poll(args->local->repl, args->local->replin);
+    time64 = gettime64();
+
+    if (time64 >= periodic.next_time64)
+    {
+      periodic_fn(&periodic);
+    }
+
+    ud.ring = fromring(args->idx, args->idx % num_disp);
+    while (timer_linkheap_next_expiry_time(&args->local->timers) < time64)
+    {
+      struct timer_link *timer = timer_linkheap_next_expiry_timer(&args->local->timers);
+      timer_linkheap_remove(&args->local->timers, timer);
+      timer->fn(timer, &args->local->timers, timer->userdata);
+    }
+    dispatch_ring_prod_flush(ud.ring);
+
+    for (d = 0; d < num_disp; d++)
+    {
+      struct dispatch_ring *inring = toring(d, args->idx);
+      struct dispatch_pkt *dp;
+      ud.ring = fromring(args->idx, d);
+      for (i = 0; i < 1000; i++)
       {
-        if (pcapng_out_ctx_write(&inctx, pkts[i].data, pkts[i].sz, gettime64(), "in"))
+        struct packet pktstruct;
+        int ret;
+        dp = dispatch_ring_cons_get(inring);
+        if (dp == NULL)
         {
-          log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't record packet");
-          exit(1);
+          break;
         }
+        pktstruct.data = dp->data;
+        pktstruct.direction = dp->direction;
+        pktstruct.sz = dp->sz;
+        if (dp->direction == PACKET_DIRECTION_UPLINK)
+        {
+          ret = uplink(args->synproxy, args->local, &pktstruct, &outport, time64, &st);
+          periodic.ulpkts++;
+          periodic.ulbytes += dp->sz;
+        }
+        else
+        {
+          ret = downlink(args->synproxy, args->local, &pktstruct, &outport, time64, &st);
+          periodic.dlpkts++;
+          periodic.dlbytes += dp->sz;
+        }
+        if (ret == 0)
+        {
+          struct dispatch_pkt *outdp = dispatch_ring_prod_get(ud.ring);
+          if (outdp == NULL)
+          {
+            ud.drops++;
+          }
+          else
+          {
+            outdp->direction = pktstruct.direction;
+            outdp->sz = pktstruct.sz;
+            memcpy(outdp->data, pktstruct.data, pktstruct.sz);
+            dispatch_ring_prod_commit(ud.ring);
+            ud.txpkts++;
+          }
+        }
+        dispatch_ring_cons_release(inring);
+      }
+      cnt += i;
+      dispatch_ring_cons_flush(inring);
+      dispatch_ring_prod_flush(ud.ring);
+    }
+    capture_flush(ud.capring);
+    rxsched_done(&sched, cnt);
+    ctrl_worker_stats_publish(&worker_stats[args->idx],
+                              periodic.ulpkts + periodic.dlpkts,
+                              periodic.ulbytes + periodic.dlbytes,
+                              ud.txpkts);
+    if (cnt == 0 && rxsched_should_sleep(&sched))
+    {
+      poll(NULL, 0, 1);
+      rxsched_slept(&sched, gettime64());
+    }
+  }
+  if (ud.drops)
+  {
+    log_log(LOG_LEVEL_NOTICE, "LDPPROXY", "worker/%d dropped %llu packets",
+            args->idx, (unsigned long long)ud.drops);
+  }
+  capture_flush(ud.capring);
+  ll_alloc_st_free(&st);
+  checkpoint_thread_exit(&checkpoint);
+  log_log(LOG_LEVEL_NOTICE, "RX", "exiting worker thread");
+  return NULL;
+}
+
+struct disp_args {
+  struct synproxy *synproxy;
+  int idx;
+};
+
+static int dispatch_in(
+  int idx, struct intf_in_queue *inq, enum packet_direction direction,
+  uint64_t *drops)
+{
+  struct ldp_packet pkts[1000];
+  struct capture_ring *capring = &capture.rings[num_work + idx];
+  uint64_t time64;
+  int num, i, w;
+
+  num = intf_in_nextpkts(inq, pkts, sizeof(pkts)/sizeof(*pkts));
+  time64 = gettime64();
+  for (i = 0; i < num; i++)
+  {
+    struct dispatch_pkt *dp;
+    capture_packet(&capture, capring, CAPTURE_FILE_IN,
+                   direction == PACKET_DIRECTION_UPLINK,
+                   pkts[i].data, pkts[i].sz, time64);
+    capture_packet(&capture, capring,
+                   direction == PACKET_DIRECTION_UPLINK ?
+                     CAPTURE_FILE_LAN : CAPTURE_FILE_WAN,
+                   0, pkts[i].data, pkts[i].sz, time64);
+    w = dispatch_hash(pkts[i].data, pkts[i].sz) % num_work;
+    dp = dispatch_ring_prod_get(toring(idx, w));
+    if (dp == NULL || pkts[i].sz > DISPATCH_PKT_SIZE)
+    {
+      (*drops)++;
+      continue;
+    }
+    dp->direction = direction;
+    dp->sz = pkts[i].sz;
+    memcpy(dp->data, pkts[i].data, pkts[i].sz);
+    dispatch_ring_prod_commit(toring(idx, w));
+  }
+  for (w = 0; w < num_work; w++)
+  {
+    dispatch_ring_prod_flush(toring(idx, w));
+  }
+  capture_flush(capring);
+  intf_in_deallocate_some(inq, pkts, num);
+  return num;
+}
+
+static int dispatch_out(int idx, uint32_t *dlunsynced, uint32_t *ulunsynced)
+{
+  struct ldp_packet dlpkts[1000];
+  struct ldp_packet ulpkts[1000];
+  int dlcnt, ulcnt, w, i;
+  int cnt = 0;
+
+  for (w = 0; w < num_work; w++)
+  {
+    struct dispatch_ring *ring = fromring(w, idx);
+    dlcnt = 0;
+    ulcnt = 0;
+    for (i = 0; i < 1000; i++)
+    {
+      struct dispatch_pkt *dp = dispatch_ring_cons_get(ring);
+      if (dp == NULL)
+      {
+        break;
+      }
+      if (dp->direction == PACKET_DIRECTION_UPLINK)
+      {
+        ulpkts[ulcnt].data = dp->data;
+        ulpkts[ulcnt].sz = dp->sz;
+        ulcnt++;
       }
-      if (wan)
+      else
+      {
+        dlpkts[dlcnt].data = dp->data;
+        dlpkts[dlcnt].sz = dp->sz;
+        dlcnt++;
+      }
+      dispatch_ring_cons_release(ring);
+    }
+    // The slots stay valid until the consumer index is published
+    *ulunsynced += intf_out_inject(&uloutq[idx], ulpkts, ulcnt);
+    *dlunsynced += intf_out_inject(&dloutq[idx], dlpkts, dlcnt);
+    dispatch_ring_cons_flush(ring);
+    cnt += i;
+  }
+  return cnt;
+}
+
+static void *disp_func(void *userdata)
+{
+  struct disp_args *args = userdata;
+  uint64_t drops = 0, last_drops = 0;
+  uint64_t next_time64 = gettime64() + 2*1000*1000;
+  uint32_t dlunsynced = 0, ulunsynced = 0;
+  struct rxsched sched;
+  const struct conf *conf = args->synproxy->conf;
+
+  rxsched_init(&sched, conf->busypoll ? conf->busypoll : DISPATCH_BUSYPOLL,
+               conf->txsync_threshold);
+
+  while (!atomic_load(&exit_threads))
+  {
+    int cnt = 0;
+    uint64_t time64;
+
+    if (intf_in_eof(&dlinq[args->idx]) && intf_in_eof(&ulinq[args->idx]))
+    {
+      int w;
+      int drained = 1;
+      // Let the workers finish the packets already handed over to them
+      for (w = 0; w < num_work; w++)
       {
-        if (pcapng_out_ctx_write(&wanctx, pkts[i].data, pkts[i].sz, gettime64(), "in"))
+        struct dispatch_ring *ring = toring(args->idx, w);
+        if (atomic_load(&ring->cons) != ring->prod_priv)
         {
-          log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't record packet");
-          exit(1);
+          drained = 0;
         }
       }
+      dispatch_out(args->idx, &dlunsynced, &ulunsynced);
+      if (drained)
+      {
+        break;
+      }
+      continue;
+    }
+    cnt += dispatch_in(args->idx, &dlinq[args->idx], PACKET_DIRECTION_UPLINK, &drops);
+    cnt += dispatch_in(args->idx, &ulinq[args->idx], PACKET_DIRECTION_DOWNLINK, &drops);
+    cnt += dispatch_out(args->idx, &dlunsynced, &ulunsynced);
+
+    if (rxsched_should_txsync(&sched, dlunsynced))
+    {
+      intf_out_txsync(&dloutq[args->idx]);
+      dlunsynced = 0;
+    }
+    if (rxsched_should_txsync(&sched, ulunsynced))
+    {
+      intf_out_txsync(&uloutq[args->idx]);
+      ulunsynced = 0;
+    }
+    rxsched_done(&sched, cnt);
+    if (cnt == 0 && rxsched_should_sleep(&sched))
+    {
+      struct pollfd pfds[2];
+      pfds[0].fd = intf_in_fd(&dlinq[args->idx]);
+      pfds[0].events = POLLIN;
+      pfds[1].fd = intf_in_fd(&ulinq[args->idx]);
+      pfds[1].events = POLLIN;
+      intf_out_txsync(&dloutq[args->idx]);
+      intf_out_txsync(&uloutq[args->idx]);
+      dlunsynced = 0;
+      ulunsynced = 0;
+      if (pfds[0].fd >= 0 && pfds[1].fd >= 0)
+      {
+        poll(pfds, 2, 1);
+      }
+      rxsched_slept(&sched, gettime64());
+    }
+
+    time64 = gettime64();
+    if (time64 >= next_time64)
+    {
+      double processpct, pollpct, sleeppct;
+      rxsched_usage(&sched, &processpct, &pollpct, &sleeppct);
+      log_log(LOG_LEVEL_INFO, "LDPPROXY",
+             "dispatcher/%d %.0f%% processing %.0f%% polling %.0f%% sleeping",
+             args->idx, processpct, pollpct, sleeppct);
+      if (drops != last_drops)
+      {
+        log_log(LOG_LEVEL_INFO, "LDPPROXY",
+               "dispatcher/%d dropped %llu packets",
+               args->idx, (unsigned long long)(drops - last_drops));
+        last_drops = drops;
+      }
+      next_time64 += 2*1000*1000;
     }
-    ldp_out_inject(dloutq[args->idx], pkts2, j);
-    ldp_in_deallocate_some(ulinq[args->idx], pkts, num);
   }
-  ll_alloc_st_free(&st);
-  log_log(LOG_LEVEL_NOTICE, "RX", "exiting RX thread");
+  log_log(LOG_LEVEL_NOTICE, "RX", "exiting dispatcher thread");
   return NULL;
 }
 
 int main(int argc, char **argv)
 {
-  pthread_t rx[MAX_RX], ctrl, sigthr;
+  pthread_t rx[MAX_RX], disp[MAX_RX_TX], ctrl, sigthr;
   struct rx_args rx_args[MAX_RX];
+  struct disp_args disp_args[MAX_RX_TX];
   struct ctrl_args ctrl_args;
+  struct learnsave learnsave;
+  struct replicate replicate;
   struct synproxy synproxy;
-  struct worker_local local;
+  struct worker_local local[MAX_RX];
   cpu_set_t cpuset;
   struct conf conf = CONF_INITIALIZER;
   int opt;
@@ -335,7 +996,9 @@ int main(int argc, char **argv)
   sigset_t set;
   int pipefd[2];
   int sockfd;
-  struct timer_link timer;
+  struct timer_link timer[MAX_RX];
+  int num_local;
+  int sharded;
 
   log_open("LDPSYNPROXY", LOG_LEVEL_DEBUG, LOG_LEVEL_INFO);
 
@@ -438,30 +1101,48 @@ int main(int argc, char **argv)
     exit(1);
   }
   max = num_rx;
+  if (conf.dispatch)
+  {
+    max = conf.queuecount ? (int)conf.queuecount : num_rx;
+    if (max > MAX_RX_TX)
+    {
+      log_log(LOG_LEVEL_CRIT, "LDPPROXY", "too many queues: %d", max);
+      exit(1);
+    }
+    num_disp = max;
+    num_work = num_rx;
+    torings = malloc(num_disp*num_work*sizeof(*torings));
+    fromrings = malloc(num_disp*num_work*sizeof(*fromrings));
+    if (torings == NULL || fromrings == NULL)
+    {
+      log_log(LOG_LEVEL_CRIT, "LDPPROXY", "out of memory");
+      exit(1);
+    }
+    for (i = 0; i < num_disp*num_work; i++)
+    {
+      if (dispatch_ring_init(&torings[i], DISPATCH_RING_SIZE) != 0 ||
+          dispatch_ring_init(&fromrings[i], DISPATCH_RING_SIZE) != 0)
+      {
+        log_log(LOG_LEVEL_CRIT, "LDPPROXY", "out of memory");
+        exit(1);
+      }
+    }
+  }
 
-  dlintf = ldp_interface_open(argv[optind+0], max, max);
-  if (dlintf == NULL)
+  if (intf_open(&dlintf, argv[optind+0], max, dlinq, dloutq) != 0)
   {
     log_log(LOG_LEVEL_CRIT, "LDPPROXY", "cannot open %s", argv[optind+0]);
     exit(1);
   }
-  ulintf = ldp_interface_open(argv[optind+1], max, max);
-  if (ulintf == NULL)
+  if (intf_open(&ulintf, argv[optind+1], max, ulinq, uloutq) != 0)
   {
     log_log(LOG_LEVEL_CRIT, "LDPPROXY", "cannot open %s", argv[optind+1]);
     exit(1);
   }
-  for (i = 0; i < max; i++)
-  {
-    dlinq[i] = dlintf->inq[i];
-    ulinq[i] = ulintf->inq[i];
-    dloutq[i] = dlintf->outq[i];
-    uloutq[i] = ulintf->outq[i];
-  }
-  
+
   if (strncmp(argv[optind+0], "pcap:", 5) != 0)
   {
-    if (ldp_interface_link_wait(dlintf) != 0)
+    if (intf_link_wait(&dlintf) != 0)
     {
       log_log(LOG_LEVEL_CRIT, "LDPPROXY", "link %s not up", argv[optind + 0]);
       exit(1);
@@ -469,33 +1150,36 @@ int main(int argc, char **argv)
   }
   if (strncmp(argv[optind+1], "pcap:", 5) != 0)
   {
-    if (ldp_interface_link_wait(ulintf) != 0)
+    if (intf_link_wait(&ulintf) != 0)
     {
       log_log(LOG_LEVEL_CRIT, "LDPPROXY", "link %s not up", argv[optind + 1]);
       exit(1);
     }
   }
 
-  worker_local_init(&local, &synproxy, 0, 1);
+  /*
+   * In sharded mode, every RX thread has its own unlocked connection table,
+   * timers, rate limiter and secrets. This relies on symmetric RSS steering
+   * both directions of a flow to the same queue index, or on the software
+   * dispatcher doing the same.
+   */
+  sharded = conf.sharding || conf.dispatch;
+  num_local = sharded ? num_rx : 1;
+  for (i = 0; i < num_local; i++)
+  {
+    worker_local_init(&local[i], &synproxy, 0, !sharded);
+  }
   if (conf.test_connections)
   {
-    int j;
-    for (j = 0; j < 90*6; j++)
-    {
-      uint32_t src, dst;
-      src = htonl((10<<24)|(2*j+2));
-      dst = htonl((11<<24)|(2*j+1));
-      synproxy_hash_put_connected(
-        &local, 4, &src, 12345, &dst, 54321,
-        gettime64());
-    }
+    synproxy_put_test_connections(local, num_local, conf.dispatch);
   }
+  checkpoint_start(&checkpoint, conf.checkpointfile, local, num_local, num_rx);
 
   for (i = 0; i < num_rx; i++)
   {
     rx_args[i].idx = i;
     rx_args[i].synproxy = &synproxy;
-    rx_args[i].local = &local;
+    rx_args[i].local = &local[sharded ? i : 0];
   }
 
   char pktdl[14] = {0x02,0,0,0,0,0x04, 0x02,0,0,0,0,0x01, 0, 0};
@@ -504,27 +1188,80 @@ int main(int argc, char **argv)
   if (strncmp(argv[optind+0], "vale", 4) == 0)
   {
     struct ldp_packet pkt = { .data = pktdl, .sz = sizeof(pktdl) };
-    ldp_out_inject(dloutq[0], &pkt, 1);
-    ldp_out_txsync(dloutq[0]);
+    intf_out_inject(&dloutq[0], &pkt, 1);
+    intf_out_txsync(&dloutq[0]);
   }
   if (strncmp(argv[optind+1], "vale", 4) == 0)
   {
     struct ldp_packet pkt = { .data = pktul, .sz = sizeof(pktul) };
-    ldp_out_inject(uloutq[0], &pkt, 1);
-    ldp_out_txsync(uloutq[0]);
+    intf_out_inject(&uloutq[0], &pkt, 1);
+    intf_out_txsync(&uloutq[0]);
+  }
+
+  for (i = 0; i < num_local; i++)
+  {
+    timer[i].time64 = gettime64() + 32*1000*1000;
+    timer[i].fn = revolve_secret;
+    timer[i].userdata = &local[i].info;
+    timer_linkheap_add(&local[i].timers, &timer[i]);
   }
 
-  timer.time64 = gettime64() + 32*1000*1000;
-  timer.fn = revolve_secret;
-  timer.userdata = &local.info;
-  timer_linkheap_add(&local.timers, &timer);
+  if (capture_init(&capture, num_rx + num_disp) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "LDPPROXY", "out of memory");
+    exit(1);
+  }
+  // Dispatchers can't look at the per-worker tables of synproxied flows
+  for (i = 0; i < num_rx; i++)
+  {
+    capture.rings[i].local = rx_args[i].local;
+  }
+  if (in)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_IN, &inctx);
+  }
+  if (out)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_OUT, &outctx);
+  }
+  if (lan)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_LAN, &lanctx);
+  }
+  if (wan)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_WAN, &wanctx);
+  }
+  if (capture_start(&capture) < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't start capture thread");
+    exit(1);
+  }
+  if (learnsave_start(&learnsave, &synproxy.autolearn, conf.learnhashfile,
+                      conf.learnhashsave_interval) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't start learnhash saving thread");
+    exit(1);
+  }
+  if (replicate_start(&replicate, local, num_local,
+                      conf.replicate_peer, conf.replicate_listen) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "LDPPROXY", "can't start replication");
+    exit(1);
+  }
 
   for (i = 0; i < num_rx; i++)
   {
-    pthread_create(&rx[i], NULL, rx_func, &rx_args[i]);
+    pthread_create(&rx[i], NULL, conf.dispatch ? work_func : rx_func, &rx_args[i]);
+  }
+  for (i = 0; i < num_disp; i++)
+  {
+    disp_args[i].synproxy = &synproxy;
+    disp_args[i].idx = i;
+    pthread_create(&disp[i], NULL, disp_func, &disp_args[i]);
   }
   int cpu = 0;
-  if (num_rx <= sysconf(_SC_NPROCESSORS_ONLN))
+  if (num_rx + num_disp <= sysconf(_SC_NPROCESSORS_ONLN))
   {
     for (i = 0; i < num_rx; i++)
     {
@@ -533,14 +1270,21 @@ int main(int argc, char **argv)
       cpu++;
       pthread_setaffinity_np(rx[i], sizeof(cpuset), &cpuset);
     }
+    for (i = 0; i < num_disp; i++)
+    {
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      cpu++;
+      pthread_setaffinity_np(disp[i], sizeof(cpuset), &cpuset);
+    }
   }
   if (strncmp(argv[optind+0], "pcap:", 5) != 0 ||
       strncmp(argv[optind+1], "pcap:", 5) != 0)
   {
     sleep(1);
   }
-  ldp_interface_set_promisc_mode(ulintf, 1);
-  ldp_interface_set_promisc_mode(dlintf, 1);
+  intf_set_promisc_mode(&ulintf, 1);
+  intf_set_promisc_mode(&dlintf, 1);
   if (getuid() == 0 && conf.gid != 0)
   {
     if (setgid(conf.gid) != 0)
@@ -563,41 +1307,60 @@ int main(int argc, char **argv)
   }
   ctrl_args.piperd = pipefd[0];
   ctrl_args.synproxy = &synproxy;
-  if (   conf.mssmode == HASHMODE_COMMANDED
-      || conf.sackmode == HASHMODE_COMMANDED
-      || conf.wscalemode == HASHMODE_COMMANDED)
-  {
-    pthread_create(&ctrl, NULL, ctrl_func, &ctrl_args);
-  }
+  ctrl_args.locals = local;
+  ctrl_args.num_locals = num_local;
+  ctrl_args.capture = &capture;
+  ctrl_args.workers = worker_stats;
+  ctrl_args.num_workers = num_rx;
+  pthread_create(&ctrl, NULL, ctrl_func, &ctrl_args);
 
   pthread_create(&sigthr, NULL, signal_handler_thr, NULL);
   log_log(LOG_LEVEL_NOTICE, "LDPPROXY", "fully running");
+  for (i = 0; i < num_disp; i++)
+  {
+    pthread_join(disp[i], NULL);
+  }
+  if (num_disp > 0)
+  {
+    // Workers have no input to see EOF on, so stop them explicitly
+    atomic_store(&exit_threads, 1);
+  }
   for (i = 0; i < num_rx; i++)
   {
     pthread_join(rx[i], NULL);
   }
+  capture_stop(&capture);
+  replicate_stop(&replicate);
+  learnsave_stop(&learnsave);
+  checkpoint_stop(&checkpoint);
   //pthread_join(sigthr, NULL);
   if (write(pipefd[1], "X", 1) != 1)
   {
     log_log(LOG_LEVEL_WARNING, "LDPPROXY", "pipe write failed");
   }
-  if (   conf.mssmode == HASHMODE_COMMANDED
-      || conf.sackmode == HASHMODE_COMMANDED
-      || conf.wscalemode == HASHMODE_COMMANDED)
-  {
-    pthread_join(ctrl, NULL);
-  }
+  pthread_join(ctrl, NULL);
 
-  ldp_interface_set_promisc_mode(ulintf, 0);
-  ldp_interface_set_promisc_mode(dlintf, 0);
-  ldp_interface_close(ulintf);
-  ldp_interface_close(dlintf);
+  intf_set_promisc_mode(&ulintf, 0);
+  intf_set_promisc_mode(&dlintf, 0);
+  intf_close(&ulintf);
+  intf_close(&dlintf);
   close(pipefd[0]);
   close(pipefd[1]);
   close(sockfd);
 
-  timer_linkheap_remove(&local.timers, &timer);
-  worker_local_free(&local);
+  for (i = 0; i < num_local; i++)
+  {
+    timer_linkheap_remove(&local[i].timers, &timer[i]);
+    worker_local_free(&local[i]);
+  }
+  for (i = 0; i < num_disp*num_work; i++)
+  {
+    dispatch_ring_free(&torings[i]);
+    dispatch_ring_free(&fromrings[i]);
+  }
+  free(torings);
+  free(fromrings);
+  capture_free(&capture);
   synproxy_free(&synproxy);
   conf_free(&conf);
   log_log(LOG_LEVEL_NOTICE, "LDPPROXY", "closing log");
@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "learnsave.h"
+#include "log.h"
+
+static void learnsave_save(struct learnsave *ls)
+{
+  int ret = sack_ip_port_hash_save(ls->hash, ls->path);
+  if (ret < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "LEARNSAVE", "can't save %s: %s",
+            ls->path, strerror(-ret));
+    return;
+  }
+  log_log(LOG_LEVEL_INFO, "LEARNSAVE", "saved %d entries", ret);
+}
+
+static void *learnsave_func(void *userdata)
+{
+  struct learnsave *ls = userdata;
+  pthread_mutex_lock(&ls->mtx);
+  while (!ls->stop)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ls->interval_sec;
+    if (pthread_cond_timedwait(&ls->cond, &ls->mtx, &ts) == ETIMEDOUT &&
+        !ls->stop)
+    {
+      pthread_mutex_unlock(&ls->mtx);
+      learnsave_save(ls);
+      pthread_mutex_lock(&ls->mtx);
+    }
+  }
+  pthread_mutex_unlock(&ls->mtx);
+  return NULL;
+}
+
+int learnsave_start(
+  struct learnsave *ls, struct sack_ip_port_hash *hash, const char *path,
+  uint32_t interval_sec)
+{
+  int ret;
+  ls->hash = hash;
+  ls->path = path;
+  ls->interval_sec = interval_sec;
+  ls->stop = 0;
+  if (path == NULL)
+  {
+    return 0;
+  }
+  ret = sack_ip_port_hash_load(hash, path);
+  if (ret >= 0)
+  {
+    log_log(LOG_LEVEL_NOTICE, "LEARNSAVE", "loaded %d entries from %s",
+            ret, path);
+  }
+  else if (ret == -ENOENT)
+  {
+    log_log(LOG_LEVEL_NOTICE, "LEARNSAVE", "no %s, starting empty", path);
+  }
+  else
+  {
+    log_log(LOG_LEVEL_WARNING, "LEARNSAVE", "ignoring %s: %s", path,
+            ret == -EINVAL ? "invalid snapshot" : strerror(-ret));
+  }
+  if (interval_sec == 0)
+  {
+    return 0;
+  }
+  pthread_mutex_init(&ls->mtx, NULL);
+  pthread_cond_init(&ls->cond, NULL);
+  if (pthread_create(&ls->thr, NULL, learnsave_func, ls) != 0)
+  {
+    pthread_cond_destroy(&ls->cond);
+    pthread_mutex_destroy(&ls->mtx);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void learnsave_stop(struct learnsave *ls)
+{
+  if (ls->path == NULL)
+  {
+    return;
+  }
+  if (ls->interval_sec != 0)
+  {
+    pthread_mutex_lock(&ls->mtx);
+    ls->stop = 1;
+    pthread_cond_signal(&ls->cond);
+    pthread_mutex_unlock(&ls->mtx);
+    pthread_join(ls->thr, NULL);
+    pthread_cond_destroy(&ls->cond);
+    pthread_mutex_destroy(&ls->mtx);
+  }
+  learnsave_save(ls);
+}
@@ -0,0 +1,39 @@
+#ifndef _LEARNSAVE_H_
+#define _LEARNSAVE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sackhash.h"
+
+/*
+ * Keeps the autolearned SACK and MSS values over restarts. The table is
+ * loaded from the file at start, saved every interval_sec seconds by a
+ * background thread and once more at exit. A missing or invalid file only
+ * means starting with an empty table.
+ */
+
+struct learnsave {
+  struct sack_ip_port_hash *hash;
+  const char *path; // NULL: disabled
+  uint32_t interval_sec; // 0: only at exit
+  pthread_t thr;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  int stop;
+};
+
+/*
+ * Loads the file and starts the saving thread. Call before the packet
+ * processing threads.
+ */
+int learnsave_start(
+  struct learnsave *ls, struct sack_ip_port_hash *hash, const char *path,
+  uint32_t interval_sec);
+
+/*
+ * Stops the saving thread and saves the table. Call after the packet
+ * processing threads have exited.
+ */
+void learnsave_stop(struct learnsave *ls);
+
+#endif
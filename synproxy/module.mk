@@ -1,5 +1,5 @@
-SYNPROXY_SRC_LIB := synproxy.c yyutils.c secret.c ctrl.c
-SYNPROXY_SRC := $(SYNPROXY_SRC_LIB) workeronlyperf.c nmsynproxy.c netmapsend.c secrettest.c conftest.c pcapngworkeronly.c unittest.c sizeof.c tcpsendrecv.c tcpsendrecv1.c ctrlperf.c odpsynproxy.c ldpsynproxy.c
+SYNPROXY_SRC_LIB := synproxy.c yyutils.c secret.c ctrl.c dispatch.c flowtable.c entrypool.c timerwheel.c sipbatch.c ratelimit.c hitters.c xdp.c ifutil.c tpacket.c capture.c learnsave.c checkpoint.c replicate.c
+SYNPROXY_SRC := $(SYNPROXY_SRC_LIB) workeronlyperf.c nmsynproxy.c netmapsend.c secrettest.c conftest.c pcapngworkeronly.c unittest.c sizeof.c tcpsendrecv.c tcpsendrecv1.c ctrlperf.c odpsynproxy.c ldpsynproxy.c dispatchtest.c ratelimitperf.c vethtest.c
 
 SYNPROXY_LEX_LIB := conf.l
 SYNPROXY_LEX := $(SYNPROXY_LEX_LIB)
@@ -50,7 +50,7 @@ clean_$(LCSYNPROXY): clean_SYNPROXY
 distclean_$(LCSYNPROXY): distclean_SYNPROXY
 unit_$(LCSYNPROXY): unit_SYNPROXY
 
-SYNPROXY: $(DIRSYNPROXY)/libsynproxy.a $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/conftest $(DIRSYNPROXY)/pcapngworkeronly $(DIRSYNPROXY)/unittest $(DIRSYNPROXY)/sizeof $(DIRSYNPROXY)/ctrlperf
+SYNPROXY: $(DIRSYNPROXY)/libsynproxy.a $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/conftest $(DIRSYNPROXY)/pcapngworkeronly $(DIRSYNPROXY)/unittest $(DIRSYNPROXY)/sizeof $(DIRSYNPROXY)/ctrlperf $(DIRSYNPROXY)/dispatchtest $(DIRSYNPROXY)/ratelimitperf $(DIRSYNPROXY)/vethtest
 
 ifeq ($(WITH_NETMAP),yes)
 SYNPROXY: $(DIRSYNPROXY)/nmsynproxy $(DIRSYNPROXY)/netmapsend $(DIRSYNPROXY)/tcpsendrecv $(DIRSYNPROXY)/tcpsendrecv1
@@ -63,10 +63,12 @@ LIBS_SYNPROXY_ODP := $(ODP_DIR)/lib/libodp-linux.a $(LIBS_ODPDEP)
 endif
 SYNPROXY: $(DIRSYNPROXY)/ldpsynproxy
 
-unit_SYNPROXY: $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/unittest
+unit_SYNPROXY: $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/unittest $(DIRSYNPROXY)/dispatchtest $(DIRSYNPROXY)/vethtest
 	$(DIRSYNPROXY)/workeronlyperf
 	$(DIRSYNPROXY)/secrettest
 	$(DIRSYNPROXY)/unittest
+	$(DIRSYNPROXY)/dispatchtest
+	$(DIRSYNPROXY)/vethtest
 
 $(DIRSYNPROXY)/libsynproxy.a: $(SYNPROXY_OBJ_LIB) $(SYNPROXY_OBJGEN_LIB) $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
 	rm -f $@
@@ -111,6 +113,15 @@ $(DIRSYNPROXY)/tcpsendrecv1: $(DIRSYNPROXY)/tcpsendrecv1.o $(DIRSYNPROXY)/libsyn
 $(DIRSYNPROXY)/ctrlperf: $(DIRSYNPROXY)/ctrlperf.o $(DIRSYNPROXY)/libsynproxy.a $(LIBS_SYNPROXY) $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
 	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SYNPROXY) -lpthread
 
+$(DIRSYNPROXY)/dispatchtest: $(DIRSYNPROXY)/dispatchtest.o $(DIRSYNPROXY)/libsynproxy.a $(LIBS_SYNPROXY) $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
+	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SYNPROXY) -lpthread
+
+$(DIRSYNPROXY)/vethtest: $(DIRSYNPROXY)/vethtest.o $(DIRSYNPROXY)/libsynproxy.a $(LIBS_SYNPROXY) $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
+	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SYNPROXY) -lpthread
+
+$(DIRSYNPROXY)/ratelimitperf: $(DIRSYNPROXY)/ratelimitperf.o $(DIRSYNPROXY)/libsynproxy.a $(LIBS_SYNPROXY) $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
+	$(CC) $(CFLAGS) -o $@ $(filter %.o,$^) $(filter %.a,$^) $(CFLAGS_SYNPROXY) -lpthread
+
 $(SYNPROXY_OBJ): %.o: %.c %.d $(MAKEFILES_COMMON) $(MAKEFILES_SYNPROXY)
 	$(CC) $(CFLAGS) -c -o $*.o $*.c $(CFLAGS_SYNPROXY)
 	$(CC) $(CFLAGS) -c -S -o $*.s $*.c $(CFLAGS_SYNPROXY)
@@ -156,6 +167,6 @@ clean_SYNPROXY:
 	rm -f $(DIRSYNPROXY)/conf.tab.h
 
 distclean_SYNPROXY: clean_SYNPROXY
-	rm -f $(DIRSYNPROXY)/libsynproxy.a $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/nmssynproxy $(DIRSYNPROXY)/netmapsend $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/conftest $(DIRSYNPROXY)/pcapngworkeronly $(DIRSYNPROXY)/unittest $(DIRSYNPROXY)/sizeof $(DIRSYNPROXY)/tcpsendrecv $(DIRSYNPROXY)/tcpsendrecv1 $(DIRSYNPROXY)/ctrlperf
+	rm -f $(DIRSYNPROXY)/libsynproxy.a $(DIRSYNPROXY)/workeronlyperf $(DIRSYNPROXY)/nmssynproxy $(DIRSYNPROXY)/netmapsend $(DIRSYNPROXY)/secrettest $(DIRSYNPROXY)/conftest $(DIRSYNPROXY)/pcapngworkeronly $(DIRSYNPROXY)/unittest $(DIRSYNPROXY)/sizeof $(DIRSYNPROXY)/tcpsendrecv $(DIRSYNPROXY)/tcpsendrecv1 $(DIRSYNPROXY)/ctrlperf $(DIRSYNPROXY)/dispatchtest $(DIRSYNPROXY)/ratelimitperf $(DIRSYNPROXY)/vethtest
 
 -include $(DIRSYNPROXY)/*.d
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #define NETMAP_WITH_LIBS
 #include <pthread.h>
+#include <inttypes.h>
 #include "llalloc.h"
 #include "synproxy.h"
 #include "iphdr.h"
@@ -19,8 +20,14 @@
 #include "read.h"
 #include "ctrl.h"
 #include "netmapcommon.h"
+#include "rxsched.h"
+#include "capture.h"
+#include "learnsave.h"
+#include "checkpoint.h"
+#include "replicate.h"
 
 atomic_int exit_threads = 0;
+struct checkpoint checkpoint; // SIGUSR1 saves the conn tables
 
 static void *signal_handler_thr(void *arg)
 {
@@ -34,7 +41,15 @@ static void *signal_handler_thr(void *arg)
   sigaddset(&set, SIGUSR1);
   sigaddset(&set, SIGUSR2);
   sigaddset(&set, SIGALRM);
-  sigwait(&set, &sig);
+  for (;;)
+  {
+    sigwait(&set, &sig);
+    if (sig != SIGUSR1 || checkpoint.path == NULL)
+    {
+      break;
+    }
+    checkpoint_request(&checkpoint);
+  }
   atomic_store(&exit_threads, 1);
   return NULL;
 }
@@ -48,6 +63,7 @@ struct rx_args {
 
 struct periodic_userdata {
   struct rx_args *args;
+  struct rxsched *sched;
   uint64_t dlbytes, ulbytes;
   uint64_t dlpkts, ulpkts;
   uint64_t last_dlbytes, last_ulbytes;
@@ -65,6 +81,8 @@ static void periodic_fn(
   uint64_t dlbdiff = ud->dlbytes - ud->last_dlbytes;
   uint64_t ulpdiff = ud->ulpkts - ud->last_ulpkts;
   uint64_t dlpdiff = ud->dlpkts - ud->last_dlpkts;
+  double processpct, pollpct, sleeppct;
+  rxsched_usage(ud->sched, &processpct, &pollpct, &sleeppct);
   ud->last_ulbytes = ud->ulbytes;
   ud->last_dlbytes = ud->dlbytes;
   ud->last_ulpkts = ud->ulpkts;
@@ -72,12 +90,21 @@ static void periodic_fn(
   worker_local_rdlock(ud->args->local);
   log_log(LOG_LEVEL_INFO, "NMPROXY",
          "worker/%d %g MPPS %g Gbps ul %g MPPS %g Gbps dl"
-         " %u conns synproxied %u conns not",
+         " %u conns synproxied %u conns not %" PRIu64 " allocs failed"
+         " %u/%u half-open %u/%u SYNs completed%s"
+         " %.0f%% processing %.0f%% polling %.0f%% sleeping",
          ud->args->idx,
          ulpdiff/diff/1e6, 8*ulbdiff/diff/1e9,
          dlpdiff/diff/1e6, 8*dlbdiff/diff/1e9,
          ud->args->local->synproxied_connections,
-         ud->args->local->direct_connections);
+         ud->args->local->direct_connections,
+         worker_local_alloc_failures(ud->args->local),
+         ud->args->local->half_open_connections,
+         ud->args->local->halfopen.limit,
+         ud->args->local->halfopen.last_completions,
+         ud->args->local->halfopen.last_syns,
+         ud->args->local->halfopen.flood ? " (SYN flood)" : "",
+         processpct, pollpct, sleeppct);
   worker_local_rdunlock(ud->args->local);
   ud->last_time64 = time64;
   ud->next_time64 += 2*1000*1000;
@@ -89,6 +116,7 @@ static void periodic_fn(
 #define MAX_RX 64
 
 struct nm_desc *dlnmds[MAX_RX_TX], *ulnmds[MAX_RX_TX];
+int zerocopy[MAX_RX_TX];
 
 int in = 0;
 struct pcapng_out_ctx inctx;
@@ -98,41 +126,177 @@ int lan = 0;
 struct pcapng_out_ctx lanctx;
 int wan = 0;
 struct pcapng_out_ctx wanctx;
+struct capture capture; // one ring per RX thread
+struct ctrl_worker_stats worker_stats[MAX_RX];
 
 #define POOL_SIZE 300
 #define CACHE_SIZE 100
 #define QUEUE_SIZE 512
 #define BLOCK_SIZE 10240
+#define BURST_SIZE 64
 
 struct tx_args {
   struct queue *txq;
   int idx;
 };
 
+/*
+ * Zero-copy forwarding swaps the buffer of a forwarded RX slot with the
+ * buffer of a free TX slot of the other port. Buffer indexes are valid in
+ * both ports only if they use the same netmap memory region.
+ */
+static int nm_zerocopy_possible(struct nm_desc *a, struct nm_desc *b)
+{
+  return a->req.nr_arg2 == b->req.nr_arg2 &&
+         a->first_rx_ring == a->last_rx_ring &&
+         a->first_tx_ring == a->last_tx_ring &&
+         b->first_rx_ring == b->last_rx_ring &&
+         b->first_tx_ring == b->last_tx_ring;
+}
+
+/*
+ * Reads a burst without releasing the RX slots. nm_zerocopy_forward()
+ * releases them.
+ */
+static int nm_zerocopy_rx(
+  struct nm_desc *nmd, struct packet *pkts, uint32_t *lens, int max,
+  enum packet_direction direction)
+{
+  struct netmap_ring *ring = NETMAP_RXRING(nmd->nifp, nmd->first_rx_ring);
+  uint32_t cur = ring->cur;
+  int num = 0;
+  while (num < max && cur != ring->tail)
+  {
+    struct netmap_slot *slot = &ring->slot[cur];
+    pkts[num].data = NETMAP_BUF(ring, slot->buf_idx);
+    pkts[num].direction = direction;
+    pkts[num].sz = slot->len;
+    lens[num] = slot->len;
+    cur = nm_ring_next(ring, cur);
+    num++;
+  }
+  return num;
+}
+
+static void nm_zerocopy_forward(
+  struct nm_desc *rxnmd, struct nm_desc *txnmd, struct packet *pkts,
+  const int *rets, int num)
+{
+  struct netmap_ring *rxring = NETMAP_RXRING(rxnmd->nifp, rxnmd->first_rx_ring);
+  struct netmap_ring *txring = NETMAP_TXRING(txnmd->nifp, txnmd->first_tx_ring);
+  uint32_t rxcur = rxring->cur;
+  uint32_t txcur = txring->cur;
+  int k;
+  for (k = 0; k < num; k++, rxcur = nm_ring_next(rxring, rxcur))
+  {
+    struct netmap_slot *rxslot = &rxring->slot[rxcur];
+    struct netmap_slot *txslot;
+    uint32_t idx;
+    if (rets[k] != 0)
+    {
+      continue;
+    }
+    if (txcur == txring->tail)
+    {
+      txring->head = txring->cur = txcur;
+      ioctl(txnmd->fd, NIOCTXSYNC, NULL);
+      if (txcur == txring->tail)
+      {
+        // TX ring full, drop like nm_inject() does
+        continue;
+      }
+    }
+    txslot = &txring->slot[txcur];
+    idx = txslot->buf_idx;
+    txslot->buf_idx = rxslot->buf_idx;
+    txslot->len = pkts[k].sz;
+    txslot->flags |= NS_BUF_CHANGED;
+    rxslot->buf_idx = idx;
+    rxslot->flags |= NS_BUF_CHANGED;
+    txcur = nm_ring_next(txring, txcur);
+  }
+  txring->head = txring->cur = txcur;
+  rxring->head = rxring->cur = rxcur;
+}
+
+/*
+ * Port that counts the packets queued on each netmap port since its last TX
+ * sync, then passes them to the next port.
+ */
+struct txcountport_userdata {
+  uint32_t dlunsynced;
+  uint32_t ulunsynced;
+  uint64_t txpkts; // queued since start
+  struct port *next;
+};
+
+static void txcountportfunc(struct packet *pkt, void *userdata)
+{
+  struct txcountport_userdata *ud = userdata;
+  if (pkt->direction == PACKET_DIRECTION_UPLINK)
+  {
+    ud->ulunsynced++;
+  }
+  else
+  {
+    ud->dlunsynced++;
+  }
+  ud->txpkts++;
+  ud->next->portfunc(pkt, ud->next->userdata);
+}
+
 static void *rx_func(void *userdata)
 {
   struct rx_args *args = userdata;
   struct ll_alloc_st st;
-  int i;
+  int i, k, num;
   struct port outport;
   struct netmapfunc2_userdata ud;
+  struct port nmport;
+  struct port txport;
+  struct txcountport_userdata txud = {};
+  struct captureport_userdata capud;
+  struct capture_ring *capring = &capture.rings[args->idx];
   struct timeval tv1;
   struct periodic_userdata periodic = {};
+  struct rxsched sched;
   struct allocif intf = {.ops = &ll_allocif_ops_st, .userdata = &st};
 
   gettimeofday(&tv1, NULL);
+  rxsched_init(&sched, args->synproxy->conf->busypoll,
+               args->synproxy->conf->txsync_threshold);
 
   ud.intf = &intf;
   ud.dlnmd = dlnmds[args->idx];
   ud.ulnmd = ulnmds[args->idx];
-  ud.lan = lan;
-  ud.wan = wan;
-  ud.out = out;
+  ud.lan = 0;
+  ud.wan = 0;
+  ud.out = 0;
   ud.lanctx = &lanctx;
   ud.wanctx = &wanctx;
   ud.outctx = &outctx;
-  outport.portfunc = netmapfunc2;
-  outport.userdata = &ud;
+  nmport.portfunc = netmapfunc2;
+  nmport.userdata = &ud;
+  txport = nmport;
+  if (sched.txsync_threshold > 0)
+  {
+    txud.next = &nmport;
+    txport.portfunc = txcountportfunc;
+    txport.userdata = &txud;
+  }
+  if (out || lan || wan)
+  {
+    // Output packets are captured asynchronously in front of the netmap port
+    capud.capture = &capture;
+    capud.ring = capring;
+    capud.next = &txport;
+    outport.portfunc = captureportfunc;
+    outport.userdata = &capud;
+  }
+  else
+  {
+    outport = txport;
+  }
 
   if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
   {
@@ -142,15 +306,21 @@ static void *rx_func(void *userdata)
   periodic.last_time64 = gettime64();
   periodic.next_time64 = periodic.last_time64 + 2*1000*1000;
   periodic.args = args;
+  periodic.sched = &sched;
 
   while (!atomic_load(&exit_threads))
   {
     uint64_t time64;
     uint64_t expiry;
     int try;
+    int cnt = 0;
+    uint32_t maxsleep;
     uint32_t timeout;
     struct pollfd pfds[2];
 
+    checkpoint_poll(&checkpoint);
+    maxsleep = replicate_poll(args->local->repl, args->local->replin);
+
     pfds[0].fd = dlnmds[args->idx]->fd;
     pfds[0].events = POLLIN;
     pfds[1].fd = ulnmds[args->idx]->fd;
@@ -159,18 +329,30 @@ static void *rx_func(void *userdata)
     worker_local_rdlock(args->local);
     expiry = timer_linkheap_next_expiry_time(&args->local->timers);
     time64 = gettime64();
-    if (expiry > time64 + 1000*1000)
+    if (expiry > periodic.next_time64)
     {
-      expiry = time64 + 1000*1000;
+      expiry = periodic.next_time64;
     }
     worker_local_rdunlock(args->local);
 
     timeout = (expiry > time64 ? (999 + expiry - time64)/1000 : 0);
-    if (timeout > 0)
+    if (timeout > maxsleep)
+    {
+      timeout = maxsleep;
+    }
+    if (timeout > 0 && rxsched_should_sleep(&sched))
     {
       ioctl(dlnmds[args->idx]->fd, NIOCTXSYNC, NULL);
       ioctl(ulnmds[args->idx]->fd, NIOCTXSYNC, NULL);
+      txud.dlunsynced = 0;
+      txud.ulunsynced = 0;
       poll(pfds, 2, timeout);
+      rxsched_slept(&sched, gettime64());
+    }
+    else if (sched.busypoll > 0)
+    {
+      // Syncs the RX rings of both ports in one call
+      poll(pfds, 2, 0);
     }
 
     time64 = gettime64();
@@ -196,96 +378,138 @@ static void *rx_func(void *userdata)
       }
       worker_local_wrunlock(args->local);
     }
-    for (i = 0; i < 1000; i++)
+    for (i = 0; i < 1000; i += num)
     {
-      struct packet pktstruct;
-      struct nm_pkthdr hdr;
-      unsigned char *pkt;
-      pkt = nm_nextpkt(dlnmds[args->idx], &hdr);
-      if (pkt == NULL)
+      struct packet pktstructs[BURST_SIZE];
+      uint32_t lens[BURST_SIZE];
+      int rets[BURST_SIZE];
+      if (zerocopy[args->idx])
       {
-        break;
+        num = nm_zerocopy_rx(dlnmds[args->idx], pktstructs, lens, BURST_SIZE,
+                             PACKET_DIRECTION_UPLINK);
       }
-
-      //pktstruct = ll_alloc_st(&st, packet_size(0));
-      pktstruct.data = pkt;
-      pktstruct.direction = PACKET_DIRECTION_UPLINK;
-      pktstruct.sz = hdr.len;
-
-      if (uplink(args->synproxy, args->local, &pktstruct, &outport, time64, &st))
+      else for (num = 0; num < BURST_SIZE; num++)
       {
-        //ll_free_st(&st, pktstruct);
+        struct nm_pkthdr hdr;
+        unsigned char *pkt;
+        pkt = nm_nextpkt(dlnmds[args->idx], &hdr);
+        if (pkt == NULL)
+        {
+          break;
+        }
+        pktstructs[num].data = pkt;
+        pktstructs[num].direction = PACKET_DIRECTION_UPLINK;
+        pktstructs[num].sz = hdr.len;
+        lens[num] = hdr.len;
       }
-      else
+      if (num == 0)
       {
-        //outpkts[j++] = pktstruct;
-        nm_my_inject(ulnmds[args->idx], pkt, hdr.len);
+        break;
       }
-      periodic.ulpkts++;
-      periodic.ulbytes += hdr.len;
-      if (in)
+
+      uplink_burst(args->synproxy, args->local, pktstructs, rets, num, &outport, time64, &st);
+
+      for (k = 0; k < num; k++)
       {
-        if (pcapng_out_ctx_write(&inctx, pkt, hdr.len, gettime64(), "out"))
+        if (rets[k] == 0)
         {
-          log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't record packet");
-          exit(1);
+          txud.ulunsynced++;
+          txud.txpkts++;
         }
-      }
-      if (lan)
-      {
-        if (pcapng_out_ctx_write(&lanctx, pkt, hdr.len, gettime64(), "in"))
+        if (rets[k] == 0 && !zerocopy[args->idx])
         {
-          log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't record packet");
-          exit(1);
+          nm_my_inject(ulnmds[args->idx], pktstructs[k].data, pktstructs[k].sz);
         }
+        periodic.ulpkts++;
+        periodic.ulbytes += lens[k];
+        capture_packet(&capture, capring, CAPTURE_FILE_IN, 1,
+                       pktstructs[k].data, lens[k], time64);
+        capture_packet(&capture, capring, CAPTURE_FILE_LAN, 0,
+                       pktstructs[k].data, lens[k], time64);
+      }
+      if (zerocopy[args->idx])
+      {
+        nm_zerocopy_forward(dlnmds[args->idx], ulnmds[args->idx],
+                            pktstructs, rets, num);
       }
     }
-    for (i = 0; i < 1000; i++)
+    cnt += i;
+    for (i = 0; i < 1000; i += num)
     {
-      struct packet pktstruct;
-      struct nm_pkthdr hdr;
-      unsigned char *pkt;
-      pkt = nm_nextpkt(ulnmds[args->idx], &hdr);
-      if (pkt == NULL)
+      struct packet pktstructs[BURST_SIZE];
+      uint32_t lens[BURST_SIZE];
+      int rets[BURST_SIZE];
+      if (zerocopy[args->idx])
       {
-        break;
+        num = nm_zerocopy_rx(ulnmds[args->idx], pktstructs, lens, BURST_SIZE,
+                             PACKET_DIRECTION_DOWNLINK);
       }
-
-      //pktstruct = ll_alloc_st(&st, packet_size(0));
-      pktstruct.data = pkt;
-      pktstruct.direction = PACKET_DIRECTION_DOWNLINK;
-      pktstruct.sz = hdr.len;
-
-      if (downlink(args->synproxy, args->local, &pktstruct, &outport, time64, &st))
+      else for (num = 0; num < BURST_SIZE; num++)
       {
-        //ll_free_st(&st, pktstruct);
+        struct nm_pkthdr hdr;
+        unsigned char *pkt;
+        pkt = nm_nextpkt(ulnmds[args->idx], &hdr);
+        if (pkt == NULL)
+        {
+          break;
+        }
+        pktstructs[num].data = pkt;
+        pktstructs[num].direction = PACKET_DIRECTION_DOWNLINK;
+        pktstructs[num].sz = hdr.len;
+        lens[num] = hdr.len;
       }
-      else
+      if (num == 0)
       {
-        //outpkts[j++] = pktstruct;
-        nm_my_inject(ulnmds[args->idx], pkt, hdr.len);
+        break;
       }
-      periodic.dlpkts++;
-      periodic.dlbytes += hdr.len;
-      if (in)
+
+      downlink_burst(args->synproxy, args->local, pktstructs, rets, num, &outport, time64, &st);
+
+      for (k = 0; k < num; k++)
       {
-        if (pcapng_out_ctx_write(&inctx, pkt, hdr.len, gettime64(), "in"))
+        if (rets[k] == 0)
         {
-          log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't record packet");
-          exit(1);
+          txud.dlunsynced++;
+          txud.txpkts++;
         }
-      }
-      if (wan)
-      {
-        if (pcapng_out_ctx_write(&wanctx, pkt, hdr.len, gettime64(), "in"))
+        if (rets[k] == 0 && !zerocopy[args->idx])
         {
-          log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't record packet");
-          exit(1);
+          nm_my_inject(dlnmds[args->idx], pktstructs[k].data, pktstructs[k].sz);
         }
+        periodic.dlpkts++;
+        periodic.dlbytes += lens[k];
+        capture_packet(&capture, capring, CAPTURE_FILE_IN, 0,
+                       pktstructs[k].data, lens[k], time64);
+        capture_packet(&capture, capring, CAPTURE_FILE_WAN, 0,
+                       pktstructs[k].data, lens[k], time64);
       }
+      if (zerocopy[args->idx])
+      {
+        nm_zerocopy_forward(ulnmds[args->idx], dlnmds[args->idx],
+                            pktstructs, rets, num);
+      }
+    }
+    cnt += i;
+    if (rxsched_should_txsync(&sched, txud.dlunsynced))
+    {
+      ioctl(dlnmds[args->idx]->fd, NIOCTXSYNC, NULL);
+      txud.dlunsynced = 0;
+    }
+    if (rxsched_should_txsync(&sched, txud.ulunsynced))
+    {
+      ioctl(ulnmds[args->idx]->fd, NIOCTXSYNC, NULL);
+      txud.ulunsynced = 0;
     }
+    capture_flush(capring);
+    rxsched_done(&sched, cnt);
+    ctrl_worker_stats_publish(&worker_stats[args->idx],
+                              periodic.ulpkts + periodic.dlpkts,
+                              periodic.ulbytes + periodic.dlbytes,
+                              txud.txpkts);
   }
+  capture_flush(capring);
   ll_alloc_st_free(&st);
+  checkpoint_thread_exit(&checkpoint);
   log_log(LOG_LEVEL_NOTICE, "RX", "exiting RX thread");
   return NULL;
 }
@@ -295,8 +519,10 @@ int main(int argc, char **argv)
   pthread_t rx[MAX_RX], ctrl, sigthr;
   struct rx_args rx_args[MAX_RX];
   struct ctrl_args ctrl_args;
+  struct learnsave learnsave;
+  struct replicate replicate;
   struct synproxy synproxy;
-  struct worker_local local;
+  struct worker_local local[MAX_RX];
   struct nmreq nmr;
   cpu_set_t cpuset;
   struct conf conf = CONF_INITIALIZER;
@@ -310,7 +536,8 @@ int main(int argc, char **argv)
   sigset_t set;
   int pipefd[2];
   int sockfd;
-  struct timer_link timer;
+  struct timer_link timer[MAX_RX];
+  int num_local;
 
   log_open("NMSYNPROXY", LOG_LEVEL_DEBUG, LOG_LEVEL_INFO);
 
@@ -465,29 +692,44 @@ int main(int argc, char **argv)
     printf("TX rings: %u\n", ulnmds[i]->last_tx_ring - ulnmds[i]->first_tx_ring + 1);
 #endif
   }
+  for (i = 0; i < max; i++)
+  {
+    zerocopy[i] = nm_zerocopy_possible(dlnmds[i], ulnmds[i]);
+  }
+  if (zerocopy[0])
+  {
+    log_log(LOG_LEVEL_NOTICE, "NMPROXY",
+            "ports share netmap memory, forwarding with zero-copy");
+  }
+  else
+  {
+    log_log(LOG_LEVEL_NOTICE, "NMPROXY",
+            "ports have separate netmap memory, forwarding by copying");
+  }
   link_wait(sockfd, argv[optind + 0]);
   link_wait(sockfd, argv[optind + 1]);
 
-  worker_local_init(&local, &synproxy, 0, 1);
+  /*
+   * In sharded mode, every RX thread has its own unlocked connection table,
+   * timers, rate limiter and secrets. This relies on symmetric RSS steering
+   * both directions of a flow to the same queue index.
+   */
+  num_local = conf.sharding ? num_rx : 1;
+  for (i = 0; i < num_local; i++)
+  {
+    worker_local_init(&local[i], &synproxy, 0, !conf.sharding);
+  }
   if (conf.test_connections)
   {
-    int j;
-    for (j = 0; j < 90*6; j++)
-    {
-      uint32_t src, dst;
-      src = htonl((10<<24)|(2*j+2));
-      dst = htonl((11<<24)|(2*j+1));
-      synproxy_hash_put_connected(
-        &local, 4, &src, 12345, &dst, 54321,
-        gettime64());
-    }
+    synproxy_put_test_connections(local, num_local, 0);
   }
+  checkpoint_start(&checkpoint, conf.checkpointfile, local, num_local, num_rx);
 
   for (i = 0; i < num_rx; i++)
   {
     rx_args[i].idx = i;
     rx_args[i].synproxy = &synproxy;
-    rx_args[i].local = &local;
+    rx_args[i].local = &local[conf.sharding ? i : 0];
   }
 
   char pktdl[14] = {0x02,0,0,0,0,0x04, 0x02,0,0,0,0,0x01, 0, 0};
@@ -504,10 +746,56 @@ int main(int argc, char **argv)
     ioctl(ulnmds[0]->fd, NIOCTXSYNC, NULL);
   }
 
-  timer.time64 = gettime64() + 32*1000*1000;
-  timer.fn = revolve_secret;
-  timer.userdata = &local.info;
-  timer_linkheap_add(&local.timers, &timer);
+  for (i = 0; i < num_local; i++)
+  {
+    timer[i].time64 = gettime64() + 32*1000*1000;
+    timer[i].fn = revolve_secret;
+    timer[i].userdata = &local[i].info;
+    timer_linkheap_add(&local[i].timers, &timer[i]);
+  }
+
+  if (capture_init(&capture, num_rx) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "NMPROXY", "out of memory");
+    exit(1);
+  }
+  for (i = 0; i < num_rx; i++)
+  {
+    capture.rings[i].local = &local[conf.sharding ? i : 0];
+  }
+  if (in)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_IN, &inctx);
+  }
+  if (out)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_OUT, &outctx);
+  }
+  if (lan)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_LAN, &lanctx);
+  }
+  if (wan)
+  {
+    capture_set_file(&capture, CAPTURE_FILE_WAN, &wanctx);
+  }
+  if (capture_start(&capture) < 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't start capture thread");
+    exit(1);
+  }
+  if (learnsave_start(&learnsave, &synproxy.autolearn, conf.learnhashfile,
+                      conf.learnhashsave_interval) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't start learnhash saving thread");
+    exit(1);
+  }
+  if (replicate_start(&replicate, local, num_local,
+                      conf.replicate_peer, conf.replicate_listen) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "NMPROXY", "can't start replication");
+    exit(1);
+  }
 
   for (i = 0; i < num_rx; i++)
   {
@@ -549,12 +837,12 @@ int main(int argc, char **argv)
   }
   ctrl_args.piperd = pipefd[0];
   ctrl_args.synproxy = &synproxy;
-  if (   conf.mssmode == HASHMODE_COMMANDED
-      || conf.sackmode == HASHMODE_COMMANDED
-      || conf.wscalemode == HASHMODE_COMMANDED)
-  {
-    pthread_create(&ctrl, NULL, ctrl_func, &ctrl_args);
-  }
+  ctrl_args.locals = local;
+  ctrl_args.num_locals = num_local;
+  ctrl_args.capture = &capture;
+  ctrl_args.workers = worker_stats;
+  ctrl_args.num_workers = num_rx;
+  pthread_create(&ctrl, NULL, ctrl_func, &ctrl_args);
 
   pthread_create(&sigthr, NULL, signal_handler_thr, NULL);
   log_log(LOG_LEVEL_NOTICE, "NMPROXY", "fully running");
@@ -562,17 +850,16 @@ int main(int argc, char **argv)
   {
     pthread_join(rx[i], NULL);
   }
+  capture_stop(&capture);
+  replicate_stop(&replicate);
+  learnsave_stop(&learnsave);
+  checkpoint_stop(&checkpoint);
   pthread_join(sigthr, NULL);
   if (write(pipefd[1], "X", 1) != 1)
   {
     log_log(LOG_LEVEL_WARNING, "NMPROXY", "pipe write failed");
   }
-  if (   conf.mssmode == HASHMODE_COMMANDED
-      || conf.sackmode == HASHMODE_COMMANDED
-      || conf.wscalemode == HASHMODE_COMMANDED)
-  {
-    pthread_join(ctrl, NULL);
-  }
+  pthread_join(ctrl, NULL);
 
   for (i = 0; i < num_rx; i++)
   {
@@ -585,8 +872,12 @@ int main(int argc, char **argv)
   set_promisc_mode(sockfd, argv[optind + 1], 0);
   close(sockfd);
 
-  timer_linkheap_remove(&local.timers, &timer);
-  worker_local_free(&local);
+  for (i = 0; i < num_local; i++)
+  {
+    timer_linkheap_remove(&local[i].timers, &timer[i]);
+    worker_local_free(&local[i]);
+  }
+  capture_free(&capture);
   synproxy_free(&synproxy);
   conf_free(&conf);
   log_log(LOG_LEVEL_NOTICE, "NMPROXY", "closing log");
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #define NETMAP_WITH_LIBS
 #include <pthread.h>
+#include <inttypes.h>
 #include "llalloc.h"
 #include "synproxy.h"
 #include "iphdr.h"
@@ -72,12 +73,19 @@ static void periodic_fn(
   worker_local_rdlock(ud->args->local);
   log_log(LOG_LEVEL_INFO, "NMPROXY",
          "worker/%d %g MPPS %g Gbps ul %g MPPS %g Gbps dl"
-         " %u conns synproxied %u conns not",
+         " %u conns synproxied %u conns not %" PRIu64 " allocs failed"
+         " %u/%u half-open %u/%u SYNs completed%s",
          ud->args->idx,
          ulpdiff/diff/1e6, 8*ulbdiff/diff/1e9,
          dlpdiff/diff/1e6, 8*dlbdiff/diff/1e9,
          ud->args->local->synproxied_connections,
-         ud->args->local->direct_connections);
+         ud->args->local->direct_connections,
+         worker_local_alloc_failures(ud->args->local),
+         ud->args->local->half_open_connections,
+         ud->args->local->halfopen.limit,
+         ud->args->local->halfopen.last_completions,
+         ud->args->local->halfopen.last_syns,
+         ud->args->local->halfopen.flood ? " (SYN flood)" : "");
   worker_local_rdunlock(ud->args->local);
   ud->last_time64 = time64;
   ud->next_time64 += 2*1000*1000;
@@ -653,6 +661,9 @@ int main(int argc, char **argv)
   }
   ctrl_args.piperd = pipefd[0];
   ctrl_args.synproxy = &synproxy;
+  ctrl_args.locals = &local;
+  ctrl_args.num_locals = 1;
+  ctrl_args.capture = NULL;
   if (   conf.mssmode == HASHMODE_COMMANDED
       || conf.sackmode == HASHMODE_COMMANDED
       || conf.wscalemode == HASHMODE_COMMANDED)
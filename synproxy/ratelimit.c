@@ -0,0 +1,34 @@
+#include <errno.h>
+#include <stdlib.h>
+#include "ratelimit.h"
+
+int ratelimit_init(struct ratelimit *rl, const struct ratehashconf *conf)
+{
+  size_t i;
+  if (conf->size == 0 || conf->timer_period_usec == 0)
+  {
+    return -EINVAL;
+  }
+  rl->buckets = malloc(conf->size*sizeof(*rl->buckets));
+  if (rl->buckets == NULL)
+  {
+    return -ENOMEM;
+  }
+  rl->size = conf->size;
+  rl->initial_tokens = conf->initial_tokens;
+  rl->timer_add = conf->timer_add;
+  rl->timer_period_usec = conf->timer_period_usec;
+  rl->network_prefix = conf->network_prefix;
+  rl->network_prefix6 = conf->network_prefix6;
+  for (i = 0; i < rl->size; i++)
+  {
+    atomic_init(&rl->buckets[i], rl->initial_tokens);
+  }
+  return 0;
+}
+
+void ratelimit_free(struct ratelimit *rl)
+{
+  free(rl->buckets);
+  rl->buckets = NULL;
+}
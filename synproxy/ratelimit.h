@@ -0,0 +1,134 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "siphash.h"
+#include "hashseed.h"
+#include "conf.h"
+
+/*
+ * SYN rate limiter with a token bucket per source network, shared by all
+ * worker threads without locks.
+ *
+ * Every bucket is one 64-bit word holding the token count and the number of
+ * the refill period the count is for. Tokens are added lazily when a bucket is
+ * used in a later period, so there is no refill timer. An empty bucket in the
+ * current period is only read, so a flood from one network doesn't make the
+ * threads fight over the cache line.
+ */
+
+struct ratelimit {
+  _Atomic uint64_t *buckets; // period << 32 | tokens
+  size_t size;
+  uint32_t initial_tokens; // also the bucket capacity
+  uint32_t timer_add; // tokens added per period
+  uint32_t timer_period_usec;
+  uint8_t network_prefix;
+  uint8_t network_prefix6;
+};
+
+int ratelimit_init(struct ratelimit *rl, const struct ratehashconf *conf);
+
+void ratelimit_free(struct ratelimit *rl);
+
+static inline uint32_t ratelimit_refill(
+  struct ratelimit *rl, uint32_t tokens, uint32_t periods)
+{
+  if (tokens >= rl->initial_tokens)
+  {
+    return tokens;
+  }
+  if (rl->timer_add == 0 ||
+      periods >= (rl->initial_tokens - tokens + rl->timer_add - 1)/rl->timer_add)
+  {
+    return periods ? rl->initial_tokens : tokens;
+  }
+  return tokens + periods*rl->timer_add;
+}
+
+/*
+ * Adds delta (1 or -1) tokens to the bucket. Returns 0 if the bucket is empty
+ * and delta is -1.
+ */
+static inline int ratelimit_update(
+  struct ratelimit *rl, uint32_t hashval, uint64_t time64, int delta)
+{
+  _Atomic uint64_t *bucket = &rl->buckets[hashval % rl->size];
+  uint32_t period = time64 / rl->timer_period_usec;
+  uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+  for (;;)
+  {
+    uint32_t tokens = ratelimit_refill(
+      rl, (uint32_t)old, period - (uint32_t)(old >> 32));
+    uint64_t new;
+    if (delta < 0 && tokens == 0)
+    {
+      return 0;
+    }
+    if (delta > 0 && tokens >= rl->initial_tokens)
+    {
+      return 1;
+    }
+    new = (((uint64_t)period) << 32) | (uint32_t)(tokens + delta);
+    if (atomic_compare_exchange_weak_explicit(
+          bucket, &old, new, memory_order_relaxed, memory_order_relaxed))
+    {
+      return 1;
+    }
+  }
+}
+
+static inline uint32_t ratelimit_hash4(struct ratelimit *rl, uint32_t ip)
+{
+  uint32_t mask = rl->network_prefix ? (~(uint32_t)0) << (32 - rl->network_prefix) : 0;
+  return siphash64(hash_seed_get(), ip & mask);
+}
+
+static inline uint32_t ratelimit_hash6(struct ratelimit *rl, const void *ip)
+{
+  unsigned char masked[16];
+  int bytes = rl->network_prefix6 / 8;
+  int bits = rl->network_prefix6 % 8;
+  memset(masked, 0, sizeof(masked));
+  memcpy(masked, ip, bytes);
+  if (bits)
+  {
+    masked[bytes] = ((const unsigned char*)ip)[bytes] & (0xFF << (8 - bits));
+  }
+  return siphash_buf(hash_seed_get(), masked, sizeof(masked));
+}
+
+/*
+ * Takes a token for a SYN from the IP. Returns 0 if the network has none.
+ */
+static inline int ratelimit_ip_permitted(
+  struct ratelimit *rl, uint32_t ip, uint64_t time64)
+{
+  return ratelimit_update(rl, ratelimit_hash4(rl, ip), time64, -1);
+}
+
+static inline int ratelimit_ipv6_permitted(
+  struct ratelimit *rl, const void *ip, uint64_t time64)
+{
+  return ratelimit_update(rl, ratelimit_hash6(rl, ip), time64, -1);
+}
+
+/*
+ * Gives the token back when the handshake completes.
+ */
+static inline void ratelimit_ip_completed(
+  struct ratelimit *rl, uint32_t ip, uint64_t time64)
+{
+  ratelimit_update(rl, ratelimit_hash4(rl, ip), time64, 1);
+}
+
+static inline void ratelimit_ipv6_completed(
+  struct ratelimit *rl, const void *ip, uint64_t time64)
+{
+  ratelimit_update(rl, ratelimit_hash6(rl, ip), time64, 1);
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "ratelimit.h"
+#include "hashseed.h"
+#include "time64.h"
+#include "conf.h"
+
+#define MAX_THREADS 8
+#define ROUNDS (4*1000*1000)
+
+struct thr_args {
+  struct ratelimit *rl;
+  uint32_t seed;
+  int one_network;
+  uint64_t permitted;
+};
+
+static void *flood_thr(void *arg)
+{
+  struct thr_args *args = arg;
+  uint32_t x = args->seed;
+  uint64_t time64 = gettime64();
+  int i;
+  for (i = 0; i < ROUNDS; i++)
+  {
+    uint32_t ip;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ip = args->one_network ? ((10U<<24) | (x & 0xFF)) : x;
+    if ((i & 1023) == 0)
+    {
+      time64 = gettime64();
+    }
+    args->permitted += ratelimit_ip_permitted(args->rl, ip, time64);
+  }
+  return NULL;
+}
+
+/*
+ * SYN flood against the rate limiter from spoofed random sources or from
+ * one /24 network, in several threads at once.
+ */
+static void flood(struct conf *conf, int threads, int one_network)
+{
+  struct ratelimit rl;
+  struct thr_args args[MAX_THREADS];
+  pthread_t thrs[MAX_THREADS];
+  uint64_t begin, end;
+  uint64_t permitted = 0;
+  int i;
+  if (ratelimit_init(&rl, &conf->ratehash) != 0)
+  {
+    abort();
+  }
+  begin = gettime64();
+  for (i = 0; i < threads; i++)
+  {
+    args[i].rl = &rl;
+    args[i].seed = 0x12345678 + i;
+    args[i].one_network = one_network;
+    args[i].permitted = 0;
+    pthread_create(&thrs[i], NULL, flood_thr, &args[i]);
+  }
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(thrs[i], NULL);
+    permitted += args[i].permitted;
+  }
+  end = gettime64();
+  printf("%d threads %s: %g MSYN/s, %llu permitted\n",
+         threads, one_network ? "one network" : "spoofed",
+         1.0*threads*ROUNDS/(end - begin), (unsigned long long)permitted);
+  ratelimit_free(&rl);
+}
+
+int main(int argc, char **argv)
+{
+  struct conf conf = CONF_INITIALIZER;
+  int threads;
+  int max_threads = 4;
+  if (argc > 1)
+  {
+    max_threads = atoi(argv[1]);
+    if (max_threads <= 0 || max_threads > MAX_THREADS)
+    {
+      fprintf(stderr, "usage: %s [threads]\n", argv[0]);
+      return 1;
+    }
+  }
+  hash_seed_init();
+  for (threads = 1; threads <= max_threads; threads++)
+  {
+    flood(&conf, threads, 0);
+    flood(&conf, threads, 1);
+  }
+  return 0;
+}
@@ -0,0 +1,807 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include "replicate.h"
+#include "synproxy.h"
+#include "time64.h"
+#include "log.h"
+
+void replicate_ring_put(
+  struct replicate_ring *ring, enum replicate_type type,
+  struct synproxy_hash_entry *e, uint64_t time64)
+{
+  struct replicate_rec *rec;
+  unsigned prod;
+  if (ring->locked)
+  {
+    pthread_mutex_lock(&ring->mtx);
+  }
+  prod = atomic_load_explicit(&ring->prod, memory_order_relaxed);
+  if (prod - ring->cached_cons >= REPLICATE_RING_SIZE)
+  {
+    ring->cached_cons = atomic_load_explicit(&ring->cons, memory_order_acquire);
+  }
+  if (prod - ring->cached_cons >= REPLICATE_RING_SIZE)
+  {
+    ring->drops++;
+    atomic_store_explicit(&ring->published_drops, ring->drops,
+                          memory_order_relaxed);
+  }
+  else
+  {
+    rec = &ring->recs[prod % REPLICATE_RING_SIZE];
+    rec->type = type;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    rec->table = ring->table;
+    checkpoint_entry_out(&rec->entry, e, time64);
+    atomic_store_explicit(&ring->prod, prod + 1, memory_order_release);
+  }
+  if (ring->locked)
+  {
+    pthread_mutex_unlock(&ring->mtx);
+  }
+}
+
+int replicate_ring_init(
+  struct replicate_ring *ring, struct worker_local *local, uint32_t table)
+{
+  ring->recs = malloc(REPLICATE_RING_SIZE*sizeof(*ring->recs));
+  if (ring->recs == NULL)
+  {
+    return -ENOMEM;
+  }
+  atomic_init(&ring->prod, 0);
+  atomic_init(&ring->cons, 0);
+  atomic_init(&ring->published_drops, 0);
+  ring->cached_cons = 0;
+  ring->drops = 0;
+  ring->locked = local->locked;
+  ring->table = table;
+  ring->local = local;
+  atomic_init(&ring->snapshot, 0);
+  atomic_init(&ring->snap_next, 0);
+  atomic_init(&ring->snap_walked, 0);
+  atomic_init(&ring->snap_entries, 0);
+  if (local->tagged)
+  {
+    ring->snap_buckets = local->flowtable.bucketmask + 1;
+  }
+  else
+  {
+    ring->snap_buckets = local->hash.bucketcnt;
+  }
+  pthread_mutex_init(&ring->mtx, NULL);
+  return 0;
+}
+
+void replicate_ring_free(struct replicate_ring *ring)
+{
+  pthread_mutex_destroy(&ring->mtx);
+  free(ring->recs);
+  ring->recs = NULL;
+}
+
+int replicate_inq_init(struct replicate_inq *q, struct worker_local *local)
+{
+  q->recs = malloc(REPLICATE_RING_SIZE*sizeof(*q->recs));
+  if (q->recs == NULL)
+  {
+    return -ENOMEM;
+  }
+  atomic_init(&q->prod, 0);
+  atomic_init(&q->cons, 0);
+  q->local = local;
+  return 0;
+}
+
+void replicate_inq_free(struct replicate_inq *q)
+{
+  free(q->recs);
+  q->recs = NULL;
+}
+
+int replicate_inq_put(struct replicate_inq *q, const struct replicate_rec *rec)
+{
+  unsigned prod = atomic_load_explicit(&q->prod, memory_order_relaxed);
+  if (prod - atomic_load_explicit(&q->cons, memory_order_acquire) >=
+      REPLICATE_RING_SIZE)
+  {
+    return -ENOBUFS;
+  }
+  q->recs[prod % REPLICATE_RING_SIZE] = *rec;
+  atomic_store_explicit(&q->prod, prod + 1, memory_order_release);
+  return 0;
+}
+
+static void replicate_apply_rec(
+  struct worker_local *local, const struct replicate_rec *rec, uint64_t time64)
+{
+  struct synproxy_hash_entry e;
+  if (rec->entry.version != 4 && rec->entry.version != 6)
+  {
+    return;
+  }
+  checkpoint_entry_in(&e, &rec->entry, time64 + rec->entry.timeout_usec);
+  if (rec->type == REPLICATE_UPDATE)
+  {
+    synproxy_hash_put_replicated(local, &e, time64);
+  }
+  else if (rec->type == REPLICATE_DELETE)
+  {
+    synproxy_hash_del_replicated(local, &e);
+  }
+}
+
+int replicate_inq_apply(struct replicate_inq *q)
+{
+  unsigned cons = atomic_load_explicit(&q->cons, memory_order_relaxed);
+  unsigned prod = atomic_load_explicit(&q->prod, memory_order_acquire);
+  uint64_t time64;
+  int cnt = 0;
+  if (cons == prod)
+  {
+    return 0;
+  }
+  time64 = gettime64();
+  while (cons != prod && cnt < REPLICATE_BATCH)
+  {
+    replicate_apply_rec(q->local, &q->recs[cons % REPLICATE_RING_SIZE],
+                        time64);
+    cons++;
+    cnt++;
+  }
+  atomic_store_explicit(&q->cons, cons, memory_order_release);
+  return cnt;
+}
+
+static int replicate_sockaddr(
+  const char *spec, struct sockaddr_storage *ss, socklen_t *len)
+{
+  struct addrinfo hints, *res;
+  char host[256];
+  const char *port;
+  size_t hostlen;
+  memset(ss, 0, sizeof(*ss));
+  if (strncmp(spec, "unix:", 5) == 0)
+  {
+    struct sockaddr_un *sun = (struct sockaddr_un*)ss;
+    if (strlen(spec + 5) >= sizeof(sun->sun_path))
+    {
+      return -ENAMETOOLONG;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, spec + 5);
+    *len = sizeof(*sun);
+    return 0;
+  }
+  port = strrchr(spec, ':');
+  if (port == NULL)
+  {
+    return -EINVAL;
+  }
+  hostlen = port - spec;
+  port++;
+  if (hostlen >= 2 && spec[0] == '[' && spec[hostlen-1] == ']')
+  {
+    spec++;
+    hostlen -= 2;
+  }
+  if (hostlen >= sizeof(host))
+  {
+    return -EINVAL;
+  }
+  memcpy(host, spec, hostlen);
+  host[hostlen] = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+  {
+    return -EINVAL;
+  }
+  memcpy(ss, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int replicate_stopped(struct replicate *r)
+{
+  return atomic_load_explicit(&r->stop, memory_order_relaxed);
+}
+
+/*
+ * Sleeps for about msec milliseconds, but returns early if stopped.
+ */
+static void replicate_sleep(struct replicate *r, int msec)
+{
+  while (msec > 0 && !replicate_stopped(r))
+  {
+    poll(NULL, 0, msec < 100 ? msec : 100);
+    msec -= 100;
+  }
+}
+
+static int replicate_writeall(struct replicate *r, int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0)
+  {
+    ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      if (replicate_stopped(r) || poll(&pfd, 1, 1000) < 0)
+      {
+        return -1;
+      }
+      continue;
+    }
+    if (ret <= 0)
+    {
+      return -1;
+    }
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+static int replicate_connect(struct replicate *r)
+{
+  struct sockaddr_storage ss;
+  struct replicate_hello hello;
+  struct pollfd pfd;
+  socklen_t len, errlen;
+  int fd, err = 0;
+  if (replicate_sockaddr(r->peer, &ss, &len) != 0)
+  {
+    return -1;
+  }
+  fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&ss, len) != 0)
+  {
+    if (errno != EINPROGRESS && errno != EAGAIN)
+    {
+      close(fd);
+      return -1;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    errlen = sizeof(err);
+    if (poll(&pfd, 1, 1000) <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0)
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  memset(&hello, 0, sizeof(hello));
+  memcpy(hello.magic, REPLICATE_MAGIC, sizeof(hello.magic));
+  hello.version = REPLICATE_VERSION;
+  hello.rec_size = sizeof(struct replicate_rec);
+  if (replicate_writeall(r, fd, &hello, sizeof(hello)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * While disconnected, events are discarded, as the snapshot sent after
+ * connecting covers them.
+ */
+static void replicate_discard(struct replicate *r)
+{
+  int i;
+  for (i = 0; i < r->num_locals; i++)
+  {
+    struct replicate_ring *ring = &r->rings[i];
+    atomic_store_explicit(&ring->cons,
+                          atomic_load_explicit(&ring->prod, memory_order_acquire),
+                          memory_order_release);
+  }
+}
+
+/*
+ * Puts the entries of a bucket to the ring. Returns the number of entries.
+ */
+static uint64_t replicate_snapshot_bucket(
+  struct replicate_ring *ring, size_t bucket, uint64_t time64)
+{
+  struct worker_local *local = ring->local;
+  uint64_t cnt = 0;
+  if (local->tagged)
+  {
+    int slot;
+    for (slot = 0; slot < FLOWTABLE_SLOTS; slot++)
+    {
+      struct synproxy_hash_entry *e =
+        local->flowtable.buckets[bucket].entries[slot];
+      if (e != NULL && checkpoint_entry_saved(e, time64))
+      {
+        replicate_ring_put(ring, REPLICATE_UPDATE, e, time64);
+        cnt++;
+      }
+    }
+  }
+  else
+  {
+    struct hash_list_node *n;
+    hash_table_lock_bucket(&local->hash, bucket);
+    HASH_TABLE_FOR_EACH_POSSIBLE(&local->hash, n, bucket)
+    {
+      struct synproxy_hash_entry *e =
+        CONTAINER_OF(n, struct synproxy_hash_entry, node);
+      if (checkpoint_entry_saved(e, time64))
+      {
+        replicate_ring_put(ring, REPLICATE_UPDATE, e, time64);
+        cnt++;
+      }
+    }
+    hash_table_unlock_bucket(&local->hash, bucket);
+  }
+  return cnt;
+}
+
+int replicate_snapshot_step(struct replicate_ring *ring)
+{
+  uint64_t time64 = gettime64();
+  uint64_t cnt = 0;
+  size_t first, last, bucket;
+  unsigned used;
+  used = atomic_load_explicit(&ring->prod, memory_order_relaxed) -
+         atomic_load_explicit(&ring->cons, memory_order_acquire);
+  if (used >= REPLICATE_RING_SIZE/2)
+  {
+    return 1;
+  }
+  first = atomic_fetch_add_explicit(&ring->snap_next,
+                                    REPLICATE_SNAPSHOT_BUCKETS,
+                                    memory_order_acquire);
+  if (first >= ring->snap_buckets)
+  {
+    return 0;
+  }
+  last = first + REPLICATE_SNAPSHOT_BUCKETS;
+  if (last > ring->snap_buckets)
+  {
+    last = ring->snap_buckets;
+  }
+  for (bucket = first; bucket < last; bucket++)
+  {
+    cnt += replicate_snapshot_bucket(ring, bucket, time64);
+  }
+  atomic_fetch_add_explicit(&ring->snap_entries, cnt, memory_order_relaxed);
+  if (atomic_fetch_add_explicit(&ring->snap_walked, last - first,
+                                memory_order_acq_rel) + (last - first) ==
+      ring->snap_buckets)
+  {
+    atomic_store_explicit(&ring->snapshot, 0, memory_order_release);
+  }
+  return 1;
+}
+
+/*
+ * Starts only after the last walk has ended. A thread that saw the last walk
+ * may claim buckets after the cursor is reset, so the cursor is reset last.
+ */
+static void replicate_snapshot_start(struct replicate *r)
+{
+  int i;
+  for (i = 0; i < r->num_locals; i++)
+  {
+    struct replicate_ring *ring = &r->rings[i];
+    atomic_store_explicit(&ring->snap_walked, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->snap_entries, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->snapshot, 1, memory_order_relaxed);
+    atomic_store_explicit(&ring->snap_next, 0, memory_order_release);
+  }
+}
+
+static int replicate_snapshot_running(struct replicate *r)
+{
+  int i;
+  for (i = 0; i < r->num_locals; i++)
+  {
+    if (atomic_load_explicit(&r->rings[i].snapshot, memory_order_acquire))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t replicate_snapshot_entries(struct replicate *r)
+{
+  uint64_t cnt = 0;
+  int i;
+  for (i = 0; i < r->num_locals; i++)
+  {
+    cnt += atomic_load_explicit(&r->rings[i].snap_entries,
+                                memory_order_relaxed);
+  }
+  return cnt;
+}
+
+/*
+ * Moves up to max events from the ring to out. Returns the number of events.
+ */
+static int replicate_ring_get(
+  struct replicate_ring *ring, struct replicate_rec *out, int max)
+{
+  unsigned cons = atomic_load_explicit(&ring->cons, memory_order_relaxed);
+  unsigned prod = atomic_load_explicit(&ring->prod, memory_order_acquire);
+  int cnt = 0;
+  while (cons != prod && cnt < max)
+  {
+    out[cnt++] = ring->recs[cons % REPLICATE_RING_SIZE];
+    cons++;
+  }
+  atomic_store_explicit(&ring->cons, cons, memory_order_release);
+  return cnt;
+}
+
+static uint64_t replicate_drops(struct replicate *r)
+{
+  uint64_t drops = 0;
+  int i;
+  for (i = 0; i < r->num_locals; i++)
+  {
+    drops += atomic_load_explicit(&r->rings[i].published_drops,
+                                  memory_order_relaxed);
+  }
+  return drops;
+}
+
+/*
+ * The peer is synced when a walk of the tables ends with the records drained
+ * and no events dropped since the walk started.
+ */
+static void *replicate_send_func(void *userdata)
+{
+  struct replicate *r = userdata;
+  struct replicate_rec batch[REPLICATE_BATCH];
+  uint64_t next_time64 = gettime64() + 2*1000*1000;
+  uint64_t snap_time64 = 0;
+  uint64_t last_drops = 0;
+  uint64_t snap_drops = 0;
+  int snapshotting = 0;
+  int resnapshot = 0;
+  int fd = -1;
+  while (!replicate_stopped(r))
+  {
+    int cnt = 0;
+    int running;
+    int i;
+    uint64_t time64;
+    if (fd < 0)
+    {
+      replicate_discard(r);
+      if (replicate_snapshot_running(r))
+      {
+        // The walk for the lost connection has to end first
+        poll(NULL, 0, 1);
+        continue;
+      }
+      fd = replicate_connect(r);
+      if (fd < 0)
+      {
+        replicate_sleep(r, 1000);
+        continue;
+      }
+      snapshotting = 0;
+      resnapshot = 1;
+      last_drops = replicate_drops(r);
+    }
+    running = replicate_snapshot_running(r);
+    for (i = 0; i < r->num_locals; i++)
+    {
+      cnt += replicate_ring_get(&r->rings[i], batch + cnt,
+                                REPLICATE_BATCH - cnt);
+    }
+    if (cnt > 0 && replicate_writeall(r, fd, batch, cnt*sizeof(*batch)) != 0)
+    {
+      // The walk after reconnecting covers what is lost here
+      log_log(LOG_LEVEL_WARNING, "REPLICATE", "connection to %s lost",
+              r->peer);
+      atomic_store(&r->synced, 0);
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    time64 = gettime64();
+    if (snapshotting && !running && cnt < REPLICATE_BATCH)
+    {
+      snapshotting = 0;
+      if (!atomic_load(&r->synced) && replicate_drops(r) == snap_drops)
+      {
+        log_log(LOG_LEVEL_NOTICE, "REPLICATE", "sent %llu connections to %s",
+                (unsigned long long)replicate_snapshot_entries(r), r->peer);
+        atomic_store(&r->synced, 1);
+      }
+    }
+    if (time64 >= next_time64)
+    {
+      uint64_t drops = replicate_drops(r);
+      if (drops != last_drops)
+      {
+        log_log(LOG_LEVEL_WARNING, "REPLICATE",
+                "dropped %llu events, sending the tables again",
+                (unsigned long long)(drops - last_drops));
+        atomic_store(&r->synced, 0);
+        resnapshot = 1;
+        last_drops = drops;
+      }
+      next_time64 += 2*1000*1000;
+    }
+    if (!snapshotting &&
+        (resnapshot ||
+         time64 - snap_time64 >= REPLICATE_REFRESH_SEC*1000ULL*1000ULL))
+    {
+      snap_drops = replicate_drops(r);
+      replicate_snapshot_start(r);
+      snap_time64 = time64;
+      snapshotting = 1;
+      resnapshot = 0;
+    }
+    if (cnt == 0)
+    {
+      poll(NULL, 0, 1);
+    }
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  return NULL;
+}
+
+/*
+ * Applies a record to a locked table, or queues it to the thread of an
+ * unlocked one, waiting while the queue is full. Returns -1 if stopped.
+ */
+static int replicate_apply(
+  struct replicate *r, const struct replicate_rec *rec, uint64_t time64)
+{
+  uint32_t table = rec->table;
+  if (r->num_locals == 1)
+  {
+    table = 0;
+  }
+  else if (table >= (uint32_t)r->num_locals)
+  {
+    return 0;
+  }
+  if (r->inqs == NULL)
+  {
+    replicate_apply_rec(&r->locals[table], rec, time64);
+    return 0;
+  }
+  while (replicate_inq_put(&r->inqs[table], rec) != 0)
+  {
+    if (replicate_stopped(r))
+    {
+      return -1;
+    }
+    poll(NULL, 0, 1);
+  }
+  return 0;
+}
+
+static int replicate_listen_fd(struct replicate *r)
+{
+  struct sockaddr_storage ss;
+  socklen_t len;
+  int fd, one = 1;
+  if (replicate_sockaddr(r->listen, &ss, &len) != 0)
+  {
+    return -1;
+  }
+  if (ss.ss_family == AF_UNIX)
+  {
+    unlink(((struct sockaddr_un*)&ss)->sun_path);
+  }
+  fd = socket(ss.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr*)&ss, len) != 0 || listen(fd, 1) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int replicate_hello_valid(const struct replicate_hello *hello)
+{
+  return memcmp(hello->magic, REPLICATE_MAGIC, sizeof(hello->magic)) == 0 &&
+         hello->version == REPLICATE_VERSION &&
+         hello->rec_size == sizeof(struct replicate_rec);
+}
+
+/*
+ * Receives from one peer until it disconnects or sends garbage.
+ */
+static void replicate_receive(struct replicate *r, int fd)
+{
+  struct replicate_rec recs[REPLICATE_BATCH];
+  struct replicate_hello hello;
+  size_t have = 0, hello_have = 0;
+  while (!replicate_stopped(r))
+  {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    uint64_t time64;
+    ssize_t ret;
+    int cnt, i;
+    if (poll(&pfd, 1, 100) <= 0)
+    {
+      continue;
+    }
+    if (hello_have < sizeof(hello))
+    {
+      ret = read(fd, (char*)&hello + hello_have, sizeof(hello) - hello_have);
+      if (ret <= 0)
+      {
+        break;
+      }
+      hello_have += ret;
+      if (hello_have == sizeof(hello) && !replicate_hello_valid(&hello))
+      {
+        log_log(LOG_LEVEL_ERR, "REPLICATE", "invalid peer hello");
+        break;
+      }
+      continue;
+    }
+    ret = read(fd, (char*)recs + have, sizeof(recs) - have);
+    if (ret <= 0)
+    {
+      break;
+    }
+    have += ret;
+    cnt = have / sizeof(*recs);
+    time64 = gettime64();
+    for (i = 0; i < cnt; i++)
+    {
+      if (replicate_apply(r, &recs[i], time64) != 0)
+      {
+        return;
+      }
+    }
+    r->applied += cnt;
+    have -= cnt*sizeof(*recs);
+    memmove(recs, (char*)recs + cnt*sizeof(*recs), have);
+  }
+}
+
+static void *replicate_recv_func(void *userdata)
+{
+  struct replicate *r = userdata;
+  int lfd = replicate_listen_fd(r);
+  if (lfd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "REPLICATE", "can't listen on %s", r->listen);
+    return NULL;
+  }
+  while (!replicate_stopped(r))
+  {
+    struct pollfd pfd = {.fd = lfd, .events = POLLIN};
+    int fd;
+    if (poll(&pfd, 1, 100) <= 0)
+    {
+      continue;
+    }
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+    {
+      continue;
+    }
+    log_log(LOG_LEVEL_NOTICE, "REPLICATE", "peer connected");
+    replicate_receive(r, fd);
+    close(fd);
+    log_log(LOG_LEVEL_NOTICE, "REPLICATE", "peer disconnected, %llu events",
+            (unsigned long long)r->applied);
+  }
+  close(lfd);
+  return NULL;
+}
+
+int replicate_start(
+  struct replicate *r, struct worker_local *locals, int num_locals,
+  const char *peer, const char *listenaddr)
+{
+  int i;
+  r->locals = locals;
+  r->num_locals = num_locals;
+  r->rings = NULL;
+  r->inqs = NULL;
+  r->peer = peer;
+  r->listen = listenaddr;
+  r->applied = 0;
+  atomic_init(&r->stop, 0);
+  atomic_init(&r->synced, 0);
+  if (peer != NULL)
+  {
+    r->rings = calloc(num_locals, sizeof(*r->rings));
+    if (r->rings == NULL)
+    {
+      return -ENOMEM;
+    }
+    for (i = 0; i < num_locals; i++)
+    {
+      if (replicate_ring_init(&r->rings[i], &locals[i], i) != 0)
+      {
+        return -ENOMEM;
+      }
+      locals[i].repl = &r->rings[i];
+    }
+    if (pthread_create(&r->sendthr, NULL, replicate_send_func, r) != 0)
+    {
+      return -ENOMEM;
+    }
+  }
+  if (listenaddr != NULL && !locals[0].locked)
+  {
+    r->inqs = calloc(num_locals, sizeof(*r->inqs));
+    if (r->inqs == NULL)
+    {
+      return -ENOMEM;
+    }
+    for (i = 0; i < num_locals; i++)
+    {
+      if (replicate_inq_init(&r->inqs[i], &locals[i]) != 0)
+      {
+        return -ENOMEM;
+      }
+      locals[i].replin = &r->inqs[i];
+    }
+  }
+  if (listenaddr != NULL &&
+      pthread_create(&r->recvthr, NULL, replicate_recv_func, r) != 0)
+  {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void replicate_stop(struct replicate *r)
+{
+  int i;
+  atomic_store(&r->stop, 1);
+  if (r->peer != NULL)
+  {
+    pthread_join(r->sendthr, NULL);
+    for (i = 0; i < r->num_locals; i++)
+    {
+      r->locals[i].repl = NULL;
+      replicate_ring_free(&r->rings[i]);
+    }
+    free(r->rings);
+    r->rings = NULL;
+  }
+  if (r->listen != NULL)
+  {
+    pthread_join(r->recvthr, NULL);
+  }
+  if (r->inqs != NULL)
+  {
+    for (i = 0; i < r->num_locals; i++)
+    {
+      r->locals[i].replin = NULL;
+      replicate_inq_free(&r->inqs[i]);
+    }
+    free(r->inqs);
+    r->inqs = NULL;
+  }
+}
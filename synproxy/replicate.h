@@ -0,0 +1,193 @@
+#ifndef _REPLICATE_H_
+#define _REPLICATE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "checkpoint.h"
+
+/*
+ * Replicates the connection tables to a standby instance, so that a failover
+ * keeps the synproxied connections alive.
+ *
+ * Every connection table has a ring of events, filled by the packet
+ * processing threads when a connection is established, changes state, has its
+ * timeout moved earlier or is deleted. A timeout moved later, as every packet
+ * of an established connection does, isn't an event. A full ring drops the
+ * event and counts it, so replication never stalls packet processing. A
+ * sender thread drains the rings to the peer in batches.
+ *
+ * When the sender connects, after events were dropped and every
+ * REPLICATE_REFRESH_SEC, the tables are sent again without stopping packet
+ * processing: the threads of a table walk it REPLICATE_SNAPSHOT_BUCKETS
+ * buckets at a time at the top of their loops, and put every entry in the
+ * ring under its bucket lock, so that it is ordered with the events of the
+ * entry. A step is skipped while the ring is half full. The refresh keeps the
+ * timeouts of the peer close to the real ones. An entry whose delete was
+ * dropped stays at the peer until it times out there.
+ *
+ * The receiver thread of the peer applies the records to tables shared by
+ * many threads itself, under the locks of the tables. A table of one thread
+ * has a ring of received records instead, applied by that thread at the top
+ * of its loop, so no RX thread is ever stopped. Both instances may have both
+ * threads, then whichever one is active replicates to the other.
+ *
+ * Records are in host byte order, so the peers must have the same byte order.
+ * Events are sent per table, so with sharding, the peers need the same
+ * thread count.
+ */
+
+#define REPLICATE_MAGIC "SYNPREPL"
+#define REPLICATE_VERSION 1
+#define REPLICATE_RING_SIZE 16384
+#define REPLICATE_BATCH 512
+#define REPLICATE_SNAPSHOT_BUCKETS 256
+#define REPLICATE_REFRESH_SEC 300
+#define REPLICATE_APPLY_MSEC 10
+
+enum replicate_type {
+  REPLICATE_UPDATE = 1,
+  REPLICATE_DELETE = 2,
+};
+
+struct replicate_hello {
+  char magic[8];
+  uint32_t version;
+  uint32_t rec_size;
+};
+
+struct replicate_rec {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t table;
+  struct checkpoint_file_entry entry;
+};
+
+/*
+ * Single consumer. Single producer, unless the table is shared by many
+ * threads, then producers take the lock.
+ */
+struct replicate_ring {
+  atomic_uint prod __attribute__((aligned(64)));
+  unsigned cached_cons;
+  uint64_t drops;
+  int locked;
+  uint32_t table;
+  pthread_mutex_t mtx;
+  atomic_uint cons __attribute__((aligned(64)));
+  _Atomic uint64_t published_drops;
+  struct replicate_rec *recs;
+  struct worker_local *local;
+  atomic_int snapshot __attribute__((aligned(64))); // 1: table being walked
+  size_t snap_buckets;
+  atomic_size_t snap_next; // next bucket to walk
+  atomic_size_t snap_walked;
+  _Atomic uint64_t snap_entries;
+};
+
+/*
+ * Records received for an unlocked table. Single producer, the receiver
+ * thread, and single consumer, the thread of the table.
+ */
+struct replicate_inq {
+  atomic_uint prod __attribute__((aligned(64)));
+  atomic_uint cons __attribute__((aligned(64)));
+  struct worker_local *local;
+  struct replicate_rec *recs;
+};
+
+struct replicate {
+  struct worker_local *locals;
+  int num_locals;
+  struct replicate_ring *rings;
+  struct replicate_inq *inqs; // NULL if not received or tables locked
+  const char *peer; // NULL: not sent
+  const char *listen; // NULL: not received
+  pthread_t sendthr;
+  pthread_t recvthr;
+  atomic_int stop;
+  atomic_int synced; // peer has the tables and gets all events
+  uint64_t applied;
+};
+
+int replicate_ring_init(
+  struct replicate_ring *ring, struct worker_local *local, uint32_t table);
+
+void replicate_ring_free(struct replicate_ring *ring);
+
+int replicate_inq_init(struct replicate_inq *q, struct worker_local *local);
+
+void replicate_inq_free(struct replicate_inq *q);
+
+/*
+ * Adds a received record to the queue. Returns -ENOBUFS if it's full.
+ */
+int replicate_inq_put(struct replicate_inq *q, const struct replicate_rec *rec);
+
+/*
+ * Applies up to REPLICATE_BATCH records of the queue to its table. Returns
+ * the number of records applied.
+ */
+int replicate_inq_apply(struct replicate_inq *q);
+
+/*
+ * Adds an event to the ring. Called by packet processing with the bucket lock
+ * of the entry.
+ */
+void replicate_ring_put(
+  struct replicate_ring *ring, enum replicate_type type,
+  struct synproxy_hash_entry *e, uint64_t time64);
+
+/*
+ * Walks the next buckets of the table if the ring has room. Returns 1 if the
+ * walk goes on.
+ */
+int replicate_snapshot_step(struct replicate_ring *ring);
+
+/*
+ * Called by every thread of the table at the top of its loop with the rings
+ * of the table, either of which may be NULL. Returns how many milliseconds
+ * the thread may sleep at most: briefly while the table is walked or records
+ * are queued, and at most REPLICATE_APPLY_MSEC while receiving.
+ */
+static inline uint32_t replicate_poll(
+  struct replicate_ring *ring, struct replicate_inq *q)
+{
+  uint32_t msec = UINT32_MAX;
+  if (ring != NULL &&
+      atomic_load_explicit(&ring->snapshot, memory_order_acquire) &&
+      replicate_snapshot_step(ring))
+  {
+    msec = 1;
+  }
+  if (q != NULL)
+  {
+    if (replicate_inq_apply(q) == REPLICATE_BATCH)
+    {
+      msec = 1;
+    }
+    else if (msec > REPLICATE_APPLY_MSEC)
+    {
+      msec = REPLICATE_APPLY_MSEC;
+    }
+  }
+  return msec;
+}
+
+/*
+ * Peer and listen addresses are "unix:/path", "host:port" or "[ipv6]:port".
+ * Starts the threads of the addresses set, and hooks the rings to the tables
+ * if peer is set, and the received queues to unlocked tables if listenaddr
+ * is set. Call before the RX threads.
+ */
+int replicate_start(
+  struct replicate *r, struct worker_local *locals, int num_locals,
+  const char *peer, const char *listenaddr);
+
+/*
+ * Stops the threads. Call after the RX threads have exited.
+ */
+void replicate_stop(struct replicate *r);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef _RXSCHED_H_
+#define _RXSCHED_H_
+
+#include <stdint.h>
+#include "time64.h"
+
+#define RXSCHED_TXSYNC_DEFAULT 64
+
+/*
+ * RX loop scheduling. A thread busy-polls its queues while packets keep
+ * arriving and blocks in poll() only after busypoll iterations in a row found
+ * nothing, busypoll == 0 meaning it always blocks. TX rings are always synced
+ * before blocking, and when at least txsync_threshold packets have been queued
+ * since the last sync. With txsync_threshold == 0, a thread that always
+ * blocks syncs only before blocking, and a busy polling thread every
+ * RXSCHED_TXSYNC_DEFAULT packets.
+ *
+ * The wall clock time of every iteration is counted as processing if it
+ * handled packets, polling if not, and the time blocked in poll() as sleeping.
+ */
+
+struct rxsched {
+  uint32_t busypoll;
+  uint32_t txsync_threshold;
+  uint32_t idle; // empty iterations in a row
+  uint64_t last_time64;
+  uint64_t poll_usec;
+  uint64_t process_usec;
+  uint64_t sleep_usec;
+  uint64_t last_poll_usec;
+  uint64_t last_process_usec;
+  uint64_t last_sleep_usec;
+};
+
+static inline void rxsched_init(
+  struct rxsched *s, uint32_t busypoll, uint32_t txsync_threshold)
+{
+  s->busypoll = busypoll;
+  s->txsync_threshold = txsync_threshold;
+  if (txsync_threshold == 0 && busypoll > 0)
+  {
+    s->txsync_threshold = RXSCHED_TXSYNC_DEFAULT;
+  }
+  s->idle = 0;
+  s->last_time64 = gettime64();
+  s->poll_usec = 0;
+  s->process_usec = 0;
+  s->sleep_usec = 0;
+  s->last_poll_usec = 0;
+  s->last_process_usec = 0;
+  s->last_sleep_usec = 0;
+}
+
+static inline int rxsched_should_sleep(struct rxsched *s)
+{
+  return s->idle >= s->busypoll;
+}
+
+/*
+ * Tells whether to sync a TX ring that has had unsynced packets queued since
+ * its last sync.
+ */
+static inline int rxsched_should_txsync(struct rxsched *s, uint32_t unsynced)
+{
+  return s->txsync_threshold > 0 && unsynced >= s->txsync_threshold;
+}
+
+/*
+ * Call after blocking, with the current time.
+ */
+static inline void rxsched_slept(struct rxsched *s, uint64_t time64)
+{
+  s->sleep_usec += time64 - s->last_time64;
+  s->last_time64 = time64;
+}
+
+/*
+ * Call at the end of an iteration that handled cnt packets.
+ */
+static inline void rxsched_done(struct rxsched *s, int cnt)
+{
+  uint64_t time64 = gettime64();
+  if (cnt > 0)
+  {
+    s->process_usec += time64 - s->last_time64;
+    s->idle = 0;
+  }
+  else
+  {
+    s->poll_usec += time64 - s->last_time64;
+    if (s->idle < UINT32_MAX)
+    {
+      s->idle++;
+    }
+  }
+  s->last_time64 = time64;
+}
+
+/*
+ * Gives the percentages of time spent processing, polling and sleeping since
+ * the previous call.
+ */
+static inline void rxsched_usage(
+  struct rxsched *s, double *process_pct, double *poll_pct, double *sleep_pct)
+{
+  double processdiff = s->process_usec - s->last_process_usec;
+  double polldiff = s->poll_usec - s->last_poll_usec;
+  double sleepdiff = s->sleep_usec - s->last_sleep_usec;
+  double total = processdiff + polldiff + sleepdiff;
+  if (total == 0)
+  {
+    total = 1;
+  }
+  *process_pct = 100*processdiff/total;
+  *poll_pct = 100*polldiff/total;
+  *sleep_pct = 100*sleepdiff/total;
+  s->last_process_usec = s->process_usec;
+  s->last_poll_usec = s->poll_usec;
+  s->last_sleep_usec = s->sleep_usec;
+}
+
+#endif
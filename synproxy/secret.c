@@ -1,6 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
 #include "timerlink.h"
-#include "siphash.h"
+#include "sipbatch.h"
 #include "chacha.h"
 #include "secret.h"
 #include "conf.h"
@@ -9,11 +10,8 @@
 
 void secret_init_deterministic(struct secretinfo *info)
 {
-  if (pthread_rwlock_init(&info->lock, NULL) != 0)
-  {
-    abort();
-  }
-  info->current_secret_index = 0;
+  atomic_store(&info->seq, 0);
+  atomic_store(&info->current_secret_index, 0);
   chacha20_init_deterministic(&info->chachactx);
   revolve_secret_impl(info);
   revolve_secret_impl(info);
@@ -21,11 +19,8 @@ void secret_init_deterministic(struct secretinfo *info)
 
 void secret_init_random(struct secretinfo *info)
 {
-  if (pthread_rwlock_init(&info->lock, NULL) != 0)
-  {
-    abort();
-  }
-  info->current_secret_index = 0;
+  atomic_store(&info->seq, 0);
+  atomic_store(&info->current_secret_index, 0);
   chacha20_init_devrandom(&info->chachactx);
   revolve_secret_impl(info);
   revolve_secret_impl(info);
@@ -33,23 +28,22 @@ void secret_init_random(struct secretinfo *info)
 
 void revolve_secret_impl(struct secretinfo *info)
 {
-  int new_secret_index = !info->current_secret_index;
-  struct secret new_secret;
+  int new_secret_index =
+    !atomic_load_explicit(&info->current_secret_index, memory_order_relaxed);
+  uint32_t seq = atomic_load_explicit(&info->seq, memory_order_relaxed);
+  uint64_t words[2];
   char buf[64];
   chacha20_next_block(&info->chachactx, buf);
-  memcpy(new_secret.data, buf, 16);
-  if (pthread_rwlock_wrlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  info->secrets[new_secret_index] = new_secret;
-  info->current_secret_index = new_secret_index;
-  if (pthread_rwlock_unlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  log_log(LOG_LEVEL_NOTICE, "SECRET",
-          "revolved secret, current is %d", new_secret_index);
+  memcpy(words, buf, 16);
+  atomic_store_explicit(&info->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&info->secrets[new_secret_index][0], words[0],
+                        memory_order_relaxed);
+  atomic_store_explicit(&info->secrets[new_secret_index][1], words[1],
+                        memory_order_relaxed);
+  atomic_store_explicit(&info->current_secret_index, new_secret_index,
+                        memory_order_relaxed);
+  atomic_store_explicit(&info->seq, seq + 2, memory_order_release);
 }
 
 void revolve_secret(
@@ -57,23 +51,151 @@ void revolve_secret(
 {
   struct secretinfo *info = ud;
   revolve_secret_impl(info);
+  log_log(LOG_LEVEL_NOTICE, "SECRET", "revolved secret, current is %d",
+          atomic_load_explicit(&info->current_secret_index,
+                               memory_order_relaxed));
   timer->time64 += 32*1000*1000;
   timer_linkheap_add(heap, timer);
 }
 
-struct addr46 {
-  int is6;
-  union {
-    struct {
-      uint32_t ip1;
-      uint32_t ip2;
-    } u4;
-    struct {
-      const void *ip1;
-      const void *ip2;
-    } u6;
-  } u;
-};
+/*
+ * Reads secret number index, or the current secret if index is negative.
+ * Returns the number of the secret read.
+ */
+static inline int secret_read(
+  struct secretinfo *info, int index, struct secret *secret)
+{
+  uint32_t seq;
+  uint64_t words[2];
+  int idx;
+  for (;;)
+  {
+    seq = atomic_load_explicit(&info->seq, memory_order_acquire);
+    if (seq & 1)
+    {
+      continue;
+    }
+    idx = index;
+    if (idx < 0)
+    {
+      idx = atomic_load_explicit(&info->current_secret_index,
+                                 memory_order_relaxed);
+    }
+    words[0] = atomic_load_explicit(&info->secrets[idx][0],
+                                    memory_order_relaxed);
+    words[1] = atomic_load_explicit(&info->secrets[idx][1],
+                                    memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&info->seq, memory_order_relaxed) == seq)
+    {
+      break;
+    }
+  }
+  memcpy(secret->data, words, 16);
+  return idx;
+}
+
+static size_t addr46_words(const struct addr46 *a46, uint64_t *words)
+{
+  if (a46->is6)
+  {
+    const char *ip1 = a46->u.u6.ip1;
+    const char *ip2 = a46->u.u6.ip2;
+    words[0] = hdr_get64h(&ip1[0]);
+    words[1] = hdr_get64h(&ip1[8]);
+    words[2] = hdr_get64h(&ip2[0]);
+    words[3] = hdr_get64h(&ip2[8]);
+    return 4;
+  }
+  words[0] = (((uint64_t)a46->u.u4.ip1)<<32) | a46->u.u4.ip2;
+  return 1;
+}
+
+static inline uint64_t ports_word(
+  uint16_t port1, uint16_t port2, uint32_t additional_bits)
+{
+  return (((uint64_t)port1)<<48) | (((uint64_t)port2)<<32) | additional_bits;
+}
+
+static uint32_t cookie_additional_bits(
+  struct conf *conf, uint16_t mss, uint8_t wscale, uint8_t sack_permitted)
+{
+  uint32_t wsbits;
+  uint32_t mssbits;
+  int i;
+  int wscnt = DYNARR_SIZE(&conf->wscalelist);
+  int msscnt = DYNARR_SIZE(&conf->msslist);
+  uint16_t *msstab = &DYNARR_GET(&conf->msslist, 0);
+  uint8_t *wstab = &DYNARR_GET(&conf->wscalelist, 0);
+  for (i = 0; i < wscnt; i++)
+  {
+    if (wstab[i] > wscale)
+    {
+      break;
+    }
+  }
+  i--;
+  wsbits = i;
+  for (i = 0; i < msscnt; i++)
+  {
+    if (msstab[i] > mss)
+    {
+      break;
+    }
+  }
+  if (i > 0)
+  {
+    i--;
+  }
+  mssbits = i;
+  sack_permitted = !!sack_permitted;
+  return
+      (((uint32_t)sack_permitted)<<(conf->wscalelist_bits+conf->msslist_bits))
+    | (mssbits<<conf->wscalelist_bits)
+    | wsbits;
+}
+
+static uint32_t timestamp_additional_bits(
+  struct conf *conf, uint32_t ts, uint16_t mss, uint8_t wscale)
+{
+  uint32_t wsbits;
+  uint32_t mssbits;
+  int i;
+  int wscnt = DYNARR_SIZE(&conf->tswscalelist);
+  int msscnt = DYNARR_SIZE(&conf->tsmsslist);
+  uint16_t *msstab = &DYNARR_GET(&conf->tsmsslist, 0);
+  uint8_t *wstab = &DYNARR_GET(&conf->tswscalelist, 0);
+  for (i = 0; i < wscnt; i++)
+  {
+    if (wstab[i] > wscale)
+    {
+      break;
+    }
+  }
+  i--;
+  wsbits = i;
+  for (i = 0; i < msscnt; i++)
+  {
+    if (msstab[i] > mss)
+    {
+      break;
+    }
+  }
+  if (i > 0)
+  {
+    i--;
+  }
+  mssbits = i;
+  return
+      (ts<<(conf->tswscalelist_bits+conf->tsmsslist_bits))
+    | (mssbits<<conf->tswscalelist_bits)
+    | wsbits;
+}
+
+static inline uint32_t timestamp_now(struct conf *conf)
+{
+  return (gettime64() % 32000000)*(1<<conf->ts_bits) / 32000000;
+}
 
 static int verify_cookie46(
   struct secretinfo *info,
@@ -89,38 +211,18 @@ static int verify_cookie46(
   uint32_t bitmask = ((1<<(32-total_bits))-1);
   uint32_t mssmask = ((1<<(conf->msslist_bits))-1);
   uint32_t wsmask = ((1<<(conf->wscalelist_bits))-1);
-  struct siphash_ctx ctx;
+  struct sipbatch_key key;
+  uint64_t words[6];
+  size_t cnt;
   uint32_t hash;
   uint16_t *msstab = &DYNARR_GET(&conf->msslist, 0);
   uint8_t *wstab = &DYNARR_GET(&conf->wscalelist, 0);
-  if (pthread_rwlock_rdlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  secret1 = info->secrets[isn>>31];
-  siphash_init(&ctx, secret1.data);
-  if (pthread_rwlock_unlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  if (a46->is6)
-  {
-    const char *ip1 = a46->u.u6.ip1;
-    const char *ip2 = a46->u.u6.ip2;
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[8]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[8]));
-  }
-  else
-  {
-    uint32_t ip1 = a46->u.u4.ip1;
-    uint32_t ip2 = a46->u.u4.ip2;
-    siphash_feed_u64(&ctx, (((uint64_t)ip1)<<32) | ip2);
-  }
-  siphash_feed_u64(&ctx, (((uint64_t)port1)<<48) | (((uint64_t)port2)<<32) | additional_bits);
-  siphash_feed_u64(&ctx, other_isn);
-  hash = siphash_get(&ctx) & bitmask;
+  secret_read(info, isn>>31, &secret1);
+  sipbatch_key_init(&key, secret1.data);
+  cnt = addr46_words(a46, words);
+  words[cnt++] = ports_word(port1, port2, additional_bits);
+  words[cnt++] = other_isn;
+  hash = sipbatch_hash1(&key, words, cnt) & bitmask;
   if (hash == (isn & bitmask))
   {
     if (wscale)
@@ -180,74 +282,21 @@ static uint32_t form_cookie46(
 {
   struct conf *conf = synproxy->conf;
   int total_bits = 1 + conf->msslist_bits + conf->wscalelist_bits + 1;
-  uint32_t wsbits;
-  uint32_t mssbits;
   uint32_t additional_bits;
-  int i;
   int current_secret;
   struct secret secret1;
-  struct siphash_ctx ctx;
+  struct sipbatch_key key;
+  uint64_t words[6];
+  size_t cnt;
   uint32_t hash;
-  int wscnt = DYNARR_SIZE(&synproxy->conf->wscalelist);
-  int msscnt = DYNARR_SIZE(&synproxy->conf->msslist);
-  uint16_t *msstab = &DYNARR_GET(&conf->msslist, 0);
-  uint8_t *wstab = &DYNARR_GET(&conf->wscalelist, 0);
   uint32_t bitmask = ((1<<(32-total_bits))-1);
-  for (i = 0; i < wscnt; i++)
-  {
-    if (wstab[i] > wscale)
-    {
-      break;
-    }
-  }
-  i--;
-  wsbits = i;
-  for (i = 0; i < msscnt; i++)
-  {
-    if (msstab[i] > mss)
-    {
-      break;
-    }
-  }
-  if (i > 0)
-  {
-    i--;
-  }
-  mssbits = i;
-  sack_permitted = !!sack_permitted;
-  additional_bits =
-      (sack_permitted<<(conf->wscalelist_bits+conf->msslist_bits))
-    | (mssbits<<conf->wscalelist_bits)
-    | wsbits;
-  if (pthread_rwlock_rdlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  current_secret = info->current_secret_index;
-  secret1 = info->secrets[current_secret];
-  siphash_init(&ctx, secret1.data);
-  if (pthread_rwlock_unlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  if (a46->is6)
-  {
-    const char *ip1 = a46->u.u6.ip1;
-    const char *ip2 = a46->u.u6.ip2;
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[8]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[8]));
-  }
-  else
-  {
-    uint32_t ip1 = a46->u.u4.ip1;
-    uint32_t ip2 = a46->u.u4.ip2;
-    siphash_feed_u64(&ctx, (((uint64_t)ip1)<<32) | ip2);
-  }
-  siphash_feed_u64(&ctx, (((uint64_t)port1)<<48) | (((uint64_t)port2)<<32) | additional_bits);
-  siphash_feed_u64(&ctx, other_isn);
-  hash = siphash_get(&ctx) & bitmask;
+  additional_bits = cookie_additional_bits(conf, mss, wscale, sack_permitted);
+  current_secret = secret_read(info, -1, &secret1);
+  sipbatch_key_init(&key, secret1.data);
+  cnt = addr46_words(a46, words);
+  words[cnt++] = ports_word(port1, port2, additional_bits);
+  words[cnt++] = other_isn;
+  hash = sipbatch_hash1(&key, words, cnt) & bitmask;
   return (current_secret<<31) | (additional_bits<<(32-total_bits)) | hash;
 }
 
@@ -297,37 +346,17 @@ static int verify_timestamp46(
   uint32_t bitmask = ((1<<(32-total_bits))-1);
   uint32_t mssmask = ((1<<(conf->msslist_bits))-1);
   uint32_t wsmask = ((1<<(conf->wscalelist_bits))-1);
-  struct siphash_ctx ctx;
+  struct sipbatch_key key;
+  uint64_t words[5];
+  size_t cnt;
   uint32_t hash;
   uint16_t *msstab = &DYNARR_GET(&conf->tsmsslist, 0);
   uint8_t *wstab = &DYNARR_GET(&conf->tswscalelist, 0);
-  if (pthread_rwlock_rdlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  secret1 = info->secrets[isn>>31];
-  siphash_init(&ctx, secret1.data);
-  if (pthread_rwlock_unlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  if (a46->is6)
-  {
-    const char *ip1 = a46->u.u6.ip1;
-    const char *ip2 = a46->u.u6.ip2;
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[8]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[8]));
-  }
-  else
-  {
-    uint32_t ip1 = a46->u.u4.ip1;
-    uint32_t ip2 = a46->u.u4.ip2;
-    siphash_feed_u64(&ctx, (((uint64_t)ip1)<<32) | ip2);
-  }
-  siphash_feed_u64(&ctx, (((uint64_t)port1)<<48) | (((uint64_t)port2)<<32) | additional_bits);
-  hash = siphash_get(&ctx) & bitmask;
+  secret_read(info, isn>>31, &secret1);
+  sipbatch_key_init(&key, secret1.data);
+  cnt = addr46_words(a46, words);
+  words[cnt++] = ports_word(port1, port2, additional_bits);
+  hash = sipbatch_hash1(&key, words, cnt) & bitmask;
   if (hash == (isn & bitmask))
   {
     if (wscale)
@@ -378,73 +407,21 @@ static uint32_t form_timestamp46(
   struct conf *conf = synproxy->conf;
   int total_bits =
     conf->ts_bits + conf->tsmsslist_bits + conf->tswscalelist_bits + 1;
-  uint32_t wsbits;
-  uint32_t mssbits;
   uint32_t additional_bits;
-  int i;
   int current_secret;
   struct secret secret1;
-  struct siphash_ctx ctx;
+  struct sipbatch_key key;
+  uint64_t words[5];
+  size_t cnt;
   uint32_t hash;
-  int wscnt = DYNARR_SIZE(&synproxy->conf->tswscalelist);
-  int msscnt = DYNARR_SIZE(&synproxy->conf->tsmsslist);
-  uint16_t *msstab = &DYNARR_GET(&conf->tsmsslist, 0);
-  uint8_t *wstab = &DYNARR_GET(&conf->tswscalelist, 0);
   uint32_t bitmask = ((1<<(32-total_bits))-1);
-  uint32_t ts = (gettime64() % 32000000)*(1<<conf->ts_bits) / 32000000;
-  for (i = 0; i < wscnt; i++)
-  {
-    if (wstab[i] > wscale)
-    {
-      break;
-    }
-  }
-  i--;
-  wsbits = i;
-  for (i = 0; i < msscnt; i++)
-  {
-    if (msstab[i] > mss)
-    {
-      break;
-    }
-  }
-  if (i > 0)
-  {
-    i--;
-  }
-  mssbits = i;
   additional_bits =
-      (ts<<(conf->tswscalelist_bits+conf->tsmsslist_bits))
-    | (mssbits<<conf->tswscalelist_bits)
-    | wsbits;
-  if (pthread_rwlock_rdlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  current_secret = info->current_secret_index;
-  secret1 = info->secrets[current_secret];
-  siphash_init(&ctx, secret1.data);
-  if (pthread_rwlock_unlock(&info->lock) != 0)
-  {
-    abort();
-  }
-  if (a46->is6)
-  {
-    const char *ip1 = a46->u.u6.ip1;
-    const char *ip2 = a46->u.u6.ip2;
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip1[8]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[0]));
-    siphash_feed_u64(&ctx, hdr_get64h(&ip2[8]));
-  }
-  else
-  {
-    uint32_t ip1 = a46->u.u4.ip1;
-    uint32_t ip2 = a46->u.u4.ip2;
-    siphash_feed_u64(&ctx, (((uint64_t)ip1)<<32) | ip2);
-  }
-  siphash_feed_u64(&ctx, (((uint64_t)port1)<<48) | (((uint64_t)port2)<<32) | additional_bits);
-  hash = siphash_get(&ctx) & bitmask;
+    timestamp_additional_bits(conf, timestamp_now(conf), mss, wscale);
+  current_secret = secret_read(info, -1, &secret1);
+  sipbatch_key_init(&key, secret1.data);
+  cnt = addr46_words(a46, words);
+  words[cnt++] = ports_word(port1, port2, additional_bits);
+  hash = sipbatch_hash1(&key, words, cnt) & bitmask;
   return (current_secret<<31) | (additional_bits<<(32-total_bits)) | hash;
 }
 
@@ -473,3 +450,97 @@ uint32_t form_timestamp6(
   a46.u.u6.ip2 = ip2;
   return form_timestamp46(info, synproxy, &a46, port1, port2, mss, wscale);
 }
+
+#define COOKIE_BATCH_MAX 64
+
+static void form_cookies_timestamps_chunk(
+  struct synproxy *synproxy, const struct sipbatch_key *key,
+  int current_secret, uint32_t ts_now,
+  struct cookie_request *reqs, size_t num, int is6)
+{
+  struct conf *conf = synproxy->conf;
+  int cookie_total_bits = 1 + conf->msslist_bits + conf->wscalelist_bits + 1;
+  int ts_total_bits =
+    conf->ts_bits + conf->tsmsslist_bits + conf->tswscalelist_bits + 1;
+  uint32_t cookie_bitmask = ((1<<(32-cookie_total_bits))-1);
+  uint32_t ts_bitmask = ((1<<(32-ts_total_bits))-1);
+  uint64_t cookie_words[6*COOKIE_BATCH_MAX];
+  uint64_t ts_words[5*COOKIE_BATCH_MAX];
+  uint64_t hashes[COOKIE_BATCH_MAX];
+  uint32_t cookie_bits[COOKIE_BATCH_MAX];
+  uint32_t ts_bits[COOKIE_BATCH_MAX];
+  size_t idx[COOKIE_BATCH_MAX];
+  size_t addrcnt = is6 ? 4 : 1;
+  size_t cnt = 0;
+  size_t i, w;
+  for (i = 0; i < num; i++)
+  {
+    if (reqs[i].a46.is6 == is6)
+    {
+      idx[cnt++] = i;
+    }
+  }
+  if (cnt == 0)
+  {
+    return;
+  }
+  // Word w of message i is at w*cnt + i
+  for (i = 0; i < cnt; i++)
+  {
+    struct cookie_request *req = &reqs[idx[i]];
+    uint64_t addrwords[4];
+    addr46_words(&req->a46, addrwords);
+    for (w = 0; w < addrcnt; w++)
+    {
+      cookie_words[w*cnt + i] = addrwords[w];
+      ts_words[w*cnt + i] = addrwords[w];
+    }
+    cookie_bits[i] = cookie_additional_bits(
+      conf, req->mss, req->wscale, req->sack_permitted);
+    ts_bits[i] = timestamp_additional_bits(conf, ts_now, req->mss, req->wscale);
+    cookie_words[addrcnt*cnt + i] =
+      ports_word(req->port1, req->port2, cookie_bits[i]);
+    cookie_words[(addrcnt+1)*cnt + i] = req->other_isn;
+    ts_words[addrcnt*cnt + i] = ports_word(req->port1, req->port2, ts_bits[i]);
+  }
+  sipbatch_hash(key, cookie_words, addrcnt + 2, hashes, cnt);
+  for (i = 0; i < cnt; i++)
+  {
+    reqs[idx[i]].cookie = (current_secret<<31)
+      | (cookie_bits[i]<<(32-cookie_total_bits))
+      | (hashes[i] & cookie_bitmask);
+  }
+  sipbatch_hash(key, ts_words, addrcnt + 1, hashes, cnt);
+  for (i = 0; i < cnt; i++)
+  {
+    reqs[idx[i]].ts = (current_secret<<31)
+      | (ts_bits[i]<<(32-ts_total_bits))
+      | (hashes[i] & ts_bitmask);
+  }
+}
+
+void form_cookies_timestamps(
+  struct secretinfo *info,
+  struct synproxy *synproxy,
+  struct cookie_request *reqs, size_t num)
+{
+  struct secret secret1;
+  struct sipbatch_key key;
+  int current_secret;
+  uint32_t ts_now = timestamp_now(synproxy->conf);
+  size_t off, cnt;
+  current_secret = secret_read(info, -1, &secret1);
+  sipbatch_key_init(&key, secret1.data);
+  for (off = 0; off < num; off += cnt)
+  {
+    cnt = num - off;
+    if (cnt > COOKIE_BATCH_MAX)
+    {
+      cnt = COOKIE_BATCH_MAX;
+    }
+    form_cookies_timestamps_chunk(
+      synproxy, &key, current_secret, ts_now, &reqs[off], cnt, 0);
+    form_cookies_timestamps_chunk(
+      synproxy, &key, current_secret, ts_now, &reqs[off], cnt, 1);
+  }
+}
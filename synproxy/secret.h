@@ -2,6 +2,8 @@
 #define _SECRET_H_
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "timerlink.h"
 #include "chacha.h"
 
@@ -11,11 +13,43 @@ struct secret {
   char data[16];
 };
 
+/*
+ * The secrets are read on every SYN and cookie ACK but change only every 32
+ * seconds, so readers use a sequence lock: they never write to shared memory
+ * and retry if a revolution happened during the read. There must be only one
+ * writer at a time, which is the thread running the revolve_secret timer.
+ */
 struct secretinfo {
-  struct secret secrets[2];
-  int current_secret_index;
+  _Atomic uint32_t seq; // odd while a secret is being written
+  _Atomic int current_secret_index;
+  _Atomic uint64_t secrets[2][2];
   struct chacha20_ctx chachactx;
-  pthread_rwlock_t lock;
+};
+
+struct addr46 {
+  int is6;
+  union {
+    struct {
+      uint32_t ip1;
+      uint32_t ip2;
+    } u4;
+    struct {
+      const void *ip1;
+      const void *ip2;
+    } u6;
+  } u;
+};
+
+struct cookie_request {
+  struct addr46 a46;
+  uint16_t port1;
+  uint16_t port2;
+  uint16_t mss;
+  uint8_t wscale;
+  uint8_t sack_permitted;
+  uint32_t other_isn;
+  uint32_t cookie; // output, same as form_cookie()
+  uint32_t ts; // output, same as form_timestamp()
 };
 
 void secret_init_deterministic(struct secretinfo *info);
@@ -79,4 +113,13 @@ uint32_t form_timestamp6(
   const void *ip1, const void *ip2, uint16_t port1, uint16_t port2,
   uint16_t mss, uint8_t wscale);
 
+/*
+ * Forms the SYN cookie and the timestamp for many SYNs at once, hashing
+ * several of them in parallel.
+ */
+void form_cookies_timestamps(
+  struct secretinfo *info,
+  struct synproxy *synproxy,
+  struct cookie_request *reqs, size_t num);
+
 #endif
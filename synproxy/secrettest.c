@@ -1,9 +1,213 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "timerlink.h"
 #include "secret.h"
 #include "synproxy.h"
 #include "conf.h"
 #include "yyutils.h"
+#include "time64.h"
+
+#define THR_TEST_THREADS 4
+#define THR_TEST_ROUNDS (1000*1000)
+
+struct thr_test {
+  struct secretinfo *info;
+  struct synproxy *synproxy;
+  atomic_int stop;
+};
+
+struct thr_test_args {
+  struct thr_test *test;
+  uint32_t ip;
+  uint64_t failures;
+};
+
+static void *verify_thr(void *arg)
+{
+  struct thr_test_args *args = arg;
+  struct thr_test *test = args->test;
+  uint32_t i;
+  for (i = 0; i < THR_TEST_ROUNDS; i++)
+  {
+    uint32_t seq = atomic_load(&test->info->seq);
+    uint32_t cookie = form_cookie(test->info, test->synproxy, args->ip, i,
+                                  12345, 80, 1460, 7, 1, i);
+    if (!verify_cookie(test->info, test->synproxy, args->ip, i, 12345, 80,
+                       cookie, NULL, NULL, NULL, i))
+    {
+      // Legitimate only if the secret was revolved twice in between
+      if (atomic_load(&test->info->seq) - seq < 4)
+      {
+        args->failures++;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void *revolve_thr(void *arg)
+{
+  struct thr_test *test = arg;
+  while (!atomic_load(&test->stop))
+  {
+    revolve_secret_impl(test->info);
+    usleep(100);
+  }
+  return NULL;
+}
+
+/*
+ * Forms and verifies cookies in several threads while another thread revolves
+ * the secret every 100 microseconds.
+ */
+static void thread_test(struct synproxy *synproxy, int threads)
+{
+  struct secretinfo info;
+  struct thr_test test = { .info = &info, .synproxy = synproxy };
+  struct thr_test_args args[THR_TEST_THREADS];
+  pthread_t thrs[THR_TEST_THREADS];
+  pthread_t revolver;
+  uint64_t begin, end;
+  int i;
+  secret_init_deterministic(&info);
+  atomic_store(&test.stop, 0);
+  pthread_create(&revolver, NULL, revolve_thr, &test);
+  begin = gettime64();
+  for (i = 0; i < threads; i++)
+  {
+    args[i].test = &test;
+    args[i].ip = i;
+    args[i].failures = 0;
+    pthread_create(&thrs[i], NULL, verify_thr, &args[i]);
+  }
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(thrs[i], NULL);
+  }
+  end = gettime64();
+  atomic_store(&test.stop, 1);
+  pthread_join(revolver, NULL);
+  for (i = 0; i < threads; i++)
+  {
+    if (args[i].failures)
+    {
+      log_log(LOG_LEVEL_ERR, "SECRETTEST",
+              "%d threads: %llu cookies failed", threads,
+              (unsigned long long)args[i].failures);
+      abort();
+    }
+  }
+  printf("%d threads: %g Mcookies/s\n", threads,
+         2.0*threads*THR_TEST_ROUNDS/(end - begin));
+}
+
+#define BATCH_TEST_SIZE 64
+#define BATCH_TEST_ROUNDS 20000
+
+/*
+ * Checks that batched cookies and timestamps equal the ones formed one at a
+ * time, and compares the speed.
+ */
+static void batch_test(struct synproxy *synproxy)
+{
+  struct secretinfo info;
+  struct cookie_request reqs[BATCH_TEST_SIZE];
+  char ipv6[BATCH_TEST_SIZE][2][16];
+  uint64_t begin, mid, end;
+  uint32_t sum = 0;
+  uint32_t tsmask =
+    ((1U<<synproxy->conf->ts_bits)-1) << (31-synproxy->conf->ts_bits);
+  int i, j, round;
+  secret_init_deterministic(&info);
+  for (i = 0; i < BATCH_TEST_SIZE; i++)
+  {
+    struct cookie_request *req = &reqs[i];
+    for (j = 0; j < 16; j++)
+    {
+      ipv6[i][0][j] = rand();
+      ipv6[i][1][j] = rand();
+    }
+    req->a46.is6 = (i % 4 == 0);
+    if (req->a46.is6)
+    {
+      req->a46.u.u6.ip1 = ipv6[i][0];
+      req->a46.u.u6.ip2 = ipv6[i][1];
+    }
+    else
+    {
+      req->a46.u.u4.ip1 = rand();
+      req->a46.u.u4.ip2 = rand();
+    }
+    req->port1 = rand();
+    req->port2 = rand();
+    req->mss = rand() % 1500;
+    req->wscale = rand() % 15;
+    req->sack_permitted = rand() % 2;
+    req->other_isn = rand();
+  }
+  form_cookies_timestamps(&info, synproxy, reqs, BATCH_TEST_SIZE);
+  for (i = 0; i < BATCH_TEST_SIZE; i++)
+  {
+    struct cookie_request *req = &reqs[i];
+    uint32_t cookie, ts;
+    if (req->a46.is6)
+    {
+      cookie = form_cookie6(&info, synproxy, ipv6[i][0], ipv6[i][1], req->port1, req->port2, req->mss, req->wscale, req->sack_permitted, req->other_isn);
+      ts = form_timestamp6(&info, synproxy, ipv6[i][0], ipv6[i][1], req->port1, req->port2, req->mss, req->wscale);
+    }
+    else
+    {
+      cookie = form_cookie(&info, synproxy, req->a46.u.u4.ip1, req->a46.u.u4.ip2, req->port1, req->port2, req->mss, req->wscale, req->sack_permitted, req->other_isn);
+      ts = form_timestamp(&info, synproxy, req->a46.u.u4.ip1, req->a46.u.u4.ip2, req->port1, req->port2, req->mss, req->wscale);
+    }
+    // Unless the timestamp ticked in between
+    if (cookie != req->cookie ||
+        (ts != req->ts && ((ts ^ req->ts) & tsmask) == 0))
+    {
+      log_log(LOG_LEVEL_ERR, "SECRETTEST", "batch cookie %d differs", i);
+      abort();
+    }
+  }
+
+  begin = gettime64();
+  for (round = 0; round < BATCH_TEST_ROUNDS; round++)
+  {
+    for (i = 0; i < BATCH_TEST_SIZE; i++)
+    {
+      struct cookie_request *req = &reqs[i];
+      req->other_isn = round;
+      if (req->a46.is6)
+      {
+        sum += form_cookie6(&info, synproxy, ipv6[i][0], ipv6[i][1], req->port1, req->port2, req->mss, req->wscale, req->sack_permitted, req->other_isn);
+        sum += form_timestamp6(&info, synproxy, ipv6[i][0], ipv6[i][1], req->port1, req->port2, req->mss, req->wscale);
+      }
+      else
+      {
+        sum += form_cookie(&info, synproxy, req->a46.u.u4.ip1, req->a46.u.u4.ip2, req->port1, req->port2, req->mss, req->wscale, req->sack_permitted, req->other_isn);
+        sum += form_timestamp(&info, synproxy, req->a46.u.u4.ip1, req->a46.u.u4.ip2, req->port1, req->port2, req->mss, req->wscale);
+      }
+    }
+  }
+  mid = gettime64();
+  for (round = 0; round < BATCH_TEST_ROUNDS; round++)
+  {
+    for (i = 0; i < BATCH_TEST_SIZE; i++)
+    {
+      reqs[i].other_isn = round;
+    }
+    form_cookies_timestamps(&info, synproxy, reqs, BATCH_TEST_SIZE);
+    for (i = 0; i < BATCH_TEST_SIZE; i++)
+    {
+      sum += reqs[i].cookie + reqs[i].ts;
+    }
+  }
+  end = gettime64();
+  printf("one at a time: %g MSYN/s, batched: %g MSYN/s (%u)\n",
+         1.0*BATCH_TEST_ROUNDS*BATCH_TEST_SIZE/(mid - begin),
+         1.0*BATCH_TEST_ROUNDS*BATCH_TEST_SIZE/(end - mid), sum);
+}
 
 int main(int argc, char **argv)
 {
@@ -20,6 +224,7 @@ int main(int argc, char **argv)
   struct secretinfo info;
   struct synproxy synproxy;
   struct conf conf = CONF_INITIALIZER;
+  int i;
   confyydirparse(argv[0], "conf.txt", &conf, 0);
   synproxy_init(&synproxy, &conf);
 
@@ -139,6 +344,13 @@ int main(int argc, char **argv)
   }
 
 
+  batch_test(&synproxy);
+
+  for (i = 1; i <= THR_TEST_THREADS; i++)
+  {
+    thread_test(&synproxy, i);
+  }
+
   synproxy_free(&synproxy);
   return 0;
 }
@@ -0,0 +1,58 @@
+#include "sipbatch.h"
+
+typedef uint64_t sipvec __attribute__((vector_size(8*SIPBATCH_LANES)));
+
+#if defined(__x86_64__)
+#define SIPBATCH_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIPBATCH_CLONES
+#endif
+
+SIPBATCH_CLONES
+static void sipbatch_hash_lanes(
+  const struct sipbatch_key *key, const uint64_t *words, size_t nwords,
+  size_t stride, uint64_t *out)
+{
+  sipvec v0 = {0}, v1 = {0}, v2 = {0}, v3 = {0};
+  uint64_t b = ((uint64_t)(8*nwords)) << 56;
+  size_t w;
+  v0 += key->k0 ^ 0x736f6d6570736575ULL;
+  v1 += key->k1 ^ 0x646f72616e646f6dULL;
+  v2 += key->k0 ^ 0x6c7967656e657261ULL;
+  v3 += key->k1 ^ 0x7465646279746573ULL;
+  for (w = 0; w < nwords; w++)
+  {
+    sipvec m;
+    memcpy(&m, &words[w*stride], sizeof(m));
+    v3 ^= m;
+    SIPBATCH_ROUND(v0, v1, v2, v3);
+    SIPBATCH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  v3 ^= b;
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  v0 ^= v1 ^ v2 ^ v3;
+  memcpy(out, &v0, sizeof(v0));
+}
+
+void sipbatch_hash(
+  const struct sipbatch_key *key, const uint64_t *words, size_t nwords,
+  uint64_t *out, size_t n)
+{
+  size_t i = 0;
+  for (; i + SIPBATCH_LANES <= n; i += SIPBATCH_LANES)
+  {
+    sipbatch_hash_lanes(key, &words[i], nwords, n, &out[i]);
+  }
+  for (; i < n; i++)
+  {
+    out[i] = sipbatch_hash_stride(key, &words[i], nwords, n);
+  }
+}
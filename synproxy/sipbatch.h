@@ -0,0 +1,90 @@
+#ifndef _SIPBATCH_H_
+#define _SIPBATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * SipHash-2-4 of messages made of 64-bit words. Word w is hashed as its 8
+ * little-endian bytes, so the result is standard SipHash-2-4 of 8*nwords
+ * bytes.
+ *
+ * sipbatch_hash() hashes many messages with the same key, SIPBATCH_LANES at a
+ * time in vector registers, using AVX-512 or AVX2 if the CPU has them.
+ */
+
+#define SIPBATCH_LANES 8
+
+struct sipbatch_key {
+  uint64_t k0;
+  uint64_t k1;
+};
+
+#define SIPBATCH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPBATCH_ROUND(v0, v1, v2, v3) \
+  do { \
+    v0 += v1; v1 = SIPBATCH_ROTL(v1, 13); v1 ^= v0; v0 = SIPBATCH_ROTL(v0, 32); \
+    v2 += v3; v3 = SIPBATCH_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIPBATCH_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIPBATCH_ROTL(v1, 17); v1 ^= v2; v2 = SIPBATCH_ROTL(v2, 32); \
+  } while (0)
+
+static inline void sipbatch_key_init(struct sipbatch_key *key, const void *data)
+{
+  uint64_t k[2];
+  memcpy(k, data, sizeof(k));
+  key->k0 = le64toh(k[0]);
+  key->k1 = le64toh(k[1]);
+}
+
+/*
+ * Hashes words[0], words[stride], ..., words[(nwords-1)*stride].
+ */
+static inline uint64_t sipbatch_hash_stride(
+  const struct sipbatch_key *key, const uint64_t *words, size_t nwords,
+  size_t stride)
+{
+  uint64_t v0 = key->k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key->k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key->k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key->k1 ^ 0x7465646279746573ULL;
+  uint64_t b = ((uint64_t)(8*nwords)) << 56;
+  size_t w;
+  for (w = 0; w < nwords; w++)
+  {
+    uint64_t m = words[w*stride];
+    v3 ^= m;
+    SIPBATCH_ROUND(v0, v1, v2, v3);
+    SIPBATCH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  v3 ^= b;
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  SIPBATCH_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline uint64_t sipbatch_hash1(
+  const struct sipbatch_key *key, const uint64_t *words, size_t nwords)
+{
+  return sipbatch_hash_stride(key, words, nwords, 1);
+}
+
+/*
+ * words[w*n + i] is word w of message i. The hash of message i is stored to
+ * out[i].
+ */
+void sipbatch_hash(
+  const struct sipbatch_key *key, const uint64_t *words, size_t nwords,
+  uint64_t *out, size_t n);
+
+#endif
@@ -1,8 +1,36 @@
 #include "synproxy.h"
 #include <stdio.h>
+#include <stddef.h>
+
+#define FIELD(field) \
+  printf("  %-24s offset %3zu line %zu\n", #field, \
+         offsetof(struct synproxy_hash_entry, field), \
+         offsetof(struct synproxy_hash_entry, field) / 64)
 
 int main(int argc, char **argv)
 {
-  printf("%zu\n", sizeof(struct synproxy_hash_entry));
+  printf("synproxy_hash_entry %zu\n", sizeof(struct synproxy_hash_entry));
+  printf("synproxy_hash_cold %zu\n", sizeof(struct synproxy_hash_cold));
+  FIELD(node);
+  FIELD(local_ip);
+  FIELD(remote_ip);
+  FIELD(local_port);
+  FIELD(remote_port);
+  FIELD(flag_state);
+  FIELD(version);
+  FIELD(wscalediff);
+  FIELD(seqoffset);
+  FIELD(tsoffset);
+  FIELD(lan_sent);
+  FIELD(wan_max);
+  FIELD(lan_max_window_unscaled);
+  FIELD(wan_max_window_unscaled);
+  FIELD(lan_wscale);
+  FIELD(lan_sack_was_supported);
+  FIELD(timer);
+  FIELD(timer.time64);
+  FIELD(ulflowlabel);
+  FIELD(established);
+  FIELD(cold);
   return 0;
 }
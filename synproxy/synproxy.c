@@ -3,7 +3,10 @@
 #include "branchpredict.h"
 #include <sys/time.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include "time64.h"
+#include "replicate.h"
+#include "dispatch.h"
 
 #define MAX_FRAG 65535
 #define IPV6_FRAG_CUTOFF 512
@@ -364,15 +367,39 @@ static inline int resend_request_is_valid(uint32_t seq, uint32_t ref_seq)
   return diff >= -3;
 }
 
+/*
+ * Sends the entry to the standby, if any. Entries in handshake aren't
+ * replicated.
+ */
+static inline void synproxy_replicate(
+  struct worker_local *local, struct synproxy_hash_entry *e,
+  enum replicate_type type)
+{
+  if (local->repl == NULL || e->cold != NULL)
+  {
+    return;
+  }
+  replicate_ring_put(local->repl, type, e, gettime64());
+}
+
 // caller must not have worker_local lock
 // caller must not have bucket lock
 static void synproxy_expiry_fn(
-  struct timer_link *timer, struct timer_linkheap *heap, void *ud)
+  struct worker_local *local, struct synproxy_hash_entry *e)
 {
-  struct worker_local *local = ud;
-  struct synproxy_hash_entry *e;
-  e = CONTAINER_OF(timer, struct synproxy_hash_entry, timer);
-  hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
+  uint32_t hashval = 0;
+  // Under the bucket lock, the delete is ordered with the other events
+  if (!local->tagged)
+  {
+    hashval = synproxy_hash(e);
+    hash_table_lock_bucket(&local->hash, hashval);
+  }
+  synproxy_replicate(local, e, REPLICATE_DELETE);
+  synproxy_conntable_delete(local, e, 1);
+  if (!local->tagged)
+  {
+    hash_table_unlock_bucket(&local->hash, hashval);
+  }
   worker_local_wrlock(local);
   if (e->was_synproxied)
   {
@@ -384,11 +411,191 @@ static void synproxy_expiry_fn(
   }
   if (e->flag_state == FLAG_STATE_DOWNLINK_HALF_OPEN)
   {
-    linked_list_delete(&e->state_data.downlink_half_open.listnode);
+    linked_list_delete(&e->cold->state_data.downlink_half_open.listnode);
     local->half_open_connections--;
   }
   worker_local_wrunlock(local);
-  free(e);
+  synproxy_hash_entry_free(local, e);
+}
+
+#define HALFOPEN_MIN_SYNS 64
+#define HALFOPEN_MIN_LIMIT 16
+
+static void halfopen_adapt(struct halfopen_ctrl *ctrl)
+{
+  uint32_t syns, completions, limit;
+  syns = atomic_exchange_explicit(&ctrl->syns, 0, memory_order_relaxed);
+  completions =
+    atomic_exchange_explicit(&ctrl->completions, 0, memory_order_relaxed);
+  limit = atomic_load_explicit(&ctrl->limit, memory_order_relaxed);
+  ctrl->flood = (syns >= HALFOPEN_MIN_SYNS &&
+                 2*(uint64_t)completions < syns);
+  if (ctrl->adaptive && ctrl->flood)
+  {
+    limit /= 2;
+    if (limit < HALFOPEN_MIN_LIMIT)
+    {
+      limit = 0;
+    }
+  }
+  else if (ctrl->adaptive && limit < ctrl->max)
+  {
+    limit = (limit < HALFOPEN_MIN_LIMIT/2) ? HALFOPEN_MIN_LIMIT : 2*limit;
+    if (limit > ctrl->max)
+    {
+      limit = ctrl->max;
+    }
+  }
+  atomic_store_explicit(&ctrl->limit, limit, memory_order_relaxed);
+  ctrl->last_syns = syns;
+  ctrl->last_completions = completions;
+}
+
+/*
+ * Deletes the oldest half-open connection if there are more than the limit.
+ * The bucket lock goes before the worker_local lock, so the entry is looked
+ * up again with both held. Returns -ENOENT if nothing was deleted.
+ */
+static int halfopen_evict_oldest(struct worker_local *local)
+{
+  struct synproxy_hash_entry key;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_cold *cold;
+  struct synproxy_hash_ctx ctx;
+  worker_local_wrlock(local);
+  if (linked_list_is_empty(&local->half_open_list))
+  {
+    worker_local_wrunlock(local);
+    return -ENOENT;
+  }
+  cold = CONTAINER_OF(
+           local->half_open_list.node.next, struct synproxy_hash_cold,
+           state_data.downlink_half_open.listnode);
+  e = cold->entry;
+  key.version = e->version;
+  key.local_ip = e->local_ip;
+  key.remote_ip = e->remote_ip;
+  key.local_port = e->local_port;
+  key.remote_port = e->remote_port;
+  worker_local_wrunlock(local);
+
+  ctx.locked = 0;
+  e = synproxy_hash_get(local, key.version, &key.local_ip, key.local_port,
+                        &key.remote_ip, key.remote_port, &ctx);
+  worker_local_wrlock(local);
+  if (e == NULL || e->flag_state != FLAG_STATE_DOWNLINK_HALF_OPEN ||
+      local->half_open_connections <=
+        atomic_load_explicit(&local->halfopen.limit, memory_order_relaxed))
+  {
+    worker_local_wrunlock(local);
+    synproxy_hash_unlock(local, &ctx);
+    return -ENOENT;
+  }
+  linked_list_delete(&e->cold->state_data.downlink_half_open.listnode);
+  local->half_open_connections--;
+  local->synproxied_connections--;
+  timer_wheel_remove(&local->conntimers, &e->timer);
+  synproxy_conntable_delete(local, e, 1);
+  worker_local_wrunlock(local);
+  synproxy_hash_unlock(local, &ctx);
+  synproxy_hash_entry_free(local, e);
+  return 0;
+}
+
+void synproxy_halfopen_adapt_fn(
+  struct timer_link *timer, struct timer_linkheap *heap, void *ud)
+{
+  struct worker_local *local = ud;
+  uint32_t limit;
+  uint32_t excess = 0;
+  worker_local_wrlock(local);
+  halfopen_adapt(&local->halfopen);
+  timer->time64 += HALFOPEN_WINDOW_USEC;
+  timer_linkheap_add(heap, timer);
+  limit = atomic_load_explicit(&local->halfopen.limit, memory_order_relaxed);
+  if (local->half_open_connections > limit)
+  {
+    excess = local->half_open_connections - limit;
+  }
+  worker_local_wrunlock(local);
+  // Give the memory of the oldest entries over the new limit back now
+  while (excess > 0 && halfopen_evict_oldest(local) == 0)
+  {
+    excess--;
+  }
+}
+
+/*
+ * The wheel is advanced from a heap timer that is armed only while the wheel
+ * has timers.
+ */
+void synproxy_wheel_fn(
+  struct timer_link *timer, struct timer_linkheap *heap, void *ud)
+{
+  struct worker_local *local = ud;
+  struct timer_wheel_link *expired;
+  worker_local_wrlock(local);
+  expired = timer_wheel_advance(&local->conntimers, timer->time64);
+  if (local->conntimers.count > 0)
+  {
+    timer->time64 += TIMER_WHEEL_TICK;
+    timer_linkheap_add(heap, timer);
+  }
+  else
+  {
+    local->wheel_timer_armed = 0;
+  }
+  worker_local_wrunlock(local);
+  while (expired)
+  {
+    struct timer_wheel_link *link = expired;
+    expired = link->next;
+    synproxy_expiry_fn(
+      local, CONTAINER_OF(link, struct synproxy_hash_entry, timer));
+  }
+}
+
+// Caller must hold worker_local mutex lock
+static void synproxy_timer_add(
+  struct worker_local *local, struct synproxy_hash_entry *e, uint64_t time64)
+{
+  if (!local->wheel_timer_armed)
+  {
+    timer_wheel_set_time(&local->conntimers, time64);
+    local->wheel_timer.time64 = time64 + TIMER_WHEEL_TICK;
+    timer_linkheap_add(&local->timers, &local->wheel_timer);
+    local->wheel_timer_armed = 1;
+  }
+  timer_wheel_add(&local->conntimers, &e->timer);
+}
+
+/*
+ * Sets a new timeout for an entry in the connection table. Moving the timeout
+ * later, as every packet of an established connection does, needs only the
+ * bucket lock, and isn't replicated: the periodic walk of the tables updates
+ * the timeouts of the standby.
+ */
+// caller must not have worker_local lock
+// caller must have bucket lock
+static void synproxy_timer_refresh(
+  struct worker_local *local, struct synproxy_hash_entry *e, uint64_t next64)
+{
+  uint64_t old64 = timer_wheel_time(&e->timer);
+  if (next64 >= old64)
+  {
+    if (next64 - old64 >= 1000*1000)
+    {
+      timer_wheel_touch(&e->timer, next64);
+    }
+    return;
+  }
+  if (old64 - next64 >= 1000*1000)
+  {
+    worker_local_wrlock(local);
+    timer_wheel_modify(&local->conntimers, &e->timer, next64);
+    worker_local_wrunlock(local);
+    synproxy_replicate(local, e, REPLICATE_UPDATE);
+  }
 }
 
 static inline int seq_cmp(uint32_t x, uint32_t y)
@@ -444,12 +651,11 @@ struct synproxy_hash_entry *synproxy_hash_put(
   {
     return NULL;
   }
-  e = malloc(sizeof(*e));
+  e = synproxy_hash_entry_alloc(local);
   if (e == NULL)
   {
     return NULL;
   }
-  memset(e, 0, sizeof(*e));
   e->version = version;
   memcpy(&e->local_ip, local_ip, (version == 4) ? 4 : 16);
   memcpy(&e->remote_ip, remote_ip, (version == 4) ? 4 : 16);
@@ -457,12 +663,16 @@ struct synproxy_hash_entry *synproxy_hash_put(
   e->remote_port = remote_port;
   e->was_synproxied = was_synproxied;
   e->timer.time64 = time64 + 86400ULL*1000ULL*1000ULL;
-  e->timer.fn = synproxy_expiry_fn;
-  e->timer.userdata = local;
   worker_local_wrlock(local);
-  timer_linkheap_add(&local->timers, &e->timer);
-  hash_table_add_nogrow_already_bucket_locked(
-    &local->hash, &e->node, synproxy_hash(e));
+  synproxy_timer_add(local, e, time64);
+  if (synproxy_conntable_add(local, e, 1) != 0)
+  {
+    timer_wheel_remove(&local->conntimers, &e->timer);
+    worker_local_wrunlock(local);
+    entrypool_put(&local->entrypool, e);
+    log_log(LOG_LEVEL_ERR, "WORKER", "conn table full");
+    return NULL;
+  }
   if (was_synproxied)
   {
     local->synproxied_connections++;
@@ -475,6 +685,207 @@ struct synproxy_hash_entry *synproxy_hash_put(
   return e;
 }
 
+int synproxy_hash_put_restored(
+  struct worker_local *local, const struct synproxy_hash_entry *saved,
+  uint64_t time64)
+{
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  ctx.locked = 0;
+  if (synproxy_hash_get(local, saved->version, &saved->local_ip,
+                        saved->local_port, &saved->remote_ip,
+                        saved->remote_port, &ctx))
+  {
+    synproxy_hash_unlock(local, &ctx);
+    return -EEXIST;
+  }
+  e = synproxy_hash_entry_alloc(local);
+  if (e == NULL)
+  {
+    synproxy_hash_unlock(local, &ctx);
+    return -ENOMEM;
+  }
+  *e = *saved;
+  memset(&e->node, 0, sizeof(e->node));
+  e->timer.next = NULL;
+  e->timer.pprev = NULL;
+  e->cold = NULL;
+  worker_local_wrlock(local);
+  synproxy_timer_add(local, e, time64);
+  if (synproxy_conntable_add(local, e, 1) != 0)
+  {
+    timer_wheel_remove(&local->conntimers, &e->timer);
+    worker_local_wrunlock(local);
+    synproxy_hash_unlock(local, &ctx);
+    entrypool_put(&local->entrypool, e);
+    return -ENOSPC;
+  }
+  if (e->was_synproxied)
+  {
+    local->synproxied_connections++;
+  }
+  else
+  {
+    local->direct_connections++;
+  }
+  worker_local_wrunlock(local);
+  synproxy_hash_unlock(local, &ctx);
+  return 0;
+}
+
+int synproxy_hash_put_replicated(
+  struct worker_local *local, const struct synproxy_hash_entry *saved,
+  uint64_t time64)
+{
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  ctx.locked = 0;
+  e = synproxy_hash_get(local, saved->version, &saved->local_ip,
+                        saved->local_port, &saved->remote_ip,
+                        saved->remote_port, &ctx);
+  if (e == NULL)
+  {
+    synproxy_hash_unlock(local, &ctx);
+    return synproxy_hash_put_restored(local, saved, time64);
+  }
+  if (e->cold != NULL)
+  {
+    synproxy_hash_unlock(local, &ctx);
+    return -EBUSY;
+  }
+  e->flag_state = saved->flag_state;
+  e->wscalediff = saved->wscalediff;
+  e->seqoffset = saved->seqoffset;
+  e->tsoffset = saved->tsoffset;
+  e->lan_sent = saved->lan_sent;
+  e->wan_sent = saved->wan_sent;
+  e->lan_acked = saved->lan_acked;
+  e->wan_acked = saved->wan_acked;
+  e->lan_max = saved->lan_max;
+  e->wan_max = saved->wan_max;
+  e->lan_max_window_unscaled = saved->lan_max_window_unscaled;
+  e->wan_max_window_unscaled = saved->wan_max_window_unscaled;
+  e->lan_wscale = saved->lan_wscale;
+  e->wan_wscale = saved->wan_wscale;
+  e->lan_sack_was_supported = saved->lan_sack_was_supported;
+  e->ulflowlabel = saved->ulflowlabel;
+  e->dlflowlabel = saved->dlflowlabel;
+  e->established = saved->established;
+  worker_local_wrlock(local);
+  timer_wheel_modify(&local->conntimers, &e->timer,
+                     timer_wheel_time(&saved->timer));
+  worker_local_wrunlock(local);
+  synproxy_hash_unlock(local, &ctx);
+  return 0;
+}
+
+void synproxy_hash_del_replicated(
+  struct worker_local *local, const struct synproxy_hash_entry *saved)
+{
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  ctx.locked = 0;
+  e = synproxy_hash_get(local, saved->version, &saved->local_ip,
+                        saved->local_port, &saved->remote_ip,
+                        saved->remote_port, &ctx);
+  if (e == NULL || e->cold != NULL ||
+      timer_wheel_time(&e->timer) >
+        timer_wheel_time(&saved->timer) + 1000*1000)
+  {
+    synproxy_hash_unlock(local, &ctx);
+    return;
+  }
+  synproxy_conntable_delete(local, e, 1);
+  worker_local_wrlock(local);
+  timer_wheel_remove(&local->conntimers, &e->timer);
+  if (e->was_synproxied)
+  {
+    local->synproxied_connections--;
+  }
+  else
+  {
+    local->direct_connections--;
+  }
+  worker_local_wrunlock(local);
+  synproxy_hash_unlock(local, &ctx);
+  synproxy_hash_entry_free(local, e);
+}
+
+int synproxy_hash_peek(
+  struct worker_local *local, int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip,
+  uint16_t remote_port, struct synproxy_hash_entry *out)
+{
+  struct synproxy_hash_key key = {
+    .version = version,
+    .local_ip = local_ip,
+    .remote_ip = remote_ip,
+    .local_port = local_port,
+    .remote_port = remote_port,
+  };
+  struct synproxy_hash_entry *e = NULL;
+  struct hash_list_node *node;
+  uint32_t hashval;
+  int steps = 0;
+  hashval = synproxy_hash_separate46(
+    version, local_ip, local_port, remote_ip, remote_port);
+  if (local->tagged)
+  {
+    e = flowtable_get(&local->flowtable, hashval, synproxy_hash_key_eq, &key);
+  }
+  else
+  {
+    HASH_TABLE_FOR_EACH_POSSIBLE(&local->hash, node, hashval)
+    {
+      struct synproxy_hash_entry *entry;
+      entry = CONTAINER_OF(node, struct synproxy_hash_entry, node);
+      if (synproxy_hash_key_eq(entry, &key))
+      {
+        e = entry;
+        break;
+      }
+      // A chain changing meanwhile could be walked for long
+      if (++steps >= 1024)
+      {
+        break;
+      }
+    }
+  }
+  if (e == NULL)
+  {
+    return -ENOENT;
+  }
+  memcpy(out, e, sizeof(*out));
+  atomic_thread_fence(memory_order_acquire);
+  if (!synproxy_hash_key_eq(out, &key) || !synproxy_hash_key_eq(e, &key))
+  {
+    return -ENOENT;
+  }
+  return 0;
+}
+
+void synproxy_put_test_connections(
+  struct worker_local *local, int num_local, int dispatched)
+{
+  int i, j;
+  for (j = 0; j < 90*6; j++)
+  {
+    uint32_t src, dst;
+    src = htonl((10<<24)|(2*j+2));
+    dst = htonl((11<<24)|(2*j+1));
+    for (i = 0; i < num_local; i++)
+    {
+      if (dispatched &&
+          dispatch_hash_flow(4, &src, 12345, &dst, 54321) % num_local != i)
+      {
+        continue;
+      }
+      synproxy_hash_put_connected(
+        &local[i], 4, &src, 12345, &dst, 54321,
+        gettime64());
+    }
+  }
+}
 
 uint32_t synproxy_hash_fn(struct hash_list_node *node, void *userdata)
 {
@@ -499,8 +910,9 @@ static void delete_closing_already_bucket_locked(
   }
   log_log(LOG_LEVEL_NOTICE, "SYNPROXY",
           "deleting closing connection to make room for new");
-  timer_linkheap_remove(&local->timers, &entry->timer);
-  hash_table_delete_already_bucket_locked(&local->hash, &entry->node);
+  synproxy_replicate(local, entry, REPLICATE_DELETE);
+  timer_wheel_remove(&local->conntimers, &entry->timer);
+  synproxy_conntable_delete(local, entry, 1);
   worker_local_wrlock(local);
   if (entry->was_synproxied)
   {
@@ -511,15 +923,20 @@ static void delete_closing_already_bucket_locked(
     local->direct_connections--;
   }
   worker_local_wrunlock(local);
-  free(entry);
+  synproxy_hash_entry_free(local, entry);
   entry = NULL;
 }
 
 
-// Caller must hold worker_local mutex lock
+// Caller must not have worker_local lock
+/*
+ * cookie has the SYN cookie and timestamp formed beforehand by the burst
+ * functions, or NULL.
+ */
 static void send_synack(
   void *orig, struct worker_local *local, struct synproxy *synproxy,
-  struct port *port, struct ll_alloc_st *st, uint64_t time64)
+  struct port *port, struct ll_alloc_st *st, uint64_t time64,
+  const struct cookie_request *cookie)
 {
   char synack[14+40+20+12+12] = {0};
   void *ip, *origip;
@@ -549,7 +966,12 @@ static void send_synack(
     log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "options in TCP SYN invalid");
     return;
   }
-  if (version == 4)
+  if (cookie != NULL)
+  {
+    syn_cookie = cookie->cookie;
+    ts = cookie->ts;
+  }
+  else if (version == 4)
   {
     syn_cookie = form_cookie(
       &local->info, synproxy, ip_dst(origip), ip_src(origip),
@@ -774,11 +1196,14 @@ static void send_synack(
   memcpy(pktstruct->data, synack, sz);
   port->portfunc(pktstruct, port->userdata);
 
-  if (synproxy->conf->halfopen_cache_max)
+  halfopen_ctrl_syn(&local->halfopen);
+  if (atomic_load_explicit(&local->halfopen.limit, memory_order_relaxed))
   {
     struct synproxy_hash_entry *e;
     struct synproxy_hash_entry *e2;
+    struct synproxy_hash_cold *cold;
     struct synproxy_hash_ctx ctx;
+    uint32_t limit;
     ctx.locked = 0;
     e2 = synproxy_hash_get(local, version,
                            local_ip, local_port, remote_ip, remote_port,
@@ -800,42 +1225,58 @@ static void send_synack(
       }
     }
     worker_local_wrlock(local);
-    if (local->half_open_connections >= synproxy->conf->halfopen_cache_max)
+    // The limit may have changed since it was read without the lock
+    limit = atomic_load_explicit(&local->halfopen.limit, memory_order_relaxed);
+    if (limit == 0)
+    {
+      worker_local_wrunlock(local);
+      synproxy_hash_unlock(local, &ctx);
+      return;
+    }
+    if (local->half_open_connections >= limit &&
+        !linked_list_is_empty(&local->half_open_list))
     {
       struct linked_list_node *node = local->half_open_list.node.next;
       uint32_t hashval;
-      e = CONTAINER_OF(
-            node, struct synproxy_hash_entry,
-            state_data.downlink_half_open.listnode);
+      cold = CONTAINER_OF(
+               node, struct synproxy_hash_cold,
+               state_data.downlink_half_open.listnode);
+      e = cold->entry;
       hashval = synproxy_hash(e);
-      linked_list_delete(&e->state_data.downlink_half_open.listnode);
-      timer_linkheap_remove(&local->timers, &e->timer);
+      linked_list_delete(&e->cold->state_data.downlink_half_open.listnode);
+      timer_wheel_remove(&local->conntimers, &e->timer);
       if (ctx.hashval == hashval)
       {
-        hash_table_delete_already_bucket_locked(&local->hash, &e->node);
+        synproxy_conntable_delete(local, e, 1);
       }
       else
       {
         // Prevent lock order reversal
         worker_local_wrunlock(local);
-        hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
+        synproxy_conntable_delete(local, e, 0);
         worker_local_wrlock(local);
       }
     }
     else
     {
-      local->half_open_connections++;
-      local->synproxied_connections++;
-      e = malloc(sizeof(*e));
-      if (e == NULL)
+      e = synproxy_hash_entry_alloc(local);
+      cold = synproxy_hash_cold_alloc(local);
+      if (e == NULL || cold == NULL)
       {
         worker_local_wrunlock(local);
         synproxy_hash_unlock(local, &ctx);
+        entrypool_put(&local->entrypool, e);
+        entrypool_put(&local->coldpool, cold);
         log_log(LOG_LEVEL_ERR, "WORKER", "out of memory");
         return;
       }
+      local->half_open_connections++;
+      local->synproxied_connections++;
     }
     memset(e, 0, sizeof(*e));
+    memset(cold, 0, sizeof(*cold));
+    e->cold = cold;
+    cold->entry = e;
     e->version = version;
     memcpy(&e->local_ip, local_ip, (version == 6) ? 16 : 4);
     memcpy(&e->remote_ip, remote_ip, (version == 6) ? 16 : 4);
@@ -843,18 +1284,27 @@ static void send_synack(
     e->remote_port = remote_port;
     e->was_synproxied = 1;
     e->timer.time64 = time64 + 64ULL*1000ULL*1000ULL;
-    e->timer.fn = synproxy_expiry_fn;
-    e->timer.userdata = local;
-    timer_linkheap_add(&local->timers, &e->timer);
-    hash_table_add_nogrow(&local->hash, &e->node, synproxy_hash(e));
+    synproxy_timer_add(local, e, time64);
+    if (synproxy_conntable_add(local, e, 0) != 0)
+    {
+      // Can't happen after eviction, the evicted entry made room
+      timer_wheel_remove(&local->conntimers, &e->timer);
+      local->half_open_connections--;
+      local->synproxied_connections--;
+      worker_local_wrunlock(local);
+      synproxy_hash_unlock(local, &ctx);
+      synproxy_hash_entry_free(local, e);
+      log_log(LOG_LEVEL_ERR, "WORKER", "conn table full");
+      return;
+    }
     linked_list_add_tail(
-      &e->state_data.downlink_half_open.listnode, &local->half_open_list);
+      &e->cold->state_data.downlink_half_open.listnode, &local->half_open_list);
     e->flag_state = FLAG_STATE_DOWNLINK_HALF_OPEN;
-    e->state_data.downlink_half_open.wscale = tcpinfo.wscale;
-    e->state_data.downlink_half_open.mss = tcpinfo.mss;
-    e->state_data.downlink_half_open.sack_permitted = tcpinfo.sack_permitted;
-    e->state_data.downlink_half_open.remote_isn = tcp_seq_number(origtcp);
-    e->state_data.downlink_half_open.local_isn = syn_cookie;
+    e->cold->state_data.downlink_half_open.wscale = tcpinfo.wscale;
+    e->cold->state_data.downlink_half_open.mss = tcpinfo.mss;
+    e->cold->state_data.downlink_half_open.sack_permitted = tcpinfo.sack_permitted;
+    e->cold->state_data.downlink_half_open.remote_isn = tcp_seq_number(origtcp);
+    e->cold->state_data.downlink_half_open.local_isn = syn_cookie;
     if (e->version == 6)
     {
       e->ulflowlabel = gen_flowlabel_entry(e);
@@ -906,7 +1356,7 @@ static void send_or_resend_syn(
   tcp_set_dst_port(tcp, tcp_dst_port(origtcp));
   tcp_set_syn_on(tcp);
   tcp_set_data_offset(tcp, sizeof(syn) - 14 - 40);
-  tcp_set_seq_number(tcp, entry->state_data.downlink_syn_sent.remote_isn);
+  tcp_set_seq_number(tcp, entry->cold->state_data.downlink_syn_sent.remote_isn);
   tcp_set_ack_number(tcp, 0);
   tcp_set_window(tcp, tcp_window(origtcp));
   tcpopts = &((unsigned char*)tcp)[20];
@@ -922,12 +1372,12 @@ static void send_or_resend_syn(
   tcpopts[3] = 1;
   tcpopts[4] = 2;
   tcpopts[5] = 4;
-  hdr_set16n(&tcpopts[6], entry->state_data.downlink_syn_sent.mss);
-  if (entry->state_data.downlink_syn_sent.sack_permitted)
+  hdr_set16n(&tcpopts[6], entry->cold->state_data.downlink_syn_sent.mss);
+  if (entry->cold->state_data.downlink_syn_sent.sack_permitted)
   {
     tcpopts[8] = 4;
     tcpopts[9] = 2;
-    if (entry->state_data.downlink_syn_sent.timestamp_present)
+    if (entry->cold->state_data.downlink_syn_sent.timestamp_present)
     {
       tcpopts[10] = 1;
       tcpopts[11] = 1;
@@ -938,7 +1388,7 @@ static void send_or_resend_syn(
       tcpopts[11] = 0;
     }
   }
-  else if (entry->state_data.downlink_syn_sent.timestamp_present)
+  else if (entry->cold->state_data.downlink_syn_sent.timestamp_present)
   {
     tcpopts[8] = 1;
     tcpopts[9] = 1;
@@ -952,14 +1402,14 @@ static void send_or_resend_syn(
     tcpopts[10] = 0;
     tcpopts[11] = 0;
   }
-  if (entry->state_data.downlink_syn_sent.timestamp_present)
+  if (entry->cold->state_data.downlink_syn_sent.timestamp_present)
   {
     tcpopts[12] = 1;
     tcpopts[13] = 1;
     tcpopts[14] = 8;
     tcpopts[15] = 10;
     hdr_set32n(&tcpopts[16],
-      entry->state_data.downlink_syn_sent.remote_timestamp);
+      entry->cold->state_data.downlink_syn_sent.remote_timestamp);
     hdr_set32n(&tcpopts[20], 0); // tsecho
   }
   else
@@ -1012,8 +1462,7 @@ static void resend_syn(
   {
     entry->wan_max_window_unscaled = tcp_window(origtcp);
   }
-  entry->timer.time64 = time64 + 120ULL*1000ULL*1000ULL;
-  timer_linkheap_modify(&local->timers, &entry->timer);
+  timer_wheel_modify(&local->conntimers, &entry->timer, time64 + 120ULL*1000ULL*1000ULL);
 
   send_or_resend_syn(orig, local, port, st, entry);
 }
@@ -1028,6 +1477,7 @@ static void send_syn(
   void *origip;
   void *origtcp;
   struct tcp_information info;
+  struct synproxy_hash_cold *cold = NULL;
   int version;
 
   origip = ether_payload(orig);
@@ -1035,34 +1485,49 @@ static void send_syn(
   origtcp = ip46_payload(origip);
   tcp_parse_options(origtcp, &info);
 
+  if (entry == NULL || entry->cold == NULL)
+  {
+    cold = synproxy_hash_cold_alloc(local);
+    if (cold == NULL)
+    {
+      log_log(LOG_LEVEL_ERR, "WORKER", "out of memory");
+      return;
+    }
+  }
   if (entry == NULL)
   {
     entry = synproxy_hash_put(
       local, version, ip46_dst(origip), tcp_dst_port(origtcp),
       ip46_src(origip), tcp_src_port(origtcp),
       1, time64);
-    if (entry->version == 6)
-    {
-      entry->ulflowlabel = gen_flowlabel_entry(entry);
-    }
     if (entry == NULL)
     {
+      entrypool_put(&local->coldpool, cold);
       log_log(LOG_LEVEL_ERR, "WORKER", "not enough memory or already existing");
       return;
     }
+    if (entry->version == 6)
+    {
+      entry->ulflowlabel = gen_flowlabel_entry(entry);
+    }
+  }
+  if (cold != NULL)
+  {
+    cold->entry = entry;
+    entry->cold = cold;
   }
   if (version == 6)
   {
     entry->dlflowlabel = ipv6_flow_label(origip);
   }
 
-  entry->state_data.downlink_syn_sent.mss = mss;
-  entry->state_data.downlink_syn_sent.sack_permitted = sack_permitted;
-  entry->state_data.downlink_syn_sent.timestamp_present = info.ts_present;
+  entry->cold->state_data.downlink_syn_sent.mss = mss;
+  entry->cold->state_data.downlink_syn_sent.sack_permitted = sack_permitted;
+  entry->cold->state_data.downlink_syn_sent.timestamp_present = info.ts_present;
   if (info.ts_present)
   {
-    entry->state_data.downlink_syn_sent.local_timestamp = info.tsecho;
-    entry->state_data.downlink_syn_sent.remote_timestamp = info.ts;
+    entry->cold->state_data.downlink_syn_sent.local_timestamp = info.tsecho;
+    entry->cold->state_data.downlink_syn_sent.remote_timestamp = info.ts;
   }
 
   entry->wan_wscale = wscale;
@@ -1076,11 +1541,10 @@ static void send_syn(
   {
     entry->wan_max_window_unscaled = 1;
   }
-  entry->state_data.downlink_syn_sent.local_isn = tcp_ack_number(origtcp) - 1;
-  entry->state_data.downlink_syn_sent.remote_isn = tcp_seq_number(origtcp) - 1 + (!!was_keepalive);
+  entry->cold->state_data.downlink_syn_sent.local_isn = tcp_ack_number(origtcp) - 1;
+  entry->cold->state_data.downlink_syn_sent.remote_isn = tcp_seq_number(origtcp) - 1 + (!!was_keepalive);
   entry->flag_state = FLAG_STATE_DOWNLINK_SYN_SENT;
-  entry->timer.time64 = time64 + 120ULL*1000ULL*1000ULL;
-  timer_linkheap_modify(&local->timers, &entry->timer);
+  timer_wheel_modify(&local->conntimers, &entry->timer, time64 + 120ULL*1000ULL*1000ULL);
 
   send_or_resend_syn(orig, local, port, st, entry);
 }
@@ -1244,9 +1708,97 @@ static void send_ack_and_window_update(
   port->portfunc(pktstruct, port->userdata);
 }
 
-int downlink(
+struct synproxy_hash_hint {
+  int valid;
+  uint32_t hashval;
+  const struct cookie_request *cookie;
+  int syn_dropped; // 1: drop, 0: permitted, -1: SYN not checked yet
+};
+
+/*
+ * All lookups in downlink() and uplink() are for the same 4-tuple, so the
+ * hash value needs to be calculated at most once per packet. The burst
+ * functions calculate it beforehand.
+ */
+static inline struct synproxy_hash_entry *synproxy_hash_get_hinted(
+  struct worker_local *local, int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port,
+  struct synproxy_hash_hint *hint, struct synproxy_hash_ctx *ctx)
+{
+  if (!hint->valid)
+  {
+    hint->hashval = synproxy_hash_separate46(
+      version, local_ip, local_port, remote_ip, remote_port);
+    hint->valid = 1;
+  }
+  return synproxy_hash_get_hashed(
+    local, version, local_ip, local_port, remote_ip, remote_port,
+    hint->hashval, ctx);
+}
+
+/*
+ * Checks a SYN from WAN before any work is done for it. Returns 1 if it's
+ * dropped.
+ */
+static int downlink_syn_dropped(
+  struct synproxy *synproxy, void *ip, void *ippay, uint16_t lan_port,
+  uint64_t time64)
+{
+  if (ip46_hdr_cksum_calc(ip) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid IP hdr cksum");
+    return 1;
+  }
+  if (tcp46_cksum_calc(ip) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid TCP hdr cksum");
+    return 1;
+  }
+  if (tcp_fin(ippay) || tcp_rst(ippay))
+  {
+    log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "SYN packet contains FIN or RST");
+    return 1;
+  }
+  if (tcp_ack(ippay))
+  {
+    return 0;
+  }
+  if (ip_version(ip) == 4)
+  {
+    if (!hitters_ip_permitted(
+      &synproxy->hitters, ip_src(ip), lan_port, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IP heavy hitter");
+      return 1;
+    }
+    if (!ratelimit_ip_permitted(&synproxy->ratelimit, ip_src(ip), time64))
+    {
+      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IP ratelimited");
+      return 1;
+    }
+  }
+  else
+  {
+    if (!hitters_ipv6_permitted(
+      &synproxy->hitters, ipv6_src(ip), lan_port, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IPv6 heavy hitter");
+      return 1;
+    }
+    if (!ratelimit_ipv6_permitted(
+      &synproxy->ratelimit, ipv6_src(ip), time64))
+    {
+      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IPv6 ratelimited");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int downlink_impl(
   struct synproxy *synproxy, struct worker_local *local, struct packet *pkt,
-  struct port *port, uint64_t time64, struct ll_alloc_st *st)
+  struct port *port, uint64_t time64, struct ll_alloc_st *st,
+  struct synproxy_hash_hint *hint)
 {
   void *ether = pkt->data;
   void *ip;
@@ -1395,54 +1947,27 @@ int downlink(
   }
   if (unlikely(tcp_syn(ippay)))
   {
-    if (ip46_hdr_cksum_calc(ip) != 0)
-    {
-      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid IP hdr cksum");
-      return 1;
-    }
-    if (tcp46_cksum_calc(ip) != 0)
+    // The burst functions check SYNs before forming their cookies
+    if (hint->syn_dropped < 0)
     {
-      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid TCP hdr cksum");
-      return 1;
+      hint->syn_dropped =
+        downlink_syn_dropped(synproxy, ip, ippay, lan_port, time64);
     }
-    if (tcp_fin(ippay) || tcp_rst(ippay))
+    if (hint->syn_dropped)
     {
-      log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "SYN packet contains FIN or RST");
       return 1;
     }
     if (!tcp_ack(ippay))
     {
-      worker_local_wrlock(local);
-      if (version == 4)
-      {
-        if (!ip_permitted(
-          ip_src(ip), synproxy->conf->ratehash.network_prefix, &local->ratelimit))
-        {
-          worker_local_wrunlock(local);
-          log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IP ratelimited");
-          return 1;
-        }
-      }
-      else
-      {
-        if (!ipv6_permitted(
-          ipv6_src(ip), synproxy->conf->ratehash.network_prefix6, &local->ratelimit))
-        {
-          worker_local_wrunlock(local);
-          log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "IPv6 ratelimited");
-          return 1;
-        }
-      }
-      send_synack(ether, local, synproxy, port, st, time64);
-      worker_local_wrunlock(local);
+      send_synack(ether, local, synproxy, port, st, time64, hint->cookie);
       return 1;
     }
     else
     {
       struct tcp_information tcpinfo;
       ctx.locked = 0;
-      entry = synproxy_hash_get(
-        local, version, lan_ip, lan_port, remote_ip, remote_port, &ctx);
+      entry = synproxy_hash_get_hinted(
+        local, version, lan_ip, lan_port, remote_ip, remote_port, hint, &ctx);
       if (entry == NULL)
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "SA/SA but entry nonexistent");
@@ -1450,7 +1975,7 @@ int downlink(
         return 1;
       }
       if (entry->flag_state == FLAG_STATE_UPLINK_SYN_RCVD &&
-          entry->state_data.uplink_syn_rcvd.isn == tcp_seq_number(ippay))
+          entry->cold->state_data.uplink_syn_rcvd.isn == tcp_seq_number(ippay))
       {
         // retransmit of SYN+ACK
         if (synproxy->conf->mss_clamp_enabled)
@@ -1506,7 +2031,7 @@ int downlink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (tcp_ack_number(ippay) != entry->state_data.uplink_syn_sent.isn + 1)
+      if (tcp_ack_number(ippay) != entry->cold->state_data.uplink_syn_sent.isn + 1)
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "SA/SA, invalid ACK num");
         synproxy_hash_unlock(local, &ctx);
@@ -1525,16 +2050,13 @@ int downlink(
       {
         entry->wan_max_window_unscaled = 1;
       }
-      entry->state_data.uplink_syn_rcvd.isn = tcp_seq_number(ippay);
+      entry->cold->state_data.uplink_syn_rcvd.isn = tcp_seq_number(ippay);
       entry->wan_sent = tcp_seq_number(ippay) + 1;
       entry->wan_acked = tcp_ack_number(ippay);
       entry->wan_max =
         entry->wan_acked + (tcp_window(ippay) << entry->wan_wscale);
       entry->flag_state = FLAG_STATE_UPLINK_SYN_RCVD;
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 60ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_timer_refresh(local, entry, time64 + 60ULL*1000ULL*1000ULL);
       if (synproxy->conf->mss_clamp_enabled)
       {
         uint16_t mss;
@@ -1554,8 +2076,8 @@ int downlink(
     }
   }
   ctx.locked = 0;
-  entry = synproxy_hash_get(
-    local, version, lan_ip, lan_port, remote_ip, remote_port, &ctx);
+  entry = synproxy_hash_get_hinted(
+    local, version, lan_ip, lan_port, remote_ip, remote_port, hint, &ctx);
   if (entry != NULL && entry->flag_state == FLAG_STATE_DOWNLINK_HALF_OPEN)
   {
     if (tcp_rst(ippay))
@@ -1588,32 +2110,31 @@ int downlink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (((uint32_t)(entry->state_data.downlink_half_open.local_isn + 1)) != ack_num)
+      if (((uint32_t)(entry->cold->state_data.downlink_half_open.local_isn + 1)) != ack_num)
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid TCP ACK number");
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (((uint32_t)(entry->state_data.downlink_half_open.remote_isn + 1)) != tcp_seq_number(ippay))
+      if (((uint32_t)(entry->cold->state_data.downlink_half_open.remote_isn + 1)) != tcp_seq_number(ippay))
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "invalid TCP SEQ number");
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      worker_local_wrlock(local);
       if (version == 4)
       {
-        ip_increment_one(
-          ip_src(ip), synproxy->conf->ratehash.network_prefix, &local->ratelimit);
+        ratelimit_ip_completed(&synproxy->ratelimit, ip_src(ip), time64);
       }
       else
       {
-        ipv6_increment_one(
-          ipv6_src(ip), synproxy->conf->ratehash.network_prefix6, &local->ratelimit);
+        ratelimit_ipv6_completed(&synproxy->ratelimit, ipv6_src(ip), time64);
       }
+      halfopen_ctrl_completed(&local->halfopen);
+      worker_local_wrlock(local);
       log_log(
         LOG_LEVEL_NOTICE, "WORKERDOWNLINK", "SYN proxy sending SYN, found");
-      linked_list_delete(&entry->state_data.downlink_half_open.listnode);
+      linked_list_delete(&entry->cold->state_data.downlink_half_open.listnode);
       if (local->half_open_connections <= 0)
       {
         abort();
@@ -1622,9 +2143,9 @@ int downlink(
       worker_local_wrunlock(local);
       send_syn(
         ether, local, port, st,
-        entry->state_data.downlink_half_open.mss,
-        entry->state_data.downlink_half_open.wscale,
-        entry->state_data.downlink_half_open.sack_permitted, entry, time64, 0);
+        entry->cold->state_data.downlink_half_open.mss,
+        entry->cold->state_data.downlink_half_open.wscale,
+        entry->cold->state_data.downlink_half_open.sack_permitted, entry, time64, 0);
       synproxy_hash_unlock(local, &ctx);
       return 1;
     }
@@ -1802,18 +2323,15 @@ int downlink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      worker_local_wrlock(local);
       if (version == 4)
       {
-        ip_increment_one(
-          ip_src(ip), synproxy->conf->ratehash.network_prefix, &local->ratelimit);
+        ratelimit_ip_completed(&synproxy->ratelimit, ip_src(ip), time64);
       }
       else
       {
-        ipv6_increment_one(
-          ipv6_src(ip), synproxy->conf->ratehash.network_prefix6, &local->ratelimit);
+        ratelimit_ipv6_completed(&synproxy->ratelimit, ipv6_src(ip), time64);
       }
-      worker_local_wrunlock(local);
+      halfopen_ctrl_completed(&local->halfopen);
       synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
       log_log(
         LOG_LEVEL_NOTICE, "WORKERDOWNLINK", "SYN proxy sending SYN, packet: %s",
@@ -1857,7 +2375,7 @@ int downlink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (tcp_ack_number(ippay) != entry->state_data.uplink_syn_sent.isn + 1)
+      if (tcp_ack_number(ippay) != entry->cold->state_data.uplink_syn_sent.isn + 1)
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "RA/RA in UL_SYN_SENT, bad seq");
         synproxy_hash_unlock(local, &ctx);
@@ -1895,10 +2413,7 @@ int downlink(
         ippay, tcp_len, tcp_ack_number(ippay)-entry->seqoffset);
     }
     entry->flag_state = FLAG_STATE_RESETED;
-    worker_local_wrlock(local);
-    entry->timer.time64 = time64 + 45ULL*1000ULL*1000ULL;
-    timer_linkheap_modify(&local->timers, &entry->timer);
-    worker_local_wrunlock(local);
+    synproxy_timer_refresh(local, entry, time64 + 45ULL*1000ULL*1000ULL);
     synproxy_hash_unlock(local, &ctx);
     //port->portfunc(pkt, port->userdata);
     return 0;
@@ -1993,19 +2508,19 @@ int downlink(
     }
     if (entry->flag_state & FLAG_STATE_DOWNLINK_FIN)
     {
-      if (entry->state_data.established.downfin != last_seq)
+      if (entry->established.downfin != last_seq)
       {
         log_log(LOG_LEVEL_ERR, "WORKERDOWNLINK", "FIN seq changed");
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
     }
-    entry->state_data.established.downfin = last_seq;
+    entry->established.downfin = last_seq;
     entry->flag_state |= FLAG_STATE_DOWNLINK_FIN;
   }
   if (unlikely(entry->flag_state & FLAG_STATE_UPLINK_FIN))
   {
-    uint32_t fin = entry->state_data.established.upfin;
+    uint32_t fin = entry->established.upfin;
     if (tcp_ack(ippay) && tcp_ack_number(ippay) == fin + 1)
     {
       if (ip46_hdr_cksum_calc(ip) != 0)
@@ -2070,13 +2585,7 @@ int downlink(
   {
     next64 = time64 + 86400ULL*1000ULL*1000ULL;
   }
-  if (abs(next64 - entry->timer.time64) >= 1000*1000)
-  {
-    worker_local_wrlock(local);
-    entry->timer.time64 = next64;
-    timer_linkheap_modify(&local->timers, &entry->timer);
-    worker_local_wrunlock(local);
-  }
+  synproxy_timer_refresh(local, entry, next64);
   tcp_find_sack_ts_headers(ippay, &hdrs);
   if (tcp_ack(ippay))
   {
@@ -2103,10 +2612,10 @@ int downlink(
   if (todelete)
   {
     worker_local_wrlock(local);
-    entry->timer.time64 = time64 + 120ULL*1000ULL*1000ULL;
     entry->flag_state = FLAG_STATE_TIME_WAIT;
-    timer_linkheap_modify(&local->timers, &entry->timer);
+    timer_wheel_modify(&local->conntimers, &entry->timer, time64 + 120ULL*1000ULL*1000ULL);
     worker_local_wrunlock(local);
+    synproxy_replicate(local, entry, REPLICATE_UPDATE);
   }
   synproxy_hash_unlock(local, &ctx);
   return 0;
@@ -2120,9 +2629,10 @@ int downlink(
  */
 
 // return: whether to free (1) or not (0)
-int uplink(
+static int uplink_impl(
   struct synproxy *synproxy, struct worker_local *local, struct packet *pkt,
-  struct port *port, uint64_t time64, struct ll_alloc_st *st)
+  struct port *port, uint64_t time64, struct ll_alloc_st *st,
+  struct synproxy_hash_hint *hint)
 {
   void *ether = pkt->data;
   void *ip;
@@ -2286,11 +2796,12 @@ int uplink(
     if (!tcp_ack(ippay))
     {
       struct tcp_information tcpinfo;
+      struct synproxy_hash_cold *cold;
       ctx.locked = 0;
-      entry = synproxy_hash_get(
-        local, version, lan_ip, lan_port, remote_ip, remote_port, &ctx);
+      entry = synproxy_hash_get_hinted(
+        local, version, lan_ip, lan_port, remote_ip, remote_port, hint, &ctx);
       if (entry != NULL && entry->flag_state == FLAG_STATE_UPLINK_SYN_SENT &&
-          entry->state_data.uplink_syn_sent.isn == tcp_seq_number(ippay))
+          entry->cold->state_data.uplink_syn_sent.isn == tcp_seq_number(ippay))
       {
         // retransmit of SYN
         synproxy_hash_unlock(local, &ctx);
@@ -2316,18 +2827,28 @@ int uplink(
           return 1;
         }
       }
-      entry = synproxy_hash_put(
-        local, version, lan_ip, lan_port, remote_ip, remote_port, 0, time64);
-      if (version == 6)
+      cold = synproxy_hash_cold_alloc(local);
+      if (cold == NULL)
       {
-        entry->ulflowlabel = ipv6_flow_label(ip);
+        log_log(LOG_LEVEL_ERR, "WORKERUPLINK", "out of memory");
+        synproxy_hash_unlock(local, &ctx);
+        return 1;
       }
+      entry = synproxy_hash_put(
+        local, version, lan_ip, lan_port, remote_ip, remote_port, 0, time64);
       if (entry == NULL)
       {
+        entrypool_put(&local->coldpool, cold);
         log_log(LOG_LEVEL_ERR, "WORKERUPLINK", "out of memory or already exists");
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
+      if (version == 6)
+      {
+        entry->ulflowlabel = ipv6_flow_label(ip);
+      }
+      cold->entry = entry;
+      entry->cold = cold;
       tcp_parse_options(ippay, &tcpinfo);
       if (!tcpinfo.options_valid)
       {
@@ -2337,7 +2858,7 @@ int uplink(
         tcpinfo.sack_permitted = 0;
       }
       entry->flag_state = FLAG_STATE_UPLINK_SYN_SENT;
-      entry->state_data.uplink_syn_sent.isn = tcp_seq_number(ippay);
+      entry->cold->state_data.uplink_syn_sent.isn = tcp_seq_number(ippay);
       entry->lan_wscale = tcpinfo.wscale;
       entry->lan_max_window_unscaled = tcp_window(ippay);
       entry->lan_sack_was_supported = tcpinfo.sack_permitted;
@@ -2360,10 +2881,7 @@ int uplink(
         }
       }
       //port->portfunc(pkt, port->userdata);
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 120ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_timer_refresh(local, entry, time64 + 120ULL*1000ULL*1000ULL);
       synproxy_hash_unlock(local, &ctx);
       return 0;
     }
@@ -2374,8 +2892,8 @@ int uplink(
       struct threetuplepayload threetuplepayload;
       uint8_t own_wscale;
       ctx.locked = 0;
-      entry = synproxy_hash_get(
-        local, version, lan_ip, lan_port, remote_ip, remote_port, &ctx);
+      entry = synproxy_hash_get_hinted(
+        local, version, lan_ip, lan_port, remote_ip, remote_port, hint, &ctx);
       if (entry == NULL)
       {
         synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
@@ -2405,7 +2923,7 @@ int uplink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (tcp_ack_number(ippay) != entry->state_data.downlink_syn_sent.remote_isn + 1)
+      if (tcp_ack_number(ippay) != entry->cold->state_data.downlink_syn_sent.remote_isn + 1)
       {
         synproxy_entry_to_str(statebuf, sizeof(statebuf), entry);
         synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
@@ -2482,11 +3000,11 @@ int uplink(
       entry->wscalediff =
         ((int)own_wscale) - ((int)tcpinfo.wscale);
       entry->seqoffset =
-        entry->state_data.downlink_syn_sent.local_isn - tcp_seq_number(ippay);
+        entry->cold->state_data.downlink_syn_sent.local_isn - tcp_seq_number(ippay);
       if (tcpinfo.ts_present)
       {
         entry->tsoffset =
-          entry->state_data.downlink_syn_sent.local_timestamp - tcpinfo.ts;
+          entry->cold->state_data.downlink_syn_sent.local_timestamp - tcpinfo.ts;
       }
       else
       {
@@ -2503,18 +3021,17 @@ int uplink(
         entry->lan_max_window_unscaled = 1;
       }
       entry->flag_state = FLAG_STATE_ESTABLISHED;
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 86400ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_hash_cold_free(local, entry);
+      synproxy_timer_refresh(local, entry, time64 + 86400ULL*1000ULL*1000ULL);
+      synproxy_replicate(local, entry, REPLICATE_UPDATE);
       send_ack_and_window_update(ether, entry, port, st);
       synproxy_hash_unlock(local, &ctx);
       return 1;
     }
   }
   ctx.locked = 0;
-  entry = synproxy_hash_get(
-    local, version, lan_ip, lan_port, remote_ip, remote_port, &ctx);
+  entry = synproxy_hash_get_hinted(
+    local, version, lan_ip, lan_port, remote_ip, remote_port, hint, &ctx);
   if (entry == NULL)
   {
     synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
@@ -2552,10 +3069,7 @@ int uplink(
         return 1;
       }
       entry->flag_state = FLAG_STATE_RESETED;
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 45ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_timer_refresh(local, entry, time64 + 45ULL*1000ULL*1000ULL);
       //port->portfunc(pkt, port->userdata);
       synproxy_hash_unlock(local, &ctx);
       return 0;
@@ -2564,7 +3078,7 @@ int uplink(
     {
       uint32_t ack = tcp_ack_number(ippay);
       uint16_t window = tcp_window(ippay);
-      if (tcp_ack_number(ippay) != entry->state_data.uplink_syn_rcvd.isn + 1)
+      if (tcp_ack_number(ippay) != entry->cold->state_data.uplink_syn_rcvd.isn + 1)
       {
         synproxy_entry_to_str(statebuf, sizeof(statebuf), entry);
         synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
@@ -2590,10 +3104,9 @@ int uplink(
       entry->lan_acked = ack;
       entry->lan_max = ack + (window << entry->lan_wscale);
       entry->flag_state = FLAG_STATE_ESTABLISHED;
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 86400ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_hash_cold_free(local, entry);
+      synproxy_timer_refresh(local, entry, time64 + 86400ULL*1000ULL*1000ULL);
+      synproxy_replicate(local, entry, REPLICATE_UPDATE);
       //port->portfunc(pkt, port->userdata);
       synproxy_hash_unlock(local, &ctx);
       return 0;
@@ -2636,7 +3149,7 @@ int uplink(
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
-      if (tcp_ack_number(ippay) != entry->state_data.downlink_syn_sent.remote_isn + 1)
+      if (tcp_ack_number(ippay) != entry->cold->state_data.downlink_syn_sent.remote_isn + 1)
       {
         synproxy_entry_to_str(statebuf, sizeof(statebuf), entry);
         synproxy_packet_to_str(packetbuf, sizeof(packetbuf), ether);
@@ -2645,15 +3158,12 @@ int uplink(
         return 1;
       }
       tcp_set_seq_number_cksum_update(
-        ippay, tcp_len, entry->state_data.downlink_syn_sent.local_isn + 1);
+        ippay, tcp_len, entry->cold->state_data.downlink_syn_sent.local_isn + 1);
       tcp_set_ack_off_cksum_update(ippay);
       tcp_set_ack_number_cksum_update(
         ippay, tcp_len, 0);
       entry->flag_state = FLAG_STATE_RESETED;
-      worker_local_wrlock(local);
-      entry->timer.time64 = time64 + 45ULL*1000ULL*1000ULL;
-      timer_linkheap_modify(&local->timers, &entry->timer);
-      worker_local_wrunlock(local);
+      synproxy_timer_refresh(local, entry, time64 + 45ULL*1000ULL*1000ULL);
       //port->portfunc(pkt, port->userdata);
       synproxy_hash_unlock(local, &ctx);
       return 0;
@@ -2676,10 +3186,7 @@ int uplink(
     tcp_set_seq_number_cksum_update(
       ippay, tcp_len, tcp_seq_number(ippay)+entry->seqoffset);
     entry->flag_state = FLAG_STATE_RESETED;
-    worker_local_wrlock(local);
-    entry->timer.time64 = time64 + 45ULL*1000ULL*1000ULL;
-    timer_linkheap_modify(&local->timers, &entry->timer);
-    worker_local_wrunlock(local);
+    synproxy_timer_refresh(local, entry, time64 + 45ULL*1000ULL*1000ULL);
     //port->portfunc(pkt, port->userdata);
     synproxy_hash_unlock(local, &ctx);
     return 0;
@@ -2772,19 +3279,19 @@ int uplink(
     }
     if (entry->flag_state & FLAG_STATE_UPLINK_FIN)
     {
-      if (entry->state_data.established.upfin != last_seq)
+      if (entry->established.upfin != last_seq)
       {
         log_log(LOG_LEVEL_ERR, "WORKERUPLINK", "FIN seq changed");
         synproxy_hash_unlock(local, &ctx);
         return 1;
       }
     }
-    entry->state_data.established.upfin = last_seq;
+    entry->established.upfin = last_seq;
     entry->flag_state |= FLAG_STATE_UPLINK_FIN;
   }
   if (unlikely(entry->flag_state & FLAG_STATE_DOWNLINK_FIN))
   {
-    uint32_t fin = entry->state_data.established.downfin;
+    uint32_t fin = entry->established.downfin;
     if (tcp_ack(ippay) && tcp_ack_number(ippay) == fin + 1)
     {
       if (ip46_hdr_cksum_calc(ip) != 0)
@@ -2841,13 +3348,7 @@ int uplink(
   {
     next64 = time64 + 86400ULL*1000ULL*1000ULL;
   }
-  if (abs(next64 - entry->timer.time64) >= 1000*1000)
-  {
-    worker_local_wrlock(local);
-    entry->timer.time64 = next64;
-    timer_linkheap_modify(&local->timers, &entry->timer);
-    worker_local_wrunlock(local);
-  }
+  synproxy_timer_refresh(local, entry, next64);
   tcp_set_seq_number_cksum_update(
     ippay, tcp_len, tcp_seq_number(ippay)+entry->seqoffset);
   if (version == 6)
@@ -2875,11 +3376,306 @@ int uplink(
   if (todelete)
   {
     worker_local_wrlock(local);
-    entry->timer.time64 = time64 + 120ULL*1000ULL*1000ULL;
     entry->flag_state = FLAG_STATE_TIME_WAIT;
-    timer_linkheap_modify(&local->timers, &entry->timer);
+    timer_wheel_modify(&local->conntimers, &entry->timer, time64 + 120ULL*1000ULL*1000ULL);
     worker_local_wrunlock(local);
+    synproxy_replicate(local, entry, REPLICATE_UPDATE);
   }
   synproxy_hash_unlock(local, &ctx);
   return 0;
 }
+
+int downlink(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkt,
+  struct port *port, uint64_t time64, struct ll_alloc_st *st)
+{
+  struct synproxy_hash_hint hint = {
+    .valid = 0, .cookie = NULL, .syn_dropped = -1,
+  };
+  return downlink_impl(synproxy, local, pkt, port, time64, st, &hint);
+}
+
+int uplink(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkt,
+  struct port *port, uint64_t time64, struct ll_alloc_st *st)
+{
+  struct synproxy_hash_hint hint = {
+    .valid = 0, .cookie = NULL, .syn_dropped = -1,
+  };
+  return uplink_impl(synproxy, local, pkt, port, time64, st, &hint);
+}
+
+#define SYNPROXY_BURST_MAX 64
+
+/*
+ * Minimal parsing for the first pass of the burst functions. Anything else
+ * than a plain TCP packet is left for the state machine to deal with.
+ */
+static int burst_parse(
+  void *ether, size_t ether_len, int *version,
+  const void **src_ip, const void **dst_ip,
+  uint16_t *src_port, uint16_t *dst_port, int *pure_syn, void **tcp)
+{
+  void *ip;
+  void *ippay;
+  size_t ip_len;
+
+  if (ether_len < ETHER_HDR_LEN)
+  {
+    return -EINVAL;
+  }
+  ip = ether_payload(ether);
+  ip_len = ether_len - ETHER_HDR_LEN;
+  if (ether_type(ether) == ETHER_TYPE_IP)
+  {
+    if (ip_len < IP_HDR_MINLEN || ip_version(ip) != 4)
+    {
+      return -EINVAL;
+    }
+    if (ip_proto(ip) != 6 || ip_frag_off(ip) != 0)
+    {
+      return -EINVAL;
+    }
+    if (ip_len < (size_t)ip_hdr_len(ip) + 20)
+    {
+      return -EINVAL;
+    }
+    *version = 4;
+    *src_ip = ip_src_ptr(ip);
+    *dst_ip = ip_dst_ptr(ip);
+    ippay = ip_payload(ip);
+  }
+  else if (ether_type(ether) == ETHER_TYPE_IPV6)
+  {
+    int is_frag = 0;
+    uint16_t proto_off_from_frag = 0;
+    uint8_t protocol = 0;
+    if (ip_len < 40 || ip_version(ip) != 6)
+    {
+      return -EINVAL;
+    }
+    if (ip_len < (size_t)(ipv6_payload_len(ip) + 40))
+    {
+      return -EINVAL;
+    }
+    ippay = ipv6_proto_hdr_2(ip, &protocol, &is_frag, NULL, &proto_off_from_frag);
+    if (ippay == NULL || protocol != 6 || is_frag)
+    {
+      return -EINVAL;
+    }
+    if (ip_len < (size_t)(((char*)ippay) - ((char*)ip)) + 20)
+    {
+      return -EINVAL;
+    }
+    *version = 6;
+    *src_ip = ipv6_src(ip);
+    *dst_ip = ipv6_dst(ip);
+  }
+  else
+  {
+    return -EINVAL;
+  }
+  *src_port = tcp_src_port(ippay);
+  *dst_port = tcp_dst_port(ippay);
+  *pure_syn = tcp_syn(ippay) && !tcp_ack(ippay);
+  *tcp = ippay;
+  return 0;
+}
+
+int synproxy_is_synproxied(
+  struct worker_local *local, void *ether, size_t ether_len)
+{
+  int version;
+  const void *src_ip, *dst_ip;
+  uint16_t src_port, dst_port;
+  int pure_syn;
+  void *tcp;
+  struct synproxy_hash_entry e;
+  if (burst_parse(ether, ether_len, &version, &src_ip, &dst_ip,
+                  &src_port, &dst_port, &pure_syn, &tcp) != 0)
+  {
+    return 0;
+  }
+  // The packet may be going either way, the local end is tried both ways.
+  // Output ports call this with the bucket lock held, so it's a peek.
+  if (synproxy_hash_peek(local, version, src_ip, src_port, dst_ip, dst_port,
+                         &e) != 0 &&
+      synproxy_hash_peek(local, version, dst_ip, dst_port, src_ip, src_port,
+                         &e) != 0)
+  {
+    return 0;
+  }
+  return e.was_synproxied;
+}
+
+/*
+ * Fills in the input of SYN cookie formation the same way as send_synack().
+ */
+static int burst_cookie_request(
+  void *ether, size_t ether_len, void *tcp, struct cookie_request *req)
+{
+  void *ip = ether_payload(ether);
+  struct tcp_information tcpinfo;
+  if ((char*)tcp + tcp_data_offset(tcp) > (char*)ether + ether_len)
+  {
+    return -EINVAL;
+  }
+  tcp_parse_options(tcp, &tcpinfo);
+  if (!tcpinfo.options_valid)
+  {
+    return -EINVAL;
+  }
+  if (ip_version(ip) == 4)
+  {
+    req->a46.is6 = 0;
+    req->a46.u.u4.ip1 = ip_dst(ip);
+    req->a46.u.u4.ip2 = ip_src(ip);
+  }
+  else
+  {
+    req->a46.is6 = 1;
+    req->a46.u.u6.ip1 = ipv6_dst(ip);
+    req->a46.u.u6.ip2 = ipv6_src(ip);
+  }
+  req->port1 = tcp_dst_port(tcp);
+  req->port2 = tcp_src_port(tcp);
+  req->mss = tcpinfo.mss;
+  req->wscale = tcpinfo.wscale;
+  req->sack_permitted = tcpinfo.sack_permitted;
+  req->other_isn = tcp_seq_number(tcp);
+  return 0;
+}
+
+/*
+ * Tells whether downlink_impl() would get to the SYN checks of the packet, so
+ * they can be done already here.
+ */
+static int burst_syn_complete(struct packet *pkt, void *tcp)
+{
+  void *ip = ether_payload(pkt->data);
+  size_t total_len = ip46_total_len(ip);
+  size_t hdr_len = (char*)tcp - (char*)ip;
+  return total_len <= pkt->sz - ETHER_HDR_LEN &&
+         total_len >= hdr_len + 20 &&
+         tcp_data_offset(tcp) <= total_len - hdr_len;
+}
+
+/*
+ * Downlink SYNs are checked and get their SYN cookies formed here all at
+ * once, so reqs must have room for num requests if is_downlink.
+ */
+static void burst_prefetch(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkts,
+  struct synproxy_hash_hint *hints, size_t num, int is_downlink,
+  struct cookie_request *reqs, uint64_t time64)
+{
+  size_t i;
+  size_t reqcnt = 0;
+  for (i = 0; i < num; i++)
+  {
+    int version;
+    const void *src_ip, *dst_ip;
+    uint16_t src_port, dst_port;
+    int pure_syn;
+    void *tcp;
+    hints[i].valid = 0;
+    hints[i].cookie = NULL;
+    hints[i].syn_dropped = -1;
+    if (burst_parse(pkts[i].data, pkts[i].sz, &version, &src_ip, &dst_ip,
+                    &src_port, &dst_port, &pure_syn, &tcp) != 0)
+    {
+      continue;
+    }
+    if (is_downlink && pure_syn && burst_syn_complete(&pkts[i], tcp))
+    {
+      // A dropped SYN gets no cookie and no prefetches
+      hints[i].syn_dropped = downlink_syn_dropped(
+        synproxy, ether_payload(pkts[i].data), tcp, dst_port, time64);
+      if (hints[i].syn_dropped)
+      {
+        continue;
+      }
+    }
+    if (is_downlink)
+    {
+      if (pure_syn &&
+          burst_cookie_request(pkts[i].data, pkts[i].sz, tcp,
+                               &reqs[reqcnt]) == 0)
+      {
+        hints[i].cookie = &reqs[reqcnt++];
+      }
+      // SYN from WAN without half-open cache only needs a cookie
+      if (pure_syn && !synproxy->conf->halfopen_cache_max)
+      {
+        continue;
+      }
+      hints[i].hashval = synproxy_hash_separate46(
+        version, dst_ip, dst_port, src_ip, src_port);
+    }
+    else
+    {
+      hints[i].hashval = synproxy_hash_separate46(
+        version, src_ip, src_port, dst_ip, dst_port);
+    }
+    hints[i].valid = 1;
+    synproxy_hash_prefetch_bucket(local, hints[i].hashval);
+  }
+  if (reqcnt > 0)
+  {
+    form_cookies_timestamps(&local->info, synproxy, reqs, reqcnt);
+  }
+  for (i = 0; i < num; i++)
+  {
+    if (hints[i].valid)
+    {
+      synproxy_hash_prefetch_entry(local, hints[i].hashval);
+    }
+  }
+}
+
+void downlink_burst(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkts,
+  int *rets, size_t num, struct port *port, uint64_t time64,
+  struct ll_alloc_st *st)
+{
+  struct synproxy_hash_hint hints[SYNPROXY_BURST_MAX];
+  struct cookie_request reqs[SYNPROXY_BURST_MAX];
+  size_t off, i, cnt;
+  for (off = 0; off < num; off += cnt)
+  {
+    cnt = num - off;
+    if (cnt > SYNPROXY_BURST_MAX)
+    {
+      cnt = SYNPROXY_BURST_MAX;
+    }
+    burst_prefetch(synproxy, local, &pkts[off], hints, cnt, 1, reqs, time64);
+    for (i = 0; i < cnt; i++)
+    {
+      rets[off + i] = downlink_impl(
+        synproxy, local, &pkts[off + i], port, time64, st, &hints[i]);
+    }
+  }
+}
+
+void uplink_burst(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkts,
+  int *rets, size_t num, struct port *port, uint64_t time64,
+  struct ll_alloc_st *st)
+{
+  struct synproxy_hash_hint hints[SYNPROXY_BURST_MAX];
+  size_t off, i, cnt;
+  for (off = 0; off < num; off += cnt)
+  {
+    cnt = num - off;
+    if (cnt > SYNPROXY_BURST_MAX)
+    {
+      cnt = SYNPROXY_BURST_MAX;
+    }
+    burst_prefetch(synproxy, local, &pkts[off], hints, cnt, 0, NULL, time64);
+    for (i = 0; i < cnt; i++)
+    {
+      rets[off + i] = uplink_impl(
+        synproxy, local, &pkts[off + i], port, time64, st, &hints[i]);
+    }
+  }
+}
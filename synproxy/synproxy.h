@@ -7,14 +7,21 @@
 #include "iphdr.h"
 #include "log.h"
 #include "hashtable.h"
+#include "flowtable.h"
+#include "entrypool.h"
 #include "linkedlist.h"
 #include "containerof.h"
 #include "siphash.h"
 #include "timerlink.h"
+#include "timerwheel.h"
+#include "time64.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "hashseed.h"
 #include "secret.h"
-#include "iphash.h"
+#include "ratelimit.h"
+#include "hitters.h"
 #include "sackhash.h"
 #include "conf.h"
 #include "threetuple.h"
@@ -23,11 +30,50 @@ struct synproxy {
   struct conf *conf;
   struct sack_ip_port_hash autolearn;
   struct threetuplectx threetuplectx;
+  struct ratelimit ratelimit; // shared by all worker_locals
+  struct hitters hitters; // shared by all worker_locals
 };
 
+/*
+ * Handshake state, allocated separately and freed when the connection is
+ * established.
+ */
+struct synproxy_hash_cold {
+  struct synproxy_hash_entry *entry;
+  union {
+    struct {
+      uint32_t isn;
+    } uplink_syn_rcvd;
+    struct {
+      uint32_t isn;
+    } uplink_syn_sent;
+    struct {
+      uint32_t local_isn; // ACK number - 1 of ACK packet
+      uint32_t remote_isn; // SEQ number - 1 of ACK packet
+      uint16_t mss;
+      uint8_t sack_permitted;
+      uint8_t timestamp_present;
+      uint32_t local_timestamp;
+      uint32_t remote_timestamp;
+    } downlink_syn_sent;
+    struct {
+      struct linked_list_node listnode;
+      uint8_t wscale;
+      uint8_t sack_permitted;
+      uint16_t mss;
+      uint32_t remote_isn;
+      uint32_t local_isn;
+    } downlink_half_open;
+  } state_data;
+};
+
+/*
+ * Entries are 64-byte aligned. The first cache line has everything needed
+ * for the lookup and the sequence number adjustment, the second one window
+ * tracking and the timer. The rest is needed only for IPv6 and FIN handling.
+ */
 struct synproxy_hash_entry {
   struct hash_list_node node;
-  struct timer_link timer;
   union {
     uint32_t ipv4;
     char ipv6[16];
@@ -36,19 +82,14 @@ struct synproxy_hash_entry {
     uint32_t ipv4;
     char ipv6[16];
   } remote_ip;
-  uint32_t ulflowlabel; // after mangling
-  uint32_t dlflowlabel;
   uint16_t local_port;
   uint16_t remote_port;
   uint16_t flag_state;
   uint8_t version; // 4 or 6, IPv4 or IPv6
   int8_t wscalediff;
-  uint8_t lan_wscale;
-  uint8_t wan_wscale;
-  uint8_t was_synproxied;
-  uint8_t lan_sack_was_supported;
   uint32_t seqoffset;
   uint32_t tsoffset;
+  // second cache line
   uint32_t lan_sent; // what LAN has sent plus 1
   uint32_t wan_sent; // what WAN has sent plus 1
   uint32_t lan_acked; // what WAN has sent and LAN has acked plus 1
@@ -63,35 +104,19 @@ struct synproxy_hash_entry {
 #endif
   uint16_t lan_max_window_unscaled; // max window LAN has advertised
   uint16_t wan_max_window_unscaled; // max window WAN has advertised
-  union {
-    struct {
-      uint32_t isn;
-    } uplink_syn_rcvd;
-    struct {
-      uint32_t isn;
-    } uplink_syn_sent;
-    struct {
-      uint32_t local_isn; // ACK number - 1 of ACK packet
-      uint32_t remote_isn; // SEQ number - 1 of ACK packet
-      uint16_t mss;
-      uint8_t sack_permitted;
-      uint8_t timestamp_present;
-      uint32_t local_timestamp;
-      uint32_t remote_timestamp;
-    } downlink_syn_sent;
-    struct {
-      uint32_t upfin; // valid if FLAG_STATE_UPLINK_FIN
-      uint32_t downfin; // valid if FLAG_STATE_DOWNLINK_FIN
-    } established;
-    struct {
-      struct linked_list_node listnode;
-      uint8_t wscale;
-      uint8_t sack_permitted;
-      uint16_t mss;
-      uint32_t remote_isn;
-      uint32_t local_isn;
-    } downlink_half_open;
-  } state_data;
+  uint8_t lan_wscale;
+  uint8_t wan_wscale;
+  uint8_t was_synproxied;
+  uint8_t lan_sack_was_supported;
+  struct timer_wheel_link timer;
+  // cold part
+  uint32_t ulflowlabel; // after mangling
+  uint32_t dlflowlabel;
+  struct {
+    uint32_t upfin; // valid if FLAG_STATE_UPLINK_FIN
+    uint32_t downfin; // valid if FLAG_STATE_DOWNLINK_FIN
+  } established;
+  struct synproxy_hash_cold *cold; // NULL if not in handshake
 };
 
 enum flag_state {
@@ -148,19 +173,115 @@ static inline uint32_t synproxy_hash(struct synproxy_hash_entry *e)
 
 uint32_t synproxy_hash_fn(struct hash_list_node *node, void *userdata);
 
+void synproxy_wheel_fn(
+  struct timer_link *timer, struct timer_linkheap *heap, void *ud);
+
+void synproxy_halfopen_adapt_fn(
+  struct timer_link *timer, struct timer_linkheap *heap, void *ud);
+
+#define HALFOPEN_WINDOW_USEC (1000*1000)
+
+/*
+ * SYN and handshake completion counts are collected per window. A window
+ * where many SYNs arrive but most of them don't complete the handshake is
+ * considered a SYN flood. With halfopen_cache_adaptive, a flood halves the
+ * half-open cache size and other windows double it, between 0 and
+ * halfopen_cache_max.
+ */
+struct halfopen_ctrl {
+  uint32_t max;
+  _Atomic uint32_t limit; // current half-open cache size
+  _Atomic uint32_t syns; // SYN+ACKs sent in this window
+  _Atomic uint32_t completions; // handshakes completed in this window
+  uint32_t last_syns;
+  uint32_t last_completions;
+  int flood; // last window was a SYN flood
+  int adaptive; // if not, limit stays at max
+  struct timer_link timer;
+};
+
+static inline void halfopen_ctrl_syn(struct halfopen_ctrl *ctrl)
+{
+  atomic_fetch_add_explicit(&ctrl->syns, 1, memory_order_relaxed);
+}
+
+static inline void halfopen_ctrl_completed(struct halfopen_ctrl *ctrl)
+{
+  atomic_fetch_add_explicit(&ctrl->completions, 1, memory_order_relaxed);
+}
+
+struct replicate_ring;
+struct replicate_inq;
+
 struct worker_local {
   struct hash_table hash;
+  struct flowtable flowtable;
+  int tagged; // flowtable used instead of hash, only if !locked
   int locked;
+  struct entrypool entrypool;
+  struct entrypool coldpool;
   pthread_rwlock_t rwlock; // Lock order: first hash bucket lock, then mutex, then global hash lock
   struct timer_linkheap timers;
+  struct timer_wheel conntimers;
+  struct timer_link wheel_timer; // in timers if wheel_timer_armed
+  int wheel_timer_armed;
   struct secretinfo info;
-  struct ip_hash ratelimit;
   uint32_t synproxied_connections;
   uint32_t direct_connections;
   uint32_t half_open_connections;
   struct linked_list_head half_open_list;
+  struct halfopen_ctrl halfopen;
+  struct replicate_ring *repl; // NULL: not replicated
+  struct replicate_inq *replin; // NULL: no records to apply by RX threads
 };
 
+static inline struct synproxy_hash_entry *synproxy_hash_entry_alloc(
+  struct worker_local *local)
+{
+  struct synproxy_hash_entry *e = entrypool_get(&local->entrypool);
+  if (e == NULL)
+  {
+    return NULL;
+  }
+  memset(e, 0, sizeof(*e));
+  return e;
+}
+
+static inline struct synproxy_hash_cold *synproxy_hash_cold_alloc(
+  struct worker_local *local)
+{
+  struct synproxy_hash_cold *cold = entrypool_get(&local->coldpool);
+  if (cold == NULL)
+  {
+    return NULL;
+  }
+  memset(cold, 0, sizeof(*cold));
+  return cold;
+}
+
+static inline void synproxy_hash_cold_free(
+  struct worker_local *local, struct synproxy_hash_entry *e)
+{
+  entrypool_put(&local->coldpool, e->cold);
+  e->cold = NULL;
+}
+
+static inline void synproxy_hash_entry_free(
+  struct worker_local *local, struct synproxy_hash_entry *e)
+{
+  entrypool_put(&local->coldpool, e->cold);
+  entrypool_put(&local->entrypool, e);
+}
+
+/*
+ * Allocations that failed because a pool ran out. Read without locking, so
+ * only approximate when read from another thread.
+ */
+static inline uint64_t worker_local_alloc_failures(struct worker_local *local)
+{
+  return local->entrypool.exhausted + local->coldpool.exhausted;
+}
+
 static inline void worker_local_rdlock(struct worker_local *local)
 {
   if (!local->locked)
@@ -203,21 +324,56 @@ static inline void worker_local_init(
 {
   if (locked)
   {
+    if (synproxy->conf->conntabletype == CONNTABLETYPE_TAGGED)
+    {
+      log_log(LOG_LEVEL_WARNING, "WORKER",
+              "tagged conn table needs sharding, using chained table");
+    }
     hash_table_init_locked(
       &local->hash, synproxy->conf->conntablesize, synproxy_hash_fn, NULL, 2); // WAS: 0
+    local->tagged = 0;
     local->locked = 1;
     if (pthread_rwlock_init(&local->rwlock, NULL) != 0)
     {
       abort();
     }
   }
+  else if (synproxy->conf->conntabletype == CONNTABLETYPE_TAGGED)
+  {
+    // 7 slots per bucket, so the table holds 1.75 * conntablesize entries
+    if (flowtable_init(&local->flowtable,
+                       (synproxy->conf->conntablesize + 3) / 4) != 0)
+    {
+      log_log(LOG_LEVEL_CRIT, "WORKER", "can't allocate tagged conn table");
+      abort();
+    }
+    local->tagged = 1;
+    local->locked = 0;
+  }
   else
   {
     hash_table_init(
       &local->hash, synproxy->conf->conntablesize, synproxy_hash_fn, NULL);
+    local->tagged = 0;
     local->locked = 0;
   }
+  if (entrypool_init(&local->entrypool,
+                     sizeof(struct synproxy_hash_entry),
+                     synproxy->conf->conntablesize,
+                     synproxy->conf->hugepages, locked) != 0 ||
+      entrypool_init(&local->coldpool,
+                     sizeof(struct synproxy_hash_cold),
+                     synproxy->conf->conntablesize,
+                     synproxy->conf->hugepages, locked) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "WORKER", "can't allocate conn entry pool");
+    abort();
+  }
   timer_linkheap_init(&local->timers);
+  timer_wheel_init(&local->conntimers, 0);
+  local->wheel_timer.fn = synproxy_wheel_fn;
+  local->wheel_timer.userdata = local;
+  local->wheel_timer_armed = 0;
   if (deterministic)
   {
     secret_init_deterministic(&local->info);
@@ -226,37 +382,104 @@ static inline void worker_local_init(
   {
     secret_init_random(&local->info);
   }
-  local->ratelimit.hash_size = synproxy->conf->ratehash.size;
-  local->ratelimit.batch_size = 16384;
-  if (local->ratelimit.batch_size > local->ratelimit.hash_size)
-  {
-    local->ratelimit.batch_size = local->ratelimit.hash_size;
-  }
-  local->ratelimit.initial_tokens = synproxy->conf->ratehash.initial_tokens;
-  local->ratelimit.timer_add = synproxy->conf->ratehash.timer_add;
-  local->ratelimit.timer_period = synproxy->conf->ratehash.timer_period_usec;
   local->synproxied_connections = 0;
   local->direct_connections = 0;
   local->half_open_connections = 0;
-  ip_hash_init(&local->ratelimit, &local->timers, locked ? &local->rwlock : NULL);
   linked_list_head_init(&local->half_open_list);
+  memset(&local->halfopen, 0, sizeof(local->halfopen));
+  local->halfopen.max = synproxy->conf->halfopen_cache_max;
+  local->halfopen.limit = local->halfopen.max;
+  local->halfopen.adaptive =
+    synproxy->conf->halfopen_cache_adaptive && local->halfopen.max > 0;
+  local->halfopen.timer.time64 = gettime64() + HALFOPEN_WINDOW_USEC;
+  local->halfopen.timer.fn = synproxy_halfopen_adapt_fn;
+  local->halfopen.timer.userdata = local;
+  timer_linkheap_add(&local->timers, &local->halfopen.timer);
+  local->repl = NULL;
+  local->replin = NULL;
 }
 
 static inline void worker_local_free(struct worker_local *local)
 {
   struct hash_list_node *x, *n;
   size_t bucket;
-  ip_hash_free(&local->ratelimit, &local->timers);
-  HASH_TABLE_FOR_EACH_SAFE(&local->hash, bucket, n, x)
+  if (local->tagged)
   {
-    struct synproxy_hash_entry *e;
-    e = CONTAINER_OF(n, struct synproxy_hash_entry, node);
-    hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
-    timer_linkheap_remove(&local->timers, &e->timer);
-    free(e);
+    void *entry;
+    int slot;
+    FLOWTABLE_FOR_EACH(&local->flowtable, bucket, slot, entry)
+    {
+      struct synproxy_hash_entry *e = entry;
+      timer_wheel_remove(&local->conntimers, &e->timer);
+      synproxy_hash_entry_free(local, e);
+    }
+    flowtable_free(&local->flowtable);
+  }
+  else
+  {
+    HASH_TABLE_FOR_EACH_SAFE(&local->hash, bucket, n, x)
+    {
+      struct synproxy_hash_entry *e;
+      e = CONTAINER_OF(n, struct synproxy_hash_entry, node);
+      hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
+      timer_wheel_remove(&local->conntimers, &e->timer);
+      synproxy_hash_entry_free(local, e);
+    }
+    hash_table_free(&local->hash);
   }
-  hash_table_free(&local->hash);
+  if (local->wheel_timer_armed)
+  {
+    timer_linkheap_remove(&local->timers, &local->wheel_timer);
+  }
+  timer_linkheap_remove(&local->timers, &local->halfopen.timer);
   timer_linkheap_free(&local->timers);
+  entrypool_free(&local->entrypool);
+  entrypool_free(&local->coldpool);
+}
+
+/*
+ * Returns -ENOSPC if the tagged table is full. The chained table can't fail.
+ */
+static inline int synproxy_conntable_add(
+  struct worker_local *local, struct synproxy_hash_entry *e,
+  int already_bucket_locked)
+{
+  if (local->tagged)
+  {
+    return flowtable_add(&local->flowtable, synproxy_hash(e), e);
+  }
+  if (already_bucket_locked)
+  {
+    hash_table_add_nogrow_already_bucket_locked(
+      &local->hash, &e->node, synproxy_hash(e));
+  }
+  else
+  {
+    hash_table_add_nogrow(&local->hash, &e->node, synproxy_hash(e));
+  }
+  return 0;
+}
+
+static inline void synproxy_conntable_delete(
+  struct worker_local *local, struct synproxy_hash_entry *e,
+  int already_bucket_locked)
+{
+  if (local->tagged)
+  {
+    if (flowtable_delete(&local->flowtable, synproxy_hash(e), e) != 0)
+    {
+      abort();
+    }
+    return;
+  }
+  if (already_bucket_locked)
+  {
+    hash_table_delete_already_bucket_locked(&local->hash, &e->node);
+  }
+  else
+  {
+    hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
+  }
 }
 
 struct synproxy_hash_ctx {
@@ -270,7 +493,10 @@ static inline void synproxy_hash_unlock(
 {
   if (ctx->locked)
   {
-    hash_table_unlock_bucket(&local->hash, ctx->hashval);
+    if (!local->tagged)
+    {
+      hash_table_unlock_bucket(&local->hash, ctx->hashval);
+    }
     ctx->locked = 0;
   }
 }
@@ -308,21 +534,95 @@ static inline int ipmemequal(const void *a, const void *b, size_t sz)
   }
 }
 
-static inline struct synproxy_hash_entry *synproxy_hash_get(
-  struct worker_local *local, int version,
-  const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port, struct synproxy_hash_ctx *ctx)
+static inline uint32_t synproxy_hash_separate46(
+  int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port)
 {
-  struct hash_list_node *node;
-  int len;
   if (version == 4)
   {
-    ctx->hashval = synproxy_hash_separate4(hdr_get32n(local_ip), local_port, hdr_get32n(remote_ip), remote_port);
-    len = 4;
+    return synproxy_hash_separate4(hdr_get32n(local_ip), local_port, hdr_get32n(remote_ip), remote_port);
   }
   else
   {
-    ctx->hashval = synproxy_hash_separate6(local_ip, local_port, remote_ip, remote_port);
-    len = 16;
+    return synproxy_hash_separate6(local_ip, local_port, remote_ip, remote_port);
+  }
+}
+
+static inline void synproxy_hash_prefetch_bucket(
+  struct worker_local *local, uint32_t hashval)
+{
+  if (local->tagged)
+  {
+    flowtable_prefetch(&local->flowtable, hashval);
+    return;
+  }
+  __builtin_prefetch(&local->hash.buckets[hashval % local->hash.bucketcnt]);
+}
+
+/*
+ * Done without the bucket lock: the worst that can happen is a useless
+ * prefetch.
+ */
+static inline void synproxy_hash_prefetch_entry(
+  struct worker_local *local, uint32_t hashval)
+{
+  struct hash_list_node *node;
+  if (local->tagged)
+  {
+    struct flowtable_bucket *b = flowtable_home(&local->flowtable, hashval);
+    uint64_t match = flowtable_match(b->tags, flowtable_tag(hashval));
+    if (match)
+    {
+      __builtin_prefetch(b->entries[__builtin_ctzll(match) / 8]);
+    }
+    return;
+  }
+  HASH_TABLE_FOR_EACH_POSSIBLE(&local->hash, node, hashval)
+  {
+    __builtin_prefetch(CONTAINER_OF(node, struct synproxy_hash_entry, node));
+    break;
+  }
+}
+
+struct synproxy_hash_key {
+  int version;
+  const void *local_ip;
+  const void *remote_ip;
+  uint16_t local_port;
+  uint16_t remote_port;
+};
+
+static inline int synproxy_hash_key_eq(const void *entry, const void *key)
+{
+  const struct synproxy_hash_entry *e = entry;
+  const struct synproxy_hash_key *k = key;
+  int len = (k->version == 4) ? 4 : 16;
+  return e->version == k->version
+      && ipmemequal(&e->local_ip, k->local_ip, len)
+      && e->local_port == k->local_port
+      && ipmemequal(&e->remote_ip, k->remote_ip, len)
+      && e->remote_port == k->remote_port;
+}
+
+static inline struct synproxy_hash_entry *synproxy_hash_get_hashed(
+  struct worker_local *local, int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port, uint32_t hashval, struct synproxy_hash_ctx *ctx)
+{
+  struct hash_list_node *node;
+  int len = (version == 4) ? 4 : 16;
+  ctx->hashval = hashval;
+  if (local->tagged)
+  {
+    struct synproxy_hash_key key = {
+      .version = version,
+      .local_ip = local_ip,
+      .remote_ip = remote_ip,
+      .local_port = local_port,
+      .remote_port = remote_port,
+    };
+    ctx->locked = 1;
+    return flowtable_get(
+      &local->flowtable, hashval, synproxy_hash_key_eq, &key);
   }
   if (!ctx->locked)
   {
@@ -346,6 +646,16 @@ static inline struct synproxy_hash_entry *synproxy_hash_get(
   return NULL;
 }
 
+static inline struct synproxy_hash_entry *synproxy_hash_get(
+  struct worker_local *local, int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip, uint16_t remote_port, struct synproxy_hash_ctx *ctx)
+{
+  uint32_t hashval;
+  hashval = synproxy_hash_separate46(version, local_ip, local_port, remote_ip, remote_port);
+  return synproxy_hash_get_hashed(
+    local, version, local_ip, local_port, remote_ip, remote_port, hashval, ctx);
+}
+
 static inline struct synproxy_hash_entry *synproxy_hash_get4(
   struct worker_local *local,
   uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port, struct synproxy_hash_ctx *ctx)
@@ -365,6 +675,53 @@ struct synproxy_hash_entry *synproxy_hash_put(
   uint8_t was_synproxied,
   uint64_t time64);
 
+/*
+ * Adds a copy of an entry saved by a checkpoint, expiring at the time64 of
+ * its timer. Returns -EEXIST if the connection is already in the table,
+ * -ENOMEM if the entry pool is empty or -ENOSPC if the table is full.
+ */
+int synproxy_hash_put_restored(
+  struct worker_local *local, const struct synproxy_hash_entry *saved,
+  uint64_t time64);
+
+/*
+ * Applies an entry replicated from the peer: adds it, or updates the state
+ * and timeout if the connection is already in the table. Returns -EBUSY if
+ * the connection is in handshake here, else as synproxy_hash_put_restored().
+ */
+int synproxy_hash_put_replicated(
+  struct worker_local *local, const struct synproxy_hash_entry *saved,
+  uint64_t time64);
+
+/*
+ * Deletes the connection of an entry the peer has deleted, unless the entry
+ * here expires more than a second later than the peer's one, which means an
+ * update crossed the delete.
+ */
+void synproxy_hash_del_replicated(
+  struct worker_local *local, const struct synproxy_hash_entry *saved);
+
+/*
+ * Copies the entry of a connection to out without any locks, for reading a
+ * table that packet processing is using. The entry pools and tables are
+ * never freed while running, so a stale pointer only gives a stale entry; the
+ * copy is taken only if the entry still has the same connection after it.
+ * Fields may still be torn by a concurrent update. Returns -ENOENT if the
+ * connection isn't found.
+ */
+int synproxy_hash_peek(
+  struct worker_local *local, int version,
+  const void *local_ip, uint16_t local_port, const void *remote_ip,
+  uint16_t remote_port, struct synproxy_hash_entry *out);
+
+/*
+ * Adds the connections of the test_connections option. If dispatched, each
+ * goes only to the table that the software dispatcher sends it to. Otherwise
+ * the queue picked by the NIC isn't known, so each goes to every table.
+ */
+void synproxy_put_test_connections(
+  struct worker_local *local, int num_local, int dispatched);
+
 static inline void synproxy_hash_put_connected(
   struct worker_local *local,
   int version,
@@ -391,7 +748,17 @@ static inline void synproxy_init(
 {
   synproxy->conf = conf;
   sack_ip_port_hash_init(&synproxy->autolearn, conf->learnhashsize);
-  threetuplectx_init(&synproxy->threetuplectx);
+  threetuplectx_init(&synproxy->threetuplectx, conf->commandedhashsize);
+  if (ratelimit_init(&synproxy->ratelimit, &conf->ratehash) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "SYNPROXY", "can't allocate rate limiter");
+    abort();
+  }
+  if (hitters_init(&synproxy->hitters, &conf->hitters, &conf->ratehash) != 0)
+  {
+    log_log(LOG_LEVEL_CRIT, "SYNPROXY", "can't allocate heavy hitter sketch");
+    abort();
+  }
 }
 
 static inline void synproxy_free(
@@ -400,14 +767,16 @@ static inline void synproxy_free(
   synproxy->conf = NULL;
   sack_ip_port_hash_free(&synproxy->autolearn);
   threetuplectx_free(&synproxy->threetuplectx);
+  ratelimit_free(&synproxy->ratelimit);
+  hitters_free(&synproxy->hitters);
 }
 
 static inline void synproxy_hash_del(
   struct worker_local *local,
   struct synproxy_hash_entry *e)
 {
-  hash_table_delete(&local->hash, &e->node, synproxy_hash(e));
-  timer_linkheap_remove(&local->timers, &e->timer);
+  synproxy_conntable_delete(local, e, 0);
+  timer_wheel_remove(&local->conntimers, &e->timer);
   if (e->was_synproxied)
   {
     local->synproxied_connections--;
@@ -418,10 +787,10 @@ static inline void synproxy_hash_del(
   }
   if (e->flag_state == FLAG_STATE_DOWNLINK_HALF_OPEN)
   {
-    linked_list_delete(&e->state_data.downlink_half_open.listnode);
+    linked_list_delete(&e->cold->state_data.downlink_half_open.listnode);
     local->half_open_connections--;
   }
-  free(e);
+  synproxy_hash_entry_free(local, e);
 }
 
 int downlink(
@@ -432,4 +801,27 @@ int uplink(
   struct synproxy *synproxy, struct worker_local *local, struct packet *pkt,
   struct port *port, uint64_t time64, struct ll_alloc_st *st);
 
+/*
+ * Burst versions of downlink() and uplink(). The return value of processing
+ * pkts[i] is stored to rets[i]. Hash values are calculated and the connection
+ * table prefetched for the whole burst before processing any packet.
+ */
+void downlink_burst(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkts,
+  int *rets, size_t num, struct port *port, uint64_t time64,
+  struct ll_alloc_st *st);
+
+void uplink_burst(
+  struct synproxy *synproxy, struct worker_local *local, struct packet *pkts,
+  int *rets, size_t num, struct port *port, uint64_t time64,
+  struct ll_alloc_st *st);
+
+/*
+ * Tells whether the TCP packet belongs to a known connection that was
+ * synproxied, looking it up from either end. Takes no locks, so it's safe
+ * to call from any thread and with a bucket lock held.
+ */
+int synproxy_is_synproxied(
+  struct worker_local *local, void *ether, size_t ether_len);
+
 #endif
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "timerwheel.h"
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t time64)
+{
+  memset(w->slots, 0, sizeof(w->slots));
+  w->count = 0;
+  w->tick = time64 >> TIMER_WHEEL_SHIFT;
+}
+
+static struct timer_wheel_link *detach_slot(struct timer_wheel_link **slot)
+{
+  struct timer_wheel_link *list = *slot;
+  *slot = NULL;
+  return list;
+}
+
+struct timer_wheel_link *timer_wheel_advance(
+  struct timer_wheel *w, uint64_t time64)
+{
+  uint64_t now_tick = time64 >> TIMER_WHEEL_SHIFT;
+  struct timer_wheel_link *expired = NULL;
+  while (w->tick <= now_tick)
+  {
+    uint64_t t = w->tick;
+    struct timer_wheel_link *list, *link;
+    int level;
+    if (w->count == 0)
+    {
+      w->tick = now_tick + 1;
+      break;
+    }
+    // Cascade from the highest level so that timers can fall several levels
+    for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+      int bits = TIMER_WHEEL_LEVEL_BITS*level;
+      if ((t & ((1ULL<<bits) - 1)) != 0)
+      {
+        continue;
+      }
+      list = detach_slot(&w->slots[level][(t >> bits) & (TIMER_WHEEL_SLOTS - 1)]);
+      while (list)
+      {
+        link = list;
+        list = link->next;
+        timer_wheel_link_in(w, link);
+      }
+    }
+    list = detach_slot(&w->slots[0][t & (TIMER_WHEEL_SLOTS - 1)]);
+    w->tick = t + 1;
+    while (list)
+    {
+      link = list;
+      list = link->next;
+      // The deadline may have been moved later by timer_wheel_touch()
+      if (timer_wheel_deadline_tick(timer_wheel_time(link)) > t)
+      {
+        timer_wheel_link_in(w, link);
+        continue;
+      }
+      link->pprev = NULL;
+      link->next = expired;
+      expired = link;
+      w->count--;
+    }
+  }
+  return expired;
+}
@@ -0,0 +1,162 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Hierarchical timer wheel for connection timeouts. 4 levels of 64 slots,
+ * level 0 tick is 2^16 microseconds (65.5 ms), so the wheel spans 12.7 days.
+ * Insert and remove are O(1).
+ *
+ * Timers are re-armed lazily: moving the deadline later is just a store to
+ * time64, and when the slot the timer was filed under comes, the timer is
+ * filed again if its deadline hasn't passed. Only moving the deadline earlier
+ * than the slot requires moving the timer.
+ *
+ * Not thread safe, except timer_wheel_touch() which may be called without
+ * the lock of the wheel, as long as its callers for one timer are serialized.
+ */
+
+#define TIMER_WHEEL_SHIFT 16
+#define TIMER_WHEEL_TICK (1ULL<<TIMER_WHEEL_SHIFT)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1<<TIMER_WHEEL_LEVEL_BITS)
+
+struct timer_wheel_link {
+  struct timer_wheel_link *next;
+  struct timer_wheel_link **pprev; // NULL if not in wheel
+  _Atomic uint64_t time64; // deadline
+  uint64_t armed; // tick of the slot the timer is filed under
+};
+
+struct timer_wheel {
+  uint64_t tick; // next tick to process
+  size_t count;
+  struct timer_wheel_link *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t time64);
+
+/*
+ * Rebases an empty wheel to the given time. No-op if the wheel has timers.
+ */
+static inline void timer_wheel_set_time(struct timer_wheel *w, uint64_t time64)
+{
+  if (w->count == 0)
+  {
+    w->tick = time64 >> TIMER_WHEEL_SHIFT;
+  }
+}
+
+static inline uint64_t timer_wheel_deadline_tick(uint64_t time64)
+{
+  return (time64 + TIMER_WHEEL_TICK - 1) >> TIMER_WHEEL_SHIFT;
+}
+
+static inline uint64_t timer_wheel_time(const struct timer_wheel_link *link)
+{
+  return atomic_load_explicit(&link->time64, memory_order_relaxed);
+}
+
+static inline void timer_wheel_link_in(
+  struct timer_wheel *w, struct timer_wheel_link *link)
+{
+  uint64_t armed = timer_wheel_deadline_tick(timer_wheel_time(link));
+  struct timer_wheel_link **slot;
+  int level;
+  const int allbits = TIMER_WHEEL_LEVEL_BITS*TIMER_WHEEL_LEVELS;
+  if (armed < w->tick)
+  {
+    armed = w->tick;
+  }
+  if ((armed >> allbits) != (w->tick >> allbits))
+  {
+    // Too far away, fires early and gets filed again
+    armed = w->tick | ((1ULL<<allbits) - 1);
+  }
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+  {
+    int bits = TIMER_WHEEL_LEVEL_BITS*(level+1);
+    if ((armed >> bits) == (w->tick >> bits))
+    {
+      break;
+    }
+  }
+  link->armed = armed;
+  slot = &w->slots[level][(armed >> (TIMER_WHEEL_LEVEL_BITS*level)) &
+                          (TIMER_WHEEL_SLOTS - 1)];
+  link->next = *slot;
+  if (link->next)
+  {
+    link->next->pprev = &link->next;
+  }
+  link->pprev = slot;
+  *slot = link;
+}
+
+static inline void timer_wheel_link_out(struct timer_wheel_link *link)
+{
+  *link->pprev = link->next;
+  if (link->next)
+  {
+    link->next->pprev = link->pprev;
+  }
+  link->next = NULL;
+  link->pprev = NULL;
+}
+
+static inline void timer_wheel_add(
+  struct timer_wheel *w, struct timer_wheel_link *link)
+{
+  timer_wheel_link_in(w, link);
+  w->count++;
+}
+
+static inline void timer_wheel_remove(
+  struct timer_wheel *w, struct timer_wheel_link *link)
+{
+  if (link->pprev == NULL)
+  {
+    return;
+  }
+  timer_wheel_link_out(link);
+  w->count--;
+}
+
+/*
+ * Sets a new deadline. Does nothing else unless the deadline moves before the
+ * slot the timer is in, or the timer isn't in the wheel.
+ */
+static inline void timer_wheel_modify(
+  struct timer_wheel *w, struct timer_wheel_link *link, uint64_t time64)
+{
+  atomic_store_explicit(&link->time64, time64, memory_order_relaxed);
+  if (link->pprev != NULL && timer_wheel_deadline_tick(time64) < link->armed)
+  {
+    timer_wheel_link_out(link);
+    timer_wheel_link_in(w, link);
+  }
+}
+
+/*
+ * Moves the deadline later without touching the wheel. The wheel sees the new
+ * deadline when the slot of the old one comes, and files the timer again
+ * instead of expiring it. A timer that was just expired stays expired.
+ */
+static inline void timer_wheel_touch(
+  struct timer_wheel_link *link, uint64_t time64)
+{
+  atomic_store_explicit(&link->time64, time64, memory_order_relaxed);
+}
+
+/*
+ * Processes all ticks up to time64. Timers whose deadline has passed are
+ * removed and returned as a list linked with the next field.
+ */
+struct timer_wheel_link *timer_wheel_advance(
+  struct timer_wheel *w, uint64_t time64);
+
+#endif
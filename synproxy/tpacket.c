@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "tpacket.h"
+#include "ifutil.h"
+#include "log.h"
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+#define TPACKET_RX_SIZE (TPACKET_RX_BLOCK_SIZE*TPACKET_RX_BLOCK_NR)
+#define TPACKET_TX_SIZE (TPACKET_TX_BLOCK_SIZE*TPACKET_TX_BLOCK_NR)
+#define TPACKET_TX_FRAME_NR (TPACKET_TX_SIZE/TPACKET_FRAME_SIZE)
+#define TPACKET_TX_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+static void tpacket_queue_close(struct tpacket_queue *q)
+{
+  if (q->map)
+  {
+    munmap(q->map, q->maplen);
+  }
+  if (q->fd >= 0)
+  {
+    close(q->fd);
+  }
+}
+
+static int tpacket_queue_open(
+  struct tpacket_queue *q, int ifindex, int *fanout_id)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  int val = TPACKET_V3;
+  socklen_t len = sizeof(val);
+
+  memset(q, 0, sizeof(*q));
+  // Protocol 0: nothing is received before the rings are set up
+  q->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (q->fd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't create socket: %s",
+            strerror(errno));
+    return -1;
+  }
+  if (setsockopt(q->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "no TPACKET_V3: %s", strerror(errno));
+    return -1;
+  }
+  val = 1;
+  if (setsockopt(q->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &val, sizeof(val)) != 0)
+  {
+    // Older kernels, outgoing packets are skipped in tpacket_in_nextpkts()
+    log_log(LOG_LEVEL_INFO, "TPACKET", "no PACKET_IGNORE_OUTGOING");
+  }
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = TPACKET_RX_BLOCK_SIZE;
+  req.tp_block_nr = TPACKET_RX_BLOCK_NR;
+  req.tp_frame_size = TPACKET_FRAME_SIZE;
+  req.tp_frame_nr = TPACKET_RX_SIZE/TPACKET_FRAME_SIZE;
+  req.tp_retire_blk_tov = TPACKET_RX_BLOCK_TIMEOUT_MS;
+  if (setsockopt(q->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't set RX ring: %s", strerror(errno));
+    return -1;
+  }
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = TPACKET_TX_BLOCK_SIZE;
+  req.tp_block_nr = TPACKET_TX_BLOCK_NR;
+  req.tp_frame_size = TPACKET_FRAME_SIZE;
+  req.tp_frame_nr = TPACKET_TX_FRAME_NR;
+  if (setsockopt(q->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't set TX ring: %s", strerror(errno));
+    return -1;
+  }
+  q->maplen = TPACKET_RX_SIZE + TPACKET_TX_SIZE;
+  q->map = mmap(NULL, q->maplen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_LOCKED | MAP_POPULATE, q->fd, 0);
+  if (q->map == MAP_FAILED)
+  {
+    q->map = mmap(NULL, q->maplen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, q->fd, 0);
+  }
+  if (q->map == MAP_FAILED)
+  {
+    q->map = NULL;
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't map rings: %s", strerror(errno));
+    return -1;
+  }
+  q->rx = q->map;
+  q->tx = q->map + TPACKET_RX_SIZE;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(q->fd, (struct sockaddr*)&sll, sizeof(sll)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't bind: %s", strerror(errno));
+    return -1;
+  }
+
+  // The first socket gets a new group ID from the kernel, others join it
+  if (*fanout_id < 0)
+  {
+    val = (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    if (setsockopt(q->fd, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)) != 0 ||
+        getsockopt(q->fd, SOL_PACKET, PACKET_FANOUT, &val, &len) != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "TPACKET", "can't create fanout group: %s",
+              strerror(errno));
+      return -1;
+    }
+    *fanout_id = val & 0xFFFF;
+    return 0;
+  }
+  val = (*fanout_id) | (PACKET_FANOUT_HASH << 16);
+  if (setsockopt(q->fd, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "can't join fanout group: %s",
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+struct tpacket_interface *tpacket_interface_open(
+  const char *name, int num_queues)
+{
+  struct tpacket_interface *intf;
+  int fanout_id = -1;
+  int i;
+  intf = calloc(1, sizeof(*intf));
+  if (intf == NULL)
+  {
+    return NULL;
+  }
+  snprintf(intf->name, sizeof(intf->name), "%s", name);
+  intf->ifindex = if_nametoindex(name);
+  if (intf->ifindex == 0)
+  {
+    log_log(LOG_LEVEL_ERR, "TPACKET", "no interface %s", name);
+    free(intf);
+    return NULL;
+  }
+  intf->queues = calloc(num_queues, sizeof(*intf->queues));
+  if (intf->queues == NULL)
+  {
+    free(intf);
+    return NULL;
+  }
+  for (i = 0; i < num_queues; i++)
+  {
+    intf->num_queues = i + 1;
+    if (tpacket_queue_open(&intf->queues[i], intf->ifindex, &fanout_id) != 0)
+    {
+      tpacket_interface_close(intf);
+      return NULL;
+    }
+  }
+  log_log(LOG_LEVEL_NOTICE, "TPACKET", "%s: %d queues, fanout group %d",
+          name, num_queues, fanout_id);
+  return intf;
+}
+
+void tpacket_interface_close(struct tpacket_interface *intf)
+{
+  int i;
+  for (i = 0; i < intf->num_queues; i++)
+  {
+    tpacket_queue_close(&intf->queues[i]);
+  }
+  free(intf->queues);
+  free(intf);
+}
+
+int tpacket_interface_link_wait(struct tpacket_interface *intf)
+{
+  return ifutil_link_wait(intf->name);
+}
+
+int tpacket_interface_set_promisc_mode(struct tpacket_interface *intf, int on)
+{
+  return ifutil_set_promisc_mode(intf->name, on);
+}
+
+static inline struct tpacket_block_desc *tpacket_block(
+  struct tpacket_queue *q, uint32_t block)
+{
+  return (struct tpacket_block_desc*)
+    (q->rx + (block % TPACKET_RX_BLOCK_NR)*TPACKET_RX_BLOCK_SIZE);
+}
+
+/*
+ * Gives back the blocks that have been read completely and have no packets
+ * left to deallocate.
+ */
+static void tpacket_rx_release(struct tpacket_queue *q)
+{
+  while (q->rx_release != q->rx_block &&
+         q->rx_pending[q->rx_release % TPACKET_RX_BLOCK_NR] == 0)
+  {
+    struct tpacket_block_desc *bd = tpacket_block(q, q->rx_release);
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    q->rx_release++;
+  }
+}
+
+int tpacket_in_nextpkts(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num)
+{
+  int n = 0;
+  while (n < num && q->rx_block - q->rx_release < TPACKET_RX_BLOCK_NR)
+  {
+    struct tpacket_block_desc *bd = tpacket_block(q, q->rx_block);
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+    if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER) == 0)
+    {
+      break;
+    }
+    if (q->rx_next == NULL)
+    {
+      q->rx_next = ((char*)bd) + bd->hdr.bh1.offset_to_first_pkt;
+      q->rx_pkt = 0;
+    }
+    if (q->rx_pkt == bd->hdr.bh1.num_pkts)
+    {
+      q->rx_block++;
+      q->rx_next = NULL;
+      continue;
+    }
+    hdr = (struct tpacket3_hdr*)q->rx_next;
+    q->rx_next += hdr->tp_next_offset;
+    q->rx_pkt++;
+    sll = (struct sockaddr_ll*)(((char*)hdr) + TPACKET_ALIGN(sizeof(*hdr)));
+    if (sll->sll_pkttype == PACKET_OUTGOING)
+    {
+      continue;
+    }
+    pkts[n].data = ((char*)hdr) + hdr->tp_mac;
+    pkts[n].sz = hdr->tp_snaplen;
+    q->rx_pending[q->rx_block % TPACKET_RX_BLOCK_NR]++;
+    n++;
+  }
+  tpacket_rx_release(q);
+  return n;
+}
+
+void tpacket_in_deallocate_some(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num)
+{
+  int i;
+  for (i = 0; i < num; i++)
+  {
+    size_t block = (((char*)pkts[i].data) - q->rx)/TPACKET_RX_BLOCK_SIZE;
+    q->rx_pending[block]--;
+  }
+  tpacket_rx_release(q);
+}
+
+static inline int tpacket_tx_busy(struct tpacket3_hdr *hdr)
+{
+  uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+  return (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) != 0;
+}
+
+int tpacket_out_inject(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num)
+{
+  int i, sent = 0;
+  for (i = 0; i < num; i++)
+  {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)
+      (q->tx + (q->tx_frame % TPACKET_TX_FRAME_NR)*TPACKET_FRAME_SIZE);
+    if (pkts[i].sz > TPACKET_FRAME_SIZE - TPACKET_TX_DATA_OFF)
+    {
+      q->tx_drops++;
+      continue;
+    }
+    if (tpacket_tx_busy(hdr))
+    {
+      // Ring full of queued frames, send them before dropping
+      tpacket_out_txsync(q);
+      if (tpacket_tx_busy(hdr))
+      {
+        q->tx_drops++;
+        continue;
+      }
+    }
+    memcpy(((char*)hdr) + TPACKET_TX_DATA_OFF, pkts[i].data, pkts[i].sz);
+    hdr->tp_len = pkts[i].sz;
+    hdr->tp_snaplen = pkts[i].sz;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                     __ATOMIC_RELEASE);
+    q->tx_frame++;
+    sent++;
+  }
+  return sent;
+}
+
+int tpacket_out_txsync(struct tpacket_queue *q)
+{
+  if (send(q->fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+      errno != EAGAIN && errno != ENOBUFS)
+  {
+    return -1;
+  }
+  return 0;
+}
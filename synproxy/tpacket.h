@@ -0,0 +1,77 @@
+#ifndef _TPACKET_H_
+#define _TPACKET_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+#include "ldp.h"
+
+/*
+ * PACKET_MMAP I/O for interfaces given with the tpacket: prefix, with the
+ * same batch interface as LDP queues.
+ *
+ * Every queue is a packet socket with a TPACKET_V3 RX ring of blocks and a TX
+ * ring of frames. The sockets of an interface are in one PACKET_FANOUT_HASH
+ * group, so the kernel spreads flows over the queues by a symmetric hash.
+ *
+ * An RX block is given back to the kernel when all of its packets returned by
+ * tpacket_in_nextpkts() have been deallocated. A partially filled block is
+ * retired after TPACKET_RX_BLOCK_TIMEOUT_MS.
+ *
+ * A queue must be used by one thread at a time.
+ */
+
+#define TPACKET_RX_BLOCK_SIZE (1<<16)
+#define TPACKET_RX_BLOCK_NR 256
+#define TPACKET_RX_BLOCK_TIMEOUT_MS 1
+#define TPACKET_TX_BLOCK_SIZE (1<<16)
+#define TPACKET_TX_BLOCK_NR 64
+#define TPACKET_FRAME_SIZE 2048
+
+struct tpacket_queue {
+  int fd;
+  char *map;
+  size_t maplen;
+  char *rx;
+  char *tx;
+  uint32_t rx_block; // next block to read
+  uint32_t rx_pkt; // packets already read from rx_block
+  char *rx_next; // next packet in rx_block
+  uint32_t rx_release; // next block to give back
+  uint32_t rx_pending[TPACKET_RX_BLOCK_NR]; // read, not deallocated
+  uint32_t tx_frame;
+  uint64_t tx_drops;
+};
+
+struct tpacket_interface {
+  char name[IF_NAMESIZE];
+  int ifindex;
+  int num_queues;
+  struct tpacket_queue *queues;
+};
+
+struct tpacket_interface *tpacket_interface_open(
+  const char *name, int num_queues);
+
+void tpacket_interface_close(struct tpacket_interface *intf);
+
+int tpacket_interface_link_wait(struct tpacket_interface *intf);
+
+int tpacket_interface_set_promisc_mode(struct tpacket_interface *intf, int on);
+
+int tpacket_in_nextpkts(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num);
+
+void tpacket_in_deallocate_some(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num);
+
+/*
+ * Queues packets to the TX ring. They are sent by tpacket_out_txsync(), or
+ * when the ring is full.
+ */
+int tpacket_out_inject(
+  struct tpacket_queue *q, struct ldp_packet *pkts, int num);
+
+int tpacket_out_txsync(struct tpacket_queue *q);
+
+#endif
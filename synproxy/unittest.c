@@ -1,6 +1,13 @@
 #define _GNU_SOURCE
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "synproxy.h"
+#include "capture.h"
+#include "checkpoint.h"
+#include "replicate.h"
+#include "dispatch.h"
+#include "ctrl.h"
 #include "iphdr.h"
 #include "ipcksum.h"
 #include "packet.h"
@@ -1420,6 +1427,11 @@ static void three_way_handshake_impl(
     log_log(LOG_LEVEL_ERR, "UNIT", "invalid flag state");
     exit(1);
   }
+  if (e->cold != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "handshake state not freed");
+    exit(1);
+  }
 }
 
 static void synproxy_handshake_impl(
@@ -1866,6 +1878,11 @@ static void synproxy_handshake_impl(
       log_log(LOG_LEVEL_ERR, "UNIT", "invalid flag state");
       exit(1);
     }
+    if (e->cold != NULL)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "handshake state not freed");
+      exit(1);
+    }
   }
 }
 
@@ -3741,72 +3758,1432 @@ static void syn_proxy_handshake_1_1_1_zerowindowprobe(int version)
   synproxy_free(&synproxy);
 }
 
-int main(int argc, char **argv)
-{
-  argv0 = argv[0];
-
-  hash_seed_init();
-  setlinebuf(stdout);
+#define BURST_TEST_COUNT 100
 
-  three_way_handshake_four_way_fin(4);
-  three_way_handshake_four_way_fin(6);
+static void burst_fill(
+  char *pkt, size_t sz, int version, const void *src, const void *dst,
+  uint16_t sport, uint16_t dport, int ack, uint32_t seq, uint32_t acknum)
+{
+  void *ether, *ip, *tcp;
+  char cli_mac[6] = {0x02,0,0,0,0,0x04};
+  char lan_mac[6] = {0x02,0,0,0,0,0x01};
+  ether = pkt;
+  memset(pkt, 0, sz);
+  memcpy(ether_dst(ether), ack ? cli_mac : lan_mac, 6);
+  memcpy(ether_src(ether), ack ? lan_mac : cli_mac, 6);
+  ether_set_type(ether, version == 4 ? ETHER_TYPE_IP : ETHER_TYPE_IPV6);
+  ip = ether_payload(ether);
+  ip_set_version(ip, version);
+  ip46_set_min_hdr_len(ip);
+  ip46_set_payload_len(ip, 20);
+  ip46_set_dont_frag(ip, 1);
+  ip46_set_id(ip, 0);
+  ip46_set_ttl(ip, 64);
+  ip46_set_proto(ip, 6);
+  ip46_set_src(ip, src);
+  ip46_set_dst(ip, dst);
+  ip46_set_hdr_cksum_calc(ip);
+  tcp = ip46_payload(ip);
+  tcp_set_src_port(tcp, sport);
+  tcp_set_dst_port(tcp, dport);
+  tcp_set_syn_on(tcp);
+  if (ack)
+  {
+    tcp_set_ack_on(tcp);
+    tcp_set_ack_number(tcp, acknum);
+  }
+  tcp_set_data_offset(tcp, 20);
+  tcp_set_seq_number(tcp, seq);
+  tcp46_set_cksum_calc(ip);
+}
 
-  established_rst_uplink(4);
-  established_rst_uplink(6);
+static void pool_exhaustion(void)
+{
+  struct synproxy synproxy;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx = {};
+  uint32_t src;
+  uint32_t dst = htonl((11<<24)|7);
+  uint64_t time64;
+  int i;
 
-  established_rst_downlink(4);
-  established_rst_downlink(6);
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  conf.conntablesize = 16;
+  synproxy_init(&synproxy, &conf);
+  worker_local_init(&local, &synproxy, 1, 0);
+  time64 = gettime64();
 
-  closed_port(4);
-  closed_port(6);
+  for (i = 0; i < 16; i++)
+  {
+    src = htonl((10<<24)|i);
+    if (synproxy_hash_put(&local, 4, &src, 12345, &dst, 80, 0, time64) == NULL)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "entry pool exhausted too early");
+      exit(1);
+    }
+  }
+  src = htonl((10<<24)|16);
+  if (synproxy_hash_put(&local, 4, &src, 12345, &dst, 80, 0, time64) != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "entry pool not exhausted");
+    exit(1);
+  }
+  if (worker_local_alloc_failures(&local) != 1)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "entry pool failure not counted");
+    exit(1);
+  }
+  src = htonl((10<<24)|0);
+  e = synproxy_hash_get(&local, 4, &src, 12345, &dst, 80, &ctx);
+  synproxy_hash_unlock(&local, &ctx);
+  if (e == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "entry not found");
+    exit(1);
+  }
+  synproxy_hash_del(&local, e);
+  src = htonl((10<<24)|16);
+  if (synproxy_hash_put(&local, 4, &src, 12345, &dst, 80, 0, time64) == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "freed entry not reused");
+    exit(1);
+  }
 
-  three_way_handshake_ulretransmit(4);
-  three_way_handshake_ulretransmit(6);
+  worker_local_free(&local);
+  synproxy_free(&synproxy);
+}
 
-  three_way_handshake_dlretransmit(4);
-  three_way_handshake_dlretransmit(6);
+static void run_timers(struct worker_local *local, uint64_t time64)
+{
+  while (timer_linkheap_next_expiry_time(&local->timers) < time64)
+  {
+    struct timer_link *timer;
+    timer = timer_linkheap_next_expiry_timer(&local->timers);
+    timer_linkheap_remove(&local->timers, timer);
+    timer->fn(timer, &local->timers, timer->userdata);
+  }
+}
 
-  three_way_handshake_finulretransmit(4);
-  three_way_handshake_finulretransmit(6);
+static void timer_expiry(void)
+{
+  struct synproxy synproxy;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx = {};
+  uint32_t src1 = htonl((10<<24)|1);
+  uint32_t src2 = htonl((10<<24)|2);
+  uint32_t src3 = htonl((10<<24)|3);
+  uint32_t dst = htonl((11<<24)|7);
+  uint64_t time64;
 
-  three_way_handshake_findlretransmit(4);
-  three_way_handshake_findlretransmit(6);
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  worker_local_init(&local, &synproxy, 1, 0);
+  time64 = gettime64();
 
-  syn_proxy_handshake(4);
-  syn_proxy_handshake(6);
+  synproxy_hash_put_connected(&local, 4, &src1, 12345, &dst, 80, time64);
+  synproxy_hash_put_connected(&local, 4, &src2, 12345, &dst, 80, time64);
+  e = synproxy_hash_get(&local, 4, &src2, 12345, &dst, 80, &ctx);
+  synproxy_hash_unlock(&local, &ctx);
+  timer_wheel_modify(
+    &local.conntimers, &e->timer, time64 + 100000ULL*1000ULL*1000ULL);
+  synproxy_hash_put_connected(&local, 4, &src3, 12345, &dst, 80, time64);
+  e = synproxy_hash_get(&local, 4, &src3, 12345, &dst, 80, &ctx);
+  timer_wheel_touch(&e->timer, time64 + 100000ULL*1000ULL*1000ULL);
+  synproxy_hash_unlock(&local, &ctx);
+
+  run_timers(&local, time64 + 86399ULL*1000ULL*1000ULL);
+  if (local.direct_connections != 3)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "connection expired too early");
+    exit(1);
+  }
+  run_timers(&local, time64 + 86401ULL*1000ULL*1000ULL);
+  if (synproxy_hash_get(&local, 4, &src1, 12345, &dst, 80, &ctx) != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "connection not expired");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local, &ctx);
+  if (synproxy_hash_get(&local, 4, &src2, 12345, &dst, 80, &ctx) == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "extended connection expired");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local, &ctx);
+  if (synproxy_hash_get(&local, 4, &src3, 12345, &dst, 80, &ctx) == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "touched connection expired");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local, &ctx);
+  run_timers(&local, time64 + 100001ULL*1000ULL*1000ULL);
+  if (local.direct_connections != 0 || local.wheel_timer_armed)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "extended connection not expired");
+    exit(1);
+  }
 
-  syn_proxy_handshake_2_1_1(4);
-  syn_proxy_handshake_2_1_1(6);
+  worker_local_free(&local);
+  synproxy_free(&synproxy);
+}
 
-  syn_proxy_handshake_1_2_1(4);
-  syn_proxy_handshake_1_2_1(6);
+static void ratelimit_tokens(void)
+{
+  struct ratehashconf rconf = {
+    .size = 1024,
+    .timer_period_usec = 1000,
+    .timer_add = 5,
+    .initial_tokens = 10,
+    .network_prefix = 24,
+    .network_prefix6 = 64,
+  };
+  struct ratelimit rl;
+  uint32_t net1 = (10<<24)|(1<<8);
+  uint32_t net2 = (10<<24)|(2<<8);
+  uint64_t time64 = 1000*1000;
+  int i;
 
-  syn_proxy_handshake_1_1_2(4);
-  syn_proxy_handshake_1_1_2(6);
+  if (ratelimit_init(&rl, &rconf) != 0)
+  {
+    abort();
+  }
+  for (i = 0; i < 10; i++)
+  {
+    if (!ratelimit_ip_permitted(&rl, net1 | i, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "SYN ratelimited too early");
+      exit(1);
+    }
+  }
+  if (ratelimit_ip_permitted(&rl, net1 | 99, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "network not ratelimited");
+    exit(1);
+  }
+  if (ratelimit_hash4(&rl, net1) % rconf.size !=
+      ratelimit_hash4(&rl, net2) % rconf.size &&
+      !ratelimit_ip_permitted(&rl, net2, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "other network ratelimited");
+    exit(1);
+  }
+  ratelimit_ip_completed(&rl, net1, time64);
+  if (!ratelimit_ip_permitted(&rl, net1, time64) ||
+      ratelimit_ip_permitted(&rl, net1, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "completed handshake didn't give a token");
+    exit(1);
+  }
+  time64 += 1000;
+  for (i = 0; i < 5; i++)
+  {
+    if (!ratelimit_ip_permitted(&rl, net1, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "tokens not refilled");
+      exit(1);
+    }
+  }
+  if (ratelimit_ip_permitted(&rl, net1, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "too many tokens refilled");
+    exit(1);
+  }
+  time64 += 1000*1000;
+  for (i = 0; i < 10; i++)
+  {
+    if (!ratelimit_ip_permitted(&rl, net1, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "tokens not refilled to full");
+      exit(1);
+    }
+  }
+  if (ratelimit_ip_permitted(&rl, net1, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "bucket over capacity");
+    exit(1);
+  }
+  ratelimit_free(&rl);
+}
 
-  syn_proxy_handshake_1_1_1_keepalive(4);
-  syn_proxy_handshake_1_1_1_keepalive(6);
+static void heavy_hitters(void)
+{
+  struct hittersconf hconf = {
+    .size = 1024,
+    .timer_period_usec = 1000*1000,
+    .threshold = 100,
+    .topk = 4,
+  };
+  struct ratehashconf rconf = {
+    .network_prefix = 24,
+    .network_prefix6 = 64,
+  };
+  struct hitters h;
+  struct hitter top[4];
+  uint32_t net1 = (10<<24)|(1<<8);
+  uint32_t net2 = (10<<24)|(2<<8);
+  uint64_t time64 = 1000*1000;
+  int i;
 
-  syn_proxy_handshake_1_1_1_zerowindowprobe(4);
-  syn_proxy_handshake_1_1_1_zerowindowprobe(6);
+  if (hitters_init(&h, &hconf, &rconf) != 0)
+  {
+    abort();
+  }
+  for (i = 0; i < 150; i++)
+  {
+    if (hitters_ip_permitted(&h, net1 | (i%256), 80, time64) != (i < 100))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "heavy hitter not dropped at threshold");
+      exit(1);
+    }
+  }
+  for (i = 0; i < 20; i++)
+  {
+    if (!hitters_ip_permitted(&h, net2, 80, time64) ||
+        !hitters_ip_permitted(&h, net1, 443, time64))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "other network or port dropped");
+      exit(1);
+    }
+  }
+  if (hitters_get_top(&h, top, 4) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "top list before period ended");
+    exit(1);
+  }
+  time64 += 1000*1000;
+  if (!hitters_ip_permitted(&h, net1, 80, time64))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "heavy hitter dropped in next period");
+    exit(1);
+  }
+  // Counting stops once over the threshold
+  if (hitters_get_top(&h, top, 4) != 3 ||
+      top[0].addr.ip != net1 || top[0].port != 80 || top[0].count != 101 ||
+      top[1].count != 20 || top[2].count != 20)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "invalid top list");
+    exit(1);
+  }
+  // Late samples of the previous period count in the current one
+  for (i = 0; i < 100; i++)
+  {
+    if (hitters_ip_permitted(&h, net1, 80, time64 - 1000*1000) != (i < 99))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "late sample not counted in period");
+      exit(1);
+    }
+  }
+  if (hitters_get_top(&h, top, 4) != 3 || top[0].count != 101)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "late sample rotated the period back");
+    exit(1);
+  }
+  hitters_free(&h);
+}
 
-  syn_proxy_closed_port(4);
-  syn_proxy_closed_port(6);
+static void halfopen_adaptive(void)
+{
+  struct synproxy synproxy;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  uint64_t time64;
+  int i;
 
-  syn_proxy_uplink(4);
-  syn_proxy_uplink(6);
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  conf.halfopen_cache_max = 1000;
+  conf.halfopen_cache_adaptive = 1;
+  synproxy_init(&synproxy, &conf);
+  worker_local_init(&local, &synproxy, 1, 0);
+  time64 = local.halfopen.timer.time64;
 
-  syn_proxy_downlink(4);
-  syn_proxy_downlink(6);
+  // Flood: limit halves every window and finally drops to zero
+  for (i = 0; i < 8; i++)
+  {
+    local.halfopen.syns = 10000;
+    local.halfopen.completions = 100;
+    run_timers(&local, time64 + 1);
+    time64 += HALFOPEN_WINDOW_USEC;
+    if (!local.halfopen.flood || local.halfopen.limit >= (1000U>>i))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "half-open cache not shrunk");
+      exit(1);
+    }
+  }
+  if (local.halfopen.limit != 0 || local.halfopen.last_syns != 10000)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "half-open cache not disabled");
+    exit(1);
+  }
 
-  syn_proxy_uplink_downlink(4);
-  syn_proxy_uplink_downlink(6);
+  // Normal load: limit grows back to the maximum
+  for (i = 0; i < 8; i++)
+  {
+    local.halfopen.syns = 10000;
+    local.halfopen.completions = 9000;
+    run_timers(&local, time64 + 1);
+    time64 += HALFOPEN_WINDOW_USEC;
+    if (local.halfopen.flood)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "normal load seen as flood");
+      exit(1);
+    }
+  }
+  if (local.halfopen.limit != 1000)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "half-open cache not grown");
+    exit(1);
+  }
 
-  syn_proxy_rst_uplink(4);
-  syn_proxy_rst_uplink(6);
+  worker_local_free(&local);
+  synproxy_free(&synproxy);
+}
 
-  syn_proxy_rst_downlink(4);
-  syn_proxy_rst_downlink(6);
+static void burst_handshake(int version)
+{
+  struct synproxy synproxy;
+  struct ll_alloc_st st;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct port outport;
+  struct linked_list_head head;
+  struct linkedlistfunc_userdata ud;
+  static char pkts[BURST_TEST_COUNT][14+40+20];
+  struct packet pktstructs[BURST_TEST_COUNT];
+  int rets[BURST_TEST_COUNT];
+  uint32_t isn1 = 0x12345678;
+  uint32_t isn2 = 0x87654321;
+  uint64_t time64;
+  size_t sz = ((version == 4) ? (sizeof(pkts[0]) - 20) : sizeof(pkts[0]));
+  uint32_t src4 = htonl((10<<24)|8);
+  uint32_t dst4 = htonl((11<<24)|7);
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x03};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x04};
+  void *src, *dst;
+  int i;
+  if (version == 4)
+  {
+    src = &src4;
+    dst = &dst4;
+  }
+  else
+  {
+    src = src6;
+    dst = dst6;
+  }
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+
+  worker_local_init(&local, &synproxy, 1, 0);
+
+  linked_list_head_init(&head);
+  ud.head = &head;
+  outport.userdata = &ud;
+  outport.portfunc = linkedlistfunc;
+
+  time64 = gettime64();
+
+  for (i = 0; i < BURST_TEST_COUNT; i++)
+  {
+    burst_fill(pkts[i], sz, version, src, dst, 10000 + i, 80, 0, isn1, 0);
+    pktstructs[i].data = pkts[i];
+    pktstructs[i].direction = PACKET_DIRECTION_UPLINK;
+    pktstructs[i].sz = sz;
+  }
+  uplink_burst(&synproxy, &local, pktstructs, rets, BURST_TEST_COUNT, &outport, time64, &st);
+  for (i = 0; i < BURST_TEST_COUNT; i++)
+  {
+    struct synproxy_hash_entry *e;
+    if (rets[i] != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "burst SYN not forwarded");
+      exit(1);
+    }
+    e = synproxy_hash_get(&local, version, src, 10000 + i, dst, 80, &hashctx);
+    if (e == NULL || e->flag_state != FLAG_STATE_UPLINK_SYN_SENT)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "burst SYN state entry invalid");
+      exit(1);
+    }
+  }
+  if (fetch_packet(&head) != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "extra packet out");
+    exit(1);
+  }
+
+  for (i = 0; i < BURST_TEST_COUNT; i++)
+  {
+    burst_fill(pkts[i], sz, version, dst, src, 80, 10000 + i, 1, isn2, isn1 + 1);
+    pktstructs[i].data = pkts[i];
+    pktstructs[i].direction = PACKET_DIRECTION_DOWNLINK;
+    pktstructs[i].sz = sz;
+  }
+  downlink_burst(&synproxy, &local, pktstructs, rets, BURST_TEST_COUNT, &outport, time64, &st);
+  for (i = 0; i < BURST_TEST_COUNT; i++)
+  {
+    struct synproxy_hash_entry *e;
+    if (rets[i] != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "burst SYN+ACK not forwarded");
+      exit(1);
+    }
+    e = synproxy_hash_get(&local, version, src, 10000 + i, dst, 80, &hashctx);
+    if (e == NULL || e->flag_state != FLAG_STATE_UPLINK_SYN_RCVD)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "burst SYN+ACK state entry invalid");
+      exit(1);
+    }
+  }
+  if (fetch_packet(&head) != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "extra packet out");
+    exit(1);
+  }
+
+  ll_alloc_st_free(&st);
+  worker_local_free(&local);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+static void capture_filtering(int version)
+{
+  struct synproxy synproxy;
+  struct ll_alloc_st st;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct capture_filter f;
+  char ulpkt[14+40+20];
+  char dlpkt[14+40+20];
+  char otherpkt[14+40+20];
+  size_t sz = ((version == 4) ? (sizeof(ulpkt) - 20) : sizeof(ulpkt));
+  size_t addrlen = ((version == 4) ? 4 : 16);
+  uint32_t isn;
+  uint32_t src4 = htonl((10<<24)|8);
+  uint32_t dst4 = htonl((11<<24)|7);
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x05};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x06};
+  void *src, *dst;
+  uint32_t n;
+  if (version == 4)
+  {
+    src = &src4;
+    dst = &dst4;
+  }
+  else
+  {
+    src = src6;
+    dst = dst6;
+  }
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+
+  worker_local_init(&local, &synproxy, 1, 0);
+
+  synproxy_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 12345, 54321,
+    &isn, 1, 1, 1, 0, 0);
+  burst_fill(ulpkt, sz, version, src, dst, 12345, 54321, 0, 1, 0);
+  burst_fill(dlpkt, sz, version, dst, src, 54321, 12345, 1, 1, 2);
+  burst_fill(otherpkt, sz, version, src, dst, 12346, 54321, 0, 1, 0);
+
+  capture_filter_init(&f);
+  if (!capture_filter_match(&f, NULL, ulpkt, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "empty capture filter didn't match");
+    exit(1);
+  }
+
+  f.version = version;
+  f.prefix = (version == 4) ? 24 : 120;
+  memcpy(f.addr, dst, addrlen);
+  if (!capture_filter_match(&f, NULL, ulpkt, sz) ||
+      !capture_filter_match(&f, NULL, dlpkt, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "capture prefix didn't match");
+    exit(1);
+  }
+  f.addr[0] ^= 0x80;
+  if (capture_filter_match(&f, NULL, ulpkt, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "other capture prefix matched");
+    exit(1);
+  }
+
+  capture_filter_init(&f);
+  f.port = 54321;
+  f.tcp_flags_mask = 0x12;
+  f.tcp_flags = 0x02;
+  if (!capture_filter_match(&f, NULL, ulpkt, sz) ||
+      capture_filter_match(&f, NULL, dlpkt, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "capture port or TCP flags invalid");
+    exit(1);
+  }
+
+  capture_filter_init(&f);
+  f.synproxied_only = 1;
+  if (!capture_filter_match(&f, &local, ulpkt, sz) ||
+      !capture_filter_match(&f, &local, dlpkt, sz) ||
+      capture_filter_match(&f, &local, otherpkt, sz))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "capture of synproxied flows invalid");
+    exit(1);
+  }
+
+  capture_filter_init(&f);
+  for (n = 2; n < 64; n++)
+  {
+    f.sample = n;
+    if (capture_filter_match(&f, NULL, ulpkt, sz) !=
+        capture_filter_match(&f, NULL, dlpkt, sz))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "flow sampled in one direction only");
+      exit(1);
+    }
+  }
+
+  ll_alloc_st_free(&st);
+  worker_local_free(&local);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+/*
+ * Output ports run with the bucket lock of the connection held, so a
+ * synproxied_only capture in front of them mustn't take it again.
+ */
+static void capture_synproxied_locked(int version)
+{
+  struct synproxy synproxy;
+  struct ll_alloc_st st;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct capture capture;
+  struct capture_filter f;
+  struct pcapng_out_ctx outctx;
+  struct captureport_userdata capud;
+  struct port nullport;
+  struct linked_list_head head;
+  struct linkedlistfunc_userdata ud;
+  struct packet *pktstruct;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  char ulpkt[14+40+20];
+  size_t sz = ((version == 4) ? (sizeof(ulpkt) - 20) : sizeof(ulpkt));
+  uint32_t isn;
+  uint32_t src4 = htonl((10<<24)|8);
+  uint32_t dst4 = htonl((11<<24)|7);
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x05};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x06};
+  void *src, *dst;
+  unsigned i;
+  if (version == 4)
+  {
+    src = &src4;
+    dst = &dst4;
+  }
+  else
+  {
+    src = src6;
+    dst = dst6;
+  }
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+
+  worker_local_init(&local, &synproxy, 1, 1);
+
+  synproxy_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 12345, 54321,
+    &isn, 1, 1, 1, 0, 0);
+  burst_fill(ulpkt, sz, version, src, dst, 12345, 54321, 0, 1, 0);
+
+  if (capture_init(&capture, 1) != 0)
+  {
+    abort();
+  }
+  capture.rings[0].local = &local;
+  capture_set_file(&capture, CAPTURE_FILE_OUT, &outctx);
+  capture_filter_init(&f);
+  f.synproxied_only = 1;
+  capture_set_filter(&capture, &f);
+  capture_flush(&capture.rings[0]);
+
+  linked_list_head_init(&head);
+  ud.head = &head;
+  nullport.userdata = &ud;
+  nullport.portfunc = linkedlistfunc;
+  capud.capture = &capture;
+  capud.ring = &capture.rings[0];
+  capud.next = &nullport;
+
+  for (i = 0; i < 2; i++)
+  {
+    ctx.locked = 0;
+    e = synproxy_hash_get(&local, version, src, 12345, dst, 54321, &ctx);
+    if (e == NULL || !e->was_synproxied)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "synproxied entry not found");
+      exit(1);
+    }
+    pktstruct = ll_alloc_st(&st, packet_size(sz));
+    pktstruct->data = packet_calc_data(pktstruct);
+    pktstruct->direction = i ? PACKET_DIRECTION_DOWNLINK :
+                               PACKET_DIRECTION_UPLINK;
+    pktstruct->sz = sz;
+    memcpy(pktstruct->data, ulpkt, sz);
+    captureportfunc(pktstruct, &capud);
+    synproxy_hash_unlock(&local, &ctx);
+    pktstruct = fetch_packet(&head);
+    if (pktstruct == NULL)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "captured packet not passed on");
+      exit(1);
+    }
+    ll_free_st(&st, pktstruct);
+  }
+  if (capture.rings[0].prod_priv != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "synproxied packet not captured");
+    exit(1);
+  }
+
+  capture_free(&capture);
+  ll_alloc_st_free(&st);
+  worker_local_free(&local);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+static void learnhash_snapshot(void)
+{
+  struct sack_ip_port_hash hash, hash2;
+  struct sack_hash_data data, data2;
+  char path[] = "/tmp/learnhashXXXXXX";
+  char ip6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                  0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x07};
+  char c;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd < 0)
+  {
+    abort();
+  }
+  close(fd);
+  if (sack_ip_port_hash_init(&hash, 1024) != 0 ||
+      sack_ip_port_hash_init(&hash2, 1024) != 0)
+  {
+    abort();
+  }
+  data.mss = 1200;
+  data.sack_supported = 1;
+  sack_ip_port_hash_add4(&hash, (10<<24)|1, 80, &data);
+  data.mss = 8960;
+  data.sack_supported = 0;
+  sack_ip_port_hash_add6(&hash, ip6, 0, &data);
+  if (sack_ip_port_hash_save(&hash, path) != 2 ||
+      sack_ip_port_hash_load(&hash2, path) != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "learnhash snapshot not saved and loaded");
+    exit(1);
+  }
+  if (!sack_ip_port_hash_get4(&hash2, (10<<24)|1, 80, &data2) ||
+      data2.mss != 1200 || data2.sack_supported != 1 ||
+      !sack_ip_port_hash_get6(&hash2, ip6, 0, &data2) ||
+      data2.mss != 8960 || data2.sack_supported != 0 ||
+      sack_ip_port_hash_get4(&hash2, (10<<24)|1, 0, &data2))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "learnhash snapshot entries invalid");
+    exit(1);
+  }
+
+  // Flip a bit of the last entry
+  fd = open(path, O_RDWR);
+  if (fd < 0 || lseek(fd, -32, SEEK_END) < 0 || read(fd, &c, 1) != 1)
+  {
+    abort();
+  }
+  c ^= 1;
+  if (lseek(fd, -32, SEEK_END) < 0 || write(fd, &c, 1) != 1)
+  {
+    abort();
+  }
+  close(fd);
+  if (sack_ip_port_hash_load(&hash2, path) != -EINVAL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "corrupted learnhash snapshot loaded");
+    exit(1);
+  }
+  unlink(path);
+  sack_ip_port_hash_free(&hash);
+  sack_ip_port_hash_free(&hash2);
+}
+
+static void conntable_checkpoint(void)
+{
+  struct synproxy synproxy;
+  struct worker_local local, local2;
+  struct conf conf = CONF_INITIALIZER;
+  struct checkpoint checkpoint, checkpoint2;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  char path[] = "/tmp/checkpointXXXXXX";
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x02};
+  uint32_t src4 = htonl((10<<24)|1);
+  uint32_t dst4;
+  uint64_t time64 = gettime64();
+  char c;
+  int fd, i;
+
+  fd = mkstemp(path);
+  if (fd < 0)
+  {
+    abort();
+  }
+  close(fd);
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  worker_local_init(&local, &synproxy, 1, 0);
+  // Locked, so that it's restored by several threads
+  worker_local_init(&local2, &synproxy, 1, 1);
+
+  for (i = 0; i < 100; i++)
+  {
+    dst4 = htonl((11<<24)|(i+1));
+    synproxy_hash_put_connected(&local, 4, &src4, 12345, &dst4, 80, time64);
+    ctx.locked = 0;
+    e = synproxy_hash_get(&local, 4, &src4, 12345, &dst4, 80, &ctx);
+    e->seqoffset = 1000*i;
+    e->tsoffset = i;
+    synproxy_hash_unlock(&local, &ctx);
+  }
+  e = synproxy_hash_put(&local, 6, src6, 443, dst6, 54321, 1, time64);
+  e->flag_state = FLAG_STATE_ESTABLISHED;
+  e->seqoffset = 12345678;
+  e->ulflowlabel = 0x12345;
+  // In handshake, not saved
+  e = synproxy_hash_put(&local, 6, src6, 444, dst6, 54321, 1, time64);
+  e->flag_state = FLAG_STATE_UPLINK_SYN_SENT;
+  e->cold = synproxy_hash_cold_alloc(&local);
+  e->cold->entry = e;
+
+  checkpoint_init(&checkpoint, path, &local, 1, 1);
+  checkpoint_init(&checkpoint2, path, &local2, 1, 4);
+  if (checkpoint_save(&checkpoint) != 101 ||
+      checkpoint_restore(&checkpoint2, 4) != 101)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "checkpoint not saved and restored");
+    exit(1);
+  }
+  if (local2.direct_connections != 100 || local2.synproxied_connections != 1)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "restored connection counts invalid");
+    exit(1);
+  }
+  for (i = 0; i < 100; i++)
+  {
+    dst4 = htonl((11<<24)|(i+1));
+    ctx.locked = 0;
+    e = synproxy_hash_get(&local2, 4, &src4, 12345, &dst4, 80, &ctx);
+    if (e == NULL || e->flag_state != FLAG_STATE_ESTABLISHED ||
+        e->seqoffset != (uint32_t)(1000*i) || e->tsoffset != (uint32_t)i ||
+        timer_wheel_time(&e->timer) < time64 + 86399ULL*1000ULL*1000ULL)
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "restored entry invalid");
+      exit(1);
+    }
+    synproxy_hash_unlock(&local2, &ctx);
+  }
+  ctx.locked = 0;
+  e = synproxy_hash_get(&local2, 6, src6, 443, dst6, 54321, &ctx);
+  if (e == NULL || !e->was_synproxied || e->seqoffset != 12345678 ||
+      e->ulflowlabel != 0x12345)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "restored IPv6 entry invalid");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local2, &ctx);
+  ctx.locked = 0;
+  if (synproxy_hash_get(&local2, 6, src6, 444, dst6, 54321, &ctx) != NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "handshake entry restored");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local2, &ctx);
+  if (checkpoint_restore(&checkpoint2, 4) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "existing entries restored again");
+    exit(1);
+  }
+
+  // Flip a bit of the last entry
+  fd = open(path, O_RDWR);
+  if (fd < 0 || lseek(fd, -8, SEEK_END) < 0 || read(fd, &c, 1) != 1)
+  {
+    abort();
+  }
+  c ^= 1;
+  if (lseek(fd, -8, SEEK_END) < 0 || write(fd, &c, 1) != 1)
+  {
+    abort();
+  }
+  close(fd);
+  if (checkpoint_restore(&checkpoint2, 4) != -EINVAL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "corrupted checkpoint restored");
+    exit(1);
+  }
+  unlink(path);
+  worker_local_free(&local);
+  worker_local_free(&local2);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+static void conntable_replication(int version)
+{
+  struct synproxy synproxy;
+  struct ll_alloc_st st;
+  struct worker_local local, local2;
+  struct conf conf = CONF_INITIALIZER;
+  struct replicate replicate, replicate2;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_ctx ctx;
+  char path[] = "/tmp/replicateXXXXXX";
+  char addr[64];
+  uint32_t isn;
+  uint32_t isn1 = 0x12345678;
+  uint32_t isn2 = 0x87654321;
+  uint32_t seqoffset;
+  uint32_t src4 = htonl((10<<24)|8);
+  uint32_t dst4 = htonl((11<<24)|7);
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x15};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x16};
+  void *src, *dst;
+  int fd, i;
+  if (version == 4)
+  {
+    src = &src4;
+    dst = &dst4;
+  }
+  else
+  {
+    src = src6;
+    dst = dst6;
+  }
+
+  fd = mkstemp(path);
+  if (fd < 0)
+  {
+    abort();
+  }
+  close(fd);
+  snprintf(addr, sizeof(addr), "unix:%s", path);
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+  // The standby is locked, so that the receiver applies the events itself
+  worker_local_init(&local, &synproxy, 1, 0);
+  worker_local_init(&local2, &synproxy, 1, 1);
+
+  // Established before connecting, so sent by the walk of the tables
+  synproxy_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 23456, 54321,
+    &isn, 1, 1, 1, 0, 0);
+
+  if (replicate_start(&replicate2, &local2, 1, NULL, addr) != 0 ||
+      replicate_start(&replicate, &local, 1, addr, NULL) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "can't start replication");
+    exit(1);
+  }
+  // This thread owns the table, so it walks it like an RX thread would
+  for (i = 0; i < 5000 && !atomic_load(&replicate.synced); i++)
+  {
+    replicate_poll(local.repl, NULL);
+    usleep(1000);
+  }
+  if (!atomic_load(&replicate.synced))
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "replication not connected");
+    exit(1);
+  }
+  for (i = 0; i < 5000; i++)
+  {
+    ctx.locked = 0;
+    e = synproxy_hash_get(&local2, version, src, 23456, dst, 54321, &ctx);
+    synproxy_hash_unlock(&local2, &ctx);
+    if (e != NULL)
+    {
+      break;
+    }
+    usleep(1000);
+  }
+  if (e == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "table not replicated");
+    exit(1);
+  }
+
+  synproxy_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 12345, 54321,
+    &isn, 1, 1, 1, 0, 0);
+  ctx.locked = 0;
+  e = synproxy_hash_get(&local, version, src, 12345, dst, 54321, &ctx);
+  if (e == NULL)
+  {
+    abort();
+  }
+  seqoffset = e->seqoffset;
+  synproxy_hash_unlock(&local, &ctx);
+
+  for (i = 0; i < 5000; i++)
+  {
+    ctx.locked = 0;
+    e = synproxy_hash_get(&local2, version, src, 12345, dst, 54321, &ctx);
+    if (e != NULL && e->flag_state == FLAG_STATE_ESTABLISHED &&
+        e->seqoffset == seqoffset)
+    {
+      synproxy_hash_unlock(&local2, &ctx);
+      break;
+    }
+    synproxy_hash_unlock(&local2, &ctx);
+    usleep(1000);
+  }
+  replicate_stop(&replicate);
+  replicate_stop(&replicate2);
+  if (i == 5000 || local2.synproxied_connections != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "connection not replicated");
+    exit(1);
+  }
+
+  // Fails over: the standby closes the connection
+  four_way_fin_seq_impl(
+    &synproxy, &local2, &st, version, src, dst, 12345, 54321,
+    isn1, isn2, isn,
+    1, 1);
+
+  unlink(path);
+  ll_alloc_st_free(&st);
+  worker_local_free(&local);
+  worker_local_free(&local2);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+/*
+ * Connections are replicated when they are established, both synproxied and
+ * opened directly, and an unlocked standby table applies them from its queue.
+ */
+static void replication_events(int version)
+{
+  struct synproxy synproxy;
+  struct ll_alloc_st st;
+  struct worker_local local, local2;
+  struct conf conf = CONF_INITIALIZER;
+  struct replicate_ring ring;
+  struct replicate_inq inq;
+  struct synproxy_hash_entry active, standby;
+  uint32_t isn;
+  uint32_t src4 = htonl((10<<24)|8);
+  uint32_t dst4 = htonl((11<<24)|7);
+  char src6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x17};
+  char dst6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                   0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x18};
+  void *src, *dst;
+  unsigned prod, i;
+  if (version == 4)
+  {
+    src = &src4;
+    dst = &dst4;
+  }
+  else
+  {
+    src = src6;
+    dst = dst6;
+  }
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  if (ll_alloc_st_init(&st, POOL_SIZE, BLOCK_SIZE) != 0)
+  {
+    abort();
+  }
+  worker_local_init(&local, &synproxy, 1, 0);
+  worker_local_init(&local2, &synproxy, 1, 0);
+  if (replicate_ring_init(&ring, &local, 0) != 0 ||
+      replicate_inq_init(&inq, &local2) != 0)
+  {
+    abort();
+  }
+  local.repl = &ring;
+
+  synproxy_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 12345, 54321,
+    &isn, 1, 1, 1, 0, 0);
+  three_way_handshake_impl(
+    &synproxy, &local, &st, version, src, dst, 12346, 54321, 1, 1);
+
+  prod = atomic_load(&ring.prod);
+  if (prod != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "%u events for 2 connections", prod);
+    exit(1);
+  }
+  for (i = 0; i < prod; i++)
+  {
+    const struct replicate_rec *rec = &ring.recs[i];
+    if (rec->type != REPLICATE_UPDATE ||
+        rec->entry.flag_state != FLAG_STATE_ESTABLISHED ||
+        rec->entry.local_port != 12345 + i ||
+        rec->entry.was_synproxied != (i == 0))
+    {
+      log_log(LOG_LEVEL_ERR, "UNIT", "established connection not queued");
+      exit(1);
+    }
+    if (replicate_inq_put(&inq, rec) != 0)
+    {
+      abort();
+    }
+  }
+
+  if (synproxy_hash_peek(&local, version, src, 12345, dst, 54321, &active) != 0)
+  {
+    abort();
+  }
+  if (replicate_poll(NULL, &inq) != REPLICATE_APPLY_MSEC ||
+      local2.synproxied_connections != 1 || local2.direct_connections != 1 ||
+      synproxy_hash_peek(&local2, version, src, 12345, dst, 54321,
+                         &standby) != 0 ||
+      standby.seqoffset != active.seqoffset ||
+      standby.tsoffset != active.tsoffset)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "queued events not applied");
+    exit(1);
+  }
+
+  local.repl = NULL;
+  replicate_ring_free(&ring);
+  replicate_inq_free(&inq);
+  ll_alloc_st_free(&st);
+  worker_local_free(&local);
+  worker_local_free(&local2);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+/*
+ * With the software dispatcher, a test connection is only in the table of
+ * the thread it dispatches to, otherwise in every table.
+ */
+static void test_connections(int dispatched)
+{
+  struct synproxy synproxy;
+  struct worker_local local[4];
+  struct conf conf = CONF_INITIALIZER;
+  struct synproxy_hash_entry e;
+  int i, j;
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  for (i = 0; i < 4; i++)
+  {
+    worker_local_init(&local[i], &synproxy, 1, 0);
+  }
+  synproxy_put_test_connections(local, 4, dispatched);
+  for (j = 0; j < 90*6; j++)
+  {
+    uint32_t src, dst;
+    int shard;
+    src = htonl((10<<24)|(2*j+2));
+    dst = htonl((11<<24)|(2*j+1));
+    shard = dispatch_hash_flow(4, &src, 12345, &dst, 54321) % 4;
+    for (i = 0; i < 4; i++)
+    {
+      if ((synproxy_hash_peek(&local[i], 4, &src, 12345, &dst, 54321, &e) == 0)
+          != (!dispatched || i == shard))
+      {
+        log_log(LOG_LEVEL_ERR, "UNIT", "test connection in wrong table");
+        exit(1);
+      }
+    }
+  }
+  for (i = 0; i < 4; i++)
+  {
+    worker_local_free(&local[i]);
+  }
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+static void count_threetuple_fn(const struct threetupleentry *e, void *ud)
+{
+  size_t *count = ud;
+  if (e->version == 4)
+  {
+    (*count)++;
+  }
+}
+
+static void ctrl_batch(void)
+{
+  struct threetuplectx ctx;
+  struct threetuplepayload payload;
+  char entries[4*CTRL_V2_ENTRY_SIZE] = {0};
+  char ip6[16] = {0xfd,0x80,0x00,0x00,0x00,0x00,0x00,0x00,
+                  0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01};
+  uint32_t first_failed;
+  size_t count = 0;
+  int i;
+
+  threetuplectx_init(&ctx, 256);
+  for (i = 0; i < 4; i++)
+  {
+    char *entry = &entries[i*CTRL_V2_ENTRY_SIZE];
+    entry[0] = 4;
+    entry[1] = 6;
+    hdr_set16n(&entry[2], 80);
+    hdr_set16n(&entry[4], 1400 + i);
+    entry[6] = 1;
+    entry[7] = 7;
+    hdr_set32n(&entry[8], (10<<24)|(i+1));
+  }
+  // Duplicate of the first one
+  hdr_set32n(&entries[2*CTRL_V2_ENTRY_SIZE+8], (10<<24)|1);
+  entries[3*CTRL_V2_ENTRY_SIZE] = 6;
+  memcpy(&entries[3*CTRL_V2_ENTRY_SIZE+8], ip6, 16);
+
+  if (ctrl_v2_apply(&ctx, 1<<1, entries, 4, &first_failed) != 1 ||
+      first_failed != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch add failures invalid");
+    exit(1);
+  }
+  if (threetuplectx_find(&ctx, (10<<24)|2, 80, 6, &payload) != 0 ||
+      payload.mss != 1401 ||
+      threetuplectx_find6(&ctx, ip6, 80, 6, &payload) != 0 ||
+      payload.mss != 1403 || payload.wscaleshift != 7)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch entries not added");
+    exit(1);
+  }
+  if (ctrl_v2_apply(&ctx, 1<<3, entries, 4, &first_failed) != 1 ||
+      first_failed != 2 ||
+      threetuplectx_find(&ctx, (10<<24)|1, 80, 6, NULL) != -ENOENT ||
+      threetuplectx_find6(&ctx, ip6, 80, 6, NULL) != -ENOENT)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch entries not deleted");
+    exit(1);
+  }
+  if (ctrl_v2_apply(&ctx, 1<<1, entries, 2, &first_failed) != 0 ||
+      first_failed != CTRL_V2_NONE_FAILED)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch entries not added again");
+    exit(1);
+  }
+  for (i = 0; i < (int)ctx.tbl.bucketcnt; i++)
+  {
+    threetuplectx_for_each_bucket(&ctx, i, count_threetuple_fn, &count);
+  }
+  if (count != 2)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch entries not dumped");
+    exit(1);
+  }
+  // Version 0 flushes everything
+  entries[0] = 0;
+  if (ctrl_v2_apply(&ctx, 1<<0, entries, 1, &first_failed) != 0 ||
+      threetuplectx_find(&ctx, (10<<24)|2, 80, 6, NULL) != -ENOENT)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "batch flush failed");
+    exit(1);
+  }
+  if (ctrl_v2_apply(&ctx, 1<<6, &entries[CTRL_V2_ENTRY_SIZE], 1,
+                    &first_failed) != 1)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "invalid batch operation accepted");
+    exit(1);
+  }
+  threetuplectx_free(&ctx);
+}
+
+static void conntable_peek(void)
+{
+  struct synproxy synproxy;
+  struct worker_local local;
+  struct conf conf = CONF_INITIALIZER;
+  struct synproxy_hash_entry *e;
+  struct synproxy_hash_entry copy;
+  struct synproxy_hash_ctx ctx;
+  uint32_t src4 = htonl((10<<24)|1);
+  uint32_t dst4 = htonl((11<<24)|1);
+  uint64_t time64 = gettime64();
+
+  confyydirparse(argv0, "conf.txt", &conf, 0);
+  synproxy_init(&synproxy, &conf);
+  worker_local_init(&local, &synproxy, 1, 1);
+
+  synproxy_hash_put_connected(&local, 4, &src4, 12345, &dst4, 80, time64);
+  ctx.locked = 0;
+  e = synproxy_hash_get(&local, 4, &src4, 12345, &dst4, 80, &ctx);
+  e->seqoffset = 12345678;
+  // Read while the bucket is locked, as if packet processing had it
+  if (synproxy_hash_peek(&local, 4, &src4, 12345, &dst4, 80, &copy) != 0 ||
+      copy.seqoffset != 12345678 || copy.flag_state != FLAG_STATE_ESTABLISHED)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "peeked entry invalid");
+    exit(1);
+  }
+  synproxy_hash_unlock(&local, &ctx);
+  if (synproxy_hash_peek(&local, 4, &src4, 12346, &dst4, 80, &copy) != -ENOENT)
+  {
+    log_log(LOG_LEVEL_ERR, "UNIT", "peeked missing entry");
+    exit(1);
+  }
+  worker_local_free(&local);
+  conf_free(&conf);
+  synproxy_free(&synproxy);
+}
+
+int main(int argc, char **argv)
+{
+  argv0 = argv[0];
+
+  hash_seed_init();
+  setlinebuf(stdout);
+
+  three_way_handshake_four_way_fin(4);
+  three_way_handshake_four_way_fin(6);
+
+  established_rst_uplink(4);
+  established_rst_uplink(6);
+
+  established_rst_downlink(4);
+  established_rst_downlink(6);
+
+  closed_port(4);
+  closed_port(6);
+
+  three_way_handshake_ulretransmit(4);
+  three_way_handshake_ulretransmit(6);
+
+  three_way_handshake_dlretransmit(4);
+  three_way_handshake_dlretransmit(6);
+
+  three_way_handshake_finulretransmit(4);
+  three_way_handshake_finulretransmit(6);
+
+  three_way_handshake_findlretransmit(4);
+  three_way_handshake_findlretransmit(6);
+
+  syn_proxy_handshake(4);
+  syn_proxy_handshake(6);
+
+  syn_proxy_handshake_2_1_1(4);
+  syn_proxy_handshake_2_1_1(6);
+
+  syn_proxy_handshake_1_2_1(4);
+  syn_proxy_handshake_1_2_1(6);
+
+  syn_proxy_handshake_1_1_2(4);
+  syn_proxy_handshake_1_1_2(6);
+
+  syn_proxy_handshake_1_1_1_keepalive(4);
+  syn_proxy_handshake_1_1_1_keepalive(6);
+
+  syn_proxy_handshake_1_1_1_zerowindowprobe(4);
+  syn_proxy_handshake_1_1_1_zerowindowprobe(6);
+
+  syn_proxy_closed_port(4);
+  syn_proxy_closed_port(6);
+
+  syn_proxy_uplink(4);
+  syn_proxy_uplink(6);
+
+  syn_proxy_downlink(4);
+  syn_proxy_downlink(6);
+
+  syn_proxy_uplink_downlink(4);
+  syn_proxy_uplink_downlink(6);
+
+  syn_proxy_rst_uplink(4);
+  syn_proxy_rst_uplink(6);
+
+  syn_proxy_rst_downlink(4);
+  syn_proxy_rst_downlink(6);
+
+  burst_handshake(4);
+  burst_handshake(6);
+
+  pool_exhaustion();
+
+  timer_expiry();
+
+  halfopen_adaptive();
+
+  ratelimit_tokens();
+
+  heavy_hitters();
+
+  capture_filtering(4);
+  capture_filtering(6);
+  capture_synproxied_locked(4);
+  capture_synproxied_locked(6);
+
+  learnhash_snapshot();
+
+  conntable_checkpoint();
+
+  conntable_replication(4);
+  conntable_replication(6);
+  replication_events(4);
+  replication_events(6);
+
+  test_connections(0);
+  test_connections(1);
+
+  ctrl_batch();
+
+  conntable_peek();
 
   printf("UNIT TEST SUCCESSFUL!\n");
 
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_packet.h>
+#include "xdp.h"
+#include "tpacket.h"
+#include "log.h"
+
+/*
+ * Runs the socket based backends against a veth pair and a bridge.
+ * Needs root to create them, so exits successfully without running anything
+ * otherwise.
+ */
+
+#define VETH0 "vethtest0"
+#define VETH1 "vethtest1"
+#define BRIDGE "vethtest2"
+#define TEST_ETHERTYPE 0x88B5 // local experimental
+#define TEST_PKT_SIZE 64
+#define TEST_COUNT 100
+
+static int run(const char *cmd)
+{
+  int ret = system(cmd);
+  if (ret != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "%s failed", cmd);
+  }
+  return ret;
+}
+
+static void del_link(const char *name)
+{
+  char cmd[64];
+  int ret;
+  snprintf(cmd, sizeof(cmd), "ip link del %s 2>/dev/null", name);
+  ret = system(cmd); // fails if it doesn't exist
+  (void)ret;
+}
+
+static void cleanup(void)
+{
+  del_link(VETH0); // also deletes VETH1
+  del_link(BRIDGE);
+}
+
+static int setup(void)
+{
+  cleanup();
+  if (run("ip link add " VETH0 " type veth peer name " VETH1) != 0 ||
+      run("ip link add " BRIDGE " type bridge") != 0 ||
+      run("ip link set " VETH0 " up") != 0 ||
+      run("ip link set " VETH1 " up") != 0 ||
+      run("ip link set " BRIDGE " up") != 0)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+static void build_pkt(char *pkt, uint32_t seq)
+{
+  uint16_t type = htons(TEST_ETHERTYPE);
+  uint32_t seqn = htonl(seq);
+  memset(pkt, 0, TEST_PKT_SIZE);
+  memset(pkt, 0xff, 6);
+  pkt[6] = 0x02;
+  memcpy(&pkt[12], &type, sizeof(type));
+  memcpy(&pkt[14], &seqn, sizeof(seqn));
+}
+
+/*
+ * Returns the sequence number of a test packet, -1 for other traffic such as
+ * IPv6 router solicitations.
+ */
+static int64_t parse_pkt(const char *pkt, size_t sz)
+{
+  uint16_t type;
+  uint32_t seqn;
+  if (sz < TEST_PKT_SIZE)
+  {
+    return -1;
+  }
+  memcpy(&type, &pkt[12], sizeof(type));
+  if (ntohs(type) != TEST_ETHERTYPE)
+  {
+    return -1;
+  }
+  memcpy(&seqn, &pkt[14], sizeof(seqn));
+  return ntohl(seqn);
+}
+
+static int packet_socket(const char *name)
+{
+  struct sockaddr_ll sll;
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "can't create packet socket: %s",
+            strerror(errno));
+    exit(1);
+  }
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = if_nametoindex(name);
+  if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "can't bind packet socket: %s",
+            strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+static void packet_send_all(int fd)
+{
+  char pkt[TEST_PKT_SIZE];
+  uint32_t i;
+  for (i = 0; i < TEST_COUNT; i++)
+  {
+    build_pkt(pkt, i);
+    if (send(fd, pkt, sizeof(pkt), 0) != sizeof(pkt))
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "send failed: %s", strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+/*
+ * Receives the test packets in order on a packet socket, waiting at most a
+ * second for each.
+ */
+static void packet_recv_all(int fd)
+{
+  char pkt[2048];
+  uint32_t next = 0;
+  while (next < TEST_COUNT)
+  {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    ssize_t sz;
+    int64_t seq;
+    if (poll(&pfd, 1, 1000) <= 0)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "packet %u not received", next);
+      exit(1);
+    }
+    sz = recv(fd, pkt, sizeof(pkt), 0);
+    seq = parse_pkt(pkt, sz < 0 ? 0 : sz);
+    if (seq < 0)
+    {
+      continue;
+    }
+    if (seq != next)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "got packet %lld, expected %u",
+              (long long)seq, next);
+      exit(1);
+    }
+    next++;
+  }
+}
+
+static void xdp_recv_all(struct xdp_queue *q)
+{
+  struct ldp_packet pkts[16];
+  uint32_t next = 0;
+  int tries = 0;
+  while (next < TEST_COUNT)
+  {
+    int num = xdp_in_nextpkts(q, pkts, sizeof(pkts)/sizeof(*pkts));
+    int i;
+    if (num == 0)
+    {
+      if (++tries > 1000)
+      {
+        log_log(LOG_LEVEL_ERR, "VETHTEST", "XDP packet %u not received", next);
+        exit(1);
+      }
+      poll(NULL, 0, 1);
+      continue;
+    }
+    for (i = 0; i < num; i++)
+    {
+      int64_t seq = parse_pkt(pkts[i].data, pkts[i].sz);
+      if (seq < 0)
+      {
+        continue;
+      }
+      if (seq != next)
+      {
+        log_log(LOG_LEVEL_ERR, "VETHTEST", "got XDP packet %lld, expected %u",
+                (long long)seq, next);
+        exit(1);
+      }
+      next++;
+    }
+    xdp_in_deallocate_some(q, pkts, num);
+  }
+}
+
+static void xdp_send_all(struct xdp_queue *q)
+{
+  char pkt[TEST_PKT_SIZE];
+  uint32_t i;
+  int tries = 0;
+  for (i = 0; i < TEST_COUNT; i++)
+  {
+    struct ldp_packet ldppkt = {.data = pkt, .sz = sizeof(pkt)};
+    build_pkt(pkt, i);
+    if (xdp_out_inject(q, &ldppkt, 1) != 1)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "XDP inject failed");
+      exit(1);
+    }
+  }
+  // Every TX frame must come back through the completion ring
+  while (q->num_free != XDP_NUM_FRAMES/2)
+  {
+    if (++tries > 1000)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "XDP TX frames not completed");
+      exit(1);
+    }
+    xdp_out_txsync(q);
+    poll(NULL, 0, 1);
+  }
+}
+
+/*
+ * veth has native XDP but no zero-copy AF_XDP, so the socket falls back to
+ * copy mode.
+ */
+static void xdp_veth(void)
+{
+  struct xdp_interface *intf;
+  int fd;
+  int round, tries;
+  // The second round checks that closing detached the program
+  for (round = 0; round < 2; round++)
+  {
+    // The kernel releases the queue of a closed socket asynchronously
+    for (tries = 0; tries < 100; tries++)
+    {
+      intf = xdp_interface_open(VETH0, 1);
+      if (intf != NULL)
+      {
+        break;
+      }
+      poll(NULL, 0, 10);
+    }
+    if (intf == NULL)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "can't open XDP on " VETH0);
+      exit(1);
+    }
+    if (!(intf->attach_flags & XDP_FLAGS_DRV_MODE) || intf->zerocopy)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "expected native copy mode");
+      exit(1);
+    }
+    fd = packet_socket(VETH1);
+    packet_send_all(fd);
+    xdp_recv_all(&intf->queues[0]);
+    xdp_send_all(&intf->queues[0]);
+    packet_recv_all(fd);
+    if (intf->queues[0].tx_drops != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "XDP TX drops");
+      exit(1);
+    }
+    close(fd);
+    xdp_interface_close(intf);
+  }
+}
+
+/*
+ * A bridge has no native XDP, so the program is attached in generic mode.
+ */
+static void xdp_bridge(void)
+{
+  struct xdp_interface *intf = xdp_interface_open(BRIDGE, 1);
+  if (intf == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "can't open XDP on " BRIDGE);
+    exit(1);
+  }
+  if (!(intf->attach_flags & XDP_FLAGS_SKB_MODE) || intf->zerocopy)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "expected generic copy mode");
+    exit(1);
+  }
+  xdp_interface_close(intf);
+}
+
+static void tpacket_recv_all(struct tpacket_queue *q)
+{
+  struct ldp_packet pkts[16];
+  uint32_t next = 0;
+  int tries = 0;
+  while (next < TEST_COUNT)
+  {
+    int num = tpacket_in_nextpkts(q, pkts, sizeof(pkts)/sizeof(*pkts));
+    int i;
+    if (num == 0)
+    {
+      if (++tries > 1000)
+      {
+        log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket packet %u not received",
+                next);
+        exit(1);
+      }
+      poll(NULL, 0, 1);
+      continue;
+    }
+    for (i = 0; i < num; i++)
+    {
+      int64_t seq = parse_pkt(pkts[i].data, pkts[i].sz);
+      if (seq < 0)
+      {
+        continue;
+      }
+      if (seq != next)
+      {
+        log_log(LOG_LEVEL_ERR, "VETHTEST",
+                "got tpacket packet %lld, expected %u", (long long)seq, next);
+        exit(1);
+      }
+      next++;
+    }
+    tpacket_in_deallocate_some(q, pkts, num);
+  }
+}
+
+/*
+ * Nothing is sent before the TX sync, except to make room in a full ring.
+ */
+static void tpacket_veth(void)
+{
+  struct tpacket_interface *intf = tpacket_interface_open(VETH0, 1);
+  struct tpacket_queue *q;
+  struct pollfd pfd;
+  char pkt[TEST_PKT_SIZE];
+  uint32_t i;
+  int fd;
+  if (intf == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "can't open tpacket on " VETH0);
+    exit(1);
+  }
+  q = &intf->queues[0];
+  fd = packet_socket(VETH1);
+  packet_send_all(fd);
+  tpacket_recv_all(q);
+
+  for (i = 0; i < TEST_COUNT; i++)
+  {
+    struct ldp_packet ldppkt = {.data = pkt, .sz = sizeof(pkt)};
+    build_pkt(pkt, i);
+    if (tpacket_out_inject(q, &ldppkt, 1) != 1)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket inject failed");
+      exit(1);
+    }
+  }
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, 100) > 0)
+  {
+    if (recv(fd, pkt, sizeof(pkt), 0) >= 0 && parse_pkt(pkt, sizeof(pkt)) >= 0)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket sent before TX sync");
+      exit(1);
+    }
+  }
+  if (tpacket_out_txsync(q) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket TX sync failed");
+    exit(1);
+  }
+  packet_recv_all(fd);
+
+  // Twice the ring size without syncing, the full ring is sent in between
+  for (i = 0; i < 2*(TPACKET_TX_BLOCK_SIZE/TPACKET_FRAME_SIZE)*
+                  TPACKET_TX_BLOCK_NR; i++)
+  {
+    struct ldp_packet ldppkt = {.data = pkt, .sz = sizeof(pkt)};
+    build_pkt(pkt, TEST_COUNT);
+    if (tpacket_out_inject(q, &ldppkt, 1) != 1)
+    {
+      log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket full ring not sent");
+      exit(1);
+    }
+  }
+  tpacket_out_txsync(q);
+  if (q->tx_drops != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "tpacket TX drops");
+    exit(1);
+  }
+  close(fd);
+  tpacket_interface_close(intf);
+}
+
+int main(int argc, char **argv)
+{
+  if (geteuid() != 0)
+  {
+    log_log(LOG_LEVEL_NOTICE, "VETHTEST", "not root, skipping");
+    return 0;
+  }
+  if (setup() != 0)
+  {
+    cleanup();
+    log_log(LOG_LEVEL_ERR, "VETHTEST", "can't create test interfaces");
+    exit(1);
+  }
+  atexit(cleanup); // failed tests exit(1)
+  xdp_veth();
+  xdp_bridge();
+  tpacket_veth();
+  return 0;
+}
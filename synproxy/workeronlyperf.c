@@ -187,6 +187,77 @@ static void *rx_func(void *userdata)
   }
 }
 
+#define CONNTABLE_BENCH_ROUNDS 8
+
+/*
+ * Single-threaded lookups from a table filled up to conntablesize, visited in
+ * a scattered order so that the table doesn't fit in the cache.
+ */
+static void conntable_bench(struct conf *origconf, enum conntabletype type)
+{
+  struct conf conf = *origconf;
+  struct synproxy synproxy;
+  struct worker_local local;
+  size_t n = origconf->conntablesize;
+  size_t j, k, hits = 0;
+  uint64_t time64, begin, hit_us, miss_us;
+  int round;
+
+  conf.conntabletype = type;
+  synproxy.conf = &conf;
+  worker_local_init(&local, &synproxy, 1, 0);
+  time64 = gettime64();
+  for (j = 0; j < n; j++)
+  {
+    uint32_t src = htonl((10<<24)|j);
+    uint32_t dst = htonl((11<<24)|j);
+    synproxy_hash_put_connected(
+      &local, 4, &src, 12345, &dst, 54321, time64);
+  }
+
+  begin = gettime64();
+  for (round = 0; round < CONNTABLE_BENCH_ROUNDS; round++)
+  {
+    for (k = 0; k < n; k++)
+    {
+      struct synproxy_hash_ctx ctx = {};
+      uint32_t src, dst;
+      j = (k*40503) & (n-1);
+      src = htonl((10<<24)|j);
+      dst = htonl((11<<24)|j);
+      hits += (synproxy_hash_get(&local, 4, &src, 12345, &dst, 54321, &ctx) != NULL);
+      synproxy_hash_unlock(&local, &ctx);
+    }
+  }
+  hit_us = gettime64() - begin;
+
+  begin = gettime64();
+  for (round = 0; round < CONNTABLE_BENCH_ROUNDS; round++)
+  {
+    for (k = 0; k < n; k++)
+    {
+      struct synproxy_hash_ctx ctx = {};
+      uint32_t src, dst;
+      j = (k*40503) & (n-1);
+      src = htonl((10<<24)|j);
+      dst = htonl((11<<24)|j);
+      hits += (synproxy_hash_get(&local, 4, &src, 12345, &dst, 54322, &ctx) != NULL);
+      synproxy_hash_unlock(&local, &ctx);
+    }
+  }
+  miss_us = gettime64() - begin;
+
+  if (hits != n*CONNTABLE_BENCH_ROUNDS)
+  {
+    printf("conn table lookup mismatch: %zu\n", hits);
+    exit(1);
+  }
+  printf("%s conn table: %g Mlookups/s hit, %g Mlookups/s miss\n",
+         type == CONNTABLETYPE_TAGGED ? "tagged" : "chained",
+         (double)n*CONNTABLE_BENCH_ROUNDS/(hit_us ? hit_us : 1),
+         (double)n*CONNTABLE_BENCH_ROUNDS/(miss_us ? miss_us : 1));
+  worker_local_free(&local);
+}
 
 int main(int argc, char **argv)
 {
@@ -206,6 +277,9 @@ int main(int argc, char **argv)
   hash_seed_init();
   setlinebuf(stdout);
 
+  conntable_bench(&conf, CONNTABLETYPE_CHAINED);
+  conntable_bench(&conf, CONNTABLETYPE_TAGGED);
+
   //if (queue_init(&workerq, QUEUE_SIZE) != 0)
   //{
   //  abort();
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "xdp.h"
+#include "ifutil.h"
+#include "log.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+static inline uint32_t ring_load(uint32_t *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_store(uint32_t *p, uint32_t val)
+{
+  __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_load_prog(struct xdp_interface *intf)
+{
+  union bpf_attr attr;
+  static const char license[] = "MIT";
+  struct bpf_insn insns[] = {
+    // r2 = ctx->rx_queue_index
+    {.code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2,
+     .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index)},
+    // r1 = xsks_map
+    {.code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+     .src_reg = BPF_PSEUDO_MAP_FD},
+    {0},
+    // return bpf_redirect_map(xsks_map, r2, XDP_PASS)
+    {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+     .imm = XDP_PASS},
+    {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+    {.code = BPF_JMP | BPF_EXIT},
+  };
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = intf->num_queues;
+  intf->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (intf->map_fd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "can't create XSKMAP: %s", strerror(errno));
+    return -1;
+  }
+  insns[1].imm = intf->map_fd;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)insns;
+  attr.insn_cnt = sizeof(insns)/sizeof(*insns);
+  attr.license = (uint64_t)(uintptr_t)license;
+  intf->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (intf->prog_fd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "can't load XDP program: %s",
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int xdp_map_socket(struct xdp_interface *intf, uint32_t idx, int fd)
+{
+  union bpf_attr attr;
+  uint32_t val = fd;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = intf->map_fd;
+  attr.key = (uint64_t)(uintptr_t)&idx;
+  attr.value = (uint64_t)(uintptr_t)&val;
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/*
+ * Attaches the program with fd to the interface, or detaches with fd -1.
+ */
+static int xdp_netlink_attach(int ifindex, int fd, uint32_t flags)
+{
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+    char attrbuf[64];
+  } req;
+  struct nlattr *nest, *nla;
+  struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+  char buf[512];
+  struct nlmsghdr *nh;
+  int sock, ret = -1;
+  ssize_t len;
+
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  req.nh.nlmsg_type = RTM_SETLINK;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = ifindex;
+  nest = (struct nlattr*)(((char*)&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+  nest->nla_type = NLA_F_NESTED | IFLA_XDP;
+  nest->nla_len = NLA_HDRLEN;
+  nla = (struct nlattr*)(((char*)nest) + nest->nla_len);
+  nla->nla_type = IFLA_XDP_FD;
+  nla->nla_len = NLA_HDRLEN + sizeof(int);
+  memcpy(((char*)nla) + NLA_HDRLEN, &fd, sizeof(int));
+  nest->nla_len += NLA_ALIGN(nla->nla_len);
+  nla = (struct nlattr*)(((char*)nest) + nest->nla_len);
+  nla->nla_type = IFLA_XDP_FLAGS;
+  nla->nla_len = NLA_HDRLEN + sizeof(uint32_t);
+  memcpy(((char*)nla) + NLA_HDRLEN, &flags, sizeof(uint32_t));
+  nest->nla_len += NLA_ALIGN(nla->nla_len);
+  req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->nla_len;
+
+  sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (sock < 0)
+  {
+    return -1;
+  }
+  if (sendto(sock, &req, req.nh.nlmsg_len, 0, (struct sockaddr*)&sa, sizeof(sa)) < 0)
+  {
+    close(sock);
+    return -1;
+  }
+  len = recv(sock, buf, sizeof(buf), 0);
+  for (nh = (struct nlmsghdr*)buf; len > 0 && NLMSG_OK(nh, len);
+       nh = NLMSG_NEXT(nh, len))
+  {
+    if (nh->nlmsg_type == NLMSG_ERROR)
+    {
+      struct nlmsgerr *err = NLMSG_DATA(nh);
+      errno = -err->error;
+      ret = err->error == 0 ? 0 : -1;
+      break;
+    }
+  }
+  close(sock);
+  return ret;
+}
+
+static void *xdp_ring_map(
+  int fd, struct xdp_ring *ring, const struct xdp_ring_offset *off,
+  uint32_t size, size_t descsize, off_t pgoff)
+{
+  ring->maplen = off->desc + size*descsize;
+  ring->map = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (ring->map == MAP_FAILED)
+  {
+    ring->map = NULL;
+    return NULL;
+  }
+  ring->producer = (uint32_t*)(((char*)ring->map) + off->producer);
+  ring->consumer = (uint32_t*)(((char*)ring->map) + off->consumer);
+  ring->flags = (uint32_t*)(((char*)ring->map) + off->flags);
+  ring->descs = ((char*)ring->map) + off->desc;
+  ring->mask = size - 1;
+  ring->cached_prod = *ring->producer;
+  ring->cached_cons = *ring->consumer;
+  return ring->map;
+}
+
+static void xdp_queue_close(struct xdp_queue *q)
+{
+  struct xdp_ring *rings[] = {&q->fill, &q->comp, &q->rx, &q->tx};
+  size_t i;
+  for (i = 0; i < sizeof(rings)/sizeof(*rings); i++)
+  {
+    if (rings[i]->map)
+    {
+      munmap(rings[i]->map, rings[i]->maplen);
+    }
+  }
+  if (q->fd >= 0)
+  {
+    close(q->fd);
+  }
+  if (q->umem)
+  {
+    munmap(q->umem, XDP_NUM_FRAMES*XDP_FRAME_SIZE);
+  }
+}
+
+static int xdp_queue_open(
+  struct xdp_queue *q, int ifindex, int queue_id, int *zerocopy)
+{
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  socklen_t optlen = sizeof(off);
+  uint32_t size = XDP_RING_SIZE;
+  uint32_t i;
+
+  memset(q, 0, sizeof(*q));
+  q->fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (q->fd < 0)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "can't create socket: %s", strerror(errno));
+    return -1;
+  }
+  q->umem = mmap(NULL, XDP_NUM_FRAMES*XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q->umem == MAP_FAILED)
+  {
+    q->umem = NULL;
+    log_log(LOG_LEVEL_ERR, "XDP", "can't allocate UMEM");
+    return -1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = (uint64_t)(uintptr_t)q->umem;
+  reg.len = XDP_NUM_FRAMES*XDP_FRAME_SIZE;
+  reg.chunk_size = XDP_FRAME_SIZE;
+  if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+      setsockopt(q->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) != 0 ||
+      setsockopt(q->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) != 0 ||
+      setsockopt(q->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) != 0 ||
+      setsockopt(q->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) != 0 ||
+      getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "can't set up UMEM: %s", strerror(errno));
+    return -1;
+  }
+  if (xdp_ring_map(q->fd, &q->fill, &off.fr, size, sizeof(uint64_t),
+                   XDP_UMEM_PGOFF_FILL_RING) == NULL ||
+      xdp_ring_map(q->fd, &q->comp, &off.cr, size, sizeof(uint64_t),
+                   XDP_UMEM_PGOFF_COMPLETION_RING) == NULL ||
+      xdp_ring_map(q->fd, &q->rx, &off.rx, size, sizeof(struct xdp_desc),
+                   XDP_PGOFF_RX_RING) == NULL ||
+      xdp_ring_map(q->fd, &q->tx, &off.tx, size, sizeof(struct xdp_desc),
+                   XDP_PGOFF_TX_RING) == NULL)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "can't map rings: %s", strerror(errno));
+    return -1;
+  }
+  // First half of the frames for RX, second half for TX
+  for (i = 0; i < XDP_NUM_FRAMES/2; i++)
+  {
+    ((uint64_t*)q->fill.descs)[(q->fill.cached_prod++) & q->fill.mask] =
+      ((uint64_t)i)*XDP_FRAME_SIZE;
+    q->free_frames[i] = ((uint64_t)(XDP_NUM_FRAMES/2 + i))*XDP_FRAME_SIZE;
+  }
+  q->num_free = XDP_NUM_FRAMES/2;
+  ring_store(q->fill.producer, q->fill.cached_prod);
+
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = queue_id;
+  sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+  if (bind(q->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) == 0)
+  {
+    *zerocopy = 1;
+    return 0;
+  }
+  sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+  if (bind(q->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) == 0)
+  {
+    *zerocopy = 0;
+    return 0;
+  }
+  log_log(LOG_LEVEL_ERR, "XDP", "can't bind to queue %d: %s",
+          queue_id, strerror(errno));
+  return -1;
+}
+
+struct xdp_interface *xdp_interface_open(const char *name, int num_queues)
+{
+  struct xdp_interface *intf;
+  int i;
+  intf = calloc(1, sizeof(*intf));
+  if (intf == NULL)
+  {
+    return NULL;
+  }
+  intf->map_fd = -1;
+  intf->prog_fd = -1;
+  intf->zerocopy = 1;
+  snprintf(intf->name, sizeof(intf->name), "%s", name);
+  intf->ifindex = if_nametoindex(name);
+  if (intf->ifindex == 0)
+  {
+    log_log(LOG_LEVEL_ERR, "XDP", "no interface %s", name);
+    free(intf);
+    return NULL;
+  }
+  intf->queues = calloc(num_queues, sizeof(*intf->queues));
+  if (intf->queues == NULL)
+  {
+    free(intf);
+    return NULL;
+  }
+  for (i = 0; i < num_queues; i++)
+  {
+    int zerocopy;
+    intf->num_queues = i + 1;
+    if (xdp_queue_open(&intf->queues[i], intf->ifindex, i, &zerocopy) != 0)
+    {
+      xdp_interface_close(intf);
+      return NULL;
+    }
+    intf->zerocopy &= zerocopy;
+  }
+  if (xdp_load_prog(intf) != 0)
+  {
+    xdp_interface_close(intf);
+    return NULL;
+  }
+  for (i = 0; i < num_queues; i++)
+  {
+    if (xdp_map_socket(intf, i, intf->queues[i].fd) != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "XDP", "can't add socket to XSKMAP: %s",
+              strerror(errno));
+      xdp_interface_close(intf);
+      return NULL;
+    }
+  }
+  intf->attach_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_DRV_MODE;
+  if (xdp_netlink_attach(intf->ifindex, intf->prog_fd, intf->attach_flags) != 0)
+  {
+    intf->attach_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_SKB_MODE;
+    if (xdp_netlink_attach(intf->ifindex, intf->prog_fd, intf->attach_flags) != 0)
+    {
+      log_log(LOG_LEVEL_ERR, "XDP", "can't attach XDP program to %s: %s",
+              name, strerror(errno));
+      intf->attach_flags = 0;
+      xdp_interface_close(intf);
+      return NULL;
+    }
+  }
+  log_log(LOG_LEVEL_NOTICE, "XDP", "%s: %d queues, %s mode, %s",
+          name, num_queues,
+          (intf->attach_flags & XDP_FLAGS_DRV_MODE) ? "native" : "generic",
+          intf->zerocopy ? "zero-copy" : "copy");
+  return intf;
+}
+
+void xdp_interface_close(struct xdp_interface *intf)
+{
+  int i;
+  if (intf->attach_flags)
+  {
+    xdp_netlink_attach(intf->ifindex, -1,
+                       intf->attach_flags & ~XDP_FLAGS_UPDATE_IF_NOEXIST);
+  }
+  for (i = 0; i < intf->num_queues; i++)
+  {
+    xdp_queue_close(&intf->queues[i]);
+  }
+  if (intf->prog_fd >= 0)
+  {
+    close(intf->prog_fd);
+  }
+  if (intf->map_fd >= 0)
+  {
+    close(intf->map_fd);
+  }
+  free(intf->queues);
+  free(intf);
+}
+
+int xdp_interface_link_wait(struct xdp_interface *intf)
+{
+  return ifutil_link_wait(intf->name);
+}
+
+int xdp_interface_set_promisc_mode(struct xdp_interface *intf, int on)
+{
+  return ifutil_set_promisc_mode(intf->name, on);
+}
+
+int xdp_in_nextpkts(struct xdp_queue *q, struct ldp_packet *pkts, int num)
+{
+  uint32_t avail = ring_load(q->rx.producer) - q->rx.cached_cons;
+  struct xdp_desc *descs = q->rx.descs;
+  int i;
+  if (avail == 0)
+  {
+    if (ring_load(q->fill.flags) & XDP_RING_NEED_WAKEUP)
+    {
+      recvfrom(q->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+    return 0;
+  }
+  if ((uint32_t)num > avail)
+  {
+    num = avail;
+  }
+  for (i = 0; i < num; i++)
+  {
+    struct xdp_desc *desc = &descs[(q->rx.cached_cons++) & q->rx.mask];
+    pkts[i].data = q->umem + desc->addr;
+    pkts[i].sz = desc->len;
+  }
+  return num;
+}
+
+void xdp_in_deallocate_some(
+  struct xdp_queue *q, struct ldp_packet *pkts, int num)
+{
+  uint64_t *fill = q->fill.descs;
+  int i;
+  if (num <= 0)
+  {
+    return;
+  }
+  for (i = 0; i < num; i++)
+  {
+    uint64_t addr = ((char*)pkts[i].data) - q->umem;
+    fill[(q->fill.cached_prod++) & q->fill.mask] =
+      addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+  }
+  ring_store(q->fill.producer, q->fill.cached_prod);
+  ring_store(q->rx.consumer, ring_load(q->rx.consumer) + num);
+}
+
+static void xdp_reclaim(struct xdp_queue *q)
+{
+  uint32_t prod = ring_load(q->comp.producer);
+  uint64_t *comp = q->comp.descs;
+  while (q->comp.cached_cons != prod)
+  {
+    q->free_frames[q->num_free++] = comp[(q->comp.cached_cons++) & q->comp.mask];
+  }
+  ring_store(q->comp.consumer, q->comp.cached_cons);
+}
+
+static void xdp_kick(struct xdp_queue *q)
+{
+  if (ring_load(q->tx.flags) & XDP_RING_NEED_WAKEUP)
+  {
+    sendto(q->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+  }
+}
+
+int xdp_out_inject(struct xdp_queue *q, struct ldp_packet *pkts, int num)
+{
+  struct xdp_desc *descs = q->tx.descs;
+  uint32_t space;
+  int i, sent = 0;
+  if (num <= 0)
+  {
+    return 0;
+  }
+  xdp_reclaim(q);
+  space = (q->tx.mask + 1) - (q->tx.cached_prod - ring_load(q->tx.consumer));
+  for (i = 0; i < num; i++)
+  {
+    struct xdp_desc *desc;
+    uint64_t frame;
+    if (space == 0 || q->num_free == 0 || pkts[i].sz > XDP_FRAME_SIZE)
+    {
+      q->tx_drops++;
+      continue;
+    }
+    frame = q->free_frames[--q->num_free];
+    memcpy(q->umem + frame, pkts[i].data, pkts[i].sz);
+    desc = &descs[(q->tx.cached_prod++) & q->tx.mask];
+    desc->addr = frame;
+    desc->len = pkts[i].sz;
+    desc->options = 0;
+    space--;
+    sent++;
+  }
+  ring_store(q->tx.producer, q->tx.cached_prod);
+  if (sent)
+  {
+    xdp_kick(q);
+  }
+  return sent;
+}
+
+int xdp_out_txsync(struct xdp_queue *q)
+{
+  xdp_kick(q);
+  xdp_reclaim(q);
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+#include "ldp.h"
+
+/*
+ * AF_XDP packet I/O for interfaces given with the xdp: prefix, with the same
+ * batch interface as LDP queues.
+ *
+ * Every queue has its own AF_XDP socket bound to the NIC queue of the same
+ * index, with its own UMEM. Half of the UMEM frames are for RX and are
+ * recycled through the fill ring, the other half are for TX and come back
+ * through the completion ring. Injected packets are copied to a TX frame,
+ * forwarded ones too: they sit in the UMEM of another socket, and their RX
+ * frames go back to the fill ring as soon as the batch has been processed.
+ * The socket is bound in zero-copy mode if the driver supports it, copy mode
+ * otherwise.
+ *
+ * A minimal XDP program redirects every packet to the socket of its RX queue.
+ * It is attached in native mode if the driver supports it, generic mode
+ * otherwise.
+ *
+ * A queue must be used by one thread at a time.
+ */
+
+#define XDP_NUM_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+#define XDP_RING_SIZE 2048
+
+struct xdp_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *descs;
+  uint32_t mask;
+  uint32_t cached_prod;
+  uint32_t cached_cons;
+  void *map;
+  size_t maplen;
+};
+
+struct xdp_queue {
+  int fd;
+  char *umem;
+  struct xdp_ring fill;
+  struct xdp_ring comp;
+  struct xdp_ring rx;
+  struct xdp_ring tx;
+  uint64_t free_frames[XDP_NUM_FRAMES/2]; // TX frames
+  uint32_t num_free;
+  uint64_t tx_drops;
+};
+
+struct xdp_interface {
+  char name[IF_NAMESIZE];
+  int ifindex;
+  int num_queues;
+  struct xdp_queue *queues;
+  int map_fd;
+  int prog_fd;
+  uint32_t attach_flags;
+  int zerocopy;
+};
+
+struct xdp_interface *xdp_interface_open(const char *name, int num_queues);
+
+void xdp_interface_close(struct xdp_interface *intf);
+
+int xdp_interface_link_wait(struct xdp_interface *intf);
+
+int xdp_interface_set_promisc_mode(struct xdp_interface *intf, int on);
+
+int xdp_in_nextpkts(struct xdp_queue *q, struct ldp_packet *pkts, int num);
+
+/*
+ * Gives the frames of packets returned by xdp_in_nextpkts() back to the
+ * kernel. Must be called for every packet, in order.
+ */
+void xdp_in_deallocate_some(
+  struct xdp_queue *q, struct ldp_packet *pkts, int num);
+
+int xdp_out_inject(struct xdp_queue *q, struct ldp_packet *pkts, int num);
+
+int xdp_out_txsync(struct xdp_queue *q);
+
+#endif
@@ -54,14 +54,63 @@ def synproxy_build_message(mode, ipaddr, port, proto, tcpmss, tcpsack, tcpwscale
         tcpmss = 0
         tcpsack = 0
         tcpwscale = 0
+    elif mode == 'top':
+        flags |= 0b0010000
+        ipaddr = '0.0.0.0'
+        tcpmss = 0
+        tcpsack = 0
+        tcpwscale = 0
+        port = 0
+        proto = 0
     # Pack message
     msg = socket.inet_pton(socket.AF_INET, ipaddr) + struct.pack('!HBBHBB', port, proto, flags, tcpmss, tcpsack, tcpwscale)
     # Return built message
     return msg
 
 
+def synproxy_build_capture_message(prefix, port, tcpflags, tcpflags_mask, sample, snaplen, synproxied, off):
+    """
+    Build and return capture filter message
+
+    Message structure:
+      - 32 bits: IPv4 network address
+      - 16 bits: Port number, 0 for any
+      - 8  bits: Prefix length
+      - 8  bits: Flags, 0x20 or 0xa0 if the network is IPv6
+      - 16 bits: Snap length, 0 for whole packets
+      - 8  bits: TCP flags mask
+      - 8  bits: TCP flags
+      - 128 bits: IPv6 network address, only if IPv6
+      - 32 bits: Sample 1 in N flows, 0 for all
+      - 8  bits: Options: 1 synproxied flows only, 2 capture off, 4 network set
+      - 24 bits: Reserved
+    """
+    flags = 0b00100000
+    options = 0
+    ip4 = b'\x00' * 4
+    ip6 = b''
+    prefixlen = 0
+    if synproxied:
+        options |= 1
+    if off:
+        options |= 2
+    if prefix:
+        options |= 4
+        network, _, prefixlen = prefix.partition('/')
+        if ':' in network:
+            flags |= 0b10000000
+            ip6 = socket.inet_pton(socket.AF_INET6, network)
+            prefixlen = int(prefixlen or 128)
+        else:
+            ip4 = socket.inet_pton(socket.AF_INET, network)
+            prefixlen = int(prefixlen or 32)
+    msg = ip4 + struct.pack('!HBBHBB', port, prefixlen, flags, snaplen, tcpflags_mask, tcpflags)
+    msg += ip6 + struct.pack('!IB3x', sample, options)
+    return msg
+
+
 @asyncio.coroutine
-def synproxy_sendrecv(ipaddr, port, mode, conn_ipaddr, conn_port, conn_proto, conn_tcpmss, conn_tcpsack, conn_tcpwscale):
+def synproxy_sendrecv(ipaddr, port, mode, conn_ipaddr, conn_port, conn_proto, conn_tcpmss, conn_tcpsack, conn_tcpwscale, capture=None):
     # Create TCP socket
     sock = socket.socket(family=socket.AF_INET, type=socket.SOCK_STREAM)
     sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
@@ -71,11 +120,21 @@ def synproxy_sendrecv(ipaddr, port, mode, conn_ipaddr, conn_port, conn_proto, co
     yield from loop.sock_connect(sock, (ipaddr, port))
     logger.debug('Connected to <{}:{}>'.format(ipaddr, port))
     # Build control message
-    msg = synproxy_build_message(mode, conn_ipaddr, conn_port, conn_proto, conn_tcpmss, conn_tcpsack, conn_tcpwscale)
+    if mode == 'capture':
+        msg = synproxy_build_capture_message(**capture)
+    else:
+        msg = synproxy_build_message(mode, conn_ipaddr, conn_port, conn_proto, conn_tcpmss, conn_tcpsack, conn_tcpwscale)
     logger.debug('Sending control message <{}>'.format(msg))
     yield from loop.sock_sendall(sock, msg)
     logger.debug('Waiting for response...')
     data = yield from asyncio.wait_for(loop.sock_recv(sock, 1024), timeout=5)
+    if mode == 'top':
+        # First line is the number of heavy hitters that follow
+        while b'\n' not in data or data.count(b'\n') < int(data.split(b'\n')[0]) + 1:
+            more = yield from asyncio.wait_for(loop.sock_recv(sock, 4096), timeout=5)
+            if not more:
+                break
+            data += more
     sock.close()
     logger.info('Received response <{}>'.format(data))
 
@@ -105,6 +164,19 @@ def validate_arguments(args):
         logger.error('Port number not valid <{}>'.format(args.conn_dstport))
         sys.exit(1)
 
+    # Validate capture network
+    if args.capture_prefix:
+        network, _, prefixlen = args.capture_prefix.partition('/')
+        family = socket.AF_INET6 if ':' in network else socket.AF_INET
+        maxlen = 128 if family == socket.AF_INET6 else 32
+        try:
+            socket.inet_pton(family, network)
+            if prefixlen and not 0 <= int(prefixlen) <= maxlen:
+                raise ValueError
+        except:
+            logger.error('Capture network not valid <{}>'.format(args.capture_prefix))
+            sys.exit(1)
+
     # Validate TCP MSS value
     ## Set MAX MTU size at 9000
     if args.conn_tcpmss <= 0 or args.conn_tcpmss > 8960:
@@ -126,7 +198,7 @@ def parse_arguments():
                         help='Dataplane IP address')
 
     # Operation mode
-    parser.add_argument('--mode', dest='mode', default='add', choices=['add', 'mod', 'del', 'flush'])
+    parser.add_argument('--mode', dest='mode', default='add', choices=['add', 'mod', 'del', 'flush', 'top', 'capture'])
 
     # n-tuple connection options
     parser.add_argument('--conn-dstaddr', type=str, default='0.0.0.0',
@@ -147,6 +219,30 @@ def parse_arguments():
                         metavar=('TCPWSCALE'),
                         help='TCP window scaling value [0-14]')
 
+    # Capture filter options
+    parser.add_argument('--capture-prefix', type=str, default=None,
+                        metavar=('NETWORK/PREFIX'),
+                        help='Capture only this source or destination network')
+    parser.add_argument('--capture-port', type=int, default=0,
+                        metavar=('PORT'),
+                        help='Capture only this source or destination TCP port')
+    parser.add_argument('--capture-tcpflags', type=lambda x: int(x, 0), default=0,
+                        metavar=('FLAGS'),
+                        help='Capture only TCP packets with these flags')
+    parser.add_argument('--capture-tcpflags-mask', type=lambda x: int(x, 0), default=0,
+                        metavar=('MASK'),
+                        help='TCP flags compared to --capture-tcpflags')
+    parser.add_argument('--capture-sample', type=int, default=0,
+                        metavar=('N'),
+                        help='Capture 1 in N flows')
+    parser.add_argument('--capture-snaplen', type=int, default=0,
+                        metavar=('BYTES'),
+                        help='Truncate captured packets')
+    parser.add_argument('--capture-synproxied', action='store_true',
+                        help='Capture only flows that were SYN proxied')
+    parser.add_argument('--capture-off', action='store_true',
+                        help='Capture nothing')
+
     args = parser.parse_args()
     validate_arguments(args)
     return args
@@ -166,7 +262,15 @@ if __name__ == '__main__':
     # Prepare coroutine with parameters for execution
     coro = synproxy_sendrecv(args.ipaddr, args.port, args.mode,
                              args.conn_dstaddr, args.conn_dstport, 6,
-                             args.conn_tcpmss, args.conn_tcpsack, args.conn_tcpwscale)
+                             args.conn_tcpmss, args.conn_tcpsack, args.conn_tcpwscale,
+                             dict(prefix=args.capture_prefix,
+                                  port=args.capture_port,
+                                  tcpflags=args.capture_tcpflags,
+                                  tcpflags_mask=args.capture_tcpflags_mask,
+                                  sample=args.capture_sample,
+                                  snaplen=args.capture_snaplen,
+                                  synproxied=args.capture_synproxied,
+                                  off=args.capture_off))
     try:
         loop.run_until_complete(coro)
     except KeyboardInterrupt:
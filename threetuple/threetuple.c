@@ -364,6 +364,19 @@ void threetuplectx_flush(struct threetuplectx *ctx)
   }
 }
 
+void threetuplectx_for_each_bucket(
+  struct threetuplectx *ctx, unsigned bucket,
+  void (*fn)(const struct threetupleentry *e, void *ud), void *ud)
+{
+  struct hash_list_node *n;
+  hash_table_lock_bucket(&ctx->tbl, bucket);
+  HASH_TABLE_FOR_EACH_POSSIBLE(&ctx->tbl, n, bucket)
+  {
+    fn(CONTAINER_OF(n, struct threetupleentry, node), ud);
+  }
+  hash_table_unlock_bucket(&ctx->tbl, bucket);
+}
+
 void threetuplectx_flush_ip(struct threetuplectx *ctx, uint32_t ip)
 {
   uint32_t hashval = threetuple_iphash(ip);
@@ -400,9 +413,9 @@ void threetuplectx_flush_ip6(struct threetuplectx *ctx, const void *ipv6)
   hash_table_unlock_bucket(&ctx->tbl, hashval);
 }
 
-void threetuplectx_init(struct threetuplectx *ctx)
+void threetuplectx_init(struct threetuplectx *ctx, size_t size)
 {
-  if (hash_table_init_locked(&ctx->tbl, 256, threetuple_hash_fn, NULL, 0))
+  if (hash_table_init_locked(&ctx->tbl, size, threetuple_hash_fn, NULL, 0))
   {
     abort();
   }
@@ -1,6 +1,7 @@
 #ifndef _THREETUPLE_H_
 #define _THREETUPLE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include "hashtable.h"
 
@@ -70,11 +71,20 @@ int threetuplectx_find6(
 
 void threetuplectx_flush(struct threetuplectx *ctx);
 
+/*
+ * Calls fn for every entry of a bucket, with the bucket lock held, so that a
+ * table can be read a bucket at a time while it's in use. Buckets are
+ * numbered from 0 to ctx->tbl.bucketcnt - 1.
+ */
+void threetuplectx_for_each_bucket(
+  struct threetuplectx *ctx, unsigned bucket,
+  void (*fn)(const struct threetupleentry *e, void *ud), void *ud);
+
 void threetuplectx_flush_ip(struct threetuplectx *ctx, uint32_t ip);
 
 void threetuplectx_flush_ip6(struct threetuplectx *ctx, const void *ipv6);
 
-void threetuplectx_init(struct threetuplectx *ctx);
+void threetuplectx_init(struct threetuplectx *ctx, size_t size);
 
 void threetuplectx_free(struct threetuplectx *ctx);
 
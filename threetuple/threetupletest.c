@@ -11,7 +11,7 @@ int main(int argc, char **argv)
   struct threetuplectx ctx = {};
   struct threetuplepayload payload = {};
   hash_seed_init();
-  threetuplectx_init(&ctx);
+  threetuplectx_init(&ctx, 256);
   if (threetuplectx_find(&ctx, (10<<24) | 1, 12345, 17, NULL) != -ENOENT)
   {
     abort();